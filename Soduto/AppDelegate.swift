@@ -15,7 +15,7 @@ class AppDelegate: NSObject, NSApplicationDelegate, DeviceManagerDelegate {
     @IBOutlet weak var statusBarMenuController: StatusBarMenuController!
     var welcomeWindowController: WelcomeWindowController?
 
-    let config = Configuration()
+    let config: Configuration
     let connectionProvider: ConnectionProvider
     let deviceManager: DeviceManager
     let serviceManager = ServiceManager()
@@ -24,10 +24,12 @@ class AppDelegate: NSObject, NSApplicationDelegate, DeviceManagerDelegate {
     static let logLevelConfigurationKey = "com.soduto.logLevel"
     
     override init() {
+        StartupTimeline.shared.mark(.appDelegateInit)
         UserDefaults.standard.register(defaults: [AppDelegate.logLevelConfigurationKey: LogSeverity.info.rawValue])
         
         #if DEBUG
-            Log.enable(configuration: XcodeLogConfiguration(minimumSeverity: .debug, debugMode: true))
+            // Not using debugMode, as it makes every log call wait for the record to be written
+            Log.enable(configuration: XcodeLogConfiguration(minimumSeverity: .debug))
         #else
             let formatter = FieldBasedLogFormatter(fields: [.severity(.simple), .delimiter(.spacedPipe), .payload])
             if let osRecorder = OSLogRecorder(formatters: [formatter]) {
@@ -37,9 +39,14 @@ class AppDelegate: NSObject, NSApplicationDelegate, DeviceManagerDelegate {
         #endif
         
         
+        self.config = Configuration()
+        StartupTimeline.shared.mark(.configurationLoaded)
+        
         self.connectionProvider = ConnectionProvider(config: config)
         self.deviceManager = DeviceManager(config: config, serviceManager: self.serviceManager)
+        // Stays eager, as it has to become notification center delegate before any notification is delivered
         self.userNotificationManager = UserNotificationManager(config: self.config, serviceManager: self.serviceManager, deviceManager: self.deviceManager)
+        StartupTimeline.shared.mark(.managersCreated)
         
         super.init()
         
@@ -50,6 +57,8 @@ class AppDelegate: NSObject, NSApplicationDelegate, DeviceManagerDelegate {
     // MARK: NSApplicationDelegate
     
     func applicationDidFinishLaunching(_ aNotification: Notification) {
+        StartupTimeline.shared.mark(.didFinishLaunching)
+        self.config.prepareHostCertificate()
         self.config.capabilitiesDataSource = self.serviceManager
         self.connectionProvider.delegate = self.deviceManager
         self.statusBarMenuController.deviceDataSource = self.deviceManager
@@ -57,23 +66,33 @@ class AppDelegate: NSObject, NSApplicationDelegate, DeviceManagerDelegate {
         self.statusBarMenuController.config = self.config
         self.deviceManager.delegate = self
         
-        //self.serviceManager.add(service: NotificationsService())
-        self.serviceManager.add(service: ClipboardService())
-        self.serviceManager.add(service: SftpService())
-        self.serviceManager.add(service: ShareService())
-        self.serviceManager.add(service: TelephonyService())
-        self.serviceManager.add(service: PingService())
-        self.serviceManager.add(service: BatteryService())
-        self.serviceManager.add(service: FindMyPhoneService())
-//        self.serviceManager.add(service: RemoteKeyboardService())
+        // Services are instantiated only once a paired device needing them becomes reachable
+        //self.serviceManager.register(NotificationsService.self) { NotificationsService() }
+        self.serviceManager.register(ClipboardService.self) { ClipboardService() }
+        self.serviceManager.register(SftpService.self) { SftpService() }
+        self.serviceManager.register(ShareService.self) { ShareService() }
+        self.serviceManager.register(TelephonyService.self) { TelephonyService() }
+        self.serviceManager.register(PingService.self) { PingService() }
+        self.serviceManager.register(BatteryService.self) { BatteryService() }
+        self.serviceManager.register(FindMyPhoneService.self) { FindMyPhoneService() }
+        if UserDefaults.standard.bool(forKey: RemoteKeyboardService.enabledConfigurationKey) {
+            self.serviceManager.register(RemoteKeyboardService.self) { RemoteKeyboardService() }
+        }
+        StartupTimeline.shared.mark(.servicesRegistered)
+        
+        if Trace.isEnabled {
+            Trace.installDumpSignalHandler()
+        }
         
         self.connectionProvider.start()
+        StartupTimeline.shared.mark(.connectionProviderStarted)
         
         showWelcomeWindow()
     }
 
     func applicationWillTerminate(_ aNotification: Notification) {
-        // Insert code here to tear down your application
+        InstrumentedLock.logStatistics()
+        Executor.shared.logStatistics()
     }
 
     
@@ -11,10 +11,17 @@ import CleanroomLogger
 
 public class CertificateUtils {
     
+    /// Type of identity private key. EC keys are generated much faster and make smaller certificates,
+    /// but older peers may support only RSA.
+    public enum KeyType: String {
+        case rsa = "rsa"
+        case ec = "ec" // NIST P-256
+    }
+    
     public enum CertificateError: Error {
         case getOrCreateIdentityFailure(error: NSError?)
         case generateSelfSignedCert // FIXME: provide more information with error
-        case generateRSAKeyPairFailure(status: OSStatus)
+        case generateKeyPairFailure(status: OSStatus)
         case createIdentityFailure(status: OSStatus)
         case deleteIdentityFailure(status: OSStatus)
         case findCertificateFailed(status: OSStatus)
@@ -49,12 +56,12 @@ public class CertificateUtils {
         return SecIdentityCopyPreferred(name as CFString, nil, nil)
     }
     
-    public class func getOrCreateIdentity(_ name: String, certCommonName: String, expirationInterval: TimeInterval) throws -> SecIdentity {
+    public class func getOrCreateIdentity(_ name: String, certCommonName: String, expirationInterval: TimeInterval, keyType: KeyType = .rsa) throws -> SecIdentity {
         if let identity = findValidIdentity(name) {
             return identity
         }
         else {
-            _ = try createIdentity(label: name, certCommonName: certCommonName, expirationInterval: expirationInterval)
+            _ = try createIdentity(label: name, certCommonName: certCommonName, expirationInterval: expirationInterval, keyType: keyType)
             if let identity = findValidIdentity(name) {
                 return identity
             }
@@ -160,6 +167,16 @@ public class CertificateUtils {
         return digest
     }
     
+    /// SHA-256 fingerprint of DER encoded certificate
+    public class func fingerprint(for certificate: SecCertificate) -> Data {
+        let data = SecCertificateCopyData(certificate) as Data
+        var digest = [UInt8](repeating: 0, count:Int(CC_SHA256_DIGEST_LENGTH))
+        data.withUnsafeBytes {
+            _ = CC_SHA256($0, CC_LONG(data.count), &digest)
+        }
+        return Data(bytes: digest)
+    }
+    
     public class func digestString(for certificate: SecCertificate) -> String {
         let digest = self.digest(for: certificate)
         let hexBytes = digest.map { String(format: "%02hhX", $0) }
@@ -167,14 +184,22 @@ public class CertificateUtils {
     }
     
     public class func validate(certificate: SecCertificate) -> Bool {
+        // Certificate whose validity period can not be read is not rejected
+        guard let period = validityPeriod(of: certificate) else { return true }
+        let now = Date()
+        return period.notBefore <= now && now <= period.notAfter
+    }
+    
+    /// Parse validity period of the certificate. Parsing is relatively slow, so results worth keeping should be cached.
+    public class func validityPeriod(of certificate: SecCertificate) -> (notBefore: Date, notAfter: Date)? {
         let oids: [CFString] = [
             kSecOIDX509V1ValidityNotAfter,
-            kSecOIDX509V1ValidityNotBefore,
-            kSecOIDCommonName
+            kSecOIDX509V1ValidityNotBefore
         ]
         let values = SecCertificateCopyValues(certificate, oids as CFArray?, nil) as? [String:[String:AnyObject]]
-        return relativeTime(forOID: kSecOIDX509V1ValidityNotAfter, values: values) >= 0.0
-            && relativeTime(forOID: kSecOIDX509V1ValidityNotBefore, values: values) <= 0.0
+        guard let notBefore = absoluteTime(forOID: kSecOIDX509V1ValidityNotBefore, values: values) else { return nil }
+        guard let notAfter = absoluteTime(forOID: kSecOIDX509V1ValidityNotAfter, values: values) else { return nil }
+        return (notBefore: Date(timeIntervalSinceReferenceDate: notBefore), notAfter: Date(timeIntervalSinceReferenceDate: notAfter))
     }
     
     
@@ -224,9 +249,9 @@ public class CertificateUtils {
     
     
     
-    private class func relativeTime(forOID oid: CFString, values: [String:[String:AnyObject]]?) -> Double {
-        guard let dateNumber = values?[oid as String]?[kSecPropertyKeyValue as String] as? NSNumber else { return 0.0 }
-        return dateNumber.doubleValue - CFAbsoluteTimeGetCurrent();
+    private class func absoluteTime(forOID oid: CFString, values: [String:[String:AnyObject]]?) -> CFAbsoluteTime? {
+        guard let dateNumber = values?[oid as String]?[kSecPropertyKeyValue as String] as? NSNumber else { return nil }
+        return dateNumber.doubleValue
     }
     
     private class func deleteItem(_ item: CFTypeRef, secClass: CFString) throws {
@@ -251,14 +276,24 @@ public class CertificateUtils {
         }
     }
     
-    private class func generateRSAKeyPair(sizeInBits: Int, permanent: Bool, label: String) throws -> (SecKey, SecKey) {
+    private class func generateKeyPair(type: KeyType, permanent: Bool, label: String) throws -> (SecKey, SecKey) {
+        let keyType: CFString
+        let sizeInBits: Int
+        switch type {
+        case .rsa:
+            keyType = kSecAttrKeyTypeRSA
+            sizeInBits = 2048
+        case .ec:
+            keyType = kSecAttrKeyTypeECSECPrimeRandom
+            sizeInBits = 256
+        }
         #if os(iOS)
             let keyAttrs: [String: AnyObject] = [
                 kSecAttrIsPermanent as String: permanent as AnyObject,
                 kSecAttrLabel as String: label as AnyObject
             ]
             let pairAttrs: [String: AnyObject] = [
-                kSecAttrKeyType as String: kSecAttrKeyTypeRSA,
+                kSecAttrKeyType as String: keyType,
                 kSecAttrKeySizeInBits as String: sizeInBits as AnyObject,
                 kSecAttrLabel as String: label as AnyObject,
                 kSecPublicKeyAttrs as String: keyAttrs as AnyObject,
@@ -266,7 +301,7 @@ public class CertificateUtils {
             ]
         #else
             let pairAttrs: [String: AnyObject] = [
-                kSecAttrKeyType as String: kSecAttrKeyTypeRSA,
+                kSecAttrKeyType as String: keyType,
                 kSecAttrKeySizeInBits as String: sizeInBits as AnyObject,
                 kSecAttrLabel as String: label as AnyObject,
                 kSecAttrIsPermanent as String: permanent as AnyObject
@@ -279,12 +314,12 @@ public class CertificateUtils {
             return (publicKey!, privateKey!)
         }
         else {
-            throw CertificateError.generateRSAKeyPairFailure(status: status)
+            throw CertificateError.generateKeyPairFailure(status: status)
         }
     }
     
-    public class func createIdentity(label: String, certCommonName: String, expirationInterval: TimeInterval) throws -> SecIdentity? {
-        let (publicKey, privateKey) = try generateRSAKeyPair(sizeInBits: 2048, permanent: true, label: label)
+    public class func createIdentity(label: String, certCommonName: String, expirationInterval: TimeInterval, keyType: KeyType = .rsa) throws -> SecIdentity? {
+        let (publicKey, privateKey) = try generateKeyPair(type: keyType, permanent: true, label: label)
         
         try? deleteKey(publicKey) // public key not needed
         
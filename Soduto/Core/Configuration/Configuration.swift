@@ -66,6 +66,7 @@ public class DeviceConfiguration: NSObject {
             return CertificateUtils.findCertificate(self.certificateName)
         }
         set {
+            PeerTrustCache.shared.invalidate(for: self.deviceId)
             do {
                 if self.certificateName.isEmpty && newValue != nil {
                     self.certificateName = DeviceConfiguration.defaultCertificateName(for: deviceId)
@@ -291,6 +292,15 @@ public class Configuration: ConnectionConfiguration, DeviceManagerConfiguration,
         return Configuration.hostCertificate(using: self.userDefaults)
     }
     
+    /// Load or create host certificate in background, so that it is ready by the time first connection needs it
+    public func prepareHostCertificate() {
+        let userDefaults = self.userDefaults
+        Executor.shared.submit(.interactive) {
+            _ = Configuration.hostCertificate(using: userDefaults)
+            StartupTimeline.shared.mark(.hostIdentityReady)
+        }
+    }
+    
     public func deviceConfig(for deviceId: Device.Id) -> DeviceConfiguration {
         return DeviceConfiguration(deviceId: deviceId, userDefaults: self.userDefaults)
     }
@@ -351,7 +361,7 @@ public class Configuration: ConnectionConfiguration, DeviceManagerConfiguration,
         }
         let expirationInterval = 60.0 * 60.0 * 24.0 * 365.0 * 10.0
         do {
-            return try CertificateUtils.getOrCreateIdentity(name, certCommonName: hostDeviceId, expirationInterval: expirationInterval)
+            return try HostIdentityProvider.shared.identity(name: name, commonName: hostDeviceId, expirationInterval: expirationInterval, userDefaults: userDefaults)
         }
         catch {
             Log.error?.message("Failed to get host identity for SSL: \(error)")
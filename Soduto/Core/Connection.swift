@@ -7,9 +7,9 @@
 //
 
 import Foundation
+import QuartzCore
 import CocoaAsyncSocket
 import CleanroomLogger
-import Reachability
 
 public enum ConnectionError: Error {
     case InitializationAlreadyFinished
@@ -20,7 +20,8 @@ public protocol ConnectionDelegate: class {
     func connection(_ connection:Connection, didSwitchToState:Connection.State)
     func connection(_ connection:Connection, didSendPacket:DataPacket, uploadedPayload: Bool)
     func connection(_ connection:Connection, didReadPacket:DataPacket)
-    func connectionCapacityChanged(_ connection:Connection) // Informs receiver that it can try to resend previously declined packets
+    func connectionCapacityChanged(_ connection:Connection) // Informs receiver that it can try to resend packets this connection declined
+    func keepAlivePacket(for connection:Connection) -> DataPacket? // Packet to be sent as keepalive instead of a plain one, e.g. a latency probe
 }
 
 public protocol ConnectionConfiguration: HostConfiguration {
@@ -45,6 +46,15 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
         case Initializing
         case Open
         case Closed
+        
+        /// Value recorded in traces
+        var traceValue: Int64 {
+            switch self {
+            case .Initializing: return 0
+            case .Open: return 1
+            case .Closed: return 2
+            }
+        }
     }
     
     public typealias SendingCompletionHandler = ((_ packetSent: Bool, _ payloadSent: Bool) -> Void)
@@ -54,13 +64,15 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
         let dataPacket: DataPacket
         let uploadTask: UploadTask?
         let completionHandler: SendingCompletionHandler?
+        let size: Int
         var packetSent: Bool? = nil
         var payloadSent: Bool? = nil
         
-        init(dataPacket: DataPacket, uploadTask: UploadTask?, completionHandler: SendingCompletionHandler?) {
+        init(dataPacket: DataPacket, uploadTask: UploadTask?, completionHandler: SendingCompletionHandler?, size: Int = 0) {
             self.dataPacket = dataPacket
             self.uploadTask = uploadTask
             self.completionHandler = completionHandler
+            self.size = size
             if self.uploadTask == nil {
                 self.payloadSent = false
             }
@@ -77,26 +89,55 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
     public private(set) var state: State {
         didSet {
             if oldValue != self.state {
+                Trace.instant(.connectionState, id: Trace.id(of: self), value: self.state.traceValue)
                 self.delegate?.connection(self, didSwitchToState: self.state)
             }
             
             if self.state == .Open && self.pairingStatus == .Paired {
                 self.rememberHwAddress()
             }
+            
+            if self.state == .Open && oldValue != .Open {
+                self.keepAlivePolicy.start()
+            }
         }
     }
     
     public private(set) var identity: DataPacket? = nil
     public private(set) var peerCertificate: SecCertificate? = nil
     public private(set) var peerAddress: SocketAddress
+    public var localAddress: SocketAddress? {
+        guard let data = self.socket.localAddress else { return nil }
+        return SocketAddress(data: data)
+    }
     
     public var hostCertificate: SecCertificate? { return self.config.hostCertificate?.certificate }
     
+    /// Live link quality metrics, used to choose the best connection for sending
+    public let metrics = ConnectionMetrics()
+    
+    /// Policy deciding on application and TCP level keepalives
+    public private(set) lazy var keepAlivePolicy: KeepAlivePolicy = self.createKeepAlivePolicy()
+    
+    /// Queued packet bytes (or packets) at which sending of packets starts being declined
+    public var highWaterMarkBytes: Int = Connection.defaultHighWaterMarkBytes
+    public var highWaterMarkPackets: Int = Connection.defaultHighWaterMarkPackets
+    /// Queued packet bytes (or packets) to drain down to before sending is accepted again
+    public var lowWaterMarkBytes: Int = Connection.defaultLowWaterMarkBytes
+    public var lowWaterMarkPackets: Int = Connection.defaultLowWaterMarkPackets
+    
+    /// Bytes of packets handed to the socket, but not yet written
+    public var queuedBytes: Int { return self.metrics.queuedBytes }
+    /// Count of packets handed to the socket, but not yet written
+    public var queuedPacketCount: Int { return self.metrics.queuedPackets }
+    /// Whether new packets are declined until queued ones drain below low water marks
+    public private(set) var isAboveHighWaterMark: Bool = false
+    
     private let config: ConnectionConfiguration
     private let socket: GCDAsyncSocket
     private let sslCertificates: [AnyObject]
-    private let uploadQueue = Connection.createDispatchQueue(withLabel: "Payload upload queue")
-    private let downloadQueue = Connection.createDispatchQueue(withLabel: "Payload download queue")
+    private let uploadQueue = Executor.shared.makeDispatchQueue(label: "Payload upload queue", lane: .transfer)
+    private let downloadQueue = Executor.shared.makeDispatchQueue(label: "Payload download queue", lane: .transfer)
     private var packetsSending: [DataPacketSendingInfo] = []  // array of packets being sent
     private var packetsExpected: Int = 0         // count of packets to read befor stopping automatic reading, -1 for unlimited count
     private var waitingToSecure: Bool = false
@@ -104,7 +145,16 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
     private var pairingHandler: DefaultPairingHandler? = nil
     private var packetHandlers: [ConnectionDataPacketHandler] = []
     
+    private var lastTransportRoundTripSampleTime: TimeInterval = 0.0
+    private var handshakeStartTime: TimeInterval? = nil
+    private var declinedForUploadPort: Bool = false // a payload packet was declined because no upload port was free
+    
+    static public let defaultHighWaterMarkBytes: Int = 256 * 1024
+    static public let defaultLowWaterMarkBytes: Int = 64 * 1024
+    static public let defaultHighWaterMarkPackets: Int = 64
+    static public let defaultLowWaterMarkPackets: Int = 16
     static private let packetsDelimiter: Data = Data(bytes: [UInt8(ascii: "\n")])
+    static private let transportRoundTripSampleInterval: TimeInterval = 1.0
     
     
     // MARK: Initialization / Deinitialization
@@ -172,6 +222,8 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
         assert(self.state == .Initializing, "Connection initialization already finished")
         assert(self.identity != nil, "Identity expected to be known before securing connection")
         
+        self.handshakeStartTime = CACurrentMediaTime()
+        Trace.begin(.tlsHandshake, id: Trace.id(of: self))
         self.secureServerSocket(self.socket)
         self.waitingToSecure = true
     }
@@ -180,6 +232,8 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
         assert(self.state == .Initializing, "Connection initialization already finished")
         assert(self.identity != nil, "Identity expected to be known before securing connection")
         
+        self.handshakeStartTime = CACurrentMediaTime()
+        Trace.begin(.tlsHandshake, id: Trace.id(of: self))
         self.secureClientSocket(self.socket)
         self.waitingToSecure = true
     }
@@ -201,20 +255,24 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
     
     // MARK: Public API
     
-    /// Try sending a packed with completion handler. Returns false if sending is declined because of capacity exceeded.
-    /// In such case the sender may try resending the packet when connection capacity changes. In other cases 
-    /// true is returned even if sending does not succeed - sending failure is reported through completion handler.
+    /// Try sending a packed with completion handler. Returns false if sending is declined because of capacity exceeded -
+    /// either too much data is queued for writing already (see water marks) or no upload port is free for a payload.
+    /// In such case the sender may try resending the packet when connection capacity changes (see `Device`, which
+    /// keeps declined packets pending until then). In other cases true is returned even if sending does not
+    /// succeed - sending failure is reported through completion handler.
     public func send(_ dataPacket: DataPacket, whenCompleted: SendingCompletionHandler? = nil) -> Bool {
-        if dataPacket.hasPayload() {
-            return self.sendPayloadPacket(dataPacket, whenCompleted: whenCompleted)
-        }
-        else {
-            return self.sendSimplePacket(dataPacket, whenCompleted: whenCompleted)
+        guard !self.isAboveHighWaterMark else {
+            Log.debug?.message("Declining packet <\(dataPacket.id)> - \(self.queuedPacketCount) packets (\(self.queuedBytes) bytes) queued [\(self)]")
+            return false
         }
+        
+        return self.sendAccepted(dataPacket, whenCompleted: whenCompleted)
     }
     
+    /// Send connection level control packet (pairing, identity). Such packets have no sender to keep them
+    /// while connection is above high water marks, so they are accepted regardless of queued data.
     public func send(_ dataPacket: DataPacket) -> Bool {
-        return self.send(dataPacket, whenCompleted: nil)
+        return self.sendAccepted(dataPacket, whenCompleted: nil)
     }
     
     public func readOnePacket() {
@@ -249,33 +307,47 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
     /// Helper function to secure any server socket equivalently as this connection secures
     /// its own socket - with same certificates and settings
     public func secureServerSocket(_ socket: GCDAsyncSocket) {
-        let settings: [String:NSObject] = [
+        var settings: [String:NSObject] = [
             kCFStreamSSLCertificates as String: self.sslCertificates as NSArray,
             kCFStreamSSLIsServer as String: NSNumber(value: true),
             GCDAsyncSocketSSLClientSideAuthenticate as String: NSNumber(value: SSLAuthenticate.alwaysAuthenticate.rawValue),
             GCDAsyncSocketManuallyEvaluateTrust as String: NSNumber(value: true)
         ]
+        if let peerId = self.tlsPeerId(isServer: true) {
+            settings[GCDAsyncSocketSSLPeerID as String] = peerId as NSData
+        }
         socket.startTLS(settings)
     }
     
     /// Helper function to secure any client socket equivalently as this connection secures
     /// its own socket - with same certificates and settings
     public func secureClientSocket(_ socket: GCDAsyncSocket) {
-        let settings: [String:NSObject] = [
+        var settings: [String:NSObject] = [
             kCFStreamSSLCertificates as String: self.sslCertificates as NSArray,
             GCDAsyncSocketManuallyEvaluateTrust as String: NSNumber(value: true)
         ]
+        if let peerId = self.tlsPeerId(isServer: false) {
+            settings[GCDAsyncSocketSSLPeerID as String] = peerId as NSData
+        }
         socket.startTLS(settings)
     }
     
     /// Helper function to validate peer certificate equivalently as this connection validates
-    /// its own connections
+    /// its own connections. Positive decisions are cached by certificate fingerprint, so repeated
+    /// handshakes (e.g. for payload transfers) do not need to look up saved certificate again.
     public func shouldTrustPeerCertificate(_ peerCertificate: SecCertificate) -> Bool {
         assert(self.identity != nil, "Identity expected to be known before securing connection and evaluating trust")
         
         guard let deviceId = try? self.identity!.getDeviceId() else { return false }
+        let fingerprint = CertificateUtils.fingerprint(for: peerCertificate)
+        if PeerTrustCache.shared.isTrusted(fingerprint: fingerprint, for: deviceId) {
+            return true
+        }
+        
         guard let savedCertificate = self.config.deviceConfig(for: deviceId).certificate else { return false }
-        return CertificateUtils.compareCertificates(savedCertificate, peerCertificate)
+        guard CertificateUtils.compareCertificates(savedCertificate, peerCertificate) else { return false }
+        PeerTrustCache.shared.setTrusted(fingerprint: fingerprint, for: deviceId)
+        return true
     }
     
     
@@ -292,24 +364,42 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
         guard let index = self.packetsSending.index(where: { Int($0.dataPacket.id) == tag }) else { return }
         
         self.packetsSending[index].packetSent = true
+        self.metrics.recordWriteCompleted(bytes: self.packetsSending[index].size)
+        self.sampleTransportRoundTripTime()
         
         if let payloadSent = self.packetsSending[index].payloadSent {
             let packetInfo = self.packetsSending.remove(at: index)
             self.finalizeSending(packet: packetInfo.dataPacket, completionHandler: packetInfo.completionHandler, packetSent: true, payloadSent: payloadSent)
         }
+        
+        self.updateWaterMarkState()
+    }
+    
+    public func socket(_ sock: GCDAsyncSocket, didWritePartialDataOfLength partialLength: UInt, tag: Int) {
+        self.metrics.recordWriteProgress()
     }
     
     public func socket(_ sock: GCDAsyncSocket, didRead data: Data, withTag tag: Int) {
         Log.debug?.message("socket(<\(sock)> didRead:<\(data)> withTag:<\(tag)>)")
         
+        let receivedTime = CACurrentMediaTime()
+        self.metrics.recordRead(bytes: data.count)
+        Trace.instant(.packetRead, id: Trace.id(of: self), value: Int64(data.count))
+        
         if data.count > 0 {
-            if let packet = DataPacket(data: data) {
+            Trace.begin(.packetDecode, id: Trace.id(of: self))
+            let decodedPacket = DataPacket(data: data)
+            Trace.end(.packetDecode, id: Trace.id(of: self), value: decodedPacket?.id ?? -1)
+            if let packet = decodedPacket {
                 var mutablePacket = packet
+                mutablePacket.receivedTime = receivedTime
                 if mutablePacket.payloadInfo != nil {
                     mutablePacket.downloadTask = DownloadTask(packet: mutablePacket, connection: self, writeQueue: self.downloadQueue)
                 }
                 
+                Trace.begin(.packetDispatch, id: Trace.id(ofPacket: packet.id))
                 self.handle(packet: mutablePacket)
+                Trace.end(.packetDispatch, id: Trace.id(ofPacket: packet.id))
                 if self.packetsExpected > 0 {
                     self.packetsExpected = self.packetsExpected - 1
                 }
@@ -326,6 +416,12 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
     
     public func socketDidSecure(_ sock: GCDAsyncSocket) {
         Log.debug?.message("socketDidSecure(<\(sock)>)")
+        if let startTime = self.handshakeStartTime {
+            TLSHandshakeStatistics.shared.record(CACurrentMediaTime() - startTime, kind: .connection)
+            Trace.end(.tlsHandshake, id: Trace.id(of: self), value: 1)
+            self.handshakeStartTime = nil
+            Log.debug?.message("TLS handshakes - connections: \(TLSHandshakeStatistics.shared.summary(for: .connection)), payloads: \(TLSHandshakeStatistics.shared.summary(for: .payload))")
+        }
         self.waitingToSecure = false
         if self.shouldFinishIntializationWhenSecured {
             self.state = .Open
@@ -335,6 +431,13 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
     public func socketDidDisconnect(_ sock: GCDAsyncSocket, withError err: Error?) {
         Log.debug?.message("socketDidDisconnect(<\(sock)> withError:<\(String(describing: err))>)")
     
+        self.keepAlivePolicy.connectionClosed(withError: err)
+        if self.handshakeStartTime != nil {
+            Trace.end(.tlsHandshake, id: Trace.id(of: self), value: 0)
+            self.handshakeStartTime = nil
+        }
+        Log.info?.message("Connection closed: \(self.keepAlivePolicy) \(self.metrics) [\(self)]")
+        
         // Execute state change before packets dicarding, so that delegate could reclaim unsent packets
         self.state = .Closed
         
@@ -439,23 +542,22 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
     // MARK: Private
     
     private func configureSocket() {
+        self.applyKeepAliveParameters(self.keepAlivePolicy.initialSocketParameters)
+    }
+    
+    private func applyKeepAliveParameters(_ parameters: KeepAlivePolicy.SocketParameters) {
         self.socket.perform {
-            if self.socket.isIPv4 {
-                do {
-                    let nativeSocket = self.socket.socket4FD()
-                    try self.setSockOpt(socket: nativeSocket, level: SOL_SOCKET, optionName: SO_KEEPALIVE, optionValue: 1)
-                    try self.setSockOpt(socket: nativeSocket, level: IPPROTO_TCP, optionName: TCP_KEEPALIVE, optionValue: 10)
-                }
-                catch {
-                    Log.error?.message("Failed to configure socket for connection \(self): \(error)")
-                }
-            }
+            var nativeSockets: [Int32] = []
+            if self.socket.isIPv4 { nativeSockets.append(self.socket.socket4FD()) }
+            if self.socket.isIPv6 { nativeSockets.append(self.socket.socket6FD()) }
             
-            if self.socket.isIPv6 {
+            for nativeSocket in nativeSockets {
                 do {
-                    let nativeSocket = self.socket.socket6FD()
                     try self.setSockOpt(socket: nativeSocket, level: SOL_SOCKET, optionName: SO_KEEPALIVE, optionValue: 1)
-                    try self.setSockOpt(socket: nativeSocket, level: IPPROTO_TCP, optionName: TCP_KEEPALIVE, optionValue: 10)
+                    try self.setSockOpt(socket: nativeSocket, level: IPPROTO_TCP, optionName: TCP_KEEPALIVE, optionValue: parameters.idleTime)
+                    try self.setSockOpt(socket: nativeSocket, level: IPPROTO_TCP, optionName: TCP_KEEPINTVL, optionValue: parameters.probeInterval)
+                    try self.setSockOpt(socket: nativeSocket, level: IPPROTO_TCP, optionName: TCP_KEEPCNT, optionValue: parameters.probeCount)
+                    try self.setSockOpt(socket: nativeSocket, level: IPPROTO_TCP, optionName: TCP_RXT_CONNDROPTIME, optionValue: parameters.retransmissionTimeout)
                 }
                 catch {
                     Log.error?.message("Failed to configure socket for connection \(self): \(error)")
@@ -464,6 +566,43 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
         }
     }
     
+    private func createKeepAlivePolicy() -> KeepAlivePolicy {
+        let policy = KeepAlivePolicy(metrics: self.metrics)
+        policy.sendKeepAlive = { [weak self] in self?.sendKeepAlivePacket() ?? false }
+        policy.applySocketParameters = { [weak self] parameters in self?.applyKeepAliveParameters(parameters) }
+        policy.closeConnection = { [weak self] in self?.close() }
+        return policy
+    }
+    
+    /// Take round trip time estimate from the TCP stack, so connections have RTT values even without
+    /// any application level round trips. Sampling is rate limited as it requires a system call.
+    private func sampleTransportRoundTripTime() {
+        let now = CACurrentMediaTime()
+        guard now - self.lastTransportRoundTripSampleTime >= Connection.transportRoundTripSampleInterval else { return }
+        self.lastTransportRoundTripSampleTime = now
+        
+        var srtt: UInt32 = 0
+        self.socket.perform {
+            let nativeSocket = self.socket.isIPv4 ? self.socket.socket4FD() : self.socket.socket6FD()
+            guard nativeSocket >= 0 else { return }
+            var info = tcp_connection_info()
+            var size = socklen_t(MemoryLayout<tcp_connection_info>.size)
+            if getsockopt(nativeSocket, IPPROTO_TCP, TCP_CONNECTION_INFO, &info, &size) == 0 {
+                srtt = info.tcpi_srtt
+            }
+        }
+        if srtt > 0 {
+            self.metrics.recordRoundTrip(TimeInterval(srtt) / 1000.0)
+        }
+    }
+    
+    /// Peer identifier used by Secure Transport to find cached TLS sessions for resumption. Sessions are
+    /// cached per peer device and role, so only handshakes with the same device may resume them.
+    private func tlsPeerId(isServer: Bool) -> Data? {
+        guard let deviceId = (try? self.identity?.getDeviceId()) ?? nil else { return nil }
+        return "com.soduto.tls.\(isServer ? "server" : "client").\(deviceId)".data(using: .utf8)
+    }
+    
     private func setSockOpt(socket: Int32, level: Int32, optionName: Int32, optionValue: Int32) throws {
         var value = optionValue // need writable value
         let result = setsockopt(socket, level, optionName, &value, UInt32(MemoryLayout<Int32>.size))
@@ -472,6 +611,15 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
         }
     }
     
+    private func sendAccepted(_ dataPacket: DataPacket, whenCompleted: SendingCompletionHandler?) -> Bool {
+        if dataPacket.hasPayload() {
+            return self.sendPayloadPacket(dataPacket, whenCompleted: whenCompleted)
+        }
+        else {
+            return self.sendSimplePacket(dataPacket, whenCompleted: whenCompleted)
+        }
+    }
+    
     private func sendSimplePacket(_ packet: DataPacket, whenCompleted: SendingCompletionHandler? = nil) -> Bool {
         assert(!packet.hasPayload())
         
@@ -480,8 +628,10 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
         if let bytes = try? packet.serialize() {
             let data = Data(bytes: bytes)
             self.socket.write(data, withTimeout: -1, tag: Int(packet.id))
-            let info = DataPacketSendingInfo(dataPacket: packet, uploadTask: nil, completionHandler: whenCompleted)
+            self.metrics.recordWriteQueued(bytes: data.count)
+            let info = DataPacketSendingInfo(dataPacket: packet, uploadTask: nil, completionHandler: whenCompleted, size: data.count)
             self.packetsSending.append(info)
+            self.updateWaterMarkState()
         }
         else {
             Log.error?.message("Failed to serialize packet: \(packet).")
@@ -505,8 +655,10 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
             if let bytes = try? packet.serialize() {
                 let data = Data(bytes: bytes)
                 self.socket.write(data, withTimeout: -1, tag: Int(packet.id))
-                let info = DataPacketSendingInfo(dataPacket: packet, uploadTask: uploadTask, completionHandler: whenCompleted)
+                self.metrics.recordWriteQueued(bytes: data.count)
+                let info = DataPacketSendingInfo(dataPacket: packet, uploadTask: uploadTask, completionHandler: whenCompleted, size: data.count)
                 self.packetsSending.append(info)
+                self.updateWaterMarkState()
             }
             else {
                 Log.error?.message("Failed to serialize packet: \(packet).")
@@ -522,13 +674,31 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
         }
         else {
             // Tell caller to wait
+            self.declinedForUploadPort = true
             return false
         }
     }
     
-    private func sendKeepAlivePacket() {
-        let packet = DataPacket(type: "soduto.keepalive", body: [:])
-        _ = send(packet)
+    /// Start declining packets when queued data reaches high water marks, and ask delegate to resend
+    /// declined packets when it drains below low water marks. The gap between the marks keeps
+    /// capacity notifications from firing for every written packet.
+    private func updateWaterMarkState() {
+        if !self.isAboveHighWaterMark {
+            if self.queuedBytes >= self.highWaterMarkBytes || self.queuedPacketCount >= self.highWaterMarkPackets {
+                self.isAboveHighWaterMark = true
+                Log.debug?.message("Connection reached high water mark - \(self.queuedPacketCount) packets (\(self.queuedBytes) bytes) queued [\(self)]")
+            }
+        }
+        else if self.queuedBytes <= self.lowWaterMarkBytes && self.queuedPacketCount <= self.lowWaterMarkPackets {
+            self.isAboveHighWaterMark = false
+            self.delegate?.connectionCapacityChanged(self)
+        }
+    }
+    
+    private func sendKeepAlivePacket() -> Bool {
+        let packet = self.delegate?.keepAlivePacket(for: self) ?? DataPacket(type: "soduto.keepalive", body: [:])
+        // Not needed while data is queued - its writes show whether connection is alive
+        return self.send(packet, whenCompleted: nil)
     }
     
     private func finalizeSending(packet: DataPacket, completionHandler: SendingCompletionHandler?, packetSent: Bool, payloadSent: Bool) {
@@ -581,13 +751,21 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
     
     private func observeNotifications() {
         NotificationCenter.default.addObserver(forName: UploadTask.portReleaseNotification, object: nil, queue: nil) { [weak self] notification in
-            if let strongSelf = self {
-                strongSelf.delegate?.connectionCapacityChanged(strongSelf)
+            // Only connections that declined payloads because of ports are interested
+            guard let strongSelf = self, strongSelf.declinedForUploadPort else { return }
+            strongSelf.declinedForUploadPort = false
+            strongSelf.delegate?.connectionCapacityChanged(strongSelf)
+        }
+        NotificationCenter.default.addObserver(forName: ConnectionProvider.localAddressesChangedNotification, object: nil, queue: nil) { [weak self] notification in
+            guard let strongSelf = self else { return }
+            let removedAddresses = notification.userInfo?[ConnectionProvider.removedAddressesKey] as? [SocketAddress] ?? []
+            if let localAddress = strongSelf.localAddress, removedAddresses.contains(where: { $0.isSameHost(as: localAddress) }) {
+                // The interface this connection goes through is gone - no point waiting for timeouts
+                Log.debug?.message("Local address \(localAddress) disappeared, closing [\(strongSelf)]")
+                strongSelf.close()
             }
-        }
-        NotificationCenter.default.addObserver(forName: Notification.Name.reachabilityChanged, object: nil, queue: nil) { [weak self] notification in
-            if let reachability = notification.object as? Reachability, reachability.connection != .none {
-                self?.sendKeepAlivePacket()
+            else {
+                strongSelf.keepAlivePolicy.networkChanged()
             }
         }
     }
@@ -613,14 +791,5 @@ public class Connection: NSObject, GCDAsyncSocketDelegate, PairingHandlerDelegat
         self.packetsSending = self.packetsSending.filter { $0.packetSent != nil || $0.uploadTask?.isStarted == true }
         return results
     }
-    
-    private class func createDispatchQueue(withLabel label: String) -> DispatchQueue {
-        if #available(OSX 10.12, *) {
-            return DispatchQueue(label: label, qos: DispatchQoS.background, autoreleaseFrequency: .workItem)
-        }
-        else {
-            return DispatchQueue(label: label, qos: DispatchQoS.background)
-        }
-    }
 
 }
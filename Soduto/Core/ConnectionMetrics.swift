@@ -0,0 +1,168 @@
+//
+//  ConnectionMetrics.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-12.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import QuartzCore
+
+/// Traffic classes used to choose the most appropriate connection for a data packet.
+///
+/// - latency: Small control packets where delivery delay matters most.
+/// - bulk: Packets with payloads where sustained throughput matters most.
+public enum TrafficClass {
+    case latency
+    case bulk
+}
+
+extension DataPacket {
+
+    /// Traffic class of the packet - packets with payloads are considered bulk, everything else - latency sensitive
+    public var trafficClass: TrafficClass {
+        return self.hasPayload() ? .bulk : .latency
+    }
+}
+
+/// Live link quality metrics of a single connection. Values are updated by the connection itself as
+/// packets are written and read, and may be fed with additional round trip samples (e.g. from ping exchanges).
+/// Not thread safe - expected to be used on the same queue as the owning connection (main queue).
+public class ConnectionMetrics: CustomStringConvertible {
+
+    // MARK: Properties
+
+    /// Round trip time assumed for connections without any samples yet
+    public static let defaultRoundTripTime: TimeInterval = 0.1
+    /// Throughput assumed for connections without any samples yet (bytes per second)
+    public static let defaultThroughput: Double = 1024 * 1024
+    /// Interval without write progress after which connection with queued data is considered stalled
+    public static let stallInterval: TimeInterval = 5.0
+    /// Payload size used to estimate bulk transfer cost
+    private static let referenceBulkSize: Double = 1024 * 1024
+    /// Shortest window over which a throughput sample is taken
+    private static let throughputSampleInterval: TimeInterval = 0.5
+
+    /// Smoothed round trip time (RFC 6298 style), nil until first sample
+    public private(set) var smoothedRoundTripTime: TimeInterval? = nil
+    /// Round trip time variation, nil until first sample
+    public private(set) var roundTripTimeVariation: TimeInterval? = nil
+    /// Smoothed write throughput in bytes per second, nil until first sample
+    public private(set) var writeThroughput: Double? = nil
+    /// Bytes handed to the socket but not yet reported as written
+    public private(set) var queuedBytes: Int = 0
+    /// Packets handed to the socket but not yet reported as written
+    public private(set) var queuedPackets: Int = 0
+    /// Total bytes written since connection creation
+    public private(set) var totalBytesWritten: Int64 = 0
+    /// Total bytes read since connection creation
+    public private(set) var totalBytesRead: Int64 = 0
+    /// Time of last write completion or read
+    public private(set) var lastActivityTime: TimeInterval = CACurrentMediaTime()
+    /// Time of last read - the only activity that proves the peer is alive
+    public private(set) var lastReadTime: TimeInterval = CACurrentMediaTime()
+    /// Time of last write progress (even partial), or of write queueing if connection was idle before
+    public private(set) var lastWriteProgressTime: TimeInterval = CACurrentMediaTime()
+
+    private var sampleStartTime: TimeInterval = CACurrentMediaTime()
+    private var sampleBytes: Int = 0
+
+    /// Connection is considered stalled if it has data queued for writing, but no writes complete for a while
+    public var isStalled: Bool {
+        return self.queuedBytes > 0 && CACurrentMediaTime() - self.lastWriteProgressTime > ConnectionMetrics.stallInterval
+    }
+
+    public var description: String {
+        let rtt = self.smoothedRoundTripTime.map { String(format: "%.1fms", $0 * 1000.0) } ?? "?"
+        let throughput = self.writeThroughput.map { String(format: "%.0fB/s", $0) } ?? "?"
+        return "<ConnectionMetrics:rtt=\(rtt):throughput=\(throughput):queued=\(self.queuedBytes)B/\(self.queuedPackets)\(self.isStalled ? ":stalled" : "")>"
+    }
+
+
+    // MARK: Public methods
+
+    /// Add a round trip time sample
+    public func recordRoundTrip(_ rtt: TimeInterval) {
+        guard rtt >= 0.0 else { return }
+
+        if let srtt = self.smoothedRoundTripTime, let rttvar = self.roundTripTimeVariation {
+            self.roundTripTimeVariation = 0.75 * rttvar + 0.25 * abs(srtt - rtt)
+            self.smoothedRoundTripTime = 0.875 * srtt + 0.125 * rtt
+        }
+        else {
+            self.smoothedRoundTripTime = rtt
+            self.roundTripTimeVariation = rtt / 2.0
+        }
+    }
+
+    /// Note that data has been handed to the socket for writing
+    public func recordWriteQueued(bytes: Int) {
+        if self.queuedBytes == 0 {
+            // Idle time should not count as stalling
+            self.lastWriteProgressTime = CACurrentMediaTime()
+        }
+        self.queuedBytes += bytes
+        self.queuedPackets += 1
+    }
+
+    /// Note that previously queued data has been written
+    public func recordWriteCompleted(bytes: Int) {
+        let now = CACurrentMediaTime()
+
+        // While the queue was empty, the link was idle - restart the sample window so idle time
+        // does not get counted as slow throughput
+        if self.queuedBytes == 0 || self.sampleBytes == 0 && now - self.lastWriteProgressTime > ConnectionMetrics.throughputSampleInterval {
+            self.sampleStartTime = self.lastWriteProgressTime
+        }
+
+        self.queuedBytes = max(self.queuedBytes - bytes, 0)
+        self.queuedPackets = max(self.queuedPackets - 1, 0)
+        self.totalBytesWritten += Int64(bytes)
+        self.lastWriteProgressTime = now
+        self.lastActivityTime = now
+        self.sampleBytes += bytes
+
+        let elapsed = now - self.sampleStartTime
+        if elapsed >= ConnectionMetrics.throughputSampleInterval {
+            let sample = Double(self.sampleBytes) / elapsed
+            if let throughput = self.writeThroughput {
+                self.writeThroughput = 0.75 * throughput + 0.25 * sample
+            }
+            else {
+                self.writeThroughput = sample
+            }
+            self.sampleStartTime = now
+            self.sampleBytes = 0
+        }
+    }
+
+    /// Note that part of a queued write has been written. Large writes on slow links take long to complete,
+    /// but they are not stalled while they progress.
+    public func recordWriteProgress() {
+        self.lastWriteProgressTime = CACurrentMediaTime()
+    }
+
+    /// Note that data has been read from the connection
+    public func recordRead(bytes: Int) {
+        self.totalBytesRead += Int64(bytes)
+        self.lastActivityTime = CACurrentMediaTime()
+        self.lastReadTime = self.lastActivityTime
+    }
+
+    /// Estimated time to deliver a packet of given traffic class over this connection. Lower is better.
+    public func estimatedCost(for trafficClass: TrafficClass) -> TimeInterval {
+        guard !self.isStalled else { return TimeInterval.greatestFiniteMagnitude }
+
+        let rtt = self.smoothedRoundTripTime ?? ConnectionMetrics.defaultRoundTripTime
+        let throughput = max(self.writeThroughput ?? ConnectionMetrics.defaultThroughput, 1.0)
+        let queueDelay = Double(self.queuedBytes) / throughput
+
+        switch trafficClass {
+        case .latency:
+            return rtt + queueDelay
+        case .bulk:
+            return rtt + queueDelay + ConnectionMetrics.referenceBulkSize / throughput
+        }
+    }
+}
@@ -29,6 +29,18 @@ public class ConnectionProvider: NSObject, GCDAsyncSocketDelegate, GCDAsyncUdpSo
     static public let minVersionWithSSLSupport: UInt = 6
     static public let minAnnouncementInterval: TimeInterval = 30.0
     static public let broadcastAnnouncementNotification: Notification.Name = Notification.Name(rawValue: "com.soduto.ConnectionProvider.broadcastAnnouncement")
+    /// Posted when network reachability changes. User info contains `[SocketAddress]` arrays of local addresses
+    /// that appeared and disappeared under `addedAddressesKey` and `removedAddressesKey` keys
+    static public let localAddressesChangedNotification: Notification.Name = Notification.Name(rawValue: "com.soduto.ConnectionProvider.localAddressesChanged")
+    static public let addedAddressesKey = "addedAddresses"
+    static public let removedAddressesKey = "removedAddresses"
+    
+    /// Time from network becoming reachable to a device connection being established again
+    public let reconnectLatencyHistogram = LatencyHistogram()
+    /// Devices not connected again within this time after network change are not waited for anymore
+    static public let maxReconnectLatency: TimeInterval = 300.0
+    /// Time after network change within which connections that did not survive it get closed
+    static private let networkChangeSettleInterval: TimeInterval = KeepAlivePolicy.reachabilityProbingDuration + KeepAlivePolicy.deadConnectionTimeout
     
     public weak var delegate: ConnectionProviderDelegate? = nil
     
@@ -40,6 +52,11 @@ public class ConnectionProvider: NSObject, GCDAsyncSocketDelegate, GCDAsyncUdpSo
     private var isStarted: Bool = false
     private var lastAnnouncementTime: TimeInterval = 0.0
     private var announcementTimer: Timer? = nil
+    private var localAddresses: [String: NetworkUtils.LocalAddressInfo] = [:]
+    private var lastNetworkChangeTime: TimeInterval? = nil
+    private let openedConnections = NSHashTable<Connection>.weakObjects()
+    private var awaitedDeviceIds: Set<Device.Id> = [] // Devices connected before network change and not reconnected yet
+    private var networkChangeSettleTimer: Timer? = nil
     
     
     
@@ -95,14 +112,9 @@ public class ConnectionProvider: NSObject, GCDAsyncSocketDelegate, GCDAsyncUdpSo
         }
         
         self.isStarted = true
+        self.localAddresses = ConnectionProvider.currentLocalAddresses()
         
-        broadcastAnnouncement()
-        
-        // Speculative broadcasts after some intervals.
-        // When broadcasting imediately after internet connection becomes available, ARP table may be incomplete and not all known devices may be detected. After some time, theese undetected devices may become known and may receive the announcement
-        _ = Timer.compatScheduledTimer(withTimeInterval: 40.0, repeats: false) { _ in self.broadcastAnnouncement() }
-        _ = Timer.compatScheduledTimer(withTimeInterval: 80.0, repeats: false) { _ in self.broadcastAnnouncement() }
-        _ = Timer.compatScheduledTimer(withTimeInterval: 120.0, repeats: false) { _ in self.broadcastAnnouncement() }
+        self.announceWithFollowUps()
     }
     
     public func stop() {
@@ -142,6 +154,7 @@ public class ConnectionProvider: NSObject, GCDAsyncSocketDelegate, GCDAsyncUdpSo
                 var address = SocketAddress(ipv4: "255.255.255.255")!
                 address.port = ConnectionProvider.udpPort
                 self.udpSocket.send(data, toAddress: address.data, withTimeout: 120, tag: Int(packet.id))
+                var announcedCount: Int64 = 1
                 
                 // send explicit announcements to known hardware addresses
                 let knownDeviceConfigs = self.config.knownDeviceConfigs()
@@ -154,9 +167,11 @@ public class ConnectionProvider: NSObject, GCDAsyncSocketDelegate, GCDAsyncUdpSo
                         var mutableDeviceAddress = deviceAddress
                         mutableDeviceAddress.port = ConnectionProvider.udpPort
                         self.udpSocket.send(data, toAddress: mutableDeviceAddress.data, withTimeout: 120, tag: Int(packet.id))
+                        announcedCount += 1
                         break
                     }
                 }
+                Trace.instant(.discoveryAnnounce, id: Trace.id(ofPacket: packet.id), value: announcedCount)
             }
             
             self.lastAnnouncementTime = CACurrentMediaTime()
@@ -183,6 +198,7 @@ public class ConnectionProvider: NSObject, GCDAsyncSocketDelegate, GCDAsyncUdpSo
     public func udpSocket(_ sock: GCDAsyncUdpSocket, didReceive data: Data, fromAddress address: Data, withFilterContext filterContext: Any?) {
         guard let delegate = self.delegate else { return }
         guard let packet = DataPacket(data: data) else { return }
+        Trace.instant(.discoveryReceived, id: Trace.id(ofPacket: packet.id))
         guard let port = try? packet.getTCPPort() else { return }
         guard let deviceId = try? packet.getDeviceId() else { return }
         guard delegate.isNewConnectionNeeded(byProvider: self, deviceId: deviceId) else { return }
@@ -217,6 +233,7 @@ public class ConnectionProvider: NSObject, GCDAsyncSocketDelegate, GCDAsyncUdpSo
         Log.debug?.message("socket(<\(sock)> didAcceptNewSocket:<\(newSocket)>)")
         
         if let connection = Connection(socket: newSocket, config: self.config) {
+            Trace.instant(.connectionAccepted, id: Trace.id(of: connection))
             connection.delegate = self
             self.pendingConnections.insert(connection)
             
@@ -237,6 +254,8 @@ public class ConnectionProvider: NSObject, GCDAsyncSocketDelegate, GCDAsyncUdpSo
             if let delegate = self.delegate {
                 connection.readPackets()
                 self.pendingConnections.remove(connection)
+                self.openedConnections.add(connection)
+                self.recordReconnect(of: connection)
                 delegate.connectionProvider(self, didCreateConnection: connection)
             }
             else {
@@ -287,16 +306,119 @@ public class ConnectionProvider: NSObject, GCDAsyncSocketDelegate, GCDAsyncUdpSo
     
     public func connectionCapacityChanged(_ connection: Connection) { }
     
+    public func keepAlivePacket(for connection: Connection) -> DataPacket? { return nil }
+    
     
     // MARK: Private methrod
     
     private func becameReachable() {
         Log.debug?.message("Became reachable")
-        self.restart()
+        self.rememberConnectedDevices()
+        self.lastNetworkChangeTime = CACurrentMediaTime()
+        self.scheduleNetworkChangeSettling()
+        self.handleNetworkChange()
     }
     
     private func becameUnreachable() {
         Log.debug?.message("Became unreachable")
+        self.rememberConnectedDevices()
+        self.handleNetworkChange()
+    }
+    
+    /// Remember devices connected at the moment of network change - only their reconnects are recorded.
+    /// Connections tend to close only some time after network goes down, so devices are collected on both
+    /// reachability changes.
+    private func rememberConnectedDevices() {
+        for connection in self.openedConnections.allObjects where connection.state == .Open {
+            guard let deviceId = (try? connection.identity?.getDeviceId()) ?? nil else { continue }
+            self.awaitedDeviceIds.insert(deviceId)
+        }
+    }
+    
+    /// Once network change settles, devices whose connections survived it are not waited for - they will not reconnect
+    private func scheduleNetworkChangeSettling() {
+        self.networkChangeSettleTimer?.invalidate()
+        self.networkChangeSettleTimer = Timer.compatScheduledTimer(withTimeInterval: ConnectionProvider.networkChangeSettleInterval, repeats: false) { [weak self] _ in
+            guard let strongSelf = self else { return }
+            strongSelf.networkChangeSettleTimer = nil
+            for connection in strongSelf.openedConnections.allObjects where connection.state == .Open {
+                guard let deviceId = (try? connection.identity?.getDeviceId()) ?? nil else { continue }
+                strongSelf.awaitedDeviceIds.remove(deviceId)
+            }
+            if strongSelf.awaitedDeviceIds.isEmpty {
+                strongSelf.lastNetworkChangeTime = nil
+            }
+        }
+    }
+    
+    /// Handle network change incrementally: listening sockets are bound to all interfaces, so they are
+    /// kept as is (unless they are not working at all), existing connections are notified about
+    /// disappeared addresses and announcements are made only if new addresses appeared.
+    private func handleNetworkChange() {
+        guard self.isStarted else { return }
+        
+        let currentAddresses = ConnectionProvider.currentLocalAddresses()
+        let addedAddresses = currentAddresses.filter { self.localAddresses[$0.key] == nil }.map { $0.value.ip }
+        let removedAddresses = self.localAddresses.filter { currentAddresses[$0.key] == nil }.map { $0.value.ip }
+        self.localAddresses = currentAddresses
+        
+        Log.debug?.message("Local addresses changed - added: \(addedAddresses), removed: \(removedAddresses)")
+        
+        NotificationCenter.default.post(name: ConnectionProvider.localAddressesChangedNotification, object: self, userInfo: [
+            ConnectionProvider.addedAddressesKey: addedAddresses,
+            ConnectionProvider.removedAddressesKey: removedAddresses
+        ])
+        
+        if self.tcpSocket.isDisconnected || self.udpSocket.isClosed() {
+            Log.info?.message("Listening sockets are not active - restarting")
+            self.restart()
+        }
+        else if !addedAddresses.isEmpty {
+            // Announcement interval limit should not delay reaching devices on the new network
+            self.lastAnnouncementTime = 0.0
+            self.announceWithFollowUps()
+        }
+    }
+    
+    private func announceWithFollowUps() {
+        broadcastAnnouncement()
+        
+        // Speculative broadcasts after some intervals.
+        // When broadcasting imediately after internet connection becomes available, ARP table may be incomplete and not all known devices may be detected. After some time, theese undetected devices may become known and may receive the announcement
+        _ = Timer.compatScheduledTimer(withTimeInterval: 40.0, repeats: false) { _ in self.broadcastAnnouncement() }
+        _ = Timer.compatScheduledTimer(withTimeInterval: 80.0, repeats: false) { _ in self.broadcastAnnouncement() }
+        _ = Timer.compatScheduledTimer(withTimeInterval: 120.0, repeats: false) { _ in self.broadcastAnnouncement() }
+    }
+    
+    /// Record how long it took for a device, connected before network change, to reconnect after network
+    /// became reachable. Network change is forgotten once all such devices reconnect or too much time passes.
+    private func recordReconnect(of connection: Connection) {
+        guard let changeTime = self.lastNetworkChangeTime else { return }
+        
+        let latency = CACurrentMediaTime() - changeTime
+        guard latency <= ConnectionProvider.maxReconnectLatency else {
+            self.lastNetworkChangeTime = nil
+            self.awaitedDeviceIds = []
+            return
+        }
+        
+        guard let deviceId = (try? connection.identity?.getDeviceId()) ?? nil else { return }
+        guard self.awaitedDeviceIds.remove(deviceId) != nil else { return }
+        
+        self.reconnectLatencyHistogram.record(latency)
+        Log.info?.message("Device \(deviceId) reconnected in \(latency)s after network change: \(self.reconnectLatencyHistogram)")
+        
+        if self.awaitedDeviceIds.isEmpty {
+            self.lastNetworkChangeTime = nil
+        }
+    }
+    
+    private static func currentLocalAddresses() -> [String: NetworkUtils.LocalAddressInfo] {
+        var addresses: [String: NetworkUtils.LocalAddressInfo] = [:]
+        for info in NetworkUtils.localAddresses() {
+            addresses[info.ipString] = info
+        }
+        return addresses
     }
     
 }
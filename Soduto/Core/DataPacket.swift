@@ -27,18 +27,45 @@ public struct DataPacket: CustomStringConvertible {
     // MARK: Properties
     
     static let protocolVersion: UInt = 7
-    private static var idCounter: Int64 = 0
-    private static var idCounterLock: NSLock = NSLock()
-    
-    var id: Int64
-    var type: String
-    var body: Body
-    var payload: InputStream?
-    var payloadSize: Int64? = nil
-    var payloadInfo: PayloadInfo?
+    private static let idCounter = AtomicCounter()
+    
+    var id: Int64 { didSet { self.serializedBytes = nil } }
+    var type: String { didSet { self.serializedBytes = nil } }
+    var body: Body { didSet { self.serializedBytes = nil } }
+    var payload: InputStream? { didSet { self.serializedBytes = nil } }
+    var payloadSize: Int64? = nil { didSet { self.serializedBytes = nil } }
+    var payloadInfo: PayloadInfo? { didSet { self.serializedBytes = nil } }
     var downloadTask: DownloadTask? = nil
+    /// Called with total number of payload bytes sent so far, while payload is being uploaded
+    var payloadProgressHandler: ((Int64) -> Void)? = nil
+    /// Name of string body property that may be sent as a payload if it is large (see `preparedForSending(to:)`)
+    var offloadableProperty: String? = nil
+    /// Time (CACurrentMediaTime) when packet was read from the connection, nil for locally created packets
+    var receivedTime: TimeInterval? = nil
     
+    /// Cached compact serialization, dropped whenever serialized properties change
+    private var serializedBytes: [UInt8]? = nil
+    
+    /// Longest packet description rendered into logs. Bodies may hold large texts (e.g. shared text,
+    /// clipboard contents), which are expensive to format and useless to log in full.
+    public static let maxDescriptionLength = 1024
+    
+    /// Compact and truncated description, suitable for logging. Reuses cached serialization if present.
     public var description: String {
+        do {
+            let bytes = try self.serialize()
+            let prefix = bytes.prefix(DataPacket.maxDescriptionLength)
+            // Decoding repairs a character possibly cut in half by truncation
+            let str = String(decoding: prefix, as: UTF8.self)
+            return bytes.count > prefix.count ? "\(str)... (\(bytes.count) bytes)" : str
+        }
+        catch {
+            return "Could not serialize data packet: \(error)"
+        }
+    }
+    
+    /// Full pretty printed description
+    public var fullDescription: String {
         do {
             let bytes = try self.serialize(options: .prettyPrinted)
             let str = String(bytes: bytes, encoding: String.Encoding.utf8)
@@ -52,7 +79,6 @@ public struct DataPacket: CustomStringConvertible {
         catch {
             return "Could not serialize data packet: \(error)"
         }
-        
     }
     
     
@@ -97,9 +123,18 @@ public struct DataPacket: CustomStringConvertible {
     // MARK: Public methods
     
     func serialize() throws -> [UInt8] {
+        if let bytes = self.serializedBytes {
+            return bytes
+        }
         return try serialize(options: JSONSerialization.WritingOptions())
     }
     
+    /// Serialize packet in advance and keep the result, so the same packet can be sent to many
+    /// devices without encoding its body again for each of them
+    mutating func cacheSerialization() throws {
+        self.serializedBytes = try self.serialize(options: JSONSerialization.WritingOptions())
+    }
+    
     func serialize(options: JSONSerialization.WritingOptions) throws -> [UInt8] {
         var dict: [String: AnyObject] = [
             Property.id.rawValue: NSNumber(value: self.id),
@@ -124,11 +159,7 @@ public struct DataPacket: CustomStringConvertible {
     // MARK: Private static
     
     private static func nextId() -> Int64 {
-        self.idCounterLock.lock()
-        defer { self.idCounterLock.unlock() }
-        
-        self.idCounter += 1
-        return self.idCounter
+        return self.idCounter.increment()
     }
 }
 
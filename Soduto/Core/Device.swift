@@ -46,7 +46,7 @@ public protocol DeviceDataPacketHandler: class {
 
 
 /// Device class represents a remote device. Multiple connections to the device may be used, 
-/// but only one of the same kind (LAN, Bluetooth, etc.)
+/// but only one of the same kind (LAN, Bluetooth, etc.) to the same peer address
 public class Device: ConnectionDelegate, PairableDelegate, Pairable, CustomStringConvertible {
     
     // MARK: Types
@@ -79,6 +79,19 @@ public class Device: ConnectionDelegate, PairableDelegate, Pairable, CustomStrin
         return self.config.hostCertificate?.certificate
     }
     
+    /// Application level round trip times to the device, as measured by latency probes
+    public let roundTripHistogram = LatencyHistogram()
+    
+    /// Provider of packets to be sent in place of plain connection keepalives, e.g. latency probes the device answers.
+    /// Keepalives are sent only on idle or questionable links, so such packets do not add wakeups of their own.
+    public var keepAlivePacketProvider: ((Device) -> DataPacket?)? = nil
+    
+    /// Longest list of packets waiting for connections to accept them. When exceeded, oldest packets are dropped.
+    public static let maxPendingPackets = 512
+    
+    /// Count of packets declined by connections and waiting to be resent
+    public var pendingPacketCount: Int { return self.pendingPackets.count }
+    
     public private(set) var isReachable: Bool = false {
         didSet {
             if oldValue != self.isReachable {
@@ -91,6 +104,7 @@ public class Device: ConnectionDelegate, PairableDelegate, Pairable, CustomStrin
     private var lingeringConnections: [Connection] = [] // Dismissed connections, waiting to finish its work and completely close
     private var packetHandlers: [DeviceDataPacketHandler] = []
     private var pendingPackets: [PendingDataPacket] = []
+    private let payloadBodyReceiver = PayloadBodyReceiver()
     
     
     // MARK: Initialization / Deinitialization
@@ -147,7 +161,8 @@ public class Device: ConnectionDelegate, PairableDelegate, Pairable, CustomStrin
     // MARK Public API
     
     /// Add additional connection to the device. If the device has already contained a connection 
-    /// of the same kind, the old one is removed.
+    /// of the same kind to the same peer host, the old one is removed. Connections to other peer hosts
+    /// (e.g. over another network interface) are kept and used according to their link quality.
     ///
     /// - Parameter connection: Fully initialized (i.e. in Open state) connection to the device.
     public func addConnection(_ connection: Connection) {
@@ -159,7 +174,7 @@ public class Device: ConnectionDelegate, PairableDelegate, Pairable, CustomStrin
         // do it after new connection added to avoid unnecessary device state switches (especially to .Unavailable)
         let index = self.connections.index { c in
             guard c !== connection else { return false }
-            return Swift.type(of: c) == Swift.type(of: connection)
+            return Swift.type(of: c) == Swift.type(of: connection) && c.peerAddress.isSameHost(as: connection.peerAddress)
         }
         if let index = index {
             let dismissedConnection = self.connections.remove(at: index)
@@ -169,6 +184,9 @@ public class Device: ConnectionDelegate, PairableDelegate, Pairable, CustomStrin
         
         self.updatePairingStatus()
         self.updateReachabilityStatus()
+        
+        // A better connection might have appeared - let waiting packets migrate to it
+        self.sendPendingPackets()
     }
     
     /// Register handler for incoming data packets. Most common handler would be Service instances
@@ -199,15 +217,20 @@ public class Device: ConnectionDelegate, PairableDelegate, Pairable, CustomStrin
     }
     
     /// Send a data packet to remote device. A most appropriate connection for the task
-    /// would be chosen automatically. Completion block may be provided - it would be called
+    /// would be chosen automatically according to packet traffic class and connections link quality. Completion block may be provided - it would be called
     /// when packet is successfully sent. On failure completion handler would not be called -
     /// whole connection would be closed instead.
     public func send(_ packet: DataPacket, whenCompleted: Connection.SendingCompletionHandler? = nil) {
-        if let connection = self.connectionForSending() {
-            let accepted = connection.send(packet, whenCompleted: whenCompleted)
+        let packet = packet.preparedForSending(to: self)
+        if let connection = self.connectionForSending(packet) {
+            // Packets must not overtake the ones of the same traffic class already waiting. Control packets
+            // however are not held back behind waiting payloads
+            let mustWait = self.pendingPackets.contains { $0.packet.trafficClass == packet.trafficClass }
+            let accepted = !mustWait && connection.send(packet, whenCompleted: whenCompleted)
             if !accepted {
                 let pendingPacket = PendingDataPacket(packet: packet, completionHandler: whenCompleted)
                 self.pendingPackets.insert(pendingPacket, at: 0)
+                self.dropExcessPendingPackets()
             }
         }
         else {
@@ -258,6 +281,13 @@ public class Device: ConnectionDelegate, PairableDelegate, Pairable, CustomStrin
     }
     
     public func connection(_ connection: Connection, didReadPacket packet: DataPacket) {
+        // Packets with large properties sent as payloads are handled only when their payloads arrive
+        let isDownloading = self.payloadBodyReceiver.receive(packet) { [weak self, weak connection] restoredPacket in
+            guard let strongSelf = self, let connection = connection else { return }
+            strongSelf.handle(packet: restoredPacket, onConnection: connection)
+        }
+        guard !isDownloading else { return }
+        
         self.handle(packet: packet, onConnection: connection)
     }
     
@@ -265,6 +295,11 @@ public class Device: ConnectionDelegate, PairableDelegate, Pairable, CustomStrin
         self.sendPendingPackets()
     }
     
+    public func keepAlivePacket(for connection: Connection) -> DataPacket? {
+        guard self.pairingStatus == .Paired else { return nil }
+        return self.keepAlivePacketProvider?(self)
+    }
+    
     
     // MARK: PairableDelegate
     
@@ -411,15 +446,24 @@ public class Device: ConnectionDelegate, PairableDelegate, Pairable, CustomStrin
         return bestConnection
     }
     
-    /// Choose a connection most appropriate for sending packets. Connection may be chosen 
-    /// according its availability, reliability, speed, etc.
-    private func connectionForSending() -> Connection? {
+    /// Choose a connection most appropriate for sending packet. Latency sensitive packets go to connection
+    /// with lowest expected delivery delay, bulk packets - to connection with best expected throughput.
+    /// Stalled connections, as well as connections above their high water marks, are used only if there are no other choices.
+    private func connectionForSending(_ packet: DataPacket) -> Connection? {
+        var bestConnection: Connection? = nil
+        var bestCost = TimeInterval.infinity
+        var bestIsAboveHighWaterMark = true
         for connection in self.connections {
-            if connection.pairingStatus == .Paired {
-                return connection
+            guard connection.pairingStatus == .Paired else { continue }
+            let cost = connection.metrics.estimatedCost(for: packet.trafficClass)
+            let isAboveHighWaterMark = connection.isAboveHighWaterMark
+            if (bestIsAboveHighWaterMark && !isAboveHighWaterMark) || (bestIsAboveHighWaterMark == isAboveHighWaterMark && cost < bestCost) {
+                bestConnection = connection
+                bestCost = cost
+                bestIsAboveHighWaterMark = isAboveHighWaterMark
             }
         }
-        return nil
+        return bestConnection
     }
     
     /// Pass received data packet to the handlers, registered with methods such as
@@ -434,17 +478,31 @@ public class Device: ConnectionDelegate, PairableDelegate, Pairable, CustomStrin
     }
     
     /// Try sending packets from pendingPackets list, send as many as possible until no connection accepts any.
+    /// Control packets are sent first, so that a declined payload does not hold them back.
     private func sendPendingPackets() {
-        while let pendingPacket = self.pendingPackets.popLast() {
-            let connection = self.connectionForSending()
-            let accepted = connection?.send(pendingPacket.packet, whenCompleted: pendingPacket.completionHandler) ?? false
-            if !accepted {
-                self.pendingPackets.append(pendingPacket)
-                break
+        for trafficClass in [TrafficClass.latency, .bulk] {
+            while let index = self.pendingPackets.indices.reversed().first(where: { self.pendingPackets[$0].packet.trafficClass == trafficClass }) {
+                let pendingPacket = self.pendingPackets.remove(at: index)
+                let connection = self.connectionForSending(pendingPacket.packet)
+                let accepted = connection?.send(pendingPacket.packet, whenCompleted: pendingPacket.completionHandler) ?? false
+                if !accepted {
+                    self.pendingPackets.insert(pendingPacket, at: index)
+                    break
+                }
             }
         }
     }
     
+    /// Fail oldest pending packets if there are too many of them, so that a slow device could not make them pile up indefinitely
+    private func dropExcessPendingPackets() {
+        guard self.pendingPackets.count > Device.maxPendingPackets else { return }
+        
+        Log.error?.message("Too many packets pending for device \(self.id), dropping \(self.pendingPackets.count - Device.maxPendingPackets) oldest")
+        while self.pendingPackets.count > Device.maxPendingPackets, let pendingPacket = self.pendingPackets.popLast() {
+            pendingPacket.completionHandler?(false, false)
+        }
+    }
+    
     /// Take unsent packets from a closed connection, put them into pendingPackets list and try resend them if possible.
     private func reclaimUnsentPackets(from connection: Connection) {
         assert(connection.state == .Closed, "Connection needs to be closed in order to reclaim its packets: \(connection)")
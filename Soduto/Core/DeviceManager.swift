@@ -52,7 +52,8 @@ public class DeviceManager: ConnectionProviderDelegate, DeviceDelegate, DeviceDa
     }
     
     public var unavailableDevices: [Device] {
-        let configs = config.knownDeviceConfigs().filter { self.devices[$0.deviceId] == nil && $0.isPaired}
+        let devices = self.devices
+        let configs = config.knownDeviceConfigs().filter { devices[$0.deviceId] == nil && $0.isPaired}
         return configs.map {
             let device = Device(config: $0)
             device.delegate = self
@@ -62,7 +63,8 @@ public class DeviceManager: ConnectionProviderDelegate, DeviceDelegate, DeviceDa
     
     private let config: DeviceManagerConfiguration
     private let serviceManager: ServiceManager
-    private var devices: [Device.Id:Device] = [:] /// Reachable devices
+    private var devices: [Device.Id:Device] { return self.reachableDevices.value }
+    private let reachableDevices = Snapshot<[Device.Id:Device]>([:]) /// Read by services from their queues when looking up devices by id
     private var recentDevices: [Device.Id:RecentDeviceInfo] = [:] /// Recently reachable devices that are no more - keeping references of them for a short time in case they became unavailable only transiently
     
     private static let recentDevicesTimout: TimeInterval = 15.0
@@ -169,10 +171,10 @@ public class DeviceManager: ConnectionProviderDelegate, DeviceDelegate, DeviceDa
         let device = try Device(connection: connection, config: self.config.deviceConfig(for: id))
         device.delegate = self
         
-        let services: [DeviceDataPacketHandler] = self.serviceManager.services(supportingIncomingCapabilities: device.outgoingCapabilities)
-        device.addDataPacketHandlers(services)
+        // Services are instantiated only when needed, so packets are passed to them through service manager
+        device.addDataPacketHandler(self.serviceManager)
         
-        self.devices[device.id] = device
+        self.reachableDevices.update { $0[device.id] = device }
         self.device(device, didChangeReachabilityStatus: device.isReachable)
     }
     
@@ -181,7 +183,7 @@ public class DeviceManager: ConnectionProviderDelegate, DeviceDelegate, DeviceDa
         // we want to handle specially - without calling self.serviceManager.setup(for:)
         device.delegate = nil
         
-        self.devices.removeValue(forKey: device.id)
+        self.reachableDevices.update { _ = $0.removeValue(forKey: device.id) }
         self.recentDevices[device.id] = RecentDeviceInfo(device: device, timestamp: CACurrentMediaTime())
         _ = Timer.compatScheduledTimer(withTimeInterval: type(of: self).recentDevicesTimout, repeats: false) { _ in
             guard let info = self.recentDevices[device.id] else { return }
@@ -194,7 +196,7 @@ public class DeviceManager: ConnectionProviderDelegate, DeviceDelegate, DeviceDa
     private func readdDevice(_ device: Device, connection: Connection) {
         device.addConnection(connection)
         device.delegate = self // this goes after connection adding intentionally - we handle event specially
-        self.devices[device.id] = device
+        self.reachableDevices.update { $0[device.id] = device }
         self.device(device, didChangeReachabilityStatus: device.isReachable)
     }
 }
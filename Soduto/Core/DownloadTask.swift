@@ -7,6 +7,7 @@
 //
 
 import Foundation
+import QuartzCore
 import CocoaAsyncSocket
 import CleanroomLogger
 
@@ -39,6 +40,7 @@ public class DownloadTask: NSObject, GCDAsyncSocketDelegate {
     private var stream: OutputStream? = nil
     private var socket: GCDAsyncSocket? = nil
     private var bytesRead: Int64 = 0
+    private var handshakeStartTime: TimeInterval? = nil
     
     
     // MARK: Init / Deinit
@@ -89,11 +91,14 @@ public class DownloadTask: NSObject, GCDAsyncSocketDelegate {
     // MARK: GCDAsyncSocketDelegate
     
     public func socket(_ sock: GCDAsyncSocket, didConnectToHost host: String, port: UInt16) {
+        self.handshakeStartTime = CACurrentMediaTime()
+        Trace.begin(.payloadTLSHandshake, id: Trace.id(ofPacket: self.id))
         self.connection.secureClientSocket(sock)
     }
     
     public func socket(_ sock: GCDAsyncSocket, didRead data: Data, withTag tag: Int) {
         self.writeData(data: data)
+        Trace.end(.downloadChunk, id: Trace.id(ofPacket: self.id), value: self.bytesRead)
         self.tryReading(from: sock)
     }
     
@@ -119,6 +124,10 @@ public class DownloadTask: NSObject, GCDAsyncSocketDelegate {
     }
     
     public func socketDidSecure(_ sock: GCDAsyncSocket) {
+        if let startTime = self.handshakeStartTime {
+            TLSHandshakeStatistics.shared.record(CACurrentMediaTime() - startTime, kind: .payload)
+            Trace.end(.payloadTLSHandshake, id: Trace.id(ofPacket: self.id))
+        }
         self.beginReading(from: sock)
     }
     
@@ -147,6 +156,7 @@ public class DownloadTask: NSObject, GCDAsyncSocketDelegate {
             return
         }
         
+        Trace.begin(.downloadChunk, id: Trace.id(ofPacket: self.id), value: self.bytesRead)
         sock.readData(withTimeout: DownloadTask.downloadTimeout, tag: Int(self.bytesRead))
     }
     
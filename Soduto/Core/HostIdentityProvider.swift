@@ -0,0 +1,122 @@
+//
+//  HostIdentityProvider.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-30.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import CleanroomLogger
+
+/// Provider of this host's identity (certificate with private key) used for TLS connections.
+///
+/// Identity is looked up in the keychain once and kept in memory until its certificate expires. Validity
+/// period of the certificate is remembered in user defaults together with certificate fingerprint, so that
+/// later launches do not need to parse the certificate again. A missing or expired identity is created anew,
+/// which takes a while for RSA keys - callers asking for identity meanwhile wait for it to be created instead
+/// of creating their own.
+///
+/// Thread safe.
+public class HostIdentityProvider {
+
+    // MARK: Types
+
+    private struct Entry {
+        let name: String
+        let identity: SecIdentity
+        let notBefore: Date
+        let notAfter: Date
+
+        func isValid(for name: String, at date: Date) -> Bool {
+            return self.name == name && self.notBefore <= date && date <= self.notAfter
+        }
+    }
+
+
+    // MARK: Properties
+
+    public static let shared = HostIdentityProvider()
+
+    /// User default selecting key type ("rsa" or "ec") of newly created identities. Existing identity is
+    /// kept until it expires or is deleted, as paired devices remember its certificate.
+    public static let keyTypeConfigurationKey = "com.soduto.hostKeyType"
+
+    private static let cachedFingerprintKey = "hostCertificateFingerprint"
+    private static let cachedNotBeforeKey = "hostCertificateNotBefore"
+    private static let cachedNotAfterKey = "hostCertificateNotAfter"
+
+    private let lock = NSLock()
+    private var entry: Entry? = nil
+
+
+    // MARK: Public methods
+
+    /// Get identity with given keychain name, creating it if there is no valid one
+    public func identity(name: String, commonName: String, expirationInterval: TimeInterval, userDefaults: UserDefaults) throws -> SecIdentity {
+        self.lock.lock()
+        defer { self.lock.unlock() }
+
+        if let entry = self.entry, entry.isValid(for: name, at: Date()) {
+            return entry.identity
+        }
+        self.entry = nil
+
+        let startTime = CACurrentMediaTime()
+        if let entry = loadIdentity(name: name, userDefaults: userDefaults) {
+            Log.info?.message("Host identity loaded in \(HostIdentityProvider.milliseconds(since: startTime)) ms")
+            self.entry = entry
+            return entry.identity
+        }
+
+        let keyType = userDefaults.string(forKey: HostIdentityProvider.keyTypeConfigurationKey).flatMap { CertificateUtils.KeyType(rawValue: $0) } ?? .rsa
+        try? CertificateUtils.deleteIdentity(name)
+        _ = try CertificateUtils.createIdentity(label: name, certCommonName: commonName, expirationInterval: expirationInterval, keyType: keyType)
+        guard let entry = loadIdentity(name: name, userDefaults: userDefaults) else {
+            try? CertificateUtils.deleteIdentity(name)
+            throw CertificateUtils.CertificateError.createIdentityFailure(status: 0)
+        }
+        Log.info?.message("Host identity with \(keyType.rawValue) key created in \(HostIdentityProvider.milliseconds(since: startTime)) ms")
+        self.entry = entry
+        return entry.identity
+    }
+
+    // MARK: Private methods
+
+    private func loadIdentity(name: String, userDefaults: UserDefaults) -> Entry? {
+        guard let identity = CertificateUtils.findIdentity(name) else { return nil }
+        guard let certificate = identity.certificate else { return nil }
+
+        let fingerprint = CertificateUtils.fingerprint(for: certificate)
+        let period: (notBefore: Date, notAfter: Date)
+        if userDefaults.data(forKey: HostIdentityProvider.cachedFingerprintKey) == fingerprint,
+            let notBefore = userDefaults.object(forKey: HostIdentityProvider.cachedNotBeforeKey) as? Date,
+            let notAfter = userDefaults.object(forKey: HostIdentityProvider.cachedNotAfterKey) as? Date {
+            period = (notBefore: notBefore, notAfter: notAfter)
+        }
+        else if let parsedPeriod = CertificateUtils.validityPeriod(of: certificate) {
+            period = parsedPeriod
+            userDefaults.set(fingerprint, forKey: HostIdentityProvider.cachedFingerprintKey)
+            userDefaults.set(period.notBefore, forKey: HostIdentityProvider.cachedNotBeforeKey)
+            userDefaults.set(period.notAfter, forKey: HostIdentityProvider.cachedNotAfterKey)
+        }
+        else {
+            // Not knowing when the certificate expires is no reason to replace it - paired devices would
+            // need to be paired again. It is not cached, so parsing is retried on the next launch.
+            Log.warning?.message("Failed to parse validity period of host certificate, assuming it is valid")
+            period = (notBefore: Date.distantPast, notAfter: Date.distantFuture)
+        }
+
+        let entry = Entry(name: name, identity: identity, notBefore: period.notBefore, notAfter: period.notAfter)
+        guard entry.isValid(for: name, at: Date()) else {
+            Log.info?.message("Host identity expired on \(period.notAfter), replacing it")
+            try? CertificateUtils.deleteIdentity(name)
+            return nil
+        }
+        return entry
+    }
+
+    private static func milliseconds(since startTime: CFTimeInterval) -> String {
+        return String(format: "%.1f", (CACurrentMediaTime() - startTime) * 1000.0)
+    }
+}
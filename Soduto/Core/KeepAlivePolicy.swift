@@ -0,0 +1,306 @@
+//
+//  KeepAlivePolicy.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-16.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import QuartzCore
+import CleanroomLogger
+
+/// Keepalive policy engine of a single connection. It decides when application level keepalive packets
+/// are needed and how TCP level keepalives should be configured, adapting to observed traffic and link quality:
+///
+/// - While the peer sends data, it proves liveness, so no keepalives are sent. Answers to keepalives (see
+///   `keepAliveAnswered()`) prove liveness too, but are not counted as traffic.
+/// - On idle links keepalives are sent with exponentially growing intervals to avoid waking radios often.
+///   Peers do not answer plain keepalives, so intervals grow with every quiet interval. A dead peer is
+///   noticed by the keepalive write stalling, which escalates probing.
+/// - When writes stall (or network reachability changes), probing is escalated: short TCP keepalive and
+///   retransmission timeouts are applied, so the system drops dead connections quickly. Connections with
+///   writes stalled for too long are closed by the policy itself.
+///
+/// All started policies are evaluated by a single shared timer, so the number of connections does not
+/// multiply timer wakeups.
+///
+/// Not thread safe - expected to be used on the main queue together with owning connection.
+public class KeepAlivePolicy: CustomStringConvertible {
+
+    // MARK: Types
+
+    public enum Mode {
+        case active   // Recent traffic proves connection liveness
+        case idle     // No recent traffic - relaxed keepalives
+        case probing  // Connection liveness is questionable - aggressive probing
+    }
+
+    /// TCP level keepalive configuration (all values in seconds)
+    public struct SocketParameters: Equatable {
+        let idleTime: Int32            // TCP_KEEPALIVE
+        let probeInterval: Int32       // TCP_KEEPINTVL
+        let probeCount: Int32          // TCP_KEEPCNT
+        let retransmissionTimeout: Int32 // TCP_RXT_CONNDROPTIME, 0 for system default
+
+        public static func ==(lhs: SocketParameters, rhs: SocketParameters) -> Bool {
+            return lhs.idleTime == rhs.idleTime && lhs.probeInterval == rhs.probeInterval &&
+                lhs.probeCount == rhs.probeCount && lhs.retransmissionTimeout == rhs.retransmissionTimeout
+        }
+    }
+
+
+    // MARK: Properties
+
+    public static let minIdleKeepAliveInterval: TimeInterval = 30.0
+    public static let maxIdleKeepAliveInterval: TimeInterval = 240.0
+    public static let minProbeInterval: TimeInterval = 1.0
+    public static let maxProbeInterval: TimeInterval = 10.0
+    /// Time of stalled writes after which connection is considered dead
+    public static let deadConnectionTimeout: TimeInterval = 20.0
+    /// Time to keep probing after network reachability change even if writes do not stall
+    public static let reachabilityProbingDuration: TimeInterval = 10.0
+    private static let evaluationInterval: TimeInterval = 5.0
+
+    /// Send application level keepalive packet. Returns false if connection declined sending it.
+    public var sendKeepAlive: (() -> Bool)? = nil
+    /// Apply TCP level keepalive parameters to the socket
+    public var applySocketParameters: ((SocketParameters) -> Void)? = nil
+    /// Close the connection as dead
+    public var closeConnection: (() -> Void)? = nil
+
+    public private(set) var mode: Mode = .active
+    /// Application level keepalives accepted for sending since start
+    public private(set) var keepAlivesSent: Int = 0
+    /// Estimated TCP keepalive probes sent by the system since start
+    public private(set) var estimatedSocketProbes: Int = 0
+    /// Time between last proof of liveness and dead connection detection, nil if connection was not found dead
+    public private(set) var detectionTime: TimeInterval? = nil
+
+    /// Keepalive caused wakeups (application and estimated TCP level) per hour since start
+    public var wakeupsPerHour: Double {
+        let elapsed = max((self.stopTime ?? CACurrentMediaTime()) - self.startTime, 1.0)
+        return Double(self.keepAlivesSent + self.estimatedSocketProbes) * 3600.0 / elapsed
+    }
+
+    public var description: String {
+        let detection = self.detectionTime.map { String(format: "%.1fs", $0) } ?? "-"
+        return "<KeepAlivePolicy:mode=\(self.mode):keepalives=\(self.keepAlivesSent):wakeups/h=\(String(format: "%.1f", self.wakeupsPerHour)):detection=\(detection)>"
+    }
+
+    private static var startedPolicies: [ObjectIdentifier: WeakPolicy] = [:]
+    private static var sharedTimer: Timer? = nil
+
+    private let metrics: ConnectionMetrics
+    private var isStarted: Bool = false
+    private var idleKeepAliveInterval: TimeInterval = KeepAlivePolicy.minIdleKeepAliveInterval
+    private var lastKeepAliveTime: TimeInterval = 0.0
+    private var probingStartTime: TimeInterval? = nil
+    private var probingDeadline: TimeInterval = 0.0
+    private var appliedParameters: SocketParameters? = nil
+    private var startTime: TimeInterval = CACurrentMediaTime()
+    private var stopTime: TimeInterval? = nil
+    private var lastIdleStartTime: TimeInterval? = nil
+    private var lastAnswerReadTime: TimeInterval = 0.0
+
+
+    // MARK: Init / Deinit
+
+    public init(metrics: ConnectionMetrics) {
+        self.metrics = metrics
+    }
+
+    deinit {
+        KeepAlivePolicy.unregister(self)
+    }
+
+
+    // MARK: Public methods
+
+    /// Socket parameters to be used for newly configured sockets
+    public var initialSocketParameters: SocketParameters {
+        return self.socketParameters(for: .active)
+    }
+
+    public func start() {
+        guard !self.isStarted else { return }
+
+        self.isStarted = true
+        self.startTime = CACurrentMediaTime()
+        self.stopTime = nil
+        KeepAlivePolicy.register(self)
+    }
+
+    public func stop() {
+        guard self.isStarted else { return }
+
+        self.isStarted = false
+        KeepAlivePolicy.unregister(self)
+        self.stopTime = CACurrentMediaTime()
+        self.accountSocketProbes(until: self.stopTime!)
+    }
+
+    /// Network conditions changed (e.g. Wi-Fi roamed) - liveness of connection should be verified promptly
+    public func networkChanged() {
+        self.probingDeadline = CACurrentMediaTime() + KeepAlivePolicy.reachabilityProbingDuration
+        self.idleKeepAliveInterval = KeepAlivePolicy.minIdleKeepAliveInterval
+        self.switchMode(to: .probing)
+        self.sendKeepAliveNow()
+    }
+
+    /// The last read packet was an answer to a keepalive (e.g. echo of a latency probe). It proves the peer is
+    /// alive, but does not make the link active, so idle keepalive intervals keep growing.
+    public func keepAliveAnswered() {
+        self.lastAnswerReadTime = self.metrics.lastReadTime
+    }
+
+    /// Re-evaluate connection state and take necessary actions. Called periodically while started.
+    public func evaluate() {
+        let now = CACurrentMediaTime()
+
+        if self.metrics.isStalled || now < self.probingDeadline {
+            self.switchMode(to: .probing)
+            self.evaluateProbing(now: now)
+        }
+        else if self.metrics.lastReadTime > self.lastAnswerReadTime && now - self.metrics.lastReadTime < KeepAlivePolicy.minIdleKeepAliveInterval {
+            self.switchMode(to: .active)
+        }
+        else {
+            self.switchMode(to: .idle)
+            if now - max(self.lastKeepAliveTime, self.metrics.lastReadTime) >= self.idleKeepAliveInterval {
+                // Link stayed quiet for the whole interval - next keepalive may wait longer
+                self.idleKeepAliveInterval = min(self.idleKeepAliveInterval * 2.0, KeepAlivePolicy.maxIdleKeepAliveInterval)
+                self.sendKeepAliveNow()
+                self.applyParameters(self.socketParameters(for: .idle))
+            }
+        }
+    }
+
+    /// Connection got closed - if it was because of an error, note how long it took to detect it
+    public func connectionClosed(withError error: Error?) {
+        if error != nil && self.detectionTime == nil {
+            self.detectionTime = CACurrentMediaTime() - max(self.metrics.lastReadTime, self.metrics.lastWriteProgressTime)
+        }
+        self.stop()
+    }
+
+
+    // MARK: Private methods
+
+    private func evaluateProbing(now: TimeInterval) {
+        let probingStartTime = self.probingStartTime ?? now
+        self.probingStartTime = probingStartTime
+
+        // Peer sent something since probing started - it is alive
+        if !self.metrics.isStalled && self.metrics.lastReadTime > probingStartTime {
+            self.probingDeadline = 0.0
+            self.switchMode(to: .active)
+            return
+        }
+
+        if self.metrics.isStalled && now - self.metrics.lastWriteProgressTime > KeepAlivePolicy.deadConnectionTimeout {
+            self.detectionTime = now - max(self.metrics.lastReadTime, self.metrics.lastWriteProgressTime)
+            Log.info?.message("Connection considered dead after \(self.detectionTime!)s without progress. \(self)")
+            self.closeConnection?()
+            return
+        }
+
+        if now - self.lastKeepAliveTime >= self.probeInterval {
+            self.sendKeepAliveNow()
+        }
+    }
+
+    private func switchMode(to mode: Mode) {
+        guard self.mode != mode else { return }
+
+        let now = CACurrentMediaTime()
+        if self.mode == .idle {
+            self.accountSocketProbes(until: now)
+        }
+        if mode == .idle {
+            self.lastIdleStartTime = now
+        }
+        if mode != .probing {
+            self.probingStartTime = nil
+        }
+        if mode == .active {
+            self.idleKeepAliveInterval = KeepAlivePolicy.minIdleKeepAliveInterval
+        }
+
+        self.mode = mode
+        self.applyParameters(self.socketParameters(for: mode))
+    }
+
+    private func sendKeepAliveNow() {
+        guard self.sendKeepAlive?() == true else { return }
+        self.lastKeepAliveTime = CACurrentMediaTime()
+        self.keepAlivesSent += 1
+    }
+
+    private func applyParameters(_ parameters: SocketParameters) {
+        guard parameters != self.appliedParameters else { return }
+        self.appliedParameters = parameters
+        self.applySocketParameters?(parameters)
+    }
+
+    /// Probe interval derived from retransmission timeout estimate
+    private var probeInterval: TimeInterval {
+        let srtt = self.metrics.smoothedRoundTripTime ?? ConnectionMetrics.defaultRoundTripTime
+        let rttvar = self.metrics.roundTripTimeVariation ?? srtt / 2.0
+        let rto = srtt + 4.0 * rttvar
+        return min(max(4.0 * rto, KeepAlivePolicy.minProbeInterval), KeepAlivePolicy.maxProbeInterval)
+    }
+
+    private func socketParameters(for mode: Mode) -> SocketParameters {
+        switch mode {
+        case .active:
+            return SocketParameters(idleTime: Int32(KeepAlivePolicy.minIdleKeepAliveInterval), probeInterval: Int32(KeepAlivePolicy.maxProbeInterval), probeCount: 3, retransmissionTimeout: 0)
+        case .idle:
+            return SocketParameters(idleTime: Int32(self.idleKeepAliveInterval), probeInterval: Int32(KeepAlivePolicy.maxProbeInterval), probeCount: 3, retransmissionTimeout: 0)
+        case .probing:
+            let interval = Int32(self.probeInterval.rounded(.up))
+            return SocketParameters(idleTime: interval, probeInterval: interval, probeCount: 3, retransmissionTimeout: Int32(KeepAlivePolicy.deadConnectionTimeout))
+        }
+    }
+
+    /// TCP keepalive probes are not observable directly - estimate them from time spent idle
+    private func accountSocketProbes(until time: TimeInterval) {
+        guard let idleStart = self.lastIdleStartTime else { return }
+        self.lastIdleStartTime = nil
+
+        let idleTime = TimeInterval(self.appliedParameters?.idleTime ?? Int32(KeepAlivePolicy.minIdleKeepAliveInterval))
+        self.estimatedSocketProbes += Int((time - idleStart) / max(idleTime, 1.0))
+    }
+
+    private struct WeakPolicy {
+        weak var policy: KeepAlivePolicy?
+    }
+
+    private static func register(_ policy: KeepAlivePolicy) {
+        self.startedPolicies[ObjectIdentifier(policy)] = WeakPolicy(policy: policy)
+        guard self.sharedTimer == nil else { return }
+
+        let timer = Timer.compatTimer(withTimeInterval: KeepAlivePolicy.evaluationInterval, repeats: true) { _ in
+            KeepAlivePolicy.evaluateStartedPolicies()
+        }
+        timer.tolerance = KeepAlivePolicy.evaluationInterval / 2.0
+        RunLoop.main.add(timer, forMode: .commonModes)
+        self.sharedTimer = timer
+    }
+
+    private static func unregister(_ policy: KeepAlivePolicy) {
+        self.startedPolicies.removeValue(forKey: ObjectIdentifier(policy))
+        if self.startedPolicies.isEmpty {
+            self.sharedTimer?.invalidate()
+            self.sharedTimer = nil
+        }
+    }
+
+    private static func evaluateStartedPolicies() {
+        // Evaluation may close connections and stop their policies, so iterate over a copy
+        let policies = self.startedPolicies.values.flatMap { $0.policy }
+        for policy in policies {
+            policy.evaluate()
+        }
+    }
+}
@@ -0,0 +1,155 @@
+//
+//  PacketReassembler.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-24.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import QuartzCore
+import CleanroomLogger
+
+/// Reassembly stage for data packets that peers split into several parts (e.g. long SMS messages).
+/// Packets are collected into groups by an id chosen by the caller. A group is finished as soon as
+/// it is known to be complete - either by `isComplete` check or by reaching `expectedCount` packets.
+/// If completeness can not be determined, the group is finished after a timeout, adapted to
+/// observed gaps between parts of the same group. Timeouts are served by a shared timer wheel.
+///
+/// Not thread safe - expected to be used on the main queue.
+public class PacketReassembler {
+
+    // MARK: Types
+
+    public typealias GroupId = String
+    /// Receives packets of a finished group, ordered by packet id
+    public typealias CompletionHandler = ([DataPacket]) -> Void
+
+    private class Group {
+        var packets: [DataPacket] = []
+        var lastPacketTime: TimeInterval = CACurrentMediaTime()
+        var timeoutToken: TimerWheel.Token? = nil
+        let completion: CompletionHandler
+
+        init(completion: @escaping CompletionHandler) {
+            self.completion = completion
+        }
+    }
+
+
+    // MARK: Properties
+
+    /// Parts of a multipart SMS may arrive hundreds of milliseconds apart even when earlier
+    /// groups came in quick bursts, so timeout never drops below a second
+    public static let minTimeout: TimeInterval = 1.0
+    public static let maxTimeout: TimeInterval = 5.0
+    /// Timeout used until gaps between parts are observed
+    public static let initialTimeout: TimeInterval = 1.0
+
+    /// Check whether collected packets (ordered by id) form a complete group
+    public var isComplete: (([DataPacket]) -> Bool)? = nil
+    /// Number of packets expected in the group, nil if unknown
+    public var expectedCount: (([DataPacket]) -> Int?)? = nil
+
+    public private(set) var completedBySignalCount: Int = 0
+    public private(set) var completedByTimeoutCount: Int = 0
+
+    /// Current timeout for unfinished groups
+    public var timeout: TimeInterval {
+        guard let gap = self.smoothedGap else { return PacketReassembler.initialTimeout }
+        return min(max(4.0 * gap, PacketReassembler.minTimeout), PacketReassembler.maxTimeout)
+    }
+
+    private let wheel: TimerWheel
+    private var groups: [GroupId: Group] = [:]
+    private var smoothedGap: TimeInterval? = nil
+
+
+    // MARK: Init / Deinit
+
+    public init(wheel: TimerWheel = TimerWheel.shared) {
+        self.wheel = wheel
+    }
+
+    deinit {
+        for group in self.groups.values {
+            if let token = group.timeoutToken {
+                self.wheel.cancel(token)
+            }
+        }
+    }
+
+
+    // MARK: Public methods
+
+    /// Add packet to a group. Completion handler of the first packet of the group is used when it finishes.
+    public func add(_ packet: DataPacket, toGroup groupId: GroupId, completion: @escaping CompletionHandler) {
+        let now = CACurrentMediaTime()
+        let group: Group
+        if let existing = self.groups[groupId] {
+            group = existing
+            self.recordGap(now - group.lastPacketTime)
+        }
+        else {
+            group = Group(completion: completion)
+            self.groups[groupId] = group
+        }
+
+        group.packets.append(packet)
+        group.lastPacketTime = now
+        group.packets.sort { $0.id < $1.id }
+
+        if let token = group.timeoutToken {
+            self.wheel.cancel(token)
+            group.timeoutToken = nil
+        }
+
+        if self.checkComplete(group.packets) {
+            self.completedBySignalCount += 1
+            self.finish(groupId)
+        }
+        else {
+            group.timeoutToken = self.wheel.schedule(after: self.timeout) { [weak self] in
+                self?.completedByTimeoutCount += 1
+                self?.finish(groupId)
+            }
+        }
+    }
+
+    /// Finish all unfinished groups right away
+    public func flushAll() {
+        for groupId in Array(self.groups.keys) {
+            self.finish(groupId)
+        }
+    }
+
+
+    // MARK: Private methods
+
+    private func checkComplete(_ packets: [DataPacket]) -> Bool {
+        if let expectedCount = self.expectedCount?(packets), packets.count >= expectedCount {
+            return true
+        }
+        return self.isComplete?(packets) ?? false
+    }
+
+    private func recordGap(_ gap: TimeInterval) {
+        // Only gaps short enough to be parts of the same group are meaningful
+        guard gap >= 0.0 && gap < PacketReassembler.maxTimeout else { return }
+
+        if let smoothedGap = self.smoothedGap {
+            self.smoothedGap = 0.875 * smoothedGap + 0.125 * gap
+        }
+        else {
+            self.smoothedGap = gap
+        }
+    }
+
+    private func finish(_ groupId: GroupId) {
+        guard let group = self.groups.removeValue(forKey: groupId) else { return }
+        if let token = group.timeoutToken {
+            self.wheel.cancel(token)
+        }
+        group.completion(group.packets)
+    }
+}
@@ -0,0 +1,129 @@
+//
+//  PayloadBody.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-26.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import CleanroomLogger
+
+// MARK: - Payload body
+
+/// Large text properties (e.g. shared text, clipboard contents) would otherwise be sent inside the JSON line
+/// of the main connection, blocking all other packets until the whole line is written and read.
+/// Instead, packets may mark one of their string properties as offloadable. When such property is larger than
+/// `payloadBodyThreshold` and the peer advertises `payloadBodyCapability`, the property is moved into
+/// a payload and put back into the body on the receiving side, before packet reaches services.
+extension DataPacket {
+
+    // MARK: Types
+
+    public enum PayloadBodyProperty: String {
+        case property = "soduto.payloadBodyProperty" // (string): name of body property sent as payload
+    }
+
+
+    // MARK: Properties
+
+    /// Capability of peers able to reconstruct body properties sent as payloads
+    public static let payloadBodyCapability = "soduto.payloadbody"
+    /// Size of text property in bytes above which it is sent as a payload
+    public static let payloadBodyThreshold = 64 * 1024
+
+    /// Name of body property that was sent as a payload, nil if none
+    public var payloadBodyProperty: String? {
+        return self.body[PayloadBodyProperty.property.rawValue] as? String
+    }
+
+
+    // MARK: Public methods
+
+    /// Return packet prepared for sending to device - with offloadable property moved to payload if needed
+    public func preparedForSending(to device: Device) -> DataPacket {
+        guard let property = self.offloadableProperty else { return self }
+        guard !self.hasPayload() else { return self }
+        guard device.incomingCapabilities.contains(DataPacket.payloadBodyCapability) else { return self }
+        guard let text = self.body[property] as? String, text.utf8.count > DataPacket.payloadBodyThreshold else { return self }
+        guard let data = text.data(using: .utf8) else { return self }
+
+        var packet = self
+        var body = packet.body
+        body.removeValue(forKey: property)
+        body[PayloadBodyProperty.property.rawValue] = property as AnyObject
+        packet.body = body
+        packet.payload = InputStream(data: data)
+        packet.payloadSize = Int64(data.count)
+        packet.offloadableProperty = nil
+        return packet
+    }
+
+    /// Return packet with downloaded payload put back into the body
+    func restoringPayloadBody(_ data: Data) -> DataPacket? {
+        guard let property = self.payloadBodyProperty else { return nil }
+        guard let text = String(data: data, encoding: .utf8) else { return nil }
+
+        var packet = self
+        var body = packet.body
+        body.removeValue(forKey: PayloadBodyProperty.property.rawValue)
+        body[property] = text as AnyObject
+        packet.body = body
+        packet.downloadTask = nil
+        packet.payloadInfo = nil
+        packet.payloadSize = nil
+        return packet
+    }
+}
+
+
+/// Downloads body properties sent as payloads and hands restored packets back to the caller.
+/// Not thread safe - expected to be used on the main queue.
+public class PayloadBodyReceiver: DownloadTaskDelegate {
+
+    // MARK: Types
+
+    public typealias CompletionHandler = (DataPacket) -> Void
+
+    private struct Download {
+        let packet: DataPacket
+        let stream: OutputStream
+        let completion: CompletionHandler
+    }
+
+
+    // MARK: Properties
+
+    private var downloads: [Int64: Download] = [:]
+
+
+    // MARK: Public methods
+
+    /// Start downloading payload body of the packet. Returns false if packet does not have one.
+    public func receive(_ packet: DataPacket, completion: @escaping CompletionHandler) -> Bool {
+        guard packet.payloadBodyProperty != nil, let task = packet.downloadTask else { return false }
+
+        let stream = OutputStream(toMemory: ())
+        stream.open()
+        self.downloads[task.id] = Download(packet: packet, stream: stream, completion: completion)
+        task.delegate = self
+        task.start(withStream: stream)
+        return true
+    }
+
+
+    // MARK: DownloadTaskDelegate
+
+    public func downloadTask(_ task: DownloadTask, finishedWithSuccess success: Bool) {
+        guard let download = self.downloads.removeValue(forKey: task.id) else { return }
+
+        let data = download.stream.property(forKey: .dataWrittenToMemoryStreamKey) as? Data
+        download.stream.close()
+
+        guard success, let bodyData = data, let packet = download.packet.restoringPayloadBody(bodyData) else {
+            Log.error?.message("Failed to receive payload body of packet: \(download.packet)")
+            return
+        }
+        download.completion(packet)
+    }
+}
@@ -0,0 +1,100 @@
+//
+//  PeerTrustCache.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-19.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+
+/// Cache of positive peer trust decisions, keyed by device id and peer certificate fingerprint.
+/// Checking trust otherwise requires looking up saved certificate in the keychain for every
+/// TLS handshake, which adds up when many payload sockets are opened (e.g. sharing many files).
+/// Thread safe - trust is evaluated on socket delegate queues of payload transfers.
+public class PeerTrustCache {
+
+    // MARK: Properties
+
+    public static let shared = PeerTrustCache()
+
+    private var trustedFingerprints: [Device.Id: Data] = [:]
+    private let lock = InstrumentedLock(name: "PeerTrustCache")
+
+
+    // MARK: Public methods
+
+    /// Check whether certificate with given fingerprint has already been found trusted for the device
+    public func isTrusted(fingerprint: Data, for deviceId: Device.Id) -> Bool {
+        self.lock.lock()
+        defer { self.lock.unlock() }
+
+        return self.trustedFingerprints[deviceId] == fingerprint
+    }
+
+    /// Remember that certificate with given fingerprint is trusted for the device
+    public func setTrusted(fingerprint: Data, for deviceId: Device.Id) {
+        self.lock.lock()
+        defer { self.lock.unlock() }
+
+        self.trustedFingerprints[deviceId] = fingerprint
+    }
+
+    /// Forget trust decisions of the device. Needs to be done whenever saved device certificate changes.
+    public func invalidate(for deviceId: Device.Id) {
+        self.lock.lock()
+        defer { self.lock.unlock() }
+
+        self.trustedFingerprints.removeValue(forKey: deviceId)
+    }
+}
+
+
+/// Timing statistics of TLS handshakes, separately for main connections and payload transfer sockets.
+/// Thread safe.
+public class TLSHandshakeStatistics {
+
+    // MARK: Types
+
+    public enum Kind {
+        case connection
+        case payload
+    }
+
+
+    // MARK: Properties
+
+    public static let shared = TLSHandshakeStatistics()
+
+    private let connectionHistogram = LatencyHistogram()
+    private let payloadHistogram = LatencyHistogram()
+    private let lock = NSLock()
+
+
+    // MARK: Public methods
+
+    public func record(_ duration: TimeInterval, kind: Kind) {
+        self.lock.lock()
+        defer { self.lock.unlock() }
+
+        self.histogram(for: kind).record(duration)
+    }
+
+    /// Return a textual summary of handshake durations of given kind
+    public func summary(for kind: Kind) -> String {
+        self.lock.lock()
+        defer { self.lock.unlock() }
+
+        return self.histogram(for: kind).description
+    }
+
+
+    // MARK: Private
+
+    private func histogram(for kind: Kind) -> LatencyHistogram {
+        switch kind {
+        case .connection: return self.connectionHistogram
+        case .payload: return self.payloadHistogram
+        }
+    }
+}
@@ -15,16 +15,23 @@ public protocol Service: DeviceDataPacketHandler {
     
     static var serviceId: Id { get }
     
-    var incomingCapabilities: Set<Capability> { get }
-    var outgoingCapabilities: Set<Capability> { get }
+    /// Capabilities are static, so that they can be announced before the service is instantiated
+    static var incomingCapabilities: Set<Capability> { get }
+    static var outgoingCapabilities: Set<Capability> { get }
     
     func setup(for device: Device)
     func cleanup(for device: Device)
     
     func actions(for device: Device) -> [ServiceAction]
     func performAction(_ id: ServiceAction.Id, forDevice device: Device)
+    
+    /// Service has no work in progress (e.g. transfers) and may be released when no device needs it
+    var isIdle: Bool { get }
 }
 
 extension Service {
     var id: Id { return type(of: self).serviceId }
+    var incomingCapabilities: Set<Capability> { return type(of: self).incomingCapabilities }
+    var outgoingCapabilities: Set<Capability> { return type(of: self).outgoingCapabilities }
+    public var isIdle: Bool { return true }
 }
@@ -7,63 +7,179 @@
 //
 
 import Foundation
+import CleanroomLogger
+
+/// Registry of services. Services are instantiated lazily - when the first paired device with matching
+/// capabilities becomes reachable - and released once the last such device leaves and they have no work in
+/// progress, so that services monitoring something (e.g. clipboard) do no work while there is nobody to serve.
+///
+/// Services are set up and cleaned up on the main queue.
+public class ServiceManager: CapabilitiesDataSource, DeviceDataPacketHandler {
+
+    // MARK: Types
+
+    public typealias Factory = () -> Service
+
+    private class Registration {
+        let serviceType: Service.Type
+        let factory: Factory
+        var instance: Service? = nil
+        var deviceIds = Set<Device.Id>()
+
+        init(serviceType: Service.Type, factory: @escaping Factory) {
+            self.serviceType = serviceType
+            self.factory = factory
+        }
+
+        func isNeeded(by device: Device) -> Bool {
+            return !self.serviceType.incomingCapabilities.isDisjoint(with: device.outgoingCapabilities)
+                || !self.serviceType.outgoingCapabilities.isDisjoint(with: device.incomingCapabilities)
+        }
+    }
+
 
-public class ServiceManager: CapabilitiesDataSource {
-    
     // MARK: Public properties
-    
-    /// Combined incoming capabilities of all services
+
+    /// Combined incoming capabilities of all services, together with capabilities handled by devices themselves
     public var incomingCapabilities: Set<Service.Capability> {
-        let capabilities = self.services.flatMap {
-            return $0.incomingCapabilities
+        let capabilities = self.registrations.flatMap {
+            return $0.serviceType.incomingCapabilities
         }
-        return Set(capabilities)
+        return Set(capabilities).union([ DataPacket.payloadBodyCapability ])
     }
-    
+
     /// Combined outgoing capabilities of all services
     public var outgoingCapabilities: Set<Service.Capability> {
-        let capabilities = self.services.flatMap {
-            return $0.outgoingCapabilities
+        let capabilities = self.registrations.flatMap {
+            return $0.serviceType.outgoingCapabilities
         }
         return Set(capabilities)
     }
-    
-    /// All registered service instances
-    public private(set) var services: [Service] = []
-    
-    
+
+    /// Currently instantiated services, in the order they were registered
+    public var services: [Service] { return self.registry.value }
+
+    /// Services are read from connection queues while packets are handled, so the list is kept as a snapshot
+    private let registry = Snapshot<[Service]>([])
+    private var registrations: [Registration] = []
+    private var releaseCheckTimer: Timer? = nil
+
+    /// How often services no longer needed by any device are checked whether they finished their work
+    private static let releaseCheckInterval: TimeInterval = 10.0
+
+
+    // MARK: Setup / Cleanup
+
+    deinit {
+        self.releaseCheckTimer?.invalidate()
+    }
+
+
     // MARK: Public methods
-    
-    /// Return services filtered by incoming capabilities
+
+    /// Return instantiated services filtered by incoming capabilities
     public func services(supportingIncomingCapabilities capabilities: Set<Service.Capability>) -> [Service] {
         return self.services.filter {
             return !$0.incomingCapabilities.isDisjoint(with: capabilities)
         }
     }
-    
-    /// Return services filtered by outgoing capabilities
+
+    /// Return instantiated services filtered by outgoing capabilities
     public func services(supportingOutgoingCapabilities capabilities: Set<Service.Capability>) -> [Service] {
         return self.services.filter {
             return !$0.outgoingCapabilities.isDisjoint(with: capabilities)
         }
     }
-    
-    /// Add a new service instance. This should be done on application start before any device connections are established
-    public func add(service: Service) {
-        services.append(service)
+
+    /// Return service of given type, instantiating it if needed. Service not needed by any device is
+    /// released once it is idle.
+    public func service<T: Service>(ofType serviceType: T.Type) -> T? {
+        guard let registration = self.registrations.first(where: { $0.serviceType.serviceId == serviceType.serviceId }) else { return nil }
+        let service = registration.instance ?? instantiate(registration)
+        if registration.deviceIds.isEmpty {
+            scheduleReleaseCheck()
+        }
+        return service as? T
+    }
+
+    /// Register a service to be made with the factory once needed. This should be done on application start before
+    /// any device connections are established, as capabilities of registered services are announced to other devices
+    public func register(_ serviceType: Service.Type, factory: @escaping Factory) {
+        assert(!self.registrations.contains { $0.serviceType.serviceId == serviceType.serviceId }, "Service \(serviceType.serviceId) is already registered")
+        self.registrations.append(Registration(serviceType: serviceType, factory: factory))
     }
-    
-    /// Setup services for provided device. This is done when a new device becomes ready (accessible and paired)
+
+    /// Setup services for provided device, instantiating them if needed. This is done when a new device becomes ready (accessible and paired)
     public func setup(for device: Device) {
-        for service in self.services {
+        for registration in self.registrations where registration.isNeeded(by: device) {
+            let service = registration.instance ?? instantiate(registration)
+            registration.deviceIds.insert(device.id)
             service.setup(for: device)
         }
     }
-    
-    /// Cleanup services for provided device. This is done when device becomes unavailable or not unpaired
+
+    /// Cleanup services for provided device. This is done when device becomes unavailable or not unpaired.
+    /// Services no longer needed by any device are released once they are idle.
     public func cleanup(for device: Device) {
-        for service in self.services {
-            service.cleanup(for: device)
+        for registration in self.registrations where registration.deviceIds.contains(device.id) {
+            registration.instance?.cleanup(for: device)
+            registration.deviceIds.remove(device.id)
+            releaseIfUnused(registration)
         }
     }
+
+
+    // MARK: DeviceDataPacketHandler
+
+    public func handleDataPacket(_ dataPacket: DataPacket, fromDevice device: Device, onConnection connection: Connection) -> Bool {
+        for service in self.services(supportingIncomingCapabilities: device.outgoingCapabilities) {
+            if service.handleDataPacket(dataPacket, fromDevice: device, onConnection: connection) {
+                return true
+            }
+        }
+        return false
+    }
+
+
+    // MARK: Private methods
+
+    private func instantiate(_ registration: Registration) -> Service {
+        let service = registration.factory()
+        registration.instance = service
+        updateRegistry()
+        Log.debug?.message("Service \(registration.serviceType.serviceId) instantiated")
+        return service
+    }
+
+    private func releaseIfUnused(_ registration: Registration) {
+        guard registration.deviceIds.isEmpty, let service = registration.instance else { return }
+        if service.isIdle {
+            release(registration)
+        }
+        else {
+            scheduleReleaseCheck()
+        }
+    }
+
+    private func scheduleReleaseCheck() {
+        guard self.releaseCheckTimer == nil else { return }
+        self.releaseCheckTimer = Timer.compatScheduledTimer(withTimeInterval: ServiceManager.releaseCheckInterval, repeats: false) { [weak self] _ in
+            guard let strongSelf = self else { return }
+            strongSelf.releaseCheckTimer = nil
+            for registration in strongSelf.registrations {
+                strongSelf.releaseIfUnused(registration)
+            }
+        }
+    }
+
+    private func release(_ registration: Registration) {
+        registration.instance = nil
+        updateRegistry()
+        Log.debug?.message("Service \(registration.serviceType.serviceId) released")
+    }
+
+    private func updateRegistry() {
+        let services = self.registrations.flatMap { $0.instance }
+        self.registry.update { $0 = services }
+    }
 }
@@ -104,6 +104,21 @@ public struct SocketAddress: CustomStringConvertible {
     
     
     
+    /// Check whether both addresses point to the same host, ignoring ports
+    public func isSameHost(as other: SocketAddress) -> Bool {
+        guard self.family == other.family else { return false }
+        if self.isIPv4 {
+            return self.ipv4.sin_addr.s_addr == other.ipv4.sin_addr.s_addr
+        }
+        if self.isIPv6 {
+            var addr1 = self.ipv6.sin6_addr
+            var addr2 = other.ipv6.sin6_addr
+            return memcmp(&addr1, &addr2, MemoryLayout<in6_addr>.size) == 0
+        }
+        return false
+    }
+
+
     init() {}
     
     init<T>(addr: T) {
@@ -7,6 +7,7 @@
 //
 
 import Foundation
+import QuartzCore
 import CocoaAsyncSocket
 import CleanroomLogger
 
@@ -40,19 +41,26 @@ public class UploadTask: NSObject, GCDAsyncSocketDelegate {
     private static let maxBufferSize = 1024 * 1024 * 32 // optimized for SSD reading (http://codecapsule.com/2014/02/12/coding-for-ssds-part-6-a-summary-what-every-programmer-should-know-about-solid-state-drives/)
     private static let listenTimeout = 30.0
     private static let uploadTimeout = 30.0
-    private static var portsManagementLock = NSLock()
-    private static var usedPorts: [UInt16] = []
+    private static let usedPorts = Snapshot<Set<UInt16>>([])
+    private static let maxPooledBuffers = 2
+    private static let pooledBufferLifetime = 10.0
+    private static let bufferPoolLock = InstrumentedLock(name: "UploadTask.bufferPool")
+    private static var bufferPool: [[UInt8]] = []
+    private static var bufferPoolGeneration: Int = 0 // changes on every pool use, so that only an idle pool is dropped
     
     private let connection: Connection
+    private let packetId: Int64
     private let payload: InputStream
     private let payloadSize: Int64?
+    private let progressHandler: ((Int64) -> Void)?
     private let delegateQueue: DispatchQueue
     private let listenTimeoutTimer: Timer
     private let listeningSocket: GCDAsyncSocket
     private var uploadingSocket: GCDAsyncSocket? = nil
     private var listeningPort: UInt16 = 0
     private var bytesSent: Int64 = 0
-    private var readBuffer = [UInt8](repeating: 0, count: UploadTask.maxBufferSize)
+    private var handshakeStartTime: TimeInterval? = nil
+    private var readBuffer: [UInt8] = [] // taken from buffer pool only when sending starts
     
     
     // MARK: Init / Deinit
@@ -64,8 +72,10 @@ public class UploadTask: NSObject, GCDAsyncSocketDelegate {
         guard let payload = packet.payload else { return nil }
         
         self.connection = connection
+        self.packetId = packet.id
         self.payload = payload
         self.payloadSize = packet.payloadSize
+        self.progressHandler = packet.payloadProgressHandler
         self.delegateQueue = delegateQueue
         self.listeningSocket = GCDAsyncSocket(delegate: nil, delegateQueue: readQueue)
         let listeningSocket = self.listeningSocket
@@ -118,33 +128,20 @@ public class UploadTask: NSObject, GCDAsyncSocketDelegate {
     // MARK: Ports managements
     
     public static func hasUsedPorts() -> Bool {
-        self.portsManagementLock.lock()
-        defer { self.portsManagementLock.unlock() }
-        
-        return self.usedPorts.count > 0
+        return !self.usedPorts.value.isEmpty
     }
     
     public static func isPortUsed(_ port: UInt16) -> Bool {
-        self.portsManagementLock.lock()
-        defer { self.portsManagementLock.unlock() }
-        
-        return self.usedPorts.index(of: port) != nil
+        return self.usedPorts.value.contains(port)
     }
     
     public static func usePort(_ port: UInt16) {
-        self.portsManagementLock.lock()
-        defer { self.portsManagementLock.unlock() }
-        
-        assert(self.usedPorts.index(of: port) == nil)
-        self.usedPorts.append(port)
+        let inserted = self.usedPorts.update { $0.insert(port).inserted }
+        assert(inserted)
     }
     
     public static func releasePort(_ port: UInt16) {
-        self.portsManagementLock.lock()
-        defer { self.portsManagementLock.unlock() }
-        
-        if let index = self.usedPorts.index(of: port) {
-            self.usedPorts.remove(at: index)
+        if self.usedPorts.update({ $0.remove(port) }) != nil {
             DispatchQueue.main.async {
                 NotificationCenter.default.post(name: portReleaseNotification, object: port as AnyObject)
             }
@@ -155,17 +152,61 @@ public class UploadTask: NSObject, GCDAsyncSocketDelegate {
     }
     
     
+    // MARK: Buffer management
+    
+    /// Reading buffers are large, so they are reused by consecutive uploads instead of being allocated for each.
+    /// Pooled buffers are dropped once no upload used the pool for a while, so they do not pin memory when idle.
+    private static func acquireBuffer() -> [UInt8] {
+        self.bufferPoolLock.lock()
+        defer { self.bufferPoolLock.unlock() }
+        
+        self.bufferPoolGeneration += 1
+        return self.bufferPool.popLast() ?? [UInt8](repeating: 0, count: UploadTask.maxBufferSize)
+    }
+    
+    private static func releaseBuffer(_ buffer: [UInt8]) {
+        self.bufferPoolLock.lock()
+        defer { self.bufferPoolLock.unlock() }
+        
+        guard self.bufferPool.count < UploadTask.maxPooledBuffers else { return }
+        self.bufferPool.append(buffer)
+        self.bufferPoolGeneration += 1
+        
+        let generation = self.bufferPoolGeneration
+        DispatchQueue.main.asyncAfter(deadline: .now() + UploadTask.pooledBufferLifetime) {
+            UploadTask.dropBufferPool(ifUnusedSince: generation)
+        }
+    }
+    
+    private static func dropBufferPool(ifUnusedSince generation: Int) {
+        self.bufferPoolLock.lock()
+        defer { self.bufferPoolLock.unlock() }
+        
+        guard self.bufferPoolGeneration == generation else { return }
+        self.bufferPool = []
+    }
+    
+    
     // MARK: GCDAsyncSocketDelegate
     
     public func socket(_ sock: GCDAsyncSocket, didAcceptNewSocket newSocket: GCDAsyncSocket) {
         guard self.uploadingSocket == nil else { return }
         
+        self.handshakeStartTime = CACurrentMediaTime()
+        Trace.begin(.payloadTLSHandshake, id: Trace.id(ofPacket: self.packetId))
         self.connection.secureServerSocket(newSocket)
         self.uploadingSocket = newSocket
         self.listeningSocket.disconnect()
     }
     
     public func socket(_ sock: GCDAsyncSocket, didWriteDataWithTag tag: Int) {
+        // Tags are total bytes sent at the end of written chunk
+        Trace.end(.uploadChunk, id: Trace.id(ofPacket: self.packetId), value: Int64(tag))
+        if let progressHandler = self.progressHandler {
+            self.delegateQueue.async {
+                progressHandler(Int64(tag))
+            }
+        }
         self.trySending(to: sock)
     }
     
@@ -190,6 +231,10 @@ public class UploadTask: NSObject, GCDAsyncSocketDelegate {
     }
     
     public func socketDidSecure(_ sock: GCDAsyncSocket) {
+        if let startTime = self.handshakeStartTime {
+            TLSHandshakeStatistics.shared.record(CACurrentMediaTime() - startTime, kind: .payload)
+            Trace.end(.payloadTLSHandshake, id: Trace.id(ofPacket: self.packetId))
+        }
         self.beginSending(to: sock)
     }
     
@@ -203,6 +248,7 @@ public class UploadTask: NSObject, GCDAsyncSocketDelegate {
     private func beginSending(to sock: GCDAsyncSocket) {
         // Try schedule 2 batches at once to exploit concurrency - one batch could be sent while another is being prepared
         self.payload.open()
+        self.readBuffer = UploadTask.acquireBuffer()
         self.trySending(to: sock)
         self.trySending(to: sock)
     }
@@ -225,6 +271,7 @@ public class UploadTask: NSObject, GCDAsyncSocketDelegate {
             guard read > 0 else { continue }
             
             let data = Data(bytes: &self.readBuffer, count: read)
+            Trace.begin(.uploadChunk, id: Trace.id(ofPacket: self.packetId), value: self.bytesSent)
             sock.write(data, withTimeout: UploadTask.uploadTimeout, tag: Int(self.bytesSent + Int64(read)))
             
             batchBytesSent += read
@@ -243,6 +290,10 @@ public class UploadTask: NSObject, GCDAsyncSocketDelegate {
         Log.debug?.message("uploadFinished(<\(success)>) [\(self)]")
         
         type(of: self).releasePort(self.listeningPort)
+        if !self.readBuffer.isEmpty {
+            UploadTask.releaseBuffer(self.readBuffer)
+            self.readBuffer = []
+        }
         self.delegateQueue.async { [weak self] in
             guard let strongSelf = self else { return }
             strongSelf.delegate?.uploadTask(strongSelf, finishedWithSuccess: success)
@@ -0,0 +1,21 @@
+//
+//  Atomic.h
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-30.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+/// Atomically add delta to 64-bit integer and return the resulting value
+int64_t atomicAdd64(int64_t *value, int64_t delta);
+
+/// Atomically read 64-bit integer
+int64_t atomicLoad64(int64_t *value);
+
+/// Atomically write 64-bit integer
+void atomicStore64(int64_t *value, int64_t newValue);
+
+/// Atomically raise 64-bit integer to candidate if it is smaller, return the resulting value
+int64_t atomicMax64(int64_t *value, int64_t candidate);
@@ -0,0 +1,35 @@
+//
+//  Atomic.m
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-30.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+#import "Atomic.h"
+#import <stdatomic.h>
+
+// Swift (as of version 4) has no atomic operations, so these are implemented with C11 atomics.
+// Operations are sequentially consistent, so that counters may be used for signaling between threads.
+
+int64_t atomicAdd64(int64_t *value, int64_t delta) {
+    return atomic_fetch_add((_Atomic int64_t *)value, delta) + delta;
+}
+
+int64_t atomicLoad64(int64_t *value) {
+    return atomic_load((_Atomic int64_t *)value);
+}
+
+void atomicStore64(int64_t *value, int64_t newValue) {
+    atomic_store((_Atomic int64_t *)value, newValue);
+}
+
+int64_t atomicMax64(int64_t *value, int64_t candidate) {
+    int64_t current = atomic_load((_Atomic int64_t *)value);
+    while (current < candidate) {
+        if (atomic_compare_exchange_weak((_Atomic int64_t *)value, &current, candidate)) {
+            return candidate;
+        }
+    }
+    return current;
+}
@@ -0,0 +1,265 @@
+//
+//  Concurrency.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-30.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import CleanroomLogger
+
+/// Lock-free 64-bit counter, e.g. for generating unique ids from many threads
+public final class AtomicCounter {
+
+    // MARK: Properties
+
+    public var value: Int64 { return atomicLoad64(self.storage) }
+
+    private let storage: UnsafeMutablePointer<Int64>
+
+
+    // MARK: Init / Deinit
+
+    public init(_ value: Int64 = 0) {
+        self.storage = UnsafeMutablePointer<Int64>.allocate(capacity: 1)
+        self.storage.initialize(to: value)
+    }
+
+    deinit {
+        self.storage.deinitialize(count: 1)
+        self.storage.deallocate(capacity: 1)
+    }
+
+
+    // MARK: Public methods
+
+    /// Increment the counter and return its new value
+    @discardableResult
+    public func increment() -> Int64 {
+        return atomicAdd64(self.storage, 1)
+    }
+
+    /// Add delta to the counter and return its new value
+    @discardableResult
+    public func add(_ delta: Int64) -> Int64 {
+        return atomicAdd64(self.storage, delta)
+    }
+
+    /// Raise the counter to given value if it is lower, e.g. for tracking a maximum. Returns the resulting value.
+    @discardableResult
+    public func raise(to value: Int64) -> Int64 {
+        return atomicMax64(self.storage, value)
+    }
+
+    /// Set the counter to given value
+    public func store(_ value: Int64) {
+        atomicStore64(self.storage, value)
+    }
+}
+
+
+/// Holder of a read-mostly value (e.g. a registry of devices or services). Readers get an immutable snapshot
+/// of the value, while writers make a modified copy and publish it as a whole. This is not lock-free:
+/// readers and publishing take a short unfair lock, held only for as long as it takes to retain or swap
+/// the value, so readers never wait for a writer's modification itself. A snapshot a reader got stays
+/// consistent even if a newer one is published meanwhile. Writers are serialized.
+///
+/// Intended for collections and other copy-on-write values - for them taking a snapshot costs a retain,
+/// and each update copies the value once.
+public final class Snapshot<Value> {
+
+    // MARK: Properties
+
+    /// Current snapshot of the value
+    public var value: Value {
+        os_unfair_lock_lock(self.publishLock)
+        defer { os_unfair_lock_unlock(self.publishLock) }
+        return self.current
+    }
+
+    /// Incremented each time a new value is published. Lets readers cheaply tell whether a value they
+    /// derived something from is still current.
+    public var version: Int64 { return self.versionCounter.value }
+
+    private var current: Value
+    private let publishLock: UnsafeMutablePointer<os_unfair_lock>
+    private let writeLock = NSLock()
+    private let versionCounter = AtomicCounter()
+
+
+    // MARK: Init / Deinit
+
+    public init(_ value: Value) {
+        self.current = value
+        self.publishLock = UnsafeMutablePointer<os_unfair_lock>.allocate(capacity: 1)
+        self.publishLock.initialize(to: os_unfair_lock())
+    }
+
+    deinit {
+        self.publishLock.deinitialize(count: 1)
+        self.publishLock.deallocate(capacity: 1)
+    }
+
+
+    // MARK: Public methods
+
+    /// Modify a copy of the current value and publish it. Readers see either the old or the new value,
+    /// never one in the middle of the modification. Nothing is published if `transform` throws.
+    @discardableResult
+    public func update<T>(_ transform: (inout Value) throws -> T) rethrows -> T {
+        self.writeLock.lock()
+        defer { self.writeLock.unlock() }
+
+        var value = self.value
+        let result = try transform(&value)
+        os_unfair_lock_lock(self.publishLock)
+        self.current = value
+        os_unfair_lock_unlock(self.publishLock)
+        self.versionCounter.increment()
+        return result
+    }
+}
+
+
+/// Mutual exclusion lock that records how often and for how long threads had to wait for it, to find
+/// which locks are worth optimizing. Recording adds a timestamp only when the lock is contended.
+/// Statistics are kept in atomic counters, so reading them does not take the lock and skew them.
+/// Named locks are registered, so their statistics can be reported together.
+///
+/// Not recursive.
+public final class InstrumentedLock: NSLocking {
+
+    // MARK: Types
+
+    public struct Statistics: CustomStringConvertible {
+        public var acquisitions: Int64 = 0
+        /// Number of acquisitions that had to wait for another thread
+        public var contentions: Int64 = 0
+        public var totalWaitTime: TimeInterval = 0.0
+        public var maxWaitTime: TimeInterval = 0.0
+
+        public var description: String {
+            let ratio = self.acquisitions > 0 ? Double(self.contentions) / Double(self.acquisitions) * 100.0 : 0.0
+            return String(format: "%lld acquisitions, %lld contended (%.1f%%), waited %.3f ms total, %.3f ms max",
+                          self.acquisitions, self.contentions, ratio, self.totalWaitTime * 1000.0, self.maxWaitTime * 1000.0)
+        }
+    }
+
+
+    // MARK: Properties
+
+    public let name: String?
+
+    /// Statistics collected so far. Counters are read one by one, so they may be off by an acquisition
+    /// happening meanwhile.
+    public var statistics: Statistics {
+        var statistics = Statistics()
+        statistics.acquisitions = self.acquisitions.value
+        statistics.contentions = self.contentions.value
+        statistics.totalWaitTime = InstrumentedLock.seconds(from: UInt64(self.totalWaitMachTime.value))
+        statistics.maxWaitTime = InstrumentedLock.seconds(from: UInt64(self.maxWaitMachTime.value))
+        return statistics
+    }
+
+    private static let registryLock = NSLock()
+    private static var registry: [WeakLock] = []
+    private static let timebase: mach_timebase_info_data_t = {
+        var info = mach_timebase_info_data_t()
+        mach_timebase_info(&info)
+        return info
+    }()
+
+    private let mutex: UnsafeMutablePointer<os_unfair_lock>
+    private let acquisitions = AtomicCounter()
+    private let contentions = AtomicCounter()
+    private let totalWaitMachTime = AtomicCounter()
+    private let maxWaitMachTime = AtomicCounter()
+
+
+    // MARK: Init / Deinit
+
+    public init(name: String? = nil) {
+        self.name = name
+        self.mutex = UnsafeMutablePointer<os_unfair_lock>.allocate(capacity: 1)
+        self.mutex.initialize(to: os_unfair_lock())
+        if name != nil {
+            InstrumentedLock.register(self)
+        }
+    }
+
+    deinit {
+        self.mutex.deinitialize(count: 1)
+        self.mutex.deallocate(capacity: 1)
+    }
+
+
+    // MARK: NSLocking
+
+    public func lock() {
+        if !os_unfair_lock_trylock(self.mutex) {
+            let start = mach_absolute_time()
+            os_unfair_lock_lock(self.mutex)
+            let waitTime = Int64(mach_absolute_time() - start)
+            self.contentions.increment()
+            self.totalWaitMachTime.add(waitTime)
+            self.maxWaitMachTime.raise(to: waitTime)
+        }
+        self.acquisitions.increment()
+    }
+
+    public func unlock() {
+        os_unfair_lock_unlock(self.mutex)
+    }
+
+
+    // MARK: Public methods
+
+    /// Execute closure while holding the lock
+    public func withLock<T>(_ body: () throws -> T) rethrows -> T {
+        lock()
+        defer { unlock() }
+        return try body()
+    }
+
+    public func resetStatistics() {
+        self.acquisitions.store(0)
+        self.contentions.store(0)
+        self.totalWaitMachTime.store(0)
+        self.maxWaitMachTime.store(0)
+    }
+
+    /// Statistics of all alive named locks
+    public static func allStatistics() -> [(name: String, statistics: Statistics)] {
+        self.registryLock.lock()
+        self.registry = self.registry.filter { $0.lock != nil }
+        let locks = self.registry.flatMap { $0.lock }
+        self.registryLock.unlock()
+
+        return locks.map { (name: $0.name ?? "", statistics: $0.statistics) }
+    }
+
+    /// Log statistics of named locks that were contended at least once
+    public static func logStatistics() {
+        for entry in allStatistics() where entry.statistics.contentions > 0 {
+            Log.debug?.message("Lock \(entry.name): \(entry.statistics)")
+        }
+    }
+
+
+    // MARK: Private
+
+    private struct WeakLock {
+        weak var lock: InstrumentedLock?
+    }
+
+    private static func register(_ lock: InstrumentedLock) {
+        self.registryLock.lock()
+        defer { self.registryLock.unlock() }
+        self.registry.append(WeakLock(lock: lock))
+    }
+
+    private static func seconds(from machTime: UInt64) -> TimeInterval {
+        return Double(machTime) * Double(self.timebase.numer) / Double(self.timebase.denom) / 1_000_000_000.0
+    }
+}
@@ -0,0 +1,36 @@
+//
+//  Data.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-22.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+
+extension Data {
+    
+    /// SHA-256 digest of the data
+    public var sha256Digest: Data {
+        var digest = [UInt8](repeating: 0, count: Int(CC_SHA256_DIGEST_LENGTH))
+        self.withUnsafeBytes {
+            _ = CC_SHA256($0, CC_LONG(self.count), &digest)
+        }
+        return Data(bytes: digest)
+    }
+    
+    /// MD5 digest of the data. Not secure - only for checking data against digests chosen by protocols.
+    public var md5Digest: Data {
+        var digest = [UInt8](repeating: 0, count: Int(CC_MD5_DIGEST_LENGTH))
+        self.withUnsafeBytes {
+            _ = CC_MD5($0, CC_LONG(self.count), &digest)
+        }
+        return Data(bytes: digest)
+    }
+    
+    /// Lowercase hexadecimal representation of the data
+    public var hexString: String {
+        return self.map { String(format: "%02hhx", $0) }.joined()
+    }
+    
+}
@@ -0,0 +1,451 @@
+//
+//  Executor.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-30.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import CleanroomLogger
+
+/// Shared pool of worker threads for background work of all subsystems, so that they do not create their
+/// own queues competing with each other. There is at most one worker per CPU core. Worker threads are started
+/// only as needed - when work is submitted and no started worker is idle - so the pool grows to the
+/// concurrency actually used.
+///
+/// Work is submitted to one of priority lanes. Each worker keeps its own deque of tasks per lane: tasks
+/// submitted from a worker go to its deque and are taken back in LIFO order, while tasks submitted from
+/// other threads go to a shared FIFO queue of the lane. Idle workers steal the oldest tasks from deques of
+/// other workers. Lanes are served in priority order, and lower priority lanes may occupy only part of the
+/// workers, so that there is always a worker free for interactive work.
+///
+/// APIs that need a dispatch queue (e.g. socket delegate queues) may get one from `makeDispatchQueue(label:lane:)`.
+///
+/// The shared executor lives for the whole app run. Other executors (e.g. in tests) should be shut down with
+/// `shutdown()` once not needed, letting their threads exit. Thread safe.
+public final class Executor {
+
+    // MARK: Types
+
+    public enum Lane: Int, CustomStringConvertible {
+        /// Work the user is waiting for, e.g. loading a directory listing
+        case interactive = 0
+        /// Long running data transfers
+        case transfer
+        /// Work nobody is waiting for, e.g. thumbnails or cache maintenance
+        case background
+
+        public static let all: [Lane] = [.interactive, .transfer, .background]
+
+        public var description: String {
+            switch self {
+            case .interactive: return "interactive"
+            case .transfer: return "transfer"
+            case .background: return "background"
+            }
+        }
+
+        fileprivate var qosClass: qos_class_t {
+            switch self {
+            case .interactive: return QOS_CLASS_USER_INITIATED
+            case .transfer: return QOS_CLASS_UTILITY
+            case .background: return QOS_CLASS_BACKGROUND
+            }
+        }
+
+        fileprivate var dispatchQoS: DispatchQoS {
+            switch self {
+            case .interactive: return .userInitiated
+            case .transfer: return .utility
+            case .background: return .background
+            }
+        }
+    }
+
+    /// Submitted piece of work. Cancelling a task prevents it from starting, running work may check
+    /// `Executor.currentTask?.isCancelled` to stop early.
+    public final class Task {
+        public let lane: Lane
+        public var isCancelled: Bool { return self.cancelled.value != 0 }
+
+        fileprivate let work: () -> Void
+        fileprivate let submitTime = CACurrentMediaTime()
+        private let cancelled = AtomicCounter()
+
+        fileprivate init(lane: Lane, work: @escaping () -> Void) {
+            self.lane = lane
+            self.work = work
+        }
+
+        public func cancel() {
+            self.cancelled.increment()
+        }
+    }
+
+    public struct LaneStatistics: CustomStringConvertible {
+        public let submitted: Int64
+        public let completed: Int64
+        public let cancelled: Int64
+        /// Tasks waiting to be started
+        public let queueDepth: Int64
+        public let maxQueueDepth: Int64
+        /// Time tasks waited from submission until start
+        public let queueLatency: LatencyHistogram
+        /// Total time workers spent running tasks
+        public let busyTime: TimeInterval
+
+        public var description: String {
+            return String(format: "%lld submitted, %lld completed, %lld cancelled, depth %lld (max %lld), busy %.3f s, queue latency: ",
+                          self.submitted, self.completed, self.cancelled, self.queueDepth, self.maxQueueDepth, self.busyTime)
+                + self.queueLatency.description
+        }
+    }
+
+
+    // MARK: Properties
+
+    public static let shared = Executor()
+
+    /// Task being run by the current thread, if it is a worker of some executor
+    public static var currentTask: Task? {
+        return Executor.currentWorker?.currentTask
+    }
+
+    /// Maximum number of worker threads
+    public let workerCount: Int
+    /// Number of worker threads started so far
+    public var startedWorkerCount: Int { return Int(self.startedWorkers.value) }
+
+    private var workers: [Worker] = []
+    private let startedWorkers = AtomicCounter()
+    private let startLock = NSLock()
+    private let shutDownFlag = AtomicCounter()
+    private var isShutDown: Bool { return self.shutDownFlag.value != 0 }
+    /// Maximum number of workers running tasks of each lane at once
+    private let laneLimits: [Int64]
+    private let injectionLock = InstrumentedLock(name: "Executor.injection")
+    private var injectedTasks = [Deque](repeating: Deque(), count: Lane.all.count)
+    private let pendingCounts = Lane.all.map { _ in AtomicCounter() }
+    private let runningCounts = Lane.all.map { _ in AtomicCounter() }
+    private let submittedCounts = Lane.all.map { _ in AtomicCounter() }
+    private let completedCounts = Lane.all.map { _ in AtomicCounter() }
+    private let cancelledCounts = Lane.all.map { _ in AtomicCounter() }
+    private let maxPendingCounts = Lane.all.map { _ in AtomicCounter() }
+    private let sleepingCount = AtomicCounter()
+    private let idleCondition = NSCondition()
+    private let dispatchTargets: [DispatchQueue]
+
+    fileprivate static let workerKey: pthread_key_t = {
+        var key = pthread_key_t()
+        pthread_key_create(&key, nil)
+        return key
+    }()
+
+    private static var currentWorker: Worker? {
+        guard let pointer = pthread_getspecific(Executor.workerKey) else { return nil }
+        return Unmanaged<Worker>.fromOpaque(pointer).takeUnretainedValue()
+    }
+
+
+    // MARK: Init / Deinit
+
+    public init(workerCount: Int = ProcessInfo.processInfo.activeProcessorCount) {
+        self.workerCount = max(workerCount, 1)
+        let count = Int64(self.workerCount)
+        self.laneLimits = [count, max(count - 1, 1), max(count / 2, 1)]
+        self.dispatchTargets = Lane.all.map {
+            DispatchQueue(label: "com.soduto.Executor.\($0)", qos: $0.dispatchQoS, attributes: .concurrent)
+        }
+        self.workers = (0 ..< self.workerCount).map { Worker(executor: self, index: $0) }
+    }
+
+
+    // MARK: Public methods
+
+    /// Schedule work to be run on a worker. Returned task may be used to cancel it. Work submitted after
+    /// the executor is shut down is not run.
+    @discardableResult
+    public func submit(_ lane: Lane, _ work: @escaping () -> Void) -> Task {
+        let task = Task(lane: lane, work: work)
+        let laneIndex = lane.rawValue
+        self.submittedCounts[laneIndex].increment()
+        guard !self.isShutDown else {
+            Log.error?.message("Task submitted to executor after it was shut down is not run")
+            task.cancel()
+            self.cancelledCounts[laneIndex].increment()
+            return task
+        }
+
+        if let worker = Executor.currentWorker, worker.executor === self {
+            worker.push(task)
+        }
+        else {
+            self.injectionLock.lock()
+            self.injectedTasks[laneIndex].pushBack(task)
+            self.injectionLock.unlock()
+        }
+        let depth = self.pendingCounts[laneIndex].increment()
+        self.maxPendingCounts[laneIndex].raise(to: depth)
+        wakeWorker()
+        return task
+    }
+
+    /// Let workers exit once they run out of already submitted work. New work is not accepted afterwards.
+    public func shutdown() {
+        self.shutDownFlag.store(1)
+        self.idleCondition.lock()
+        self.idleCondition.broadcast()
+        self.idleCondition.unlock()
+    }
+
+    /// Make a serial dispatch queue for APIs that need one. Queues of a lane all target a single shared queue,
+    /// so that many of them (e.g. per connection) are scheduled together. Their work is not counted in lane statistics.
+    public func makeDispatchQueue(label: String, lane: Lane) -> DispatchQueue {
+        return DispatchQueue(label: label, qos: lane.dispatchQoS, autoreleaseFrequency: .workItem, target: self.dispatchTargets[lane.rawValue])
+    }
+
+    public func statistics(for lane: Lane) -> LaneStatistics {
+        let laneIndex = lane.rawValue
+        let queueLatency = LatencyHistogram()
+        var busyTime: TimeInterval = 0.0
+        for worker in self.workers {
+            worker.statisticsLock.lock()
+            queueLatency.add(worker.queueLatencies[laneIndex])
+            busyTime += worker.busyTimes[laneIndex]
+            worker.statisticsLock.unlock()
+        }
+        return LaneStatistics(submitted: self.submittedCounts[laneIndex].value,
+                              completed: self.completedCounts[laneIndex].value,
+                              cancelled: self.cancelledCounts[laneIndex].value,
+                              queueDepth: max(self.pendingCounts[laneIndex].value, 0),
+                              maxQueueDepth: self.maxPendingCounts[laneIndex].value,
+                              queueLatency: queueLatency,
+                              busyTime: busyTime)
+    }
+
+    public func logStatistics() {
+        for lane in Lane.all {
+            Log.debug?.message("Executor lane \(lane): \(statistics(for: lane))")
+        }
+    }
+
+
+    // MARK: Private methods
+
+    /// Find a task for the worker: its own newest task, then the oldest task submitted from outside, then the
+    /// oldest task of another worker - trying lanes in priority order.
+    fileprivate func takeTask(for worker: Worker) -> Task? {
+        for lane in Lane.all {
+            let laneIndex = lane.rawValue
+            guard self.pendingCounts[laneIndex].value > 0 else { continue }
+            guard self.runningCounts[laneIndex].increment() <= self.laneLimits[laneIndex] else {
+                self.runningCounts[laneIndex].add(-1)
+                continue
+            }
+            if let task = worker.popLocal(lane) ?? popInjected(lane) ?? steal(lane, for: worker) {
+                self.pendingCounts[laneIndex].add(-1)
+                return task
+            }
+            self.runningCounts[laneIndex].add(-1)
+        }
+        return nil
+    }
+
+    fileprivate func run(_ task: Task, on worker: Worker) {
+        let laneIndex = task.lane.rawValue
+        defer {
+            self.runningCounts[laneIndex].add(-1)
+            // Freed slot of a limited lane may let a sleeping worker take a task
+            wakeWorker()
+        }
+
+        guard !task.isCancelled else {
+            self.cancelledCounts[laneIndex].increment()
+            return
+        }
+
+        let startTime = CACurrentMediaTime()
+        worker.currentTask = task
+        worker.setQoS(of: task.lane)
+        autoreleasepool {
+            task.work()
+        }
+        worker.currentTask = nil
+        worker.recordTask(of: task.lane, queueLatency: startTime - task.submitTime, busyTime: CACurrentMediaTime() - startTime)
+        self.completedCounts[laneIndex].increment()
+    }
+
+    /// Wait until there is work for the worker. Returns false if the worker should exit instead.
+    fileprivate func waitForWork() -> Bool {
+        self.idleCondition.lock()
+        defer { self.idleCondition.unlock() }
+
+        self.sleepingCount.increment()
+        while !hasRunnableTasks() && !self.isShutDown {
+            self.idleCondition.wait()
+        }
+        self.sleepingCount.add(-1)
+        return hasRunnableTasks() || !self.isShutDown
+    }
+
+    private func hasRunnableTasks() -> Bool {
+        for lane in Lane.all {
+            let laneIndex = lane.rawValue
+            if self.pendingCounts[laneIndex].value > 0 && self.runningCounts[laneIndex].value < self.laneLimits[laneIndex] {
+                return true
+            }
+        }
+        return false
+    }
+
+    private func wakeWorker() {
+        // Counters are sequentially consistent, so either a worker going to sleep sees the new task,
+        // or the submitter sees the sleeping worker
+        guard self.sleepingCount.value > 0 else {
+            startWorkerIfNeeded()
+            return
+        }
+        self.idleCondition.lock()
+        self.idleCondition.signal()
+        self.idleCondition.unlock()
+    }
+
+    /// Start one more worker thread, as no started one is idle. Busy workers may still pick the task up first,
+    /// in which case the new worker just goes to sleep.
+    private func startWorkerIfNeeded() {
+        guard self.startedWorkers.value < Int64(self.workerCount) && !self.isShutDown && hasRunnableTasks() else { return }
+
+        self.startLock.lock()
+        defer { self.startLock.unlock() }
+        let index = Int(self.startedWorkers.value)
+        guard index < self.workerCount else { return }
+        self.startedWorkers.increment()
+
+        let worker = self.workers[index]
+        let thread = Thread(target: worker, selector: #selector(Worker.run), object: nil)
+        thread.name = "com.soduto.Executor.worker\(worker.index)"
+        thread.start()
+    }
+
+    private func popInjected(_ lane: Lane) -> Task? {
+        self.injectionLock.lock()
+        defer { self.injectionLock.unlock() }
+        return self.injectedTasks[lane.rawValue].popFront()
+    }
+
+    private func steal(_ lane: Lane, for thief: Worker) -> Task? {
+        for offset in 1 ..< self.workers.count {
+            let victim = self.workers[(thief.index + offset) % self.workers.count]
+            if let task = victim.steal(lane) {
+                return task
+            }
+        }
+        return nil
+    }
+}
+
+
+/// Double-ended queue of tasks. Not thread safe.
+fileprivate struct Deque {
+    private var tasks: [Executor.Task] = []
+    private var head: Int = 0
+
+    mutating func pushBack(_ task: Executor.Task) {
+        self.tasks.append(task)
+    }
+
+    mutating func popBack() -> Executor.Task? {
+        guard self.head < self.tasks.count else { return nil }
+        let task = self.tasks.removeLast()
+        compact()
+        return task
+    }
+
+    mutating func popFront() -> Executor.Task? {
+        guard self.head < self.tasks.count else { return nil }
+        let task = self.tasks[self.head]
+        self.head += 1
+        compact()
+        return task
+    }
+
+    private mutating func compact() {
+        if self.head == self.tasks.count {
+            self.tasks.removeAll(keepingCapacity: true)
+            self.head = 0
+        }
+        else if self.head >= 64 && self.head * 2 >= self.tasks.count {
+            self.tasks.removeFirst(self.head)
+            self.head = 0
+        }
+    }
+}
+
+
+fileprivate final class Worker: NSObject {
+
+    unowned let executor: Executor
+    let index: Int
+    /// Set and read only by the worker thread
+    var currentTask: Executor.Task? = nil
+
+    let statisticsLock = InstrumentedLock()
+    var queueLatencies = Executor.Lane.all.map { _ in LatencyHistogram() }
+    var busyTimes = [TimeInterval](repeating: 0.0, count: Executor.Lane.all.count)
+
+    private let dequeLock = InstrumentedLock()
+    private var deques = [Deque](repeating: Deque(), count: Executor.Lane.all.count)
+    private var currentQoS: Executor.Lane? = nil
+
+    init(executor: Executor, index: Int) {
+        self.executor = executor
+        self.index = index
+    }
+
+    @objc func run() {
+        // Executor is kept alive while any of its workers runs
+        let executor: Executor = self.executor
+        pthread_setspecific(Executor.workerKey, Unmanaged.passUnretained(self).toOpaque())
+        while true {
+            if let task = executor.takeTask(for: self) {
+                executor.run(task, on: self)
+            }
+            else if !executor.waitForWork() {
+                break
+            }
+        }
+        pthread_setspecific(Executor.workerKey, nil)
+    }
+
+    func push(_ task: Executor.Task) {
+        self.dequeLock.lock()
+        self.deques[task.lane.rawValue].pushBack(task)
+        self.dequeLock.unlock()
+    }
+
+    func popLocal(_ lane: Executor.Lane) -> Executor.Task? {
+        self.dequeLock.lock()
+        defer { self.dequeLock.unlock() }
+        return self.deques[lane.rawValue].popBack()
+    }
+
+    func steal(_ lane: Executor.Lane) -> Executor.Task? {
+        self.dequeLock.lock()
+        defer { self.dequeLock.unlock() }
+        return self.deques[lane.rawValue].popFront()
+    }
+
+    func setQoS(of lane: Executor.Lane) {
+        guard self.currentQoS != lane else { return }
+        pthread_set_qos_class_self_np(lane.qosClass, 0)
+        self.currentQoS = lane
+    }
+
+    func recordTask(of lane: Executor.Lane, queueLatency: TimeInterval, busyTime: TimeInterval) {
+        self.statisticsLock.lock()
+        self.queueLatencies[lane.rawValue].record(queueLatency)
+        self.busyTimes[lane.rawValue] += busyTime
+        self.statisticsLock.unlock()
+    }
+}
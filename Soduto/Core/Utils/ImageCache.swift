@@ -0,0 +1,257 @@
+//
+//  ImageCache.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-22.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import Cocoa
+import CleanroomLogger
+
+/// Two level (memory and disk) cache of images received from other devices, like notification icons
+/// and contact thumbnails. Images are keyed by a hash of their content, so the same image is decoded
+/// only once no matter how many packets carry it. Memory level is a LRU bounded by estimated decoded
+/// image size, disk level is trimmed by file modification date when it grows over its limit.
+///
+/// Keys may come from other devices (e.g. payload hashes announced by a peer), so they are never used
+/// as file names directly - files are named by a hash of the key.
+///
+/// Not thread safe - expected to be used on the main queue. Disk writes are done in background.
+public class ImageCache: CustomStringConvertible {
+
+    // MARK: Types
+
+    public typealias Key = String
+
+    private class Entry {
+        let key: Key
+        let image: NSImage
+        let cost: Int
+        var previous: Entry? = nil
+        var next: Entry? = nil
+
+        init(key: Key, image: NSImage, cost: Int) {
+            self.key = key
+            self.image = image
+            self.cost = cost
+        }
+    }
+
+
+    // MARK: Properties
+
+    public static let shared = ImageCache(name: "Images")
+
+    public let memoryLimit: Int
+    public let diskLimit: Int
+
+    /// Estimated memory used by decoded images in bytes
+    public private(set) var memoryCost: Int = 0
+    public private(set) var memoryHits: Int = 0
+    public private(set) var diskHits: Int = 0
+    public private(set) var misses: Int = 0
+
+    public var hitRate: Double {
+        let lookups = self.memoryHits + self.diskHits + self.misses
+        return lookups > 0 ? Double(self.memoryHits + self.diskHits) / Double(lookups) : 0.0
+    }
+
+    public var description: String {
+        return "<ImageCache:entries=\(self.entries.count):memory=\(self.memoryCost)B:hits=\(self.memoryHits)+\(self.diskHits):misses=\(self.misses):hitRate=\(String(format: "%.2f", self.hitRate))>"
+    }
+
+    private let directoryUrl: URL?
+    private let ioQueue = DispatchQueue(label: "com.soduto.ImageCache.io", qos: .utility)
+    private var entries: [Key: Entry] = [:]
+    private var head: Entry? = nil // most recently used
+    private var tail: Entry? = nil // least recently used
+
+
+    // MARK: Init / Deinit
+
+    public init(name: String, memoryLimit: Int = 16 * 1024 * 1024, diskLimit: Int = 32 * 1024 * 1024) {
+        self.memoryLimit = memoryLimit
+        self.diskLimit = diskLimit
+
+        let cachesUrl = try? FileManager.default.url(for: .cachesDirectory, in: .userDomainMask, appropriateFor: nil, create: true)
+        let bundleId = Bundle.main.bundleIdentifier ?? "com.soduto.Soduto"
+        self.directoryUrl = cachesUrl?.appendingPathComponent(bundleId, isDirectory: true).appendingPathComponent(name, isDirectory: true)
+        if let url = self.directoryUrl {
+            try? FileManager.default.createDirectory(at: url, withIntermediateDirectories: true, attributes: nil)
+        }
+    }
+
+
+    // MARK: Public methods
+
+    /// Key for image with given encoded content
+    public static func key(for data: Data) -> Key {
+        return data.sha256Digest.hexString
+    }
+
+    /// Check whether image for the key is available without decoding it (e.g. to skip downloading it again)
+    public func contains(_ key: Key) -> Bool {
+        if self.entries[key] != nil {
+            return true
+        }
+        guard let url = self.fileUrl(for: key) else { return false }
+        return FileManager.default.fileExists(atPath: url.path)
+    }
+
+    /// Return cached image for the key, looking into memory first and then on disk
+    public func image(forKey key: Key) -> NSImage? {
+        if let entry = self.entries[key] {
+            self.memoryHits += 1
+            self.moveToFront(entry)
+            return entry.image
+        }
+
+        if let url = self.fileUrl(for: key), let data = try? Data(contentsOf: url), let image = NSImage(data: data) {
+            self.diskHits += 1
+            self.insert(image, forKey: key)
+            // Keep recently used files from being trimmed
+            try? FileManager.default.setAttributes([.modificationDate: Date()], ofItemAtPath: url.path)
+            return image
+        }
+
+        self.misses += 1
+        return nil
+    }
+
+    /// Return image with given encoded content, decoding and caching it if it is not cached yet
+    public func image(for data: Data, key: Key? = nil) -> NSImage? {
+        let key = key ?? ImageCache.key(for: data)
+        if let image = self.image(forKey: key) {
+            return image
+        }
+        return self.store(data, forKey: key)
+    }
+
+    /// Decode image from data and put it into the cache. Returns decoded image, nil if data is not a valid image.
+    @discardableResult
+    public func store(_ data: Data, forKey key: Key) -> NSImage? {
+        guard let image = NSImage(data: data) else { return nil }
+
+        self.insert(image, forKey: key)
+
+        if let url = self.fileUrl(for: key) {
+            self.ioQueue.async {
+                do {
+                    try data.write(to: url, options: .atomic)
+                    self.trimDisk()
+                }
+                catch {
+                    Log.error?.message("Failed to save cached image: \(error)")
+                }
+            }
+        }
+
+        Log.debug?.message("Image cached: \(key) \(self)")
+        return image
+    }
+
+    public func removeAll() {
+        self.entries = [:]
+        self.head = nil
+        self.tail = nil
+        self.memoryCost = 0
+
+        if let url = self.directoryUrl {
+            self.ioQueue.async {
+                let files = (try? FileManager.default.contentsOfDirectory(at: url, includingPropertiesForKeys: nil, options: [])) ?? []
+                for file in files {
+                    try? FileManager.default.removeItem(at: file)
+                }
+            }
+        }
+    }
+
+
+    // MARK: Private methods
+
+    private func fileUrl(for key: Key) -> URL? {
+        let fileName = Data(key.utf8).sha256Digest.hexString
+        return self.directoryUrl?.appendingPathComponent(fileName, isDirectory: false)
+    }
+
+    private func insert(_ image: NSImage, forKey key: Key) {
+        if let existing = self.entries[key] {
+            self.unlink(existing)
+            self.memoryCost -= existing.cost
+        }
+
+        let entry = Entry(key: key, image: image, cost: ImageCache.cost(of: image))
+        self.entries[key] = entry
+        self.memoryCost += entry.cost
+        self.linkAtFront(entry)
+
+        while self.memoryCost > self.memoryLimit, let last = self.tail, last !== entry {
+            self.unlink(last)
+            self.entries.removeValue(forKey: last.key)
+            self.memoryCost -= last.cost
+        }
+    }
+
+    private func moveToFront(_ entry: Entry) {
+        guard self.head !== entry else { return }
+        self.unlink(entry)
+        self.linkAtFront(entry)
+    }
+
+    private func linkAtFront(_ entry: Entry) {
+        entry.previous = nil
+        entry.next = self.head
+        self.head?.previous = entry
+        self.head = entry
+        if self.tail == nil {
+            self.tail = entry
+        }
+    }
+
+    private func unlink(_ entry: Entry) {
+        if let previous = entry.previous {
+            previous.next = entry.next
+        }
+        else {
+            self.head = entry.next
+        }
+        if let next = entry.next {
+            next.previous = entry.previous
+        }
+        else {
+            self.tail = entry.previous
+        }
+        entry.previous = nil
+        entry.next = nil
+    }
+
+    /// Estimated memory footprint of decoded image
+    private static func cost(of image: NSImage) -> Int {
+        let pixels = image.representations.reduce(0) { $0 + max($1.pixelsWide, 1) * max($1.pixelsHigh, 1) }
+        return max(pixels, Int(image.size.width * image.size.height)) * 4
+    }
+
+    /// Remove least recently used files until disk usage fits the limit. Called on the IO queue.
+    private func trimDisk() {
+        guard let url = self.directoryUrl else { return }
+
+        let keys: [URLResourceKey] = [.fileSizeKey, .contentModificationDateKey]
+        guard let files = try? FileManager.default.contentsOfDirectory(at: url, includingPropertiesForKeys: keys, options: [.skipsHiddenFiles]) else { return }
+
+        var infos: [(url: URL, size: Int, date: Date)] = files.map { file in
+            let values = try? file.resourceValues(forKeys: Set(keys))
+            return (file, values?.fileSize ?? 0, values?.contentModificationDate ?? Date.distantPast)
+        }
+        var totalSize = infos.reduce(0) { $0 + $1.size }
+        guard totalSize > self.diskLimit else { return }
+
+        infos.sort { $0.date < $1.date }
+        for info in infos {
+            guard totalSize > self.diskLimit else { break }
+            try? FileManager.default.removeItem(at: info.url)
+            totalSize -= info.size
+        }
+    }
+}
@@ -0,0 +1,119 @@
+//
+//  LatencyHistogram.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-14.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+
+/// Fixed-memory latency histogram in the spirit of HdrHistogram: values are kept in log-linear buckets
+/// (32 linear sub-buckets per power of two), giving about 3% relative precision for values from
+/// 1 microsecond up to more than an hour, with constant time recording.
+/// Not thread safe - expected to be used from a single queue.
+public class LatencyHistogram: CustomStringConvertible {
+
+    // MARK: Properties
+
+    private static let subBucketBits = 6
+    private static let subBucketHalfCount = 1 << (subBucketBits - 1) // linear sub-buckets per power of two
+    private static let bucketCount = 896 // enough for values up to UInt32.max microseconds
+
+    public private(set) var count: Int = 0
+    public private(set) var min: TimeInterval? = nil
+    public private(set) var max: TimeInterval? = nil
+    /// Number of samples that were expected but never arrived (e.g. timed out probes)
+    public private(set) var lostCount: Int = 0
+
+    private var counts = [Int](repeating: 0, count: LatencyHistogram.bucketCount)
+
+    public var p50: TimeInterval? { return self.value(atPercentile: 50.0) }
+    public var p99: TimeInterval? { return self.value(atPercentile: 99.0) }
+
+    public var description: String {
+        func format(_ value: TimeInterval?) -> String {
+            guard let value = value else { return "-" }
+            return String(format: "%.1fms", value * 1000.0)
+        }
+        return "<LatencyHistogram:count=\(self.count):lost=\(self.lostCount):p50=\(format(self.p50)):p99=\(format(self.p99)):max=\(format(self.max))>"
+    }
+
+
+    // MARK: Public methods
+
+    /// Record a latency sample
+    public func record(_ value: TimeInterval) {
+        guard value >= 0.0 else { return }
+
+        let micros = UInt64(Swift.min(value * 1_000_000.0, Double(UInt32.max)))
+        let index = Swift.min(LatencyHistogram.bucketIndex(for: micros), LatencyHistogram.bucketCount - 1)
+        self.counts[index] += 1
+        self.count += 1
+        self.min = Swift.min(self.min ?? value, value)
+        self.max = Swift.max(self.max ?? value, value)
+    }
+
+    /// Record a sample that has been lost
+    public func recordLost() {
+        self.lostCount += 1
+    }
+
+    /// Add samples recorded by another histogram, e.g. to combine per-thread histograms
+    public func add(_ other: LatencyHistogram) {
+        for index in 0 ..< LatencyHistogram.bucketCount {
+            self.counts[index] += other.counts[index]
+        }
+        self.count += other.count
+        self.lostCount += other.lostCount
+        if let otherMin = other.min {
+            self.min = Swift.min(self.min ?? otherMin, otherMin)
+        }
+        if let otherMax = other.max {
+            self.max = Swift.max(self.max ?? otherMax, otherMax)
+        }
+    }
+
+    /// Return value below which given percentage of samples fall, nil if there are no samples
+    public func value(atPercentile percentile: Double) -> TimeInterval? {
+        guard self.count > 0 else { return nil }
+
+        let threshold = Swift.max(Int((Double(self.count) * percentile / 100.0).rounded(.up)), 1)
+        var cumulative = 0
+        for (index, count) in self.counts.enumerated() where count > 0 {
+            cumulative += count
+            if cumulative >= threshold {
+                let micros = LatencyHistogram.highestEquivalentValue(for: index)
+                return Swift.min(TimeInterval(micros) / 1_000_000.0, self.max ?? 0.0)
+            }
+        }
+        return self.max
+    }
+
+    public func reset() {
+        self.counts = [Int](repeating: 0, count: LatencyHistogram.bucketCount)
+        self.count = 0
+        self.lostCount = 0
+        self.min = nil
+        self.max = nil
+    }
+
+
+    // MARK: Private
+
+    private static func bucketIndex(for value: UInt64) -> Int {
+        guard value >= UInt64(2 * subBucketHalfCount) else { return Int(value) }
+
+        let msb = 63 - value.leadingZeroBitCount
+        let shift = msb - (subBucketBits - 1)
+        return (shift + 1) * subBucketHalfCount + Int(value >> UInt64(shift)) - subBucketHalfCount
+    }
+
+    private static func highestEquivalentValue(for index: Int) -> UInt64 {
+        guard index >= 2 * subBucketHalfCount else { return UInt64(index) }
+
+        let shift = index / subBucketHalfCount - 1
+        let subBucket = UInt64(index % subBucketHalfCount + subBucketHalfCount)
+        return ((subBucket + 1) << UInt64(shift)) - 1
+    }
+}
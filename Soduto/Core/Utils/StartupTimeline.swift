@@ -0,0 +1,95 @@
+//
+//  StartupTimeline.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-30.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import CleanroomLogger
+
+/// Records when the application reaches milestones of its startup, measured from the process start, and
+/// logs the whole timeline once all of them are reached. Meant to show where launch time goes.
+///
+/// Thread safe - some milestones are reached on background queues.
+public final class StartupTimeline {
+
+    // MARK: Types
+
+    public enum Milestone: String {
+        case appDelegateInit = "app delegate init"
+        case configurationLoaded = "configuration loaded"
+        case managersCreated = "managers created"
+        case didFinishLaunching = "did finish launching"
+        case servicesRegistered = "services registered"
+        case connectionProviderStarted = "connection provider started"
+        case hostIdentityReady = "host identity ready"
+
+        static let all: [Milestone] = [.appDelegateInit, .configurationLoaded, .managersCreated, .didFinishLaunching,
+                                       .servicesRegistered, .connectionProviderStarted, .hostIdentityReady]
+    }
+
+
+    // MARK: Properties
+
+    public static let shared = StartupTimeline()
+
+    private let lock = NSLock()
+    private var marks: [Milestone: TimeInterval] = [:]
+    private var isLogged = false
+    private let processStartTime: Date
+
+
+    // MARK: Init / Deinit
+
+    private init() {
+        self.processStartTime = StartupTimeline.processStartTime() ?? Date()
+    }
+
+
+    // MARK: Public methods
+
+    /// Record that milestone is reached now. Only the first time a milestone is reached is recorded.
+    public func mark(_ milestone: Milestone) {
+        let time = Date().timeIntervalSince(self.processStartTime)
+
+        self.lock.lock()
+        if self.marks[milestone] == nil {
+            self.marks[milestone] = time
+        }
+        let shouldLog = !self.isLogged && self.marks.count == Milestone.all.count
+        if shouldLog {
+            self.isLogged = true
+        }
+        let marks = self.marks
+        self.lock.unlock()
+
+        if shouldLog {
+            StartupTimeline.log(marks)
+        }
+    }
+
+
+    // MARK: Private methods
+
+    private static func log(_ marks: [Milestone: TimeInterval]) {
+        var previousTime: TimeInterval = 0.0
+        var lines: [String] = []
+        for (milestone, time) in marks.sorted(by: { $0.value < $1.value }) {
+            lines.append(String(format: "%8.1f ms (+%.1f ms) %@", time * 1000.0, (time - previousTime) * 1000.0, milestone.rawValue))
+            previousTime = time
+        }
+        Log.info?.message("Startup timeline:\n\(lines.joined(separator: "\n"))")
+    }
+
+    private static func processStartTime() -> Date? {
+        var info = kinfo_proc()
+        var size = MemoryLayout<kinfo_proc>.stride
+        var mib: [Int32] = [CTL_KERN, KERN_PROC, KERN_PROC_PID, getpid()]
+        guard sysctl(&mib, u_int(mib.count), &info, &size, nil, 0) == 0 else { return nil }
+
+        let startTime = info.kp_proc.p_un.__p_starttime
+        return Date(timeIntervalSince1970: TimeInterval(startTime.tv_sec) + TimeInterval(startTime.tv_usec) / 1_000_000.0)
+    }
+}
@@ -0,0 +1,151 @@
+//
+//  TimerWheel.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-24.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import QuartzCore
+
+/// Hashed timer wheel for large numbers of short, coarse timeouts. Instead of creating a `Timer` for every
+/// timeout, deadlines are put into slots of a wheel that is advanced by a single timer ticking while there
+/// are any scheduled timeouts. Scheduling and cancelling are O(1), precision is one tick.
+///
+/// Not thread safe - expected to be used on the main queue.
+public class TimerWheel {
+
+    // MARK: Types
+
+    public typealias Token = Int
+
+    private struct Entry {
+        let deadlineTick: Int64
+        let handler: () -> Void
+    }
+
+
+    // MARK: Properties
+
+    public static let shared = TimerWheel()
+
+    public let tickInterval: TimeInterval
+    public var scheduledCount: Int { return self.entries.count }
+
+    private var slots: [[Token]]
+    private var entries: [Token: Entry] = [:]
+    private var nextToken: Token = 1
+    private var currentTick: Int64 = 0
+    private var startTime: TimeInterval = CACurrentMediaTime()
+    private var timer: Timer? = nil
+
+
+    // MARK: Init / Deinit
+
+    public init(tickInterval: TimeInterval = 0.1, slotCount: Int = 128) {
+        assert(tickInterval > 0.0 && slotCount > 0, "Timer wheel needs positive tick interval and slot count")
+        self.tickInterval = tickInterval
+        self.slots = [[Token]](repeating: [], count: slotCount)
+    }
+
+    deinit {
+        self.timer?.invalidate()
+    }
+
+
+    // MARK: Public methods
+
+    /// Call handler after given delay (rounded up to tick interval). Returns token for cancelling.
+    @discardableResult
+    public func schedule(after delay: TimeInterval, handler: @escaping () -> Void) -> Token {
+        if self.timer == nil {
+            self.startTicking()
+        }
+
+        let ticks = max(Int64((max(delay, 0.0) / self.tickInterval).rounded(.up)), 1)
+        let deadlineTick = self.currentTick + ticks
+        let token = self.nextToken
+        self.nextToken += 1
+
+        self.entries[token] = Entry(deadlineTick: deadlineTick, handler: handler)
+        self.slots[self.slotIndex(for: deadlineTick)].append(token)
+        return token
+    }
+
+    /// Cancel scheduled handler. Cancelling already fired or cancelled token does nothing.
+    public func cancel(_ token: Token) {
+        // Slot list is cleaned up lazily, when the slot is visited
+        self.entries.removeValue(forKey: token)
+        if self.entries.isEmpty {
+            self.stopTicking()
+        }
+    }
+
+
+    // MARK: Private methods
+
+    private func slotIndex(for tick: Int64) -> Int {
+        return Int(tick % Int64(self.slots.count))
+    }
+
+    private var elapsedTicks: Int64 {
+        return Int64((CACurrentMediaTime() - self.startTime) / self.tickInterval)
+    }
+
+    private func startTicking() {
+        self.startTime = CACurrentMediaTime()
+        self.currentTick = 0
+        let timer = Timer.compatTimer(withTimeInterval: self.tickInterval, repeats: true) { [weak self] _ in
+            self?.advance()
+        }
+        timer.tolerance = self.tickInterval / 4.0
+        RunLoop.main.add(timer, forMode: .commonModes)
+        self.timer = timer
+    }
+
+    private func stopTicking() {
+        self.timer?.invalidate()
+        self.timer = nil
+        for index in 0 ..< self.slots.count {
+            self.slots[index].removeAll(keepingCapacity: true)
+        }
+    }
+
+    private func advance() {
+        // Timer may fire late - catch up with all the ticks that passed
+        // Elapsed ticks are recomputed each time, as handlers may restart the wheel
+        while self.timer != nil && self.currentTick < self.elapsedTicks {
+            self.currentTick += 1
+            self.fireSlot(at: self.slotIndex(for: self.currentTick))
+        }
+    }
+
+    private func fireSlot(at index: Int) {
+        let tokens = self.slots[index]
+        guard !tokens.isEmpty else { return }
+        self.slots[index] = []
+
+        var due: [Entry] = []
+        for token in tokens {
+            guard let entry = self.entries[token] else { continue }
+            if entry.deadlineTick <= self.currentTick {
+                self.entries.removeValue(forKey: token)
+                due.append(entry)
+            }
+            else {
+                // Deadline is more than a full wheel revolution away
+                self.slots[index].append(token)
+            }
+        }
+
+        if self.entries.isEmpty {
+            self.stopTicking()
+        }
+
+        // Handlers may schedule new timeouts - call them after wheel state is consistent
+        for entry in due {
+            entry.handler()
+        }
+    }
+}
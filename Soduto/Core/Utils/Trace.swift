@@ -0,0 +1,385 @@
+//
+//  Trace.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-27.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import CleanroomLogger
+
+/// Low overhead recording of connection and packet lifecycle events, for diagnosing issues like slow
+/// transfers or disconnects after they happened. Events are small fixed-size binary records, kept in a ring
+/// buffer of the recording thread, so recording costs a timestamp and an uncontended lock. When a ring is full,
+/// its oldest events are overwritten.
+///
+/// Recording is off unless enabled with `com.soduto.tracing` user default. Recorded events can be dumped
+/// in compact binary form and converted to Chrome trace format (chrome://tracing) for viewing.
+public final class Trace {
+
+    // MARK: Types
+
+    /// Instrumented points. Raw values are stored in dumps - only append new points.
+    public enum Point: UInt16 {
+        case discoveryAnnounce = 1  // value: number of addresses announced to
+        case discoveryReceived      // id: announcement packet id
+        case connectionAccepted
+        case connectionState        // id: connection, value: new state
+        case tlsHandshake           // id: connection, value at end: 1 if secured, 0 if failed
+        case packetRead             // id: connection, value: bytes
+        case packetDecode           // id: connection, value at end: packet id, or -1 if failed
+        case packetDispatch         // id: packet id
+        case uploadChunk            // id: packet id, value: bytes sent so far
+        case downloadChunk          // id: packet id, value: bytes read so far
+        case payloadTLSHandshake    // id: packet id
+
+        public var name: String {
+            switch self {
+            case .discoveryAnnounce: return "discovery.announce"
+            case .discoveryReceived: return "discovery.received"
+            case .connectionAccepted: return "connection.accepted"
+            case .connectionState: return "connection.state"
+            case .tlsHandshake: return "connection.tls"
+            case .packetRead: return "packet.read"
+            case .packetDecode: return "packet.decode"
+            case .packetDispatch: return "packet.dispatch"
+            case .uploadChunk: return "payload.uploadChunk"
+            case .downloadChunk: return "payload.downloadChunk"
+            case .payloadTLSHandshake: return "payload.tls"
+            }
+        }
+    }
+
+    public enum Phase: UInt8 {
+        case instant = 0
+        case begin = 1
+        case end = 2
+    }
+
+    public enum TraceError: Error {
+        case invalidDump
+    }
+
+    fileprivate struct Event {
+        var time: UInt64 = 0    // mach absolute time
+        var id: UInt64 = 0      // correlates begin and end events
+        var value: Int64 = 0
+        var point: UInt16 = 0
+        var phase: UInt8 = 0
+    }
+
+    /// Ring of events recorded by a single thread. Lock is only contended while dumping.
+    fileprivate final class Buffer {
+        let threadId: UInt64
+        let threadName: String
+        let capacity: Int
+        var isRetired: Bool = false
+        private let events: UnsafeMutablePointer<Event>
+        private let lock: UnsafeMutablePointer<os_unfair_lock>
+        private var count: Int = 0 // total events ever recorded
+
+        init(capacity: Int) {
+            var threadId: UInt64 = 0
+            pthread_threadid_np(nil, &threadId)
+            self.threadId = threadId
+            if let name = Thread.current.name, !name.isEmpty {
+                self.threadName = name
+            }
+            else {
+                self.threadName = String(cString: __dispatch_queue_get_label(nil))
+            }
+            self.capacity = capacity
+            self.events = UnsafeMutablePointer<Event>.allocate(capacity: capacity)
+            self.events.initialize(to: Event(), count: capacity)
+            self.lock = UnsafeMutablePointer<os_unfair_lock>.allocate(capacity: 1)
+            self.lock.initialize(to: os_unfair_lock())
+        }
+
+        deinit {
+            self.events.deinitialize(count: self.capacity)
+            self.events.deallocate(capacity: self.capacity)
+            self.lock.deinitialize()
+            self.lock.deallocate(capacity: 1)
+        }
+
+        func append(_ event: Event) {
+            os_unfair_lock_lock(self.lock)
+            self.events[self.count % self.capacity] = event
+            self.count += 1
+            os_unfair_lock_unlock(self.lock)
+        }
+
+        /// Recorded events, oldest first
+        func snapshot() -> [Event] {
+            os_unfair_lock_lock(self.lock)
+            defer { os_unfair_lock_unlock(self.lock) }
+            let available = min(self.count, self.capacity)
+            let start = self.count - available
+            return (start ..< self.count).map { self.events[$0 % self.capacity] }
+        }
+    }
+
+
+    // MARK: Properties
+
+    public static let enabledConfigurationKey = "com.soduto.tracing"
+    public static let eventsPerThread = 8192
+    /// Buffers of exited threads kept for dumping
+    public static let maxRetiredBuffers = 32
+
+    public static var isEnabled: Bool = UserDefaults.standard.bool(forKey: Trace.enabledConfigurationKey)
+
+    private static let dumpMagic: UInt32 = 0x52544453 // "SDTR"
+    private static let dumpVersion: UInt32 = 1
+
+    private static let registryLock = NSLock()
+    private static var buffers: [Buffer] = []
+    private static var dumpSignalSource: DispatchSourceSignal? = nil
+
+    private static let bufferKey: pthread_key_t = {
+        var key = pthread_key_t()
+        pthread_key_create(&key) { pointer in
+            Trace.retire(Unmanaged<Buffer>.fromOpaque(pointer).takeRetainedValue())
+        }
+        return key
+    }()
+
+
+    // MARK: Recording
+
+    @inline(__always)
+    public static func instant(_ point: Point, id: UInt64 = 0, value: Int64 = 0) {
+        guard Trace.isEnabled else { return }
+        Trace.record(point, phase: .instant, id: id, value: value)
+    }
+
+    @inline(__always)
+    public static func begin(_ point: Point, id: UInt64 = 0, value: Int64 = 0) {
+        guard Trace.isEnabled else { return }
+        Trace.record(point, phase: .begin, id: id, value: value)
+    }
+
+    @inline(__always)
+    public static func end(_ point: Point, id: UInt64 = 0, value: Int64 = 0) {
+        guard Trace.isEnabled else { return }
+        Trace.record(point, phase: .end, id: id, value: value)
+    }
+
+    /// Trace id of an object (e.g. connection), valid while the object is alive
+    public static func id(of object: AnyObject) -> UInt64 {
+        return UInt64(UInt(bitPattern: ObjectIdentifier(object).hashValue))
+    }
+
+    /// Trace id of a data packet
+    public static func id(ofPacket packetId: Int64) -> UInt64 {
+        return UInt64(bitPattern: packetId)
+    }
+
+
+    // MARK: Dumping
+
+    /// Binary dump of all recorded events
+    public static func dump() -> Data {
+        Trace.registryLock.lock()
+        let buffers = Trace.buffers
+        Trace.registryLock.unlock()
+
+        var writer = DumpWriter()
+        writer.write(Trace.dumpMagic)
+        writer.write(Trace.dumpVersion)
+        var timebase = mach_timebase_info_data_t()
+        mach_timebase_info(&timebase)
+        writer.write(timebase.numer)
+        writer.write(timebase.denom)
+
+        writer.write(UInt32(buffers.count))
+        for buffer in buffers {
+            let events = buffer.snapshot()
+            writer.write(buffer.threadId)
+            writer.write(buffer.threadName)
+            writer.write(UInt32(events.count))
+            for event in events {
+                writer.write(event.time)
+                writer.write(event.id)
+                writer.write(event.value)
+                writer.write(event.point)
+                writer.write(event.phase)
+            }
+        }
+        return writer.data
+    }
+
+    /// Convert binary dump to Chrome trace event format (JSON)
+    public static func chromeTrace(fromDump dump: Data) throws -> Data {
+        var reader = DumpReader(data: dump)
+        guard try reader.read(UInt32.self) == Trace.dumpMagic else { throw TraceError.invalidDump }
+        guard try reader.read(UInt32.self) == Trace.dumpVersion else { throw TraceError.invalidDump }
+        let numer = try reader.read(UInt32.self)
+        let denom = try reader.read(UInt32.self)
+        guard denom > 0 else { throw TraceError.invalidDump }
+
+        var threads: [(id: UInt64, name: String, events: [Event])] = []
+        let bufferCount = try reader.read(UInt32.self)
+        for _ in 0 ..< bufferCount {
+            let threadId = try reader.read(UInt64.self)
+            let threadName = try reader.readString()
+            let eventCount = try reader.read(UInt32.self)
+            var events: [Event] = []
+            events.reserveCapacity(Int(eventCount))
+            for _ in 0 ..< eventCount {
+                var event = Event()
+                event.time = try reader.read(UInt64.self)
+                event.id = try reader.read(UInt64.self)
+                event.value = try reader.read(Int64.self)
+                event.point = try reader.read(UInt16.self)
+                event.phase = try reader.read(UInt8.self)
+                events.append(event)
+            }
+            threads.append((id: threadId, name: threadName, events: events))
+        }
+
+        let startTime = threads.flatMap { $0.events.first?.time }.min() ?? 0
+        func micros(_ time: UInt64) -> Double {
+            return Double(time &- startTime) * Double(numer) / Double(denom) / 1000.0
+        }
+
+        var traceEvents: [[String: Any]] = []
+        for thread in threads {
+            traceEvents.append(["ph": "M", "name": "thread_name", "pid": 1, "tid": thread.id, "args": ["name": thread.name]])
+            for event in thread.events {
+                let name = Point(rawValue: event.point)?.name ?? "point\(event.point)"
+                var traceEvent: [String: Any] = ["name": name, "cat": "soduto", "pid": 1, "tid": thread.id, "ts": micros(event.time), "args": ["id": event.id, "value": event.value]]
+                switch Phase(rawValue: event.phase) {
+                case .begin?:
+                    traceEvent["ph"] = "b"
+                    traceEvent["id"] = String(format: "0x%llx", event.id)
+                case .end?:
+                    traceEvent["ph"] = "e"
+                    traceEvent["id"] = String(format: "0x%llx", event.id)
+                default:
+                    traceEvent["ph"] = "i"
+                    traceEvent["s"] = "t"
+                }
+                traceEvents.append(traceEvent)
+            }
+        }
+
+        return try JSONSerialization.data(withJSONObject: ["traceEvents": traceEvents, "displayTimeUnit": "ms"], options: [])
+    }
+
+    /// Write binary dump and its Chrome trace conversion into the directory. Returns URL of the binary dump.
+    @discardableResult
+    public static func writeDump(to directory: URL) throws -> URL {
+        try FileManager.default.createDirectory(at: directory, withIntermediateDirectories: true, attributes: nil)
+        let formatter = DateFormatter()
+        formatter.dateFormat = "yyyyMMdd-HHmmss"
+        let name = "trace-\(formatter.string(from: Date()))"
+
+        let dump = Trace.dump()
+        let dumpUrl = directory.appendingPathComponent(name).appendingPathExtension("sdtrace")
+        try dump.write(to: dumpUrl)
+        try Trace.chromeTrace(fromDump: dump).write(to: directory.appendingPathComponent(name).appendingPathExtension("json"))
+        return dumpUrl
+    }
+
+    /// Dump recorded events into ~/Library/Logs/Soduto whenever SIGUSR1 is received (`killall -USR1 Soduto`)
+    public static func installDumpSignalHandler() {
+        guard Trace.dumpSignalSource == nil else { return }
+
+        signal(SIGUSR1, SIG_IGN)
+        let source = DispatchSource.makeSignalSource(signal: SIGUSR1, queue: DispatchQueue.global(qos: .utility))
+        source.setEventHandler {
+            let directory = FileManager.default.urls(for: .libraryDirectory, in: .userDomainMask)[0].appendingPathComponent("Logs/Soduto", isDirectory: true)
+            do {
+                let url = try Trace.writeDump(to: directory)
+                Log.info?.message("Trace dumped to \(url.path)")
+            }
+            catch {
+                Log.error?.message("Failed to dump trace: \(error)")
+            }
+        }
+        source.resume()
+        Trace.dumpSignalSource = source
+    }
+
+
+    // MARK: Private methods
+
+    private static func record(_ point: Point, phase: Phase, id: UInt64, value: Int64) {
+        let event = Event(time: mach_absolute_time(), id: id, value: value, point: point.rawValue, phase: phase.rawValue)
+        Trace.currentBuffer().append(event)
+    }
+
+    private static func currentBuffer() -> Buffer {
+        if let pointer = pthread_getspecific(Trace.bufferKey) {
+            return Unmanaged<Buffer>.fromOpaque(pointer).takeUnretainedValue()
+        }
+
+        let buffer = Buffer(capacity: Trace.eventsPerThread)
+        pthread_setspecific(Trace.bufferKey, Unmanaged.passRetained(buffer).toOpaque())
+        Trace.registryLock.lock()
+        Trace.buffers.append(buffer)
+        Trace.registryLock.unlock()
+        return buffer
+    }
+
+    private static func retire(_ buffer: Buffer) {
+        Trace.registryLock.lock()
+        defer { Trace.registryLock.unlock() }
+
+        buffer.isRetired = true
+        var retiredCount = Trace.buffers.filter { $0.isRetired }.count
+        Trace.buffers = Trace.buffers.filter { candidate in
+            guard candidate.isRetired && retiredCount > Trace.maxRetiredBuffers else { return true }
+            retiredCount -= 1
+            return false
+        }
+    }
+}
+
+
+// MARK: - Dump serialization
+
+private struct DumpWriter {
+    var data = Data()
+
+    mutating func write<T: FixedWidthInteger>(_ value: T) {
+        var littleEndian = value.littleEndian
+        withUnsafeBytes(of: &littleEndian) { self.data.append(contentsOf: $0) }
+    }
+
+    mutating func write(_ string: String) {
+        let bytes = Array(string.utf8.prefix(Int(UInt16.max)))
+        self.write(UInt16(bytes.count))
+        self.data.append(contentsOf: bytes)
+    }
+}
+
+private struct DumpReader {
+    let data: Data
+    var offset: Int = 0
+
+    init(data: Data) {
+        self.data = data
+    }
+
+    mutating func read<T: FixedWidthInteger>(_ type: T.Type) throws -> T {
+        let size = MemoryLayout<T>.size
+        guard self.offset + size <= self.data.count else { throw Trace.TraceError.invalidDump }
+        var value: T = 0
+        for i in 0 ..< size {
+            value |= T(truncatingIfNeeded: self.data[self.data.startIndex + self.offset + i]) << (8 * i)
+        }
+        self.offset += size
+        return value
+    }
+
+    mutating func readString() throws -> String {
+        let length = Int(try self.read(UInt16.self))
+        guard self.offset + length <= self.data.count else { throw Trace.TraceError.invalidDump }
+        let start = self.data.startIndex + self.offset
+        self.offset += length
+        return String(decoding: self.data[start ..< start + length], as: UTF8.self)
+    }
+}
@@ -8,11 +8,13 @@
 
 #import "Logging.h"
 #import "CollectionUtils.h"
+#import "MYLogWriter.h"
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/param.h>
 #include <termios.h>
+#include <pthread.h>
 
 
 BOOL gMYWarnRaisesException;
@@ -167,40 +169,31 @@ static NSString* color(NSString* ansi, NSString* xcode) {
 
 static void _Logv( NSString *prefix, NSString *msg, va_list args )
 {
-    if (MYLoggingCallback) {
-        msg = [[NSString alloc] initWithFormat: msg arguments: args];
-        if (!MYLoggingCallback(prefix, msg))
-            return;
-    }
+    msg = [[NSString alloc] initWithFormat: msg arguments: args];
+    if (MYLoggingCallback && !MYLoggingCallback(prefix, msg))
+        return;
     if (sLoggingTo > kLoggingToOther) {
         @autoreleasepool {
-            static NSDateFormatter *sTimestampFormat;
-            if( ! sTimestampFormat ) {
-                sTimestampFormat = [[NSDateFormatter alloc] init];
-                sTimestampFormat.dateFormat = @"HH:mm:ss.SSS";
-            }
-            NSDate *now = [[NSDate alloc] init];
-            NSString *timestamp = [sTimestampFormat stringFromDate: now];
-
-            NSString* timestampTrailer = @"|";
-            if (![[NSThread currentThread] isMainThread])
-                timestampTrailer = @"‖";
+            // Output goes through the async writer, so the calling thread only pays for formatting
+            char timestamp[16];
+            MYLogWriterFormatTimestamp(timestamp, sizeof(timestamp));
+            NSString* timestampTrailer = pthread_main_np() ? @"|" : @"‖";
 
             NSString *separator = prefix.length ?@": " :@"";
-            msg = [[NSString alloc] initWithFormat: msg arguments: args];
             BOOL isWarning = [prefix isEqualToString: kWarningPrefix];
             NSString *prefixColor = isWarning ?COLOR_WARNING :COLOR_PREFIX;
             NSString *msgColor = isWarning ?@"" :COLOR_RESET;
-            NSString *finalMsg = [[NSString alloc] initWithFormat: @"%@%@%@ %@%@%@%@%@\n", 
+            NSString *finalMsg = [[NSString alloc] initWithFormat: @"%@%s%@ %@%@%@%@%@\n", 
                                   COLOR_TIME,timestamp, timestampTrailer,
                                   prefixColor,prefix,separator,
                                   msgColor,msg];
-            fputs([finalMsg UTF8String], stderr);
+            const char *utf8 = finalMsg.UTF8String;
+            MYLogWriterWrite(utf8, strlen(utf8));
         }
     } else {
         if( prefix.length )
             msg = $sprintf(@"%@: %@", prefix,msg);
-        NSLogv(msg,args);
+        NSLog(@"%@", msg);
     }
 }
 
@@ -255,6 +248,9 @@ void Warn( NSString *msg, ... )
     va_end(args);
 
     if (gMYWarnRaisesException) {
+#ifndef MY_DISABLE_LOGGING
+        MYLogWriterFlush(1.0);
+#endif
         va_list args;
         va_start(args,msg);
         [NSException raise: NSInternalInconsistencyException
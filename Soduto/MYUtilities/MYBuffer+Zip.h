@@ -7,12 +7,17 @@
 //
 
 #import "MYBuffer.h"
+#import "MYZip.h"
 
 
 /** Wraps a MYReader and transparently compresses or decompresses the data being read from it. */
 @interface MYZipReader : NSObject <MYReader>
 - (instancetype) initWithReader: (id<MYReader>)reader
                     compressing: (BOOL)compressing;
+
+/** Uses the given codec, e.g. a MYParallelZip compressor, instead of a MYZip. */
+- (instancetype) initWithReader: (id<MYReader>)reader
+                          codec: (id<MYCodec>)codec;
 @end
 
 
@@ -23,4 +28,8 @@
 @interface MYZipWriter : NSObject <MYWriter>
 - (instancetype) initWithWriter: (id<MYWriter>)writer
                     compressing: (BOOL)compressing;
+
+/** Uses the given codec, e.g. a MYParallelZip compressor, instead of a MYZip. */
+- (instancetype) initWithWriter: (id<MYWriter>)writer
+                          codec: (id<MYCodec>)codec;
 @end
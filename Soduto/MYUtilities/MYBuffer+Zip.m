@@ -34,16 +34,20 @@ static inline size_t move(MYSlice* dst, MYSlice* src, BOOL slideSrc) {
 @implementation MYZipReader
 {
     id<MYReader> _reader;
-    MYZip* _zipper;
+    id<MYCodec> _zipper;
     NSMutableData* _zippedBuf;
     MYSlice _zipped;
 }
 
 - (instancetype) initWithReader: (id<MYReader>)reader compressing: (BOOL)compressing {
+    return [self initWithReader: reader codec: [[MYZip alloc] initForCompressing: compressing]];
+}
+
+- (instancetype) initWithReader: (id<MYReader>)reader codec: (id<MYCodec>)codec {
     self = [super init];
     if (self) {
         _reader = reader;
-        _zipper = [[MYZip alloc] initForCompressing: compressing];
+        _zipper = codec;
         _zippedBuf = [[NSMutableData alloc] initWithLength: kZippedBufferSize];
         _zipped = (MYSlice){_zippedBuf.mutableBytes, 0};
     }
@@ -55,7 +59,7 @@ static inline size_t move(MYSlice* dst, MYSlice* src, BOOL slideSrc) {
         _zippedBuf.length = _zipped.length + new.length;
         _zipped.bytes = _zippedBuf.mutableBytes;
     }
-    memcpy((void*)_zipped.bytes+_zipped.length, &new.bytes, new.length);
+    memcpy((void*)_zipped.bytes+_zipped.length, new.bytes, new.length);
     _zipped.length += new.length;
 
 }
@@ -103,16 +107,20 @@ static inline size_t move(MYSlice* dst, MYSlice* src, BOOL slideSrc) {
 @implementation MYZipWriter
 {
     id<MYWriter> _writer;
-    MYZip* _zipper;
+    id<MYCodec> _zipper;
     NSMutableData* _zippedBuf;
     MYSlice _zipped;
 }
 
 - (instancetype) initWithWriter: (id<MYWriter>)writer compressing: (BOOL)compressing {
+    return [self initWithWriter: writer codec: [[MYZip alloc] initForCompressing: compressing]];
+}
+
+- (instancetype) initWithWriter: (id<MYWriter>)writer codec: (id<MYCodec>)codec {
     self = [super init];
     if (self) {
         _writer = writer;
-        _zipper = [[MYZip alloc] initForCompressing: compressing];
+        _zipper = codec;
     }
     return self;
 }
@@ -131,6 +139,7 @@ static inline size_t move(MYSlice* dst, MYSlice* src, BOOL slideSrc) {
 
 - (BOOL) writeContentsOfStream: (NSInputStream*)inputStream {
     Assert(NO, @"UNIMPLEMENTED"); //TODO
+    return NO;
 }
 
 @end
@@ -7,6 +7,7 @@
 //
 
 #import <Foundation/Foundation.h>
+#import <sys/uio.h>
 #import "MYData.h"
 
 
@@ -32,6 +33,8 @@
 /** If possible, returns a slice (pointer+length) pointing to the reader data read from the
     buffer. This memory is only valid until the next call to the buffer; do NOT free or modify it.
     You may get back fewer bytes than you asked for; that doesn't mean that the buffer is at EOF.
+    (MYBuffer returns one contiguous block at a time, even if more is buffered after it; use
+    -getIOVecs:maxCount:maxLength: to gather several blocks at once.)
     This may well fail (if reading from a stream) in which case the slice points to NULL. In that
     case you should fall back to the regular -readBytes:maxLength: call. */
 - (MYSlice) readSliceOfMaxLength: (size_t)maxLength;
@@ -44,14 +47,30 @@
 
 /** A growable data buffer that can be written/appended to, and read from.
     A stream can be added to a buffer; this effectively adds its entire contents, but they'll be
-    read on demand instead of being copied into memory all at once. */
+    read on demand instead of being copied into memory all at once.
+    Small writes are copied into fixed-size blocks taken from a shared pool; large NSData objects
+    are kept by reference instead of being copied. Buffered length is tracked as data is written
+    and read, so the length properties don't walk the contents. */
 @interface MYBuffer : NSObject <MYReader, MYWriter>
 
 - (instancetype) initWithData: (NSData*)data;
 
+/** Number of bytes buffered in memory. Doesn't include the contents of added streams. */
 @property (readonly) NSUInteger minLength;
+/** Same as minLength if no streams were added, otherwise NSIntegerMax. */
 @property (readonly) NSUInteger maxLength;
 
+/** Fills `iov` with up to `maxCount` pointers to consecutive runs of buffered bytes, `maxLength`
+    bytes at most in total, without consuming them. This allows writing several blocks with one
+    writev() call. Stops at an added stream. Returns the number of entries filled in.
+    The memory is only valid until the next call to the buffer; do NOT free or modify it.
+    Call -skipBytes: afterwards with the number of bytes actually used. */
+- (int) getIOVecs: (struct iovec*)iov maxCount: (int)maxCount maxLength: (size_t)maxLength;
+
+/** Consumes up to `length` buffered bytes without copying them anywhere. Stops at an added
+    stream. Returns the number of bytes consumed. */
+- (size_t) skipBytes: (size_t)length;
+
 /** Returns the entire (remaining) contents of the buffer as a single NSData.
     This doesn't consume any bytes, it just reorganizes the buffer's contents if needed. */
 - (NSData*) flattened;
@@ -9,23 +9,92 @@
 #import "MYBuffer.h"
 #import "Logging.h"
 #import "Test.h"
+#import <os/lock.h>
 
 
-#define kChunkCapacity 4096
+#define kBlockSize 4096
+#define kMaxPooledBlocks 64
+#define kMinReferencedDataLength (kBlockSize / 2)   // larger NSData is kept by reference, not copied
+#define kInitialChunkCapacity 8                      // must be a power of 2
+
+
+#pragma mark - BLOCK POOL:
+
+
+// Blocks are recycled between buffers, so that streaming data through buffers doesn't keep
+// allocating and freeing memory.
+static os_unfair_lock sBlockPoolLock = OS_UNFAIR_LOCK_INIT;
+static uint8_t* sBlockPool[kMaxPooledBlocks];
+static int sBlockPoolCount = 0;
+
+static uint8_t* AllocBlock(void) {
+    uint8_t* block = NULL;
+    os_unfair_lock_lock(&sBlockPoolLock);
+    if (sBlockPoolCount > 0)
+        block = sBlockPool[--sBlockPoolCount];
+    os_unfair_lock_unlock(&sBlockPoolLock);
+    return block ?: malloc(kBlockSize);
+}
+
+static void FreeBlock(uint8_t* block) {
+    os_unfair_lock_lock(&sBlockPoolLock);
+    if (sBlockPoolCount < kMaxPooledBlocks) {
+        sBlockPool[sBlockPoolCount++] = block;
+        block = NULL;
+    }
+    os_unfair_lock_unlock(&sBlockPoolLock);
+    free(block);
+}
+
+
+#pragma mark - CHUNKS:
+
+
+typedef enum {
+    kBlockChunk,        // pooled block, owned by the buffer
+    kDataChunk,         // bytes of a referenced NSData
+    kStreamChunk        // NSInputStream, read on demand
+} ChunkType;
+
+typedef struct {
+    ChunkType type;
+    const uint8_t* bytes;   // NULL for streams
+    size_t start, end;      // range of unread bytes
+    CFTypeRef object;       // retained NSData or NSInputStream
+} Chunk;
+
+static inline BOOL ChunkIsEmptyMemory(const Chunk* chunk) {
+    return chunk->type != kStreamChunk && chunk->start >= chunk->end;
+}
+
+static void ReleaseChunk(Chunk* chunk) {
+    if (chunk->type == kBlockChunk)
+        FreeBlock((uint8_t*)chunk->bytes);
+    if (chunk->type == kStreamChunk)
+        [(__bridge NSInputStream*)chunk->object close];
+    if (chunk->object)
+        CFRelease(chunk->object);
+    *chunk = (Chunk){};
+}
+
+
+#pragma mark - BUFFER:
 
 
 @implementation MYBuffer
 {
-    NSMutableArray* _chunks;
-    NSMutableData* _writingChunk;      // data chunk currently being written to
-
-    size_t _chunkReadOffset;
+    Chunk* _chunks;             // ring of chunks
+    size_t _chunkCapacity;      // always a power of 2
+    size_t _firstChunk, _chunkCount;
+    size_t _length;             // unread bytes in memory chunks
+    size_t _streamCount;
 }
 
 - (instancetype) init {
     self = [super init];
     if (self) {
-        _chunks = [NSMutableArray array];
+        _chunkCapacity = kInitialChunkCapacity;
+        _chunks = calloc(_chunkCapacity, sizeof(Chunk));
     }
     return self;
 }
@@ -40,39 +109,73 @@
 }
 
 - (void)dealloc {
-    for (id source in _chunks) {
-        if ([source isKindOfClass: [NSInputStream class]])
-            [source close];
-    }
+    for (size_t i = 0; i < _chunkCount; i++)
+        ReleaseChunk([self chunkAt: i]);
+    free(_chunks);
 }
 
 
 - (BOOL) lengthKnown {
-    for (id chunk in _chunks) {
-        if (![chunk isKindOfClass: [NSData class]])
-            return NO;
-    }
-    return YES;
+    return _streamCount == 0;
 }
 
 - (NSUInteger) minLength {
-    NSUInteger len = 0;
-    for (id chunk in _chunks) {
-        if ([chunk isKindOfClass: [NSData class]])
-            len += [chunk length];
-    }
-    return len;
+    return _length;
 }
 
 - (NSUInteger) maxLength {
-    NSUInteger len = 0;
-    for (id chunk in _chunks) {
-        if ([chunk isKindOfClass: [NSData class]])
-            len += [chunk length];
-        else
-            return NSIntegerMax;
+    return _streamCount > 0 ? NSIntegerMax : _length;
+}
+
+
+#pragma mark - CHUNK RING:
+
+
+- (Chunk*) chunkAt: (size_t)index {
+    return &_chunks[(_firstChunk + index) & (_chunkCapacity - 1)];
+}
+
+- (Chunk*) firstChunk {
+    return _chunkCount > 0 ? [self chunkAt: 0] : NULL;
+}
+
+- (Chunk*) lastChunk {
+    return _chunkCount > 0 ? [self chunkAt: _chunkCount - 1] : NULL;
+}
+
+- (Chunk*) appendChunk: (Chunk)chunk {
+    if (_chunkCount == _chunkCapacity) {
+        size_t newCapacity = 2 * _chunkCapacity;
+        Chunk* newChunks = calloc(newCapacity, sizeof(Chunk));
+        for (size_t i = 0; i < _chunkCount; i++)
+            newChunks[i] = *[self chunkAt: i];
+        free(_chunks);
+        _chunks = newChunks;
+        _chunkCapacity = newCapacity;
+        _firstChunk = 0;
+    }
+    Chunk* slot = [self chunkAt: _chunkCount++];
+    *slot = chunk;
+    return slot;
+}
+
+- (void) removeFirstChunk {
+    ReleaseChunk([self firstChunk]);
+    _firstChunk = (_firstChunk + 1) & (_chunkCapacity - 1);
+    _chunkCount--;
+}
+
+/** Frees memory chunks that have been read entirely. This isn't done right when they're used up,
+    because a slice returned by -readSliceOfMaxLength: or -getIOVecs: may still point into them. */
+- (void) removeUsedChunks {
+    Chunk* chunk;
+    while (NULL != (chunk = [self firstChunk]) && ChunkIsEmptyMemory(chunk)) {
+        if (_chunkCount == 1 && chunk->type == kBlockChunk) {
+            chunk->start = chunk->end = 0;   // keep the last block for further writes
+            break;
+        }
+        [self removeFirstChunk];
     }
-    return len;
 }
 
 
@@ -80,15 +183,20 @@
 
 
 - (BOOL) writeSlice: (MYSlice)slice {
-    if (slice.length == 0)
-        return YES;
-    if (_writingChunk && _writingChunk.length + slice.length > kChunkCapacity)
-        _writingChunk = nil;
-    if (!_writingChunk) {
-        _writingChunk = [NSMutableData dataWithCapacity: kChunkCapacity];
-        [_chunks addObject: _writingChunk];
+    [self removeUsedChunks];
+    const uint8_t* bytes = slice.bytes;
+    size_t length = slice.length;
+    while (length > 0) {
+        Chunk* chunk = [self lastChunk];
+        if (!chunk || chunk->type != kBlockChunk || chunk->end == kBlockSize)
+            chunk = [self appendChunk: (Chunk){kBlockChunk, AllocBlock(), 0, 0, NULL}];
+        size_t n = MIN(length, kBlockSize - chunk->end);
+        memcpy((uint8_t*)chunk->bytes + chunk->end, bytes, n);
+        chunk->end += n;
+        _length += n;
+        bytes += n;
+        length -= n;
     }
-    [_writingChunk appendBytes: slice.bytes length: slice.length];
     return YES;
 }
 
@@ -96,19 +204,23 @@
     NSUInteger length = data.length;
     if (length == 0) {
         return YES;
-    } else if (_writingChunk.length + length <= kChunkCapacity) {
+    } else if (length < kMinReferencedDataLength) {
         [self writeSlice: MYMakeSlice(data.bytes, length)];
     } else {
-        _writingChunk = nil;
-        [_chunks addObject: [data copy]];
+        [self removeUsedChunks];
+        NSData* immutableData = [data copy];    // doesn't copy bytes if data is immutable
+        [self appendChunk: (Chunk){kDataChunk, immutableData.bytes, 0, length,
+                                   CFBridgingRetain(immutableData)}];
+        _length += length;
     }
     return YES;
 }
 
 - (BOOL) writeContentsOfStream: (NSInputStream*)inputStream {
+    [self removeUsedChunks];
     [inputStream open];
-    _writingChunk = nil;
-    [_chunks addObject: inputStream];
+    [self appendChunk: (Chunk){kStreamChunk, NULL, 0, 0, CFBridgingRetain(inputStream)}];
+    _streamCount++;
     return YES;
 }
 
@@ -117,32 +229,33 @@
 
 
 - (ssize_t) readBytes: (void*)buffer maxLength: (size_t)maxLength {
+    [self removeUsedChunks];
     ssize_t bytesRead = 0;
-    id chunk;
-    while (maxLength > 0 && nil != (chunk = _chunks.firstObject)) {
+    Chunk* chunk;
+    while (maxLength > 0 && NULL != (chunk = [self firstChunk])) {
         ssize_t nRead;
-        if ([chunk isKindOfClass: [NSData class]]) {
-            // Read from NSData:
-            NSData* data = chunk;
-            nRead = MIN(data.length - _chunkReadOffset, maxLength);
-            memcpy(buffer, (uint8_t*)data.bytes + _chunkReadOffset, nRead);
-            _chunkReadOffset += nRead;
-            if (_chunkReadOffset >= data.length) {
-                [_chunks removeObjectAtIndex: 0]; // remove data source when done
-                _chunkReadOffset = 0;
-            }
+        if (chunk->type != kStreamChunk) {
+            // Read from memory:
+            if (chunk->start >= chunk->end)
+                break;  // only the kept empty block is left
+            nRead = MIN(chunk->end - chunk->start, maxLength);
+            memcpy(buffer, chunk->bytes + chunk->start, nRead);
+            chunk->start += nRead;
+            _length -= nRead;
+            if (chunk->start >= chunk->end)
+                [self removeUsedChunks];
             bytesRead += nRead;
         } else {
             // Read from NSInputStream:
-            NSInputStream* stream = chunk;
+            NSInputStream* stream = (__bridge NSInputStream*)chunk->object;
             nRead = [stream read: buffer maxLength: maxLength];
             if (nRead < 0) {
                 Warn(@"%@: Error reading from %@: %@", self, stream, stream.streamError);
                 return nRead; // read error!
             }
             if (nRead == 0 || stream.streamStatus == NSStreamStatusAtEnd) {
-                [stream close]; // EOF
-                [_chunks removeObjectAtIndex: 0];
+                [self removeFirstChunk]; // EOF; closes the stream
+                _streamCount--;
             }
             if (nRead > 0) {
                 bytesRead += nRead;
@@ -156,17 +269,22 @@
 }
 
 - (MYSlice) readSliceOfMaxLength: (size_t)maxLength {
-    id chunk = _chunks.firstObject;
-    if ([chunk isKindOfClass: [NSData class]]) {
-        size_t bytesRead = MIN([chunk length] - _chunkReadOffset, maxLength);
-        MYSlice result = MYMakeSlice((uint8_t*)[chunk bytes] + _chunkReadOffset, bytesRead);
-        _chunkReadOffset += bytesRead;
-        // Note: can't remove source from _sources even if it's used up, because that would
-        // invalidate the returned pointer into the data. It will be removed on the next readBytes:
+    [self removeUsedChunks];
+    Chunk* chunk = [self firstChunk];
+    if (!chunk) {
+        return MYNullSlice();
+    } else if (chunk->type != kStreamChunk) {
+        // A slice can't span chunks, as they aren't contiguous; -getIOVecs: can.
+        size_t bytesRead = MIN(chunk->end - chunk->start, maxLength);
+        MYSlice result = MYMakeSlice(chunk->bytes + chunk->start, bytesRead);
+        chunk->start += bytesRead;
+        _length -= bytesRead;
+        // Note: can't remove the chunk even if it's used up, because that would invalidate the
+        // returned pointer. It will be removed on the next call.
         return result;
-    } else if ([chunk isKindOfClass: [NSInputStream class]]) {
+    } else {
         CFIndex length;
-        const uint8_t* buffer = CFReadStreamGetBuffer((__bridge CFReadStreamRef)chunk,
+        const uint8_t* buffer = CFReadStreamGetBuffer((CFReadStreamRef)chunk->object,
                                                       maxLength, &length);
         if (buffer)
             return MYMakeSlice(buffer, length);
@@ -174,35 +292,70 @@
     return MYNullSlice();
 }
 
+- (int) getIOVecs: (struct iovec*)iov maxCount: (int)maxCount maxLength: (size_t)maxLength {
+    [self removeUsedChunks];
+    int count = 0;
+    for (size_t i = 0; i < _chunkCount && count < maxCount && maxLength > 0; i++) {
+        Chunk* chunk = [self chunkAt: i];
+        if (chunk->type == kStreamChunk)
+            break;
+        size_t length = MIN(chunk->end - chunk->start, maxLength);
+        if (length == 0)
+            continue;
+        iov[count++] = (struct iovec){(void*)(chunk->bytes + chunk->start), length};
+        maxLength -= length;
+    }
+    return count;
+}
+
+- (size_t) skipBytes: (size_t)length {
+    size_t skipped = 0;
+    for (size_t i = 0; i < _chunkCount && length > 0; i++) {
+        Chunk* chunk = [self chunkAt: i];
+        if (chunk->type == kStreamChunk)
+            break;
+        size_t n = MIN(chunk->end - chunk->start, length);
+        chunk->start += n;
+        _length -= n;
+        skipped += n;
+        length -= n;
+    }
+    // Used chunks are removed on the next call, as the caller may still be using the memory
+    return skipped;
+}
+
 
 - (NSData*) flattened {
-    id firstChunk = _chunks.firstObject;
-    if (_chunkReadOffset == 0 && _chunks.count == 1 && [firstChunk isKindOfClass: [NSData class]])
-        return firstChunk;  // already flat
-    NSMutableData* flat = [NSMutableData dataWithCapacity: self.minLength];
-    for (id chunk in _chunks) {
-        if (![chunk isKindOfClass: [NSData class]])
-            return nil;
-        NSData* data = chunk;
-        if (data == firstChunk)
-            data = [data subdataWithRange: NSMakeRange(_chunkReadOffset,
-                                                         data.length - _chunkReadOffset)];
-        [flat appendData: data];
-    }
-    [_chunks removeAllObjects];
-    [_chunks addObject: flat];
-    _chunkReadOffset = 0;
+    [self removeUsedChunks];
+    if (_streamCount > 0)
+        return nil;
+    Chunk* firstChunk = [self firstChunk];
+    if (_chunkCount == 1 && firstChunk->type == kDataChunk && firstChunk->start == 0)
+        return (__bridge NSData*)firstChunk->object;  // already flat
+    NSMutableData* flat = [NSMutableData dataWithLength: _length];
+    uint8_t* dst = flat.mutableBytes;
+    while (_chunkCount > 0) {
+        Chunk* chunk = [self firstChunk];
+        memcpy(dst, chunk->bytes + chunk->start, chunk->end - chunk->start);
+        dst += chunk->end - chunk->start;
+        [self removeFirstChunk];
+    }
+    if (flat.length > 0)
+        [self appendChunk: (Chunk){kDataChunk, flat.bytes, 0, flat.length, CFBridgingRetain(flat)}];
     return flat;
 }
 
 
 - (BOOL) hasBytesAvailable {
-    for (id chunk in _chunks) {
-        if ([chunk isKindOfClass: [NSData class]]) {
-            if (_chunkReadOffset < [chunk length])
+    if (_streamCount == 0)
+        return _length > 0;
+    for (size_t i = 0; i < _chunkCount; i++) {
+        Chunk* chunk = [self chunkAt: i];
+        if (chunk->type != kStreamChunk) {
+            if (chunk->start < chunk->end)
                 return YES;
         } else {
-            NSInputStream* stream = chunk;
+            NSInputStream* stream = (__bridge NSInputStream*)chunk->object;
             if (stream.streamStatus < NSStreamStatusAtEnd)
                 return stream.hasBytesAvailable;
         }
@@ -211,14 +364,13 @@
 }
 
 - (BOOL) atEnd {
-    for (id chunk in _chunks) {
-        if ([chunk isKindOfClass: [NSData class]]) {
-            if (_chunkReadOffset < [chunk length])
-                return NO;
-        } else {
-            if (((NSInputStream*)chunk).streamStatus < NSStreamStatusAtEnd)
-                return NO;
-        }
+    if (_length > 0)
+        return NO;
+    for (size_t i = 0; i < _chunkCount; i++) {
+        Chunk* chunk = [self chunkAt: i];
+        if (chunk->type == kStreamChunk
+                && ((__bridge NSInputStream*)chunk->object).streamStatus < NSStreamStatusAtEnd)
+            return NO;
     }
     return YES;
 }
@@ -227,6 +379,156 @@
 @end
 
 
+#pragma mark - TESTS:
+
+
+static NSData* TestData(size_t length) {
+    NSMutableData* data = [NSMutableData dataWithLength: length];
+    uint8_t* bytes = data.mutableBytes;
+    for (size_t i = 0; i < length; i++)
+        bytes[i] = (uint8_t)(i * 7 + i / 251);
+    return data;
+}
+
+TestCase(MYBuffer) {
+    NSData* data = TestData(3 * kBlockSize + 123);
+    MYBuffer* buffer = [[MYBuffer alloc] init];
+    // Small writes crossing block boundaries, then a large referenced one:
+    size_t offset = 0;
+    while (offset < kBlockSize + 500) {
+        size_t n = MIN((size_t)333, kBlockSize + 500 - offset);
+        [buffer writeSlice: MYMakeSlice((const uint8_t*)data.bytes + offset, n)];
+        offset += n;
+    }
+    [buffer writeData: [data subdataWithRange: NSMakeRange(offset, data.length - offset)]];
+    CAssertEq(buffer.minLength, data.length);
+    CAssertEq(buffer.maxLength, data.length);
+    CAssert(buffer.hasBytesAvailable);
+
+    // Slices don't span chunks:
+    MYSlice slice = [buffer readSliceOfMaxLength: 10000];
+    CAssertEq(slice.length, (size_t)kBlockSize);
+    CAssert(memcmp(slice.bytes, data.bytes, slice.length) == 0);
+    CAssertEq(buffer.minLength, data.length - kBlockSize);
+
+    NSMutableData* rest = [NSMutableData dataWithLength: data.length];
+    ssize_t nRead = [buffer readBytes: rest.mutableBytes maxLength: rest.length];
+    CAssertEq(nRead, (ssize_t)(data.length - kBlockSize));
+    CAssert(memcmp(rest.bytes, (const uint8_t*)data.bytes + kBlockSize, nRead) == 0);
+    CAssertEq(buffer.minLength, (NSUInteger)0);
+    CAssert(buffer.atEnd);
+
+    // Reading a drained buffer whose last block is kept for further writes:
+    MYBuffer* small = [[MYBuffer alloc] init];
+    [small writeSlice: MYMakeSlice("abc", 3)];
+    char abc[10];
+    CAssertEq([small readBytes: abc maxLength: sizeof(abc)], (ssize_t)3);
+    CAssertEq([small readBytes: abc maxLength: sizeof(abc)], (ssize_t)0);
+    CAssertEq([small readSliceOfMaxLength: sizeof(abc)].length, (size_t)0);
+    CAssert(small.atEnd);
+
+    // Streams:
+    [buffer writeData: [data subdataWithRange: NSMakeRange(0, 100)]];
+    [buffer writeContentsOfStream: [NSInputStream inputStreamWithData: data]];
+    CAssertEq(buffer.minLength, (NSUInteger)100);
+    CAssertEq(buffer.maxLength, (NSUInteger)NSIntegerMax);
+    CAssertNil(buffer.flattened);
+    NSMutableData* all = [NSMutableData data];
+    uint8_t chunk[1000];
+    while ((nRead = [buffer readBytes: chunk maxLength: sizeof(chunk)]) > 0)
+        [all appendBytes: chunk length: nRead];
+    CAssertEq(all.length, data.length + 100);
+    CAssert(buffer.atEnd);
+
+    // Flattening:
+    NSData* immutableData = [data copy];
+    buffer = [[MYBuffer alloc] initWithData: immutableData];
+    CAssertEq(buffer.flattened, immutableData);     // referenced, not copied
+    [buffer writeSlice: MYMakeSlice("abc", 3)];
+    [buffer readSliceOfMaxLength: 10];
+    NSData* flat = buffer.flattened;
+    CAssertEq(flat.length, data.length - 10 + 3);
+    CAssert(memcmp(flat.bytes, (const uint8_t*)data.bytes + 10, data.length - 10) == 0);
+}
+
+TestCase(MYBufferIOVecs) {
+    RequireTestCase(MYBuffer);
+    NSData* data = TestData(5 * kBlockSize);
+    MYBuffer* buffer = [[MYBuffer alloc] init];
+    for (size_t offset = 0; offset < data.length; offset += 1000)
+        [buffer writeSlice: MYMakeSlice((const uint8_t*)data.bytes + offset, MIN((size_t)1000, data.length - offset))];
+
+    struct iovec iov[8];
+    int count = [buffer getIOVecs: iov maxCount: 8 maxLength: 3 * kBlockSize - 10];
+    CAssertEq(count, 3);
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        CAssert(memcmp(iov[i].iov_base, (const uint8_t*)data.bytes + total, iov[i].iov_len) == 0);
+        total += iov[i].iov_len;
+    }
+    CAssertEq(total, (size_t)(3 * kBlockSize - 10));
+    CAssertEq(buffer.minLength, data.length);      // not consumed
+
+    CAssertEq([buffer skipBytes: total], total);
+    CAssertEq(buffer.minLength, data.length - total);
+    count = [buffer getIOVecs: iov maxCount: 8 maxLength: SIZE_MAX];
+    CAssertEq(count, 3);
+    CAssertEq(iov[0].iov_len, (size_t)10);
+    CAssert(memcmp(iov[0].iov_base, (const uint8_t*)data.bytes + total, 10) == 0);
+    CAssertEq([buffer skipBytes: SIZE_MAX], data.length - total);
+    CAssert(buffer.atEnd);
+}
+
+TestCase(MYBufferBenchmark) {
+    // Compares with the way the buffer used to work: an array of NSData chunks, with length
+    // computed by walking the chunks.
+    RequireTestCase(MYBuffer);
+    const int kRounds = 200;
+    const size_t kWriteSize = 100;
+    const int kWritesPerRound = 500;
+    NSData* data = TestData(kWriteSize);
+    uint8_t readBuffer[16 * 1024];
+
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    for (int round = 0; round < kRounds; round++) {
+        NSMutableArray* chunks = [NSMutableArray array];
+        NSMutableData* writingChunk = nil;
+        for (int i = 0; i < kWritesPerRound; i++) {
+            if (!writingChunk || writingChunk.length + kWriteSize > kBlockSize) {
+                writingChunk = [NSMutableData dataWithCapacity: kBlockSize];
+                [chunks addObject: writingChunk];
+            }
+            [writingChunk appendData: data];
+            NSUInteger length = 0;
+            for (NSData* chunk in chunks)
+                length += chunk.length;
+            CAssertEq(length, (i + 1) * kWriteSize);
+        }
+        while (chunks.count > 0) {
+            NSData* chunk = chunks[0];
+            memcpy(readBuffer, chunk.bytes, MIN(chunk.length, sizeof(readBuffer)));
+            [chunks removeObjectAtIndex: 0];
+        }
+    }
+    CFAbsoluteTime arrayTime = CFAbsoluteTimeGetCurrent() - start;
+
+    start = CFAbsoluteTimeGetCurrent();
+    for (int round = 0; round < kRounds; round++) {
+        MYBuffer* buffer = [[MYBuffer alloc] init];
+        for (int i = 0; i < kWritesPerRound; i++) {
+            [buffer writeData: data];
+            CAssertEq(buffer.minLength, (i + 1) * kWriteSize);
+        }
+        while ([buffer readBytes: readBuffer maxLength: sizeof(readBuffer)] > 0)
+            ;
+    }
+    CFAbsoluteTime bufferTime = CFAbsoluteTimeGetCurrent() - start;
+
+    Log(@"MYBuffer benchmark: %d x %d writes of %zu bytes: chunk array %.3f ms, MYBuffer %.3f ms",
+        kRounds, kWritesPerRound, kWriteSize, arrayTime * 1000.0, bufferTime * 1000.0);
+}
+
+
 
 /*
  Copyright (c) 2008-2013, Jens Alfke <jens@mooseyard.com>. All rights reserved.
@@ -0,0 +1,31 @@
+//
+//  MYLogWriter.h
+//  MYUtilities
+//
+//  Created by Giedrius Stanevičius on 2018-03-27.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/* Asynchronous log output shared by Logging.m and MYLogging.m.
+   Log lines are copied into a fixed-size lock-free ring buffer and written to stderr by a
+   background thread, so logging threads never block on console or file I/O. If the ring is full,
+   records are dropped and the number of dropped records is written once the writer catches up. */
+
+
+/** Queues a formatted log line (including trailing newline) for writing to stderr.
+    Safe to call from any thread. Returns NO if the record was dropped because the buffer is full. */
+BOOL MYLogWriterWrite(const char *text, size_t length);
+
+/** Blocks until all records queued so far are written, or the timeout expires.
+    Called automatically at exit. */
+void MYLogWriterFlush(NSTimeInterval timeout);
+
+/** Formats current local time as "HH:mm:ss.SSS". Much cheaper than NSDateFormatter.
+    The buffer should have room for at least 13 characters. */
+void MYLogWriterFormatTimestamp(char *buffer, size_t size);
+
+/** Total number of records dropped because the buffer was full. */
+uint64_t MYLogWriterDroppedCount(void);
@@ -0,0 +1,201 @@
+//
+//  MYLogWriter.m
+//  MYUtilities
+//
+//  Created by Giedrius Stanevičius on 2018-03-27.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+#import "MYLogWriter.h"
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+
+#define kRecordCount    1024    // Must be a power of two
+#define kInlineSize     240     // Longer records are copied to the heap
+#define kOutputSize     16384   // Records are written to stderr in batches of up to this size
+
+
+/* The ring is a bounded multi-producer queue (D. Vyukov). Each record has a sequence number
+   telling whose turn it is: producers may claim a record at position `pos` when its sequence is
+   `pos`, and publish it by setting the sequence to `pos+1`; the writer consumes it and hands it
+   back to producers of the next lap by setting the sequence to `pos+kRecordCount`. */
+typedef struct {
+    _Atomic(uint64_t) sequence;
+    size_t length;
+    char *heapText;
+    char inlineText[kInlineSize];
+} MYLogRecord;
+
+static MYLogRecord sRecords[kRecordCount];
+static _Atomic(uint64_t) sEnqueuePos;
+static _Atomic(uint64_t) sWrittenPos;
+static _Atomic(uint64_t) sDroppedCount;
+static _Atomic(uint64_t) sUnreportedDropCount;
+static uint64_t sDequeuePos;            // Only accessed by the writer thread
+static dispatch_semaphore_t sWakeup;
+
+
+static void writeOutput(const char *bytes, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(STDERR_FILENO, bytes, length);
+        if (written < 0)
+            return;
+        bytes += written;
+        length -= (size_t)written;
+    }
+}
+
+
+static void drainRecords(void) {
+    static char sOutput[kOutputSize];
+    size_t outputLength = 0;
+
+    for (;;) {
+        MYLogRecord *record = &sRecords[sDequeuePos & (kRecordCount - 1)];
+        uint64_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        if (sequence != sDequeuePos + 1)
+            break;
+
+        const char *text = record->heapText ?: record->inlineText;
+        if (outputLength + record->length > kOutputSize) {
+            writeOutput(sOutput, outputLength);
+            outputLength = 0;
+        }
+        if (record->length > kOutputSize) {
+            writeOutput(text, record->length);
+        } else {
+            memcpy(sOutput + outputLength, text, record->length);
+            outputLength += record->length;
+        }
+        free(record->heapText);
+        record->heapText = NULL;
+
+        atomic_store_explicit(&record->sequence, sDequeuePos + kRecordCount, memory_order_release);
+        ++sDequeuePos;
+    }
+
+    uint64_t dropped = atomic_exchange_explicit(&sUnreportedDropCount, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        char message[96];
+        int length = snprintf(message, sizeof(message),
+                              "MYLogWriter: %llu log records dropped, buffer was full\n",
+                              (unsigned long long)dropped);
+        if (outputLength + (size_t)length > kOutputSize) {
+            writeOutput(sOutput, outputLength);
+            outputLength = 0;
+        }
+        memcpy(sOutput + outputLength, message, (size_t)length);
+        outputLength += (size_t)length;
+    }
+
+    writeOutput(sOutput, outputLength);
+    atomic_store_explicit(&sWrittenPos, sDequeuePos, memory_order_release);
+}
+
+
+static void* writerMain(void *unused) {
+    pthread_setname_np("MYLogWriter");
+    for (;;) {
+        dispatch_semaphore_wait(sWakeup, DISPATCH_TIME_FOREVER);
+        drainRecords();
+    }
+    return NULL;
+}
+
+
+static void flushAtExit(void) {
+    MYLogWriterFlush(1.0);
+}
+
+
+static void startWriter(void) {
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        for (uint64_t i = 0; i < kRecordCount; ++i)
+            atomic_init(&sRecords[i].sequence, i);
+        sWakeup = dispatch_semaphore_create(0);
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_attr_set_qos_class_np(&attr, QOS_CLASS_UTILITY, 0);
+        pthread_t thread;
+        pthread_create(&thread, &attr, writerMain, NULL);
+        pthread_attr_destroy(&attr);
+
+        atexit(flushAtExit);
+    });
+}
+
+
+BOOL MYLogWriterWrite(const char *text, size_t length) {
+    startWriter();
+
+    MYLogRecord *record;
+    uint64_t pos = atomic_load_explicit(&sEnqueuePos, memory_order_relaxed);
+    for (;;) {
+        record = &sRecords[pos & (kRecordCount - 1)];
+        uint64_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        int64_t diff = (int64_t)(sequence - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&sEnqueuePos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // Writer is a full lap behind
+            atomic_fetch_add_explicit(&sDroppedCount, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&sUnreportedDropCount, 1, memory_order_relaxed);
+            dispatch_semaphore_signal(sWakeup);
+            return NO;
+        } else {
+            // Another producer claimed this record first
+            pos = atomic_load_explicit(&sEnqueuePos, memory_order_relaxed);
+        }
+    }
+
+    record->heapText = NULL;
+    if (length > kInlineSize) {
+        record->heapText = malloc(length);
+        if (!record->heapText)
+            length = kInlineSize;  // Better truncated than lost
+    }
+    memcpy(record->heapText ?: record->inlineText, text, length);
+    record->length = length;
+    atomic_store_explicit(&record->sequence, pos + 1, memory_order_release);
+
+    dispatch_semaphore_signal(sWakeup);
+    return YES;
+}
+
+
+void MYLogWriterFlush(NSTimeInterval timeout) {
+    if (!sWakeup)
+        return;
+    uint64_t target = atomic_load_explicit(&sEnqueuePos, memory_order_acquire);
+    double deadline = CFAbsoluteTimeGetCurrent() + timeout;
+    while (atomic_load_explicit(&sWrittenPos, memory_order_acquire) < target) {
+        if (CFAbsoluteTimeGetCurrent() >= deadline)
+            break;
+        dispatch_semaphore_signal(sWakeup);
+        usleep(1000);
+    }
+}
+
+
+void MYLogWriterFormatTimestamp(char *buffer, size_t size) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    struct tm local;
+    localtime_r(&now.tv_sec, &local);
+    snprintf(buffer, size, "%02d:%02d:%02d.%03d",
+             local.tm_hour, local.tm_min, local.tm_sec, (int)(now.tv_usec / 1000));
+}
+
+
+uint64_t MYLogWriterDroppedCount(void) {
+    return atomic_load_explicit(&sDroppedCount, memory_order_relaxed);
+}
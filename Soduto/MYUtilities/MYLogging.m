@@ -8,11 +8,13 @@
 
 #import "MYLogging.h"
 #import "CollectionUtils.h"
+#import "MYLogWriter.h"
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/param.h>
 #include <termios.h>
+#include <pthread.h>
 
 
 #if !__has_feature(objc_arc)
@@ -232,28 +234,22 @@ static void _Logv(const MYLogDomain* domain, NSString *msg, va_list args) {
         }
 
         if (loggingMode() > kLoggingToOther) {
-            static NSDateFormatter *sTimestampFormat;
-            if (! sTimestampFormat) {
-                sTimestampFormat = [[NSDateFormatter alloc] init];
-                sTimestampFormat.dateFormat = @"HH:mm:ss.SSS";
-            }
-            NSDate *now = [[NSDate alloc] init];
-            NSString *timestamp = [sTimestampFormat stringFromDate: now];
-
-            NSString* timestampTrailer = @"|";
-            if (![[NSThread currentThread] isMainThread])
-                timestampTrailer = @"‖";
+            // Output goes through the async writer, so the calling thread only pays for formatting
+            char timestamp[16];
+            MYLogWriterFormatTimestamp(timestamp, sizeof(timestamp));
+            NSString* timestampTrailer = pthread_main_np() ? @"|" : @"‖";
 
             NSString *separator = hasDomain ?@": " :@"";
             BOOL isWarning = (domain == &sWarningDomain);
             NSString* prefix = hasDomain ? @(domain->name) : @"";
             NSString *prefixColor = isWarning ?COLOR_WARNING :COLOR_PREFIX;
             NSString *msgColor = isWarning ?@"" :COLOR_RESET;
-            NSString *finalMsg = [[NSString alloc] initWithFormat: @"%@%@%@ %@%@%@%@%@\n", 
+            NSString *finalMsg = [[NSString alloc] initWithFormat: @"%@%s%@ %@%@%@%@%@\n", 
                                   COLOR_TIME,timestamp, timestampTrailer,
                                   prefixColor, prefix, separator,
                                   msgColor,msg];
-            fputs([finalMsg UTF8String], stderr);
+            const char *utf8 = finalMsg.UTF8String;
+            MYLogWriterWrite(utf8, strlen(utf8));
         } else {
             if (hasDomain)
                 NSLog(@"%s: %@", domain->name, msg);
@@ -303,6 +299,9 @@ void MYWarn(const char *where, int line, NSString *msg, ...) {
 #endif
 
     if (gMYWarnRaisesException) {
+#ifndef MY_DISABLE_LOGGING
+        MYLogWriterFlush(1.0);
+#endif
         va_list args;
         va_start(args,msg);
         [NSException raise: NSInternalInconsistencyException
@@ -0,0 +1,45 @@
+//
+//  MYParallelZip.h
+//  MYUtilities
+//
+//  Created by Giedrius Stanevičius on 2018-03-29.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+#import "MYZip.h"
+
+
+/** GZip compressor that splits its input into blocks and compresses them concurrently, the way
+    pigz does. Each block is compressed as a separate raw deflate stream, primed with the last 32KB
+    of the previous block and ended with a sync flush, so the blocks join into a single ordinary
+    gzip stream that any inflate implementation (including MYZip) can decompress.
+    Works as a MYCodec, so it can be used with MYZipReader and MYZipWriter. Output is delivered
+    in order, on the thread calling -addBytes:length:onOutput:. At most twice `threadCount` blocks
+    are held at once (being compressed or waiting for an earlier one); once that many are, adding
+    bytes blocks until the oldest one is compressed and delivered. */
+@interface MYParallelZip : NSObject <MYCodec>
+
+/** Initializes a compressor.
+    @param level  Compression level, 0-9, or MYZipDefaultLevel.
+    @param strategy  Compression strategy.
+    @param threadCount  Maximum number of blocks compressed at once; 0 to use one per active CPU core.
+    @return  The initialized instance. */
+- (instancetype) initWithLevel: (int)level
+                      strategy: (MYZipStrategy)strategy
+                   threadCount: (NSUInteger)threadCount;
+
+/** Size of input blocks compressed independently. Larger blocks compress slightly better, smaller
+    ones spread better across cores. Must be set before any bytes are added. Defaults to 128KB. */
+@property (nonatomic) size_t blockSize;
+
+@property (readonly) NSUInteger threadCount;
+
+/** Number of blocks submitted for compression but not delivered to output yet. */
+@property (readonly) NSUInteger pendingBlockCount;
+
+/** One-shot parallel compression of NSData. */
++ (NSData*) dataByCompressingData: (NSData*)src
+                            level: (int)level
+                      threadCount: (NSUInteger)threadCount;
+
+@end
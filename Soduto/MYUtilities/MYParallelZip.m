@@ -0,0 +1,371 @@
+//
+//  MYParallelZip.m
+//  MYUtilities
+//
+//  Created by Giedrius Stanevičius on 2018-03-29.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+#import "MYParallelZip.h"
+#import "Logging.h"
+#import "Test.h"
+#import <zlib.h>
+
+#define kDefaultBlockSize (128*1024)
+#define kDictionarySize (32*1024)      // deflate window size
+
+
+/** A block of input and its compressed form. */
+@interface MYZipBlock : NSObject
+{
+    @public
+    NSData* _input;
+    NSData* _dictionary;        // tail of the previous block's input
+    BOOL _isLast;
+    NSMutableData* _output;
+    uLong _crc;
+    int _status;
+    dispatch_semaphore_t _done;
+}
+@end
+
+@implementation MYZipBlock
+@end
+
+
+@implementation MYParallelZip
+{
+    int _level;
+    MYZipStrategy _strategy;
+    dispatch_queue_t _queue;
+    dispatch_semaphore_t _slots;        // limits number of blocks being compressed at once
+    NSMutableData* _input;              // input of the block being filled
+    NSData* _previousInput;
+    NSMutableArray* _pendingBlocks;     // submitted but not yet delivered, in order
+    NSUInteger _maxPendingBlocks;
+    BOOL _headerWritten;
+    BOOL _finished;
+    uLong _crc;
+    uLong _totalLength;
+}
+
+@synthesize status=_status, threadCount=_threadCount, blockSize=_blockSize;
+
+
+- (instancetype) initWithLevel: (int)level
+                      strategy: (MYZipStrategy)strategy
+                   threadCount: (NSUInteger)threadCount
+{
+    self = [super init];
+    if (self) {
+        _level = level;
+        _strategy = strategy;
+        _threadCount = threadCount > 0 ? threadCount : [NSProcessInfo processInfo].activeProcessorCount;
+        _blockSize = kDefaultBlockSize;
+        _queue = dispatch_get_global_queue(QOS_CLASS_UTILITY, 0);
+        _slots = dispatch_semaphore_create(_threadCount);
+        _maxPendingBlocks = 2 * _threadCount;
+        _pendingBlocks = [NSMutableArray array];
+        _crc = crc32(0L, Z_NULL, 0);
+        _status = MYZipStatusOK;
+    }
+    return self;
+}
+
+- (instancetype) init {
+    return [self initWithLevel: MYZipDefaultLevel strategy: MYZipStrategyDefault threadCount: 0];
+}
+
+- (NSUInteger) pendingBlockCount {
+    return _pendingBlocks.count;
+}
+
+- (void) dealloc {
+    // Blocks still being compressed hold their own references; just wait so slots aren't leaked
+    for (MYZipBlock* block in _pendingBlocks)
+        dispatch_semaphore_wait(block->_done, DISPATCH_TIME_FOREVER);
+}
+
+
+- (BOOL) addBytes: (const void*)bytes length: (size_t)length
+         onOutput: (void(^)(const void*,size_t))onOutput
+{
+    if (_finished) {
+        if (length == 0)
+            return YES;
+        if (_status >= 0)
+            _status = MYZipStatusReadPastEOF;
+        return NO;
+    }
+    if (_status < MYZipStatusOK)
+        return NO;
+
+    if (!_headerWritten) {
+        // Minimal gzip header: magic, deflate method, no flags, no mtime, no extra flags, unknown OS
+        static const uint8_t kHeader[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+        onOutput(kHeader, sizeof(kHeader));
+        _headerWritten = YES;
+    }
+
+    BOOL isFinal = (length == 0);
+    const uint8_t* src = bytes;
+    while (length > 0) {
+        if (!_input)
+            _input = [NSMutableData dataWithCapacity: _blockSize];
+        size_t n = MIN(length, _blockSize - _input.length);
+        [_input appendBytes: src length: n];
+        src += n;
+        length -= n;
+        if (_input.length == _blockSize)
+            [self submitBlock: NO onOutput: onOutput];
+    }
+
+    if (isFinal) {
+        // Zero-length call finishes the stream:
+        [self submitBlock: YES onOutput: onOutput];
+        [self deliverBlocks: YES onOutput: onOutput];
+        if (_status < MYZipStatusOK)
+            return NO;
+        uint8_t trailer[8];
+        OSWriteLittleInt32(trailer, 0, (uint32_t)_crc);
+        OSWriteLittleInt32(trailer, 4, (uint32_t)_totalLength);
+        onOutput(trailer, sizeof(trailer));
+        _finished = YES;
+        _status = MYZipStatusEOF;
+        return YES;
+    }
+
+    [self deliverBlocks: NO onOutput: onOutput];
+    return _status >= MYZipStatusOK;
+}
+
+
+- (void) submitBlock: (BOOL)isLast onOutput: (void(^)(const void*,size_t))onOutput {
+    MYZipBlock* block = [[MYZipBlock alloc] init];
+    block->_input = _input ?: [NSData data];
+    block->_isLast = isLast;
+    if (_previousInput.length > 0) {
+        size_t dictLength = MIN(_previousInput.length, (size_t)kDictionarySize);
+        block->_dictionary = [_previousInput subdataWithRange:
+                                NSMakeRange(_previousInput.length - dictLength, dictLength)];
+    }
+    block->_done = dispatch_semaphore_create(0);
+    _previousInput = block->_input;
+    _input = nil;
+
+    // Compressed blocks wait for earlier ones to be delivered, each holding its input and output.
+    // Their number is limited by waiting for the oldest one, so memory use stays bounded even
+    // when a single call adds lots of input:
+    while (_pendingBlocks.count >= _maxPendingBlocks) {
+        MYZipBlock* first = _pendingBlocks.firstObject;
+        dispatch_semaphore_wait(first->_done, DISPATCH_TIME_FOREVER);
+        dispatch_semaphore_signal(first->_done);
+        [self deliverBlocks: NO onOutput: onOutput];
+    }
+
+    // Wait for a free slot, delivering finished blocks meanwhile:
+    while (dispatch_semaphore_wait(_slots, DISPATCH_TIME_NOW) != 0) {
+        MYZipBlock* first = _pendingBlocks.firstObject;
+        if (!first) {
+            dispatch_semaphore_wait(_slots, DISPATCH_TIME_FOREVER);
+            break;
+        }
+        dispatch_semaphore_wait(first->_done, DISPATCH_TIME_FOREVER);
+        dispatch_semaphore_signal(first->_done);
+        [self deliverBlocks: NO onOutput: onOutput];
+    }
+
+    [_pendingBlocks addObject: block];
+    int level = _level;
+    MYZipStrategy strategy = _strategy;
+    dispatch_semaphore_t slots = _slots;
+    dispatch_async(_queue, ^{
+        compressBlock(block, level, strategy);
+        dispatch_semaphore_signal(block->_done);
+        dispatch_semaphore_signal(slots);
+    });
+}
+
+
+/** Passes compressed blocks to the output in order. If `wait` is NO, stops at the first block
+    that isn't compressed yet, otherwise waits for all. */
+- (void) deliverBlocks: (BOOL)wait onOutput: (void(^)(const void*,size_t))onOutput {
+    while (_pendingBlocks.count > 0) {
+        MYZipBlock* block = _pendingBlocks[0];
+        dispatch_time_t timeout = wait ? DISPATCH_TIME_FOREVER : DISPATCH_TIME_NOW;
+        if (dispatch_semaphore_wait(block->_done, timeout) != 0)
+            break;
+        // Semaphore is signaled again, so that waiting on the block again doesn't block
+        dispatch_semaphore_signal(block->_done);
+        [_pendingBlocks removeObjectAtIndex: 0];
+
+        if (block->_status != Z_OK) {
+            if (_status >= MYZipStatusOK)
+                _status = block->_status;
+            continue;
+        }
+        if (_status < MYZipStatusOK)
+            continue;
+        if (block->_output.length > 0)
+            onOutput(block->_output.bytes, block->_output.length);
+        _crc = crc32_combine(_crc, block->_crc, (z_off_t)block->_input.length);
+        _totalLength += block->_input.length;
+    }
+}
+
+
+/** Compresses a block into a raw deflate stream. Blocks other than the last one end with a sync
+    flush, which aligns output to a byte boundary without ending the deflate stream, so compressed
+    blocks can simply be concatenated. */
+static void compressBlock(MYZipBlock* block, int level, MYZipStrategy strategy) {
+    z_stream strm = {};
+    block->_crc = crc32(crc32(0L, Z_NULL, 0), block->_input.bytes, (uInt)block->_input.length);
+    int rval = deflateInit2(&strm, level, Z_DEFLATED,
+                            -15,        // Default window size, raw deflate without header
+                            8,          // Default mem level
+                            strategy);
+    if (rval != Z_OK) {
+        block->_status = rval;
+        return;
+    }
+    if (block->_dictionary) {
+        rval = deflateSetDictionary(&strm, block->_dictionary.bytes, (uInt)block->_dictionary.length);
+        if (rval != Z_OK) {
+            deflateEnd(&strm);
+            block->_status = rval;
+            return;
+        }
+    }
+
+    size_t capacity = deflateBound(&strm, block->_input.length) + 16;
+    block->_output = [NSMutableData dataWithLength: capacity];
+    strm.next_in = (Bytef*)block->_input.bytes;
+    strm.avail_in = (uInt)block->_input.length;
+    strm.next_out = block->_output.mutableBytes;
+    strm.avail_out = (uInt)capacity;
+    rval = deflate(&strm, block->_isLast ? Z_FINISH : Z_SYNC_FLUSH);
+    if (rval == Z_STREAM_END || (rval == Z_OK && !block->_isLast && strm.avail_in == 0))
+        rval = Z_OK;
+    else if (rval == Z_OK)
+        rval = Z_BUF_ERROR;     // deflateBound should make this impossible
+    block->_output.length = capacity - strm.avail_out;
+    block->_status = rval;
+    deflateEnd(&strm);
+}
+
+
++ (NSData*) dataByCompressingData: (NSData*)src
+                            level: (int)level
+                      threadCount: (NSUInteger)threadCount
+{
+    NSMutableData* output = [NSMutableData dataWithCapacity: src.length / 2];
+    MYParallelZip* zip = [[self alloc] initWithLevel: level
+                                            strategy: MYZipStrategyDefault
+                                         threadCount: threadCount];
+    void (^onOutput)(const void*, size_t) = ^(const void *bytes, size_t len) {
+        [output appendBytes: bytes length: len];
+    };
+    [zip addBytes: src.bytes length: src.length onOutput: onOutput];
+    [zip addBytes: NULL length: 0 onOutput: onOutput];
+    if (zip.status < MYZipStatusOK) {
+        Warn(@"GZip error %d compressing data in parallel", zip.status);
+        return nil;
+    }
+    return output;
+}
+
+
+@end
+
+
+
+#pragma mark - TESTS:
+
+
+static NSData* CompressibleTestData(size_t length) {
+    NSMutableData* data = [NSMutableData dataWithLength: length];
+    char* bytes = data.mutableBytes;
+    size_t pos = 0;
+    unsigned n = 0;
+    while (pos < length) {
+        int len = snprintf(bytes + pos, length - pos, "line %u: value=%u, square=%u\n",
+                           n, n % 977, (n % 977) * (n % 977));
+        if (len <= 0)
+            break;
+        pos += MIN((size_t)len, length - pos);
+        n++;
+    }
+    return data;
+}
+
+TestCase(MYParallelZip) {
+    NSData* data = CompressibleTestData(1000000);
+    for (NSUInteger threads = 1; threads <= 4; threads *= 2) {
+        NSData* zipped = [MYParallelZip dataByCompressingData: data level: 6 threadCount: threads];
+        CAssert(zipped.length > 0 && zipped.length < data.length / 2);
+        NSData* unzipped = [MYZip dataByDecompressingData: zipped];
+        CAssertEqual(unzipped, data);
+    }
+
+    // Empty input still makes a valid gzip stream:
+    NSData* zipped = [MYParallelZip dataByCompressingData: [NSData data] level: 6 threadCount: 2];
+    CAssertEqual([MYZip dataByDecompressingData: zipped], [NSData data]);
+
+    // Streaming through MYZipWriter in uneven pieces:
+    MYParallelZip* zip = [[MYParallelZip alloc] initWithLevel: 1
+                                                     strategy: MYZipStrategyRLE
+                                                  threadCount: 3];
+    zip.blockSize = 10000;
+    NSMutableData* streamed = [NSMutableData data];
+    for (size_t offset = 0; offset < data.length; offset += 7777) {
+        size_t n = MIN((size_t)7777, data.length - offset);
+        CAssert([zip addBytes: (const uint8_t*)data.bytes + offset length: n
+                     onOutput: ^(const void *bytes, size_t len) {
+            [streamed appendBytes: bytes length: len];
+        }]);
+    }
+    CAssert([zip addBytes: NULL length: 0 onOutput: ^(const void *bytes, size_t len) {
+        [streamed appendBytes: bytes length: len];
+    }]);
+    CAssertEqual([MYZip dataByDecompressingData: streamed], data);
+}
+
+TestCase(MYParallelZipPendingBlocks) {
+    RequireTestCase(MYParallelZip);
+    NSData* data = CompressibleTestData(1000000);
+    MYParallelZip* zip = [[MYParallelZip alloc] initWithLevel: 9
+                                                     strategy: MYZipStrategyDefault
+                                                  threadCount: 2];
+    zip.blockSize = 10000;
+    __block NSUInteger maxPending = 0;
+    NSMutableData* zipped = [NSMutableData data];
+    void (^onOutput)(const void*, size_t) = ^(const void *bytes, size_t len) {
+        maxPending = MAX(maxPending, zip.pendingBlockCount);
+        [zipped appendBytes: bytes length: len];
+    };
+    // One call adding 100 blocks must not keep them all:
+    CAssert([zip addBytes: data.bytes length: data.length onOutput: onOutput]);
+    CAssert(zipped.length > 10);
+    CAssert([zip addBytes: NULL length: 0 onOutput: onOutput]);
+    CAssert(maxPending <= 4);
+    CAssertEqual([MYZip dataByDecompressingData: zipped], data);
+}
+
+TestCase(MYParallelZipBenchmark) {
+    RequireTestCase(MYParallelZip);
+    NSData* data = CompressibleTestData(32 * 1024 * 1024);
+
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    NSData* serial = [MYZip dataByCompressingData: data];
+    CFAbsoluteTime serialTime = CFAbsoluteTimeGetCurrent() - start;
+    Log(@"MYZip: %.3f s, %lu -> %lu bytes", serialTime, (unsigned long)data.length, (unsigned long)serial.length);
+
+    NSUInteger maxThreads = [NSProcessInfo processInfo].activeProcessorCount;
+    for (NSUInteger threads = 1; threads <= maxThreads; threads *= 2) {
+        start = CFAbsoluteTimeGetCurrent();
+        NSData* zipped = [MYParallelZip dataByCompressingData: data level: MYZipDefaultLevel threadCount: threads];
+        CFAbsoluteTime time = CFAbsoluteTimeGetCurrent() - start;
+        Log(@"MYParallelZip, %lu threads: %.3f s (%.2fx), %lu bytes",
+            (unsigned long)threads, time, serialTime / time, (unsigned long)zipped.length);
+    }
+}
@@ -42,6 +42,21 @@ typedef enum : int {
 } MYZipStatus;
 
 
+/** Compression levels range from 1 (fastest) to 9 (smallest); 0 stores data uncompressed. */
+enum {
+    MYZipDefaultLevel = -1
+};
+
+/** Compression strategies; same values as zlib's Z_DEFAULT_STRATEGY etc. */
+typedef enum : int {
+    MYZipStrategyDefault = 0,
+    MYZipStrategyFiltered = 1,
+    MYZipStrategyHuffmanOnly = 2,
+    MYZipStrategyRLE = 3,
+    MYZipStrategyFixed = 4
+} MYZipStrategy;
+
+
 
 /** Incremental, stream-like GZip compressor/decompressor. */
 @interface MYZip : NSObject <MYCodec>
@@ -51,6 +66,10 @@ typedef enum : int {
     @return  The initialized instance. */
 - (instancetype)initForCompressing: (BOOL)compressing;
 
+/** Initializes a compressor with given compression level and strategy. */
+- (instancetype)initForCompressingWithLevel: (int)level
+                                   strategy: (MYZipStrategy)strategy;
+
 /** One-shot compression of NSData. */
 + (NSData*) dataByCompressingData: (NSData*)src;
 
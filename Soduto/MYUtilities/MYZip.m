@@ -25,6 +25,19 @@
 
 
 - (instancetype) initForCompressing: (BOOL)compressing {
+    return [self initForCompressing: compressing
+                              level: MYZipDefaultLevel
+                           strategy: MYZipStrategyDefault];
+}
+
+- (instancetype) initForCompressingWithLevel: (int)level strategy: (MYZipStrategy)strategy {
+    return [self initForCompressing: YES level: level strategy: strategy];
+}
+
+- (instancetype) initForCompressing: (BOOL)compressing
+                              level: (int)level
+                           strategy: (MYZipStrategy)strategy
+{
     self = [super init];
     if (self) {
         _strm.next_out  = _buffer;
@@ -34,11 +47,11 @@
         int rval;
         if (compressing)
             rval = deflateInit2(&_strm,
-                                Z_DEFAULT_COMPRESSION,
+                                level,
                                 Z_DEFLATED, // Only legal value
                                 15 + 16,    // Default window size, plus write gzip header
                                 8,          // Default mem level
-                                Z_DEFAULT_STRATEGY);
+                                strategy);
         else
             rval = inflateInit2(&_strm,
                                 15 + 32);   // Default window size, plus accept gzip headers
@@ -8,6 +8,7 @@
 
 import Foundation
 import Cocoa
+import CleanroomLogger
 
 /// Service providing clipboard content sharing between devices
 ///
@@ -20,56 +21,69 @@ import Cocoa
 ///
 /// This plugin is symmetric to its counterpart in the other device: both have the
 /// same behaviour.
+///
+/// Large clipboard contents are sent to Soduto peers as a payload instead of the "content"
+/// field, so they do not block the main connection (see `DataPacket.preparedForSending(to:)`).
+/// Peers that can not receive payload bodies are not sent contents above `maxInlineContentSize`.
 public class ClipboardService: Service {
     
     // MARK: Properties
     
-    private static let monitoringInterval: TimeInterval = 0.5
+    /// Content size in bytes above which content is not sent inline to peers not supporting payload bodies
+    public static let maxInlineContentSize = 1024 * 1024
+    
+    private let engine: ClipboardSyncEngine
+    private var devices: [Device.Id: Device] = [:]
+    private var activationObserver: NSObjectProtocol? = nil
     
-    private var monitoringTimer: Timer? = nil
-    private var lastChangeCount: Int = NSPasteboard.general.changeCount
-    private var lastExternalChangeCount: Int = -1
-    private var lastExternalChangeDevice: Device? = nil
-    private var devices: [Device] = []
+    
+    // MARK: Init / Deinit
+    
+    public init(source: ClipboardSource = SystemClipboardSource()) {
+        self.engine = ClipboardSyncEngine(source: source)
+        self.engine.sendContent = { [weak self] content, deviceIds in
+            self?.send(content, to: deviceIds)
+        }
+        
+        // Copying usually happens in another application - check clipboard as soon as user leaves it
+        self.activationObserver = NSWorkspace.shared.notificationCenter.addObserver(forName: NSWorkspace.didActivateApplicationNotification, object: nil, queue: OperationQueue.main) { [weak self] _ in
+            self?.engine.userActivityDetected()
+        }
+    }
+    
+    deinit {
+        if let observer = self.activationObserver {
+            NSWorkspace.shared.notificationCenter.removeObserver(observer)
+        }
+    }
     
     
     // MARK: Service
     
     public static let serviceId: Service.Id = "com.soduto.services.clipboard"
     
-    public let incomingCapabilities = Set<Service.Capability>([ DataPacket.clipboardPacketType ])
-    public let outgoingCapabilities = Set<Service.Capability>([ DataPacket.clipboardPacketType ])
+    public static let incomingCapabilities = Set<Service.Capability>([ DataPacket.clipboardPacketType ])
+    public static let outgoingCapabilities = Set<Service.Capability>([ DataPacket.clipboardPacketType ])
     
     public func handleDataPacket(_ dataPacket: DataPacket, fromDevice device: Device, onConnection connection: Connection) -> Bool {
         
         guard dataPacket.isClipboardPacket else { return false }
+        
         guard let contents = try? dataPacket.getContent() else { return true }
         
-        self.lastExternalChangeDevice = device
-        self.lastExternalChangeCount = NSPasteboard.general.clearContents()
-        NSPasteboard.general.writeObjects([ contents as NSString ])
+        self.engine.receive(contents, from: device.id)
         
         return true
     }
     
     public func setup(for device: Device) {
-        guard !self.devices.contains(where: { $0.id == device.id }) else { return }
-        
-        self.devices.append(device)
-        
-        if self.monitoringTimer == nil {
-            self.startMonitoring()
-        }
+        self.devices[device.id] = device
+        self.engine.addPeer(device.id)
     }
     
     public func cleanup(for device: Device) {
-        guard let index = self.devices.index(where: { $0.id == device.id }) else { return }
-        
-        self.devices.remove(at: index)
-        
-        if self.devices.count == 0 {
-            self.stopMonitoring()
-        }
+        self.devices.removeValue(forKey: device.id)
+        self.engine.removePeer(device.id)
     }
     
     public func actions(for device: Device) -> [ServiceAction] {
@@ -84,32 +98,19 @@ public class ClipboardService: Service {
     
     // MARK: Private methods
     
-    private func startMonitoring() {
-        let interval = ClipboardService.monitoringInterval
-        self.monitoringTimer = Timer.compatScheduledTimer(withTimeInterval: interval, repeats: true) { [weak self] _ in
-            self?.checkPasteboard()
+    private func send(_ content: String, to deviceIds: [Device.Id]) {
+        // Serialize once for all devices. Devices receiving content as a payload get their own copy.
+        var packet = DataPacket.clipboardPacket(withContent: content)
+        try? packet.cacheSerialization()
+        let isLarge = content.utf8.count > ClipboardService.maxInlineContentSize
+        for device in deviceIds.flatMap({ self.devices[$0] }) {
+            guard !isLarge || device.incomingCapabilities.contains(DataPacket.payloadBodyCapability) else {
+                Log.info?.message("Clipboard content of \(content.utf8.count) bytes is too large to be sent inline to \(device)")
+                continue
+            }
+            device.send(packet)
         }
     }
-    
-    private func stopMonitoring() {
-        self.monitoringTimer?.invalidate()
-        self.monitoringTimer = nil
-    }
-    
-    private func checkPasteboard() {
-        guard NSPasteboard.general.changeCount != self.lastChangeCount else { return }
-        guard let items = NSPasteboard.general.readObjects(forClasses: [ NSString.self ], options: nil) else { return }
-        guard items.count > 0 else { return }
-        guard let content = items[0] as? String else { return }
-        
-        self.lastChangeCount = NSPasteboard.general.changeCount
-        
-        for device in self.devices {
-            guard !(self.lastChangeCount == self.lastExternalChangeCount && self.lastExternalChangeDevice === device) else { continue }
-            device.send(DataPacket.clipboardPacket(withContent: content))
-        }
-        
-    }
 }
 
 
@@ -140,9 +141,11 @@ fileprivate extension DataPacket {
     // MARK: Public static methods
     
     static func clipboardPacket(withContent content: String) -> DataPacket {
-        return DataPacket(type: clipboardPacketType, body: [
+        var packet = DataPacket(type: clipboardPacketType, body: [
             ClipboardProperty.content.rawValue: content as AnyObject
         ])
+        packet.offloadableProperty = ClipboardProperty.content.rawValue
+        return packet
     }
     
     
@@ -0,0 +1,226 @@
+//
+//  ClipboardSyncEngine.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-21.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import Cocoa
+
+/// Source of clipboard content. Abstracted so that clipboard synchronization could be driven
+/// without the system pasteboard (e.g. in tests).
+public protocol ClipboardSource: class {
+    /// Counter that changes whenever clipboard content changes
+    var changeCount: Int { get }
+    /// Current text content of the clipboard, nil if there is none
+    func readText() -> String?
+    /// Replace clipboard content with given text. Returns change count after the write.
+    func writeText(_ text: String) -> Int
+}
+
+
+/// Clipboard source backed by system pasteboard
+public class SystemClipboardSource: ClipboardSource {
+
+    private let pasteboard: NSPasteboard
+
+    public init(pasteboard: NSPasteboard = NSPasteboard.general) {
+        self.pasteboard = pasteboard
+    }
+
+    public var changeCount: Int {
+        return self.pasteboard.changeCount
+    }
+
+    public func readText() -> String? {
+        guard let items = self.pasteboard.readObjects(forClasses: [ NSString.self ], options: nil) else { return nil }
+        return items.first as? String
+    }
+
+    public func writeText(_ text: String) -> Int {
+        let changeCount = self.pasteboard.clearContents()
+        self.pasteboard.writeObjects([ text as NSString ])
+        return max(changeCount, self.pasteboard.changeCount)
+    }
+}
+
+
+/// Clipboard synchronization engine. It watches clipboard source for changes and decides what content
+/// should be sent to which peers:
+///
+/// - Content is identified by its hash. Peers that are known to have the content already (because they
+///   sent it or were sent it before) are not sent it again, so content does not echo back and forth
+///   between devices and repeated copies of the same text are not resent.
+/// - Rapid successive copies are debounced - only the last one is sent.
+/// - Clipboard is polled frequently only shortly after activity. While nothing changes, polling backs off.
+///   Owner may report user activity (e.g. application switches) to check clipboard promptly.
+///
+/// Not thread safe - expected to be used on the main queue.
+public class ClipboardSyncEngine {
+
+    // MARK: Types
+
+    public typealias ContentHash = Data
+
+
+    // MARK: Properties
+
+    public static let minPollingInterval: TimeInterval = 0.25
+    public static let maxPollingInterval: TimeInterval = 2.0
+    public static let debounceInterval: TimeInterval = 0.3
+
+    /// Called to send content to given peers. Called once per content change, however many peers there are.
+    public var sendContent: ((_ content: String, _ peers: [Device.Id]) -> Void)? = nil
+
+    /// Local changes sent to at least one peer
+    public private(set) var sentChangesCount: Int = 0
+    /// Content deliveries (local or received) skipped because content was already known to the peer
+    public private(set) var suppressedCount: Int = 0
+    public private(set) var peers: Set<Device.Id> = []
+
+    private let source: ClipboardSource
+    private var peerHashes: [Device.Id: ContentHash] = [:]
+    private var currentHash: ContentHash? = nil
+    private var lastChangeCount: Int
+    private var lastWrittenChangeCount: Int? = nil
+    private var pollingInterval: TimeInterval = ClipboardSyncEngine.minPollingInterval
+    private var pollingTimer: Timer? = nil
+    private var debounceTimer: Timer? = nil
+
+
+    // MARK: Init / Deinit
+
+    public init(source: ClipboardSource) {
+        self.source = source
+        self.lastChangeCount = source.changeCount
+    }
+
+    deinit {
+        self.pollingTimer?.invalidate()
+        self.debounceTimer?.invalidate()
+    }
+
+
+    // MARK: Public methods
+
+    public func addPeer(_ peer: Device.Id) {
+        guard !self.peers.contains(peer) else { return }
+
+        self.peers.insert(peer)
+        if self.peers.count == 1 {
+            self.lastChangeCount = self.source.changeCount
+            self.currentHash = self.source.readText().map { ClipboardSyncEngine.hash(of: $0) }
+            self.schedulePolling(interval: ClipboardSyncEngine.minPollingInterval)
+        }
+    }
+
+    public func removePeer(_ peer: Device.Id) {
+        guard self.peers.remove(peer) != nil else { return }
+
+        // Peer could have changed clipboard while disconnected - do not trust what it had before
+        self.peerHashes.removeValue(forKey: peer)
+        if self.peers.isEmpty {
+            self.pollingTimer?.invalidate()
+            self.pollingTimer = nil
+            self.debounceTimer?.invalidate()
+            self.debounceTimer = nil
+        }
+    }
+
+    /// Content received from a peer. It is written into the clipboard and relayed to other peers
+    /// that do not have it yet.
+    public func receive(_ content: String, from peer: Device.Id) {
+        let hash = ClipboardSyncEngine.hash(of: content)
+        self.peerHashes[peer] = hash
+
+        guard hash != self.currentHash else {
+            self.suppressedCount += 1
+            return
+        }
+
+        self.currentHash = hash
+        self.lastWrittenChangeCount = self.source.writeText(content)
+        self.lastChangeCount = self.lastWrittenChangeCount!
+        self.distribute(content, hash: hash)
+    }
+
+    /// Check clipboard for changes right away and resume frequent polling
+    public func userActivityDetected() {
+        guard !self.peers.isEmpty else { return }
+
+        self.checkForChanges()
+        self.schedulePolling(interval: ClipboardSyncEngine.minPollingInterval)
+    }
+
+    /// Check clipboard source for changes. Called periodically while there are peers.
+    public func checkForChanges() {
+        let changeCount = self.source.changeCount
+        guard changeCount != self.lastChangeCount else { return }
+
+        self.lastChangeCount = changeCount
+        guard changeCount != self.lastWrittenChangeCount else { return }
+
+        self.debounceTimer?.invalidate()
+        self.debounceTimer = Timer.compatScheduledTimer(withTimeInterval: ClipboardSyncEngine.debounceInterval, repeats: false) { [weak self] _ in
+            self?.debounceTimer = nil
+            self?.flushLocalChange()
+        }
+    }
+
+    /// Hash identifying clipboard content
+    public static func hash(of content: String) -> ContentHash {
+        return (content.data(using: .utf8) ?? Data()).sha256Digest
+    }
+
+
+    // MARK: Private methods
+
+    private func flushLocalChange() {
+        guard let content = self.source.readText() else { return }
+
+        let hash = ClipboardSyncEngine.hash(of: content)
+        self.currentHash = hash
+        if self.distribute(content, hash: hash) {
+            self.sentChangesCount += 1
+        }
+    }
+
+    /// Send content to peers that do not have it yet. Returns true if it was sent to anyone.
+    @discardableResult
+    private func distribute(_ content: String, hash: ContentHash) -> Bool {
+        let targets = self.peers.filter { self.peerHashes[$0] != hash }
+        self.suppressedCount += self.peers.count - targets.count
+        guard !targets.isEmpty else { return false }
+
+        for peer in targets {
+            self.peerHashes[peer] = hash
+        }
+        self.sendContent?(content, Array(targets))
+        return true
+    }
+
+    private func poll() {
+        let changeCount = self.lastChangeCount
+        self.checkForChanges()
+
+        // Back off while nothing happens
+        let interval = self.lastChangeCount != changeCount ?
+            ClipboardSyncEngine.minPollingInterval :
+            min(self.pollingInterval * 2.0, ClipboardSyncEngine.maxPollingInterval)
+        self.schedulePolling(interval: interval)
+    }
+
+    private func schedulePolling(interval: TimeInterval) {
+        guard interval != self.pollingInterval || self.pollingTimer == nil else { return }
+
+        self.pollingTimer?.invalidate()
+        self.pollingInterval = interval
+        let timer = Timer.compatScheduledTimer(withTimeInterval: interval, repeats: true) { [weak self] _ in
+            self?.poll()
+        }
+        timer.tolerance = interval / 5.0
+        self.pollingTimer = timer
+    }
+}
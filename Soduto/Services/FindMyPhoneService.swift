@@ -32,8 +32,8 @@ public class FindMyPhoneService: Service {
     
     public static let serviceId: Service.Id = "com.soduto.services.findmyphone"
     
-    public let incomingCapabilities = Set<Service.Capability>()
-    public let outgoingCapabilities = Set<Service.Capability>([ DataPacket.findMyPhoneRequestPacketType ])
+    public static let incomingCapabilities = Set<Service.Capability>()
+    public static let outgoingCapabilities = Set<Service.Capability>([ DataPacket.findMyPhoneRequestPacketType ])
     
     
     // MARK: Service methods
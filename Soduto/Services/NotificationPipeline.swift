@@ -0,0 +1,193 @@
+//
+//  NotificationPipeline.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-23.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import QuartzCore
+import CleanroomLogger
+
+/// Delivery pipeline for user notifications mirrored from other devices.
+///
+/// Devices tend to replay many notifications at once (e.g. on reconnect). Notifications are therefore
+/// collected into bursts per group (device and application) for a short time window. When a burst is
+/// flushed, all of its notifications are delivered, but only the last one is presented (with sound),
+/// and only if no other notification was presented very recently. Others go silently to notification center.
+///
+/// Delivered and pending notifications are indexed by identifier, so cancels and replacements do not
+/// need to scan notification center lists. Only notifications unknown to the index (e.g. left over from
+/// a previous application session) are looked up in notification center.
+///
+/// Not thread safe - expected to be used on the main queue.
+public class NotificationPipeline: CustomStringConvertible {
+
+    // MARK: Types
+
+    public typealias Id = String
+    public typealias GroupId = String
+
+    private class Burst {
+        var notifications: [Id: NSUserNotification] = [:]
+        var order: [Id] = []
+        let startTime: TimeInterval = CACurrentMediaTime()
+        var timer: Timer? = nil
+    }
+
+
+    // MARK: Properties
+
+    /// Time to wait for more notifications of the same group before flushing a burst
+    public static let burstWindow: TimeInterval = 1.0
+    /// Longest time a burst may be held back
+    public static let maxBurstDelay: TimeInterval = 3.0
+    /// Shortest interval between presented notifications
+    public static let minPresentationInterval: TimeInterval = 2.0
+
+    /// Number of flushed bursts by their size
+    public private(set) var burstSizes: [Int: Int] = [:]
+    public private(set) var presentedCount: Int = 0
+    public private(set) var silencedCount: Int = 0
+
+    public var description: String {
+        let sizes = self.burstSizes.keys.sorted().map { "\($0)x\(self.burstSizes[$0]!)" }.joined(separator: ",")
+        return "<NotificationPipeline:delivered=\(self.delivered.count):pending=\(self.pendingGroups.count):presented=\(self.presentedCount):silenced=\(self.silencedCount):bursts=[\(sizes)]>"
+    }
+
+    private var bursts: [GroupId: Burst] = [:]
+    private var pendingGroups: [Id: GroupId] = [:]
+    private var delivered: [Id: NSUserNotification] = [:]
+    private var lastPresentationTime: TimeInterval = 0.0
+    private let center: NSUserNotificationCenter
+
+
+    // MARK: Init / Deinit
+
+    public init(center: NSUserNotificationCenter = NSUserNotificationCenter.default) {
+        self.center = center
+    }
+
+    deinit {
+        for burst in self.bursts.values {
+            burst.timer?.invalidate()
+        }
+    }
+
+
+    // MARK: Public methods
+
+    /// Queue notification for delivery. Notification must have an identifier. If notification with the same
+    /// identifier is pending or delivered already, it gets replaced.
+    public func post(_ notification: NSUserNotification, group: GroupId) {
+        guard let id = notification.identifier else {
+            assert(false, "Notification posted to pipeline is expected to have an identifier")
+            return
+        }
+
+        if let previousGroup = self.pendingGroups[id], previousGroup != group {
+            self.bursts[previousGroup]?.notifications.removeValue(forKey: id)
+        }
+
+        let burst = self.bursts[group] ?? Burst()
+        self.bursts[group] = burst
+        if burst.notifications.updateValue(notification, forKey: id) == nil {
+            burst.order.append(id)
+        }
+        self.pendingGroups[id] = group
+
+        let now = CACurrentMediaTime()
+        let flushTime = min(now + NotificationPipeline.burstWindow, burst.startTime + NotificationPipeline.maxBurstDelay)
+        burst.timer?.invalidate()
+        burst.timer = Timer.compatScheduledTimer(withTimeInterval: max(flushTime - now, 0.0), repeats: false) { [weak self] _ in
+            self?.flush(group: group)
+        }
+    }
+
+    /// Remove pending or delivered notification
+    public func remove(_ id: Id) {
+        let pendingGroup = self.pendingGroups.removeValue(forKey: id)
+        if let group = pendingGroup {
+            self.bursts[group]?.notifications.removeValue(forKey: id)
+        }
+        if let notification = self.delivered.removeValue(forKey: id) {
+            self.center.removeDeliveredNotification(notification)
+            self.center.removeScheduledNotification(notification)
+        }
+        else if pendingGroup == nil {
+            // Pending notification was never delivered - no need to look for it in the notification center
+            self.removeFromCenter(id)
+        }
+    }
+
+    /// Return pending or delivered notification with given identifier
+    public func notification(withId id: Id) -> NSUserNotification? {
+        if let group = self.pendingGroups[id], let notification = self.bursts[group]?.notifications[id] {
+            return notification
+        }
+        return self.delivered[id]
+    }
+
+    /// Forget delivered notification that was removed by other means (e.g. user activated it)
+    public func forget(_ id: Id) {
+        self.delivered.removeValue(forKey: id)
+    }
+
+
+    // MARK: Private methods
+
+    /// Remove notification delivered without going through the index
+    private func removeFromCenter(_ id: Id) {
+        if let notification = self.center.deliveredNotifications.first(where: { $0.identifier == id }) {
+            self.center.removeDeliveredNotification(notification)
+        }
+        if let notification = self.center.scheduledNotifications.first(where: { $0.identifier == id }) {
+            self.center.removeScheduledNotification(notification)
+        }
+    }
+
+    private func flush(group: GroupId) {
+        guard let burst = self.bursts.removeValue(forKey: group) else { return }
+        burst.timer?.invalidate()
+
+        // Removed notifications remain in the order list - skip them
+        let notifications: [NSUserNotification] = burst.order.flatMap { burst.notifications[$0] }
+        guard !notifications.isEmpty else { return }
+
+        self.burstSizes[notifications.count, default: 0] += 1
+        if notifications.count > 1 {
+            Log.debug?.message("Flushing burst of \(notifications.count) notifications for group '\(group)'")
+        }
+
+        let now = CACurrentMediaTime()
+        let canPresent = now - self.lastPresentationTime >= NotificationPipeline.minPresentationInterval
+        for (index, notification) in notifications.enumerated() {
+            let isLast = index == notifications.count - 1
+            let wantsPresentation = !((notification.userInfo?[UserNotificationManager.Property.dontPresent.rawValue] as? NSNumber)?.boolValue ?? false)
+
+            if isLast && canPresent && wantsPresentation {
+                if notifications.count > 1 && notification.subtitle == nil {
+                    notification.subtitle = String(format: NSLocalizedString("and %d more", comment: "notification subtitle of a burst"), notifications.count - 1)
+                }
+                self.lastPresentationTime = now
+                self.presentedCount += 1
+            }
+            else if wantsPresentation {
+                var userInfo = notification.userInfo ?? [:]
+                userInfo[UserNotificationManager.Property.dontPresent.rawValue] = NSNumber(value: true)
+                notification.userInfo = userInfo
+                notification.soundName = nil
+                self.silencedCount += 1
+            }
+
+            let id = notification.identifier!
+            self.pendingGroups.removeValue(forKey: id)
+            if let previous = self.delivered[id] {
+                self.center.removeDeliveredNotification(previous)
+            }
+            self.delivered[id] = notification
+            self.center.scheduleNotification(notification)
+        }
+    }
+}
@@ -31,7 +31,8 @@ import CleanroomLogger
 /// "requestAnswer" (boolean): True if this is an answer to a "request" package.
 ///
 /// Additionally the package can contain a payload with the icon of the notification
-/// in PNG format.
+/// in PNG format. Its MD5 hash is sent in "payloadHash" field, so icons already in
+/// the image cache are not downloaded again.
 ///
 /// The content of these fields is used to display the notifications to the user.
 /// Note that if we receive a second notification with the same "id", we should
@@ -42,7 +43,10 @@ import CleanroomLogger
 /// "id" set to the id of the notification we want to dismiss and a boolean "cancel"
 /// set to true. The other device will answer with a notification package with
 /// "isCancel" set to true when it is dismissed.
-public class NotificationsService: Service, UserNotificationActionHandler {
+///
+/// Notifications are delivered through `NotificationPipeline`, which coalesces bursts of
+/// notifications (e.g. replayed on reconnect) and limits how often they are presented.
+public class NotificationsService: Service, UserNotificationActionHandler, DownloadTaskDelegate {
     
     // MARK: Types
     
@@ -54,17 +58,37 @@ public class NotificationsService: Service, UserNotificationActionHandler {
         case isCancelable = "com.soduto.services.notifications.isCancelable"
     }
     
+    /// Notification waiting for its icon before delivery
+    private struct PendingDelivery {
+        let deviceId: Device.Id
+        let sequence: Int
+    }
+    
+    private struct IconDownloadInfo {
+        let task: DownloadTask
+        let stream: OutputStream
+        let key: ImageCache.Key?
+        let completion: (NSImage?) -> Void
+    }
+    
     
     // MARK: Service properties
     
     public static let serviceId: Service.Id = "com.soduto.services.notifications"
     
-    public let incomingCapabilities = Set<Service.Capability>([ DataPacket.notificationPacketType ])
-    public let outgoingCapabilities = Set<Service.Capability>([ DataPacket.notificationPacketType ])
+    public static let incomingCapabilities = Set<Service.Capability>([ DataPacket.notificationPacketType ])
+    public static let outgoingCapabilities = Set<Service.Capability>([ DataPacket.notificationPacketType ])
     
     /// Delivered notification ids grouped by device
     private var notificationIds: [Device.Id: Set<NotificationId>] = [:]
     
+    private var iconDownloads: [IconDownloadInfo] = []
+    /// Notifications with icons being loaded. Cancelled or replaced ones are removed or replaced here,
+    /// so that a stale notification is not delivered once its icon arrives.
+    private var pendingDeliveries: [NotificationId: PendingDelivery] = [:]
+    private var deliverySequence: Int = 0
+    private let pipeline = NotificationPipeline()
+    
     
     // MARK: Service methods
     
@@ -95,6 +119,9 @@ public class NotificationsService: Service, UserNotificationActionHandler {
     
     public func cleanup(for device: Device) {
         // Hide notifications for the device
+        for (id, delivery) in self.pendingDeliveries where delivery.deviceId == device.id {
+            self.pendingDeliveries.removeValue(forKey: id)
+        }
         guard let ids = self.notificationIds[device.id] else { return }
         for id in ids {
             self.hideNotification(for: id, from: device)
@@ -125,15 +152,66 @@ public class NotificationsService: Service, UserNotificationActionHandler {
             device.send(DataPacket.notificationCancelPacket(forId: notificationId))
         }
         
+        guard let identifier = notification.identifier else { return }
         for service in context.serviceManager.services {
             guard let notificationsService = service as? NotificationsService else { continue }
-            notificationsService.removeNotificationId(notificationId, from: device)
+            notificationsService.removeNotificationId(identifier, from: device)
+        }
+    }
+    
+    
+    // MARK: DownloadTaskDelegate
+    
+    public func downloadTask(_ task: DownloadTask, finishedWithSuccess success: Bool) {
+        guard let index = self.iconDownloads.index(where: { $0.task === task }) else { return }
+        let info = self.iconDownloads.remove(at: index)
+        
+        let data = info.stream.property(forKey: .dataWrittenToMemoryStreamKey) as? Data
+        info.stream.close()
+        
+        guard success, let iconData = data else {
+            info.completion(nil)
+            return
         }
+        // Payload hash comes from the peer - data not matching it must not be cached under it, otherwise
+        // a peer could replace icons of other notifications
+        var key = ImageCache.key(for: iconData)
+        if let payloadHash = info.key {
+            if iconData.md5Digest.hexString == payloadHash.lowercased() {
+                key = payloadHash
+            }
+            else {
+                Log.error?.message("Notification icon does not match its payload hash \(payloadHash)")
+            }
+        }
+        info.completion(ImageCache.shared.store(iconData, forKey: key))
+        Log.debug?.message("Notification icon downloaded: \(ImageCache.shared)")
     }
     
     
     // MARK: Private methods
     
+    /// Retrieve notification icon from the image cache or download it if it is not cached yet
+    private func loadIcon(for dataPacket: DataPacket, completion: @escaping (NSImage?) -> Void) {
+        guard let downloadTask = dataPacket.downloadTask else {
+            completion(nil)
+            return
+        }
+        
+        let key = (try? dataPacket.getPayloadHash()) ?? nil
+        if let key = key, let image = ImageCache.shared.image(forKey: key) {
+            downloadTask.cancel()
+            completion(image)
+            return
+        }
+        
+        let stream = OutputStream(toMemory: ())
+        stream.open()
+        self.iconDownloads.append(IconDownloadInfo(task: downloadTask, stream: stream, key: key, completion: completion))
+        downloadTask.delegate = self
+        downloadTask.start(withStream: stream)
+    }
+    
     private func notificationId(for dataPacket: DataPacket, from device: Device) -> NotificationId? {
         assert(dataPacket.isNotificationPacket, "Expected notification data packet")
         
@@ -171,9 +249,19 @@ public class NotificationsService: Service, UserNotificationActionHandler {
             }
             notification.hasActionButton = false
             notification.identifier = notificationId
-            NSUserNotificationCenter.default.scheduleNotification(notification)
             
-            self.addNotificationId(notificationId, from: device)
+            self.deliverySequence += 1
+            let delivery = PendingDelivery(deviceId: device.id, sequence: self.deliverySequence)
+            self.pendingDeliveries[notificationId] = delivery
+            
+            self.loadIcon(for: dataPacket) { icon in
+                guard self.pendingDeliveries[notificationId]?.sequence == delivery.sequence else { return }
+                self.pendingDeliveries.removeValue(forKey: notificationId)
+                
+                notification.contentImage = icon
+                self.pipeline.post(notification, group: "\(device.id).\(appName)")
+                self.addNotificationId(notificationId, from: device)
+            }
         }
         catch {
             Log.error?.message("Error while showing notification: \(error)")
@@ -188,20 +276,8 @@ public class NotificationsService: Service, UserNotificationActionHandler {
     }
     
     private func hideNotification(for id: NotificationId, from device: Device) {
-        for notification in NSUserNotificationCenter.default.deliveredNotifications {
-            if notification.identifier == id {
-                NSUserNotificationCenter.default.removeDeliveredNotification(notification)
-                break
-            }
-        }
-        
-        for notification in NSUserNotificationCenter.default.scheduledNotifications {
-            if notification.identifier == id {
-                NSUserNotificationCenter.default.removeScheduledNotification(notification)
-                break
-            }
-        }
-        
+        self.pendingDeliveries.removeValue(forKey: id)
+        self.pipeline.remove(id)
         self.removeNotificationId(id, from: device)
     }
     
@@ -213,6 +289,7 @@ public class NotificationsService: Service, UserNotificationActionHandler {
     }
     
     private func removeNotificationId(_ id: NotificationId, from device: Device) {
+        self.pipeline.forget(id)
         guard self.notificationIds[device.id] != nil else { return }
         _ = self.notificationIds[device.id]?.remove(id)
     }
@@ -238,6 +315,7 @@ fileprivate extension DataPacket {
         case invalidCancelFlag
         case invalidAnswerFlag
         case invalidSilentFlag
+        case invalidPayloadHash
     }
     
     enum NotificationProperty: String {
@@ -253,6 +331,7 @@ fileprivate extension DataPacket {
         case isCancel = "isCancel"           // (boolean): True if the notification was dismissed in the peer device.
         case requestAnswer = "requestAnswer" // (boolean): True if this is an answer to a "request" package.
         case silent = "silent"               // (boolean): True if this notification should be silent.
+        case payloadHash = "payloadHash"     // (string): MD5 hash of icon payload
     }
     
     
@@ -343,6 +422,13 @@ fileprivate extension DataPacket {
         return value.boolValue
     }
     
+    func getPayloadHash() throws -> String? {
+        try self.validateNotificationType()
+        guard body.keys.contains(NotificationProperty.payloadHash.rawValue) else { return nil }
+        guard let value = body[NotificationProperty.payloadHash.rawValue] as? String else { throw NotificationError.invalidPayloadHash }
+        return value
+    }
+    
     func validateNotificationType() throws {
         guard self.isNotificationPacket else { throw NotificationError.wrongType }
     }
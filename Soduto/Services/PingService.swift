@@ -7,6 +7,8 @@
 //
 
 import Foundation
+import QuartzCore
+import CleanroomLogger
 
 /// Ping service data packet utilities
 fileprivate extension DataPacket {
@@ -42,12 +44,54 @@ fileprivate extension DataPacket {
     }
 }
 
+/// Latency probe data packet utilities. A probe is answered by an echo carrying the same id and has no
+/// other effects. Probe packet types are specific to Soduto, so probes are sent only to devices announcing
+/// they can answer them.
+fileprivate extension DataPacket {
+    
+    static let latencyProbePacketType = "soduto.latency.probe"
+    static let latencyProbeEchoPacketType = "soduto.latency.echo"
+    
+    enum LatencyProbeError: Error {
+        case invalidId
+    }
+    
+    enum LatencyProbeProperty: String {
+        case id = "id"
+    }
+    
+    static func latencyProbePacket(id: Int) -> DataPacket {
+        return DataPacket(type: latencyProbePacketType, body: [
+            LatencyProbeProperty.id.rawValue: id as AnyObject
+        ])
+    }
+    
+    static func latencyProbeEchoPacket(id: Int) -> DataPacket {
+        return DataPacket(type: latencyProbeEchoPacketType, body: [
+            LatencyProbeProperty.id.rawValue: id as AnyObject
+        ])
+    }
+    
+    func getLatencyProbeId() throws -> Int {
+        guard let id = body[LatencyProbeProperty.id.rawValue] as? Int else { throw LatencyProbeError.invalidId }
+        return id
+    }
+    
+    var isLatencyProbePacket: Bool { return self.type == DataPacket.latencyProbePacketType }
+    var isLatencyProbeEchoPacket: Bool { return self.type == DataPacket.latencyProbeEchoPacketType }
+}
+
 /// Service providing capability to send end receive "pings" - short messages that can be used to test 
 /// devices connectivity
 ///
 /// This service displays a notification to the user each time a package with type
 /// "kdeconnect.ping" is received. If the package has something in the "message"
 /// field, that will be displayed in the notification body.
+///
+/// Additionally the service probes application level round trip time of paired devices that answer
+/// latency probes, and answers probes of other devices. Probes are sent in place of connection keepalives, so they follow the keepalive
+/// schedule and do not keep idle links awake. Results are recorded into `Device.roundTripHistogram` and
+/// fed into the link quality metrics of connection the echo arrived on.
 public class PingService: Service {
     
     // MARK: Types
@@ -56,19 +100,44 @@ public class PingService: Service {
         case send
     }
     
+    /// Latency probing state of a single device. Only one probe is kept in flight at a time, so an
+    /// echo can always be matched to the probe that caused it.
+    private class LatencyProbe {
+        var probeId: Int = 0
+        var probeSentTime: TimeInterval? = nil
+        /// Whether device has answered any probe - unanswered probes are counted as lost only then
+        var isAnswered: Bool = false
+    }
+    
+    
+    // MARK: Properties
+    
+    /// Time after which unanswered probe is considered lost
+    public static let latencyProbeTimeout: TimeInterval = 10.0
+    
+    private var latencyProbes: [Device.Id: LatencyProbe] = [:]
+    
     
     // MARK: Service properties
     
     public static let serviceId: Service.Id = "com.soduto.services.ping"
     
-    public let incomingCapabilities = Set<Service.Capability>([ DataPacket.pingPacketType ])
-    public let outgoingCapabilities = Set<Service.Capability>([ DataPacket.pingPacketType ])
+    public static let incomingCapabilities = Set<Service.Capability>([ DataPacket.pingPacketType, DataPacket.latencyProbePacketType, DataPacket.latencyProbeEchoPacketType ])
+    public static let outgoingCapabilities = Set<Service.Capability>([ DataPacket.pingPacketType, DataPacket.latencyProbePacketType, DataPacket.latencyProbeEchoPacketType ])
     
     
     // MARK: Service methods
     
     public func handleDataPacket(_ dataPacket: DataPacket, fromDevice device: Device, onConnection connection: Connection) -> Bool {
         
+        if dataPacket.isLatencyProbePacket {
+            self.answerLatencyProbe(dataPacket, from: device)
+            return true
+        }
+        if dataPacket.isLatencyProbeEchoPacket {
+            return self.handleLatencyProbeEcho(dataPacket, from: device, onConnection: connection)
+        }
+        
         guard dataPacket.isPingPacket else { return false }
         
         self.showNotification(for: dataPacket, from: device)
@@ -76,9 +145,13 @@ public class PingService: Service {
         return true
     }
     
-    public func setup(for device: Device) {}
+    public func setup(for device: Device) {
+        self.startLatencyProbing(for: device)
+    }
     
-    public func cleanup(for device: Device) {}
+    public func cleanup(for device: Device) {
+        self.stopLatencyProbing(for: device)
+    }
     
     public func actions(for device: Device) -> [ServiceAction] {
         guard device.incomingCapabilities.contains(DataPacket.pingPacketType) else { return [] }
@@ -102,6 +175,76 @@ public class PingService: Service {
     }
     
     
+    // MARK: Latency probing
+    
+    /// Round trip time statistics of the device, nil if device is not being probed
+    public func latencyHistogram(for device: Device) -> LatencyHistogram? {
+        guard self.latencyProbes[device.id] != nil else { return nil }
+        return device.roundTripHistogram
+    }
+    
+    private func startLatencyProbing(for device: Device) {
+        guard device.pairingStatus == .Paired else { return }
+        guard device.incomingCapabilities.contains(DataPacket.latencyProbePacketType) else { return }
+        guard device.outgoingCapabilities.contains(DataPacket.latencyProbeEchoPacketType) else { return }
+        guard self.latencyProbes[device.id] == nil else { return }
+        
+        self.latencyProbes[device.id] = LatencyProbe()
+        device.keepAlivePacketProvider = { [weak self] device in
+            return self?.latencyProbePacket(for: device)
+        }
+    }
+    
+    private func stopLatencyProbing(for device: Device) {
+        guard self.latencyProbes.removeValue(forKey: device.id) != nil else { return }
+        device.keepAlivePacketProvider = nil
+        Log.debug?.message("Round trip times of \(device): \(device.roundTripHistogram)")
+    }
+    
+    /// Probe to be sent as a keepalive, nil if a previous probe is still in flight
+    private func latencyProbePacket(for device: Device) -> DataPacket? {
+        guard let probe = self.latencyProbes[device.id] else { return nil }
+        
+        if let sentTime = probe.probeSentTime {
+            guard CACurrentMediaTime() - sentTime > PingService.latencyProbeTimeout else { return nil }
+            if probe.isAnswered {
+                device.roundTripHistogram.recordLost()
+            }
+            probe.probeSentTime = nil
+        }
+        
+        probe.probeId += 1
+        probe.probeSentTime = CACurrentMediaTime()
+        return DataPacket.latencyProbePacket(id: probe.probeId)
+    }
+    
+    private func answerLatencyProbe(_ dataPacket: DataPacket, from device: Device) {
+        guard device.pairingStatus == .Paired else { return }
+        do {
+            device.send(DataPacket.latencyProbeEchoPacket(id: try dataPacket.getLatencyProbeId()))
+        }
+        catch {
+            Log.error?.message("Invalid latency probe from \(device): \(error)")
+        }
+    }
+    
+    private func handleLatencyProbeEcho(_ dataPacket: DataPacket, from device: Device, onConnection connection: Connection) -> Bool {
+        guard let probe = self.latencyProbes[device.id] else { return true }
+        guard let sentTime = probe.probeSentTime else { return true }
+        guard (try? dataPacket.getLatencyProbeId()) == probe.probeId else { return true }
+        
+        let roundTripTime = CACurrentMediaTime() - sentTime
+        probe.probeSentTime = nil
+        probe.isAnswered = true
+        device.roundTripHistogram.record(roundTripTime)
+        connection.metrics.recordRoundTrip(roundTripTime)
+        connection.keepAlivePolicy.keepAliveAnswered()
+        
+        Log.debug?.message("Latency probe of \(device) returned in \(roundTripTime)s: \(device.roundTripHistogram)")
+        return true
+    }
+    
+    
     // MARK: Private methods
     
     private func showNotification(for dataPacket: DataPacket, from device: Device) {
@@ -8,34 +8,141 @@
 
 import Foundation
 import Cocoa
+import Carbon
+import QuartzCore
 import CleanroomLogger
 
+/// Service injecting keyboard input received from other devices
+///
+/// It receives packets with type kdeconnect.mousepad.request, containing either a text
+/// in "key" field, or a special key code in "specialKey" field, with optional "shift",
+/// "ctrl" and "alt" modifier flags. If "sendAck" is set, the input is acknowledged
+/// with a kdeconnect.mousepad.echo packet.
+///
+/// Fast typing produces many small packets. Connection reads them one at a time, so key events arriving
+/// within a short window are batched: consecutive text keys are injected as a single keyboard event and
+/// all acknowledgements of a batch are coalesced into a single echo.
+///
+/// Characters are posted with virtual key codes of the current keyboard layout, so that applications
+/// interpreting key codes (e.g. for shortcuts) see the right keys. Modified or special keys that have no
+/// key code are dropped. Posting events requires accessibility permission - without it input is dropped too.
 public class RemoteKeyboardService: Service {
     
+    // MARK: Types
+    
+    struct KeyEvent {
+        let key: String
+        let specialKey: Int?
+        let shift: Bool
+        let ctrl: Bool
+        let alt: Bool
+        let sendAck: Bool
+        let receivedTime: TimeInterval
+        
+        var isPlainText: Bool { return self.specialKey == nil && !self.shift && !self.ctrl && !self.alt }
+    }
+    
+    private struct KeyStroke {
+        let keyCode: CGKeyCode
+        let shift: Bool
+    }
+    
+    
+    // MARK: Properties
+    
+    /// Time key events are collected for after the first one arrives, before they are injected as a batch.
+    /// Short enough not to be noticed as typing delay.
+    public static let batchWindow: TimeInterval = 0.02
+    
+    /// Setting enabling the service. Injecting input needs accessibility permission, so it is off by default.
+    public static let enabledConfigurationKey = "com.soduto.remoteKeyboardEnabled"
+    
+    /// Maximum number of UTF-16 characters a single keyboard event can carry
+    private static let maxEventStringLength = 20
+    
+    /// Key code of text events carrying characters not present on the keyboard layout (e.g. emoji). It is
+    /// not assigned to any key, so the event is seen only as text input.
+    private static let unmappedCharacterKeyCode: CGKeyCode = 0xFF
+    
+    /// Special key codes used by KDE Connect mapped to macOS virtual key codes
+    private static let specialKeyCodes: [Int: CGKeyCode] = [
+        1: 0x33,  // backspace
+        2: 0x30,  // tab
+        4: 0x7B,  // left
+        5: 0x7E,  // up
+        6: 0x7C,  // right
+        7: 0x7D,  // down
+        8: 0x74,  // page up
+        9: 0x79,  // page down
+        10: 0x73, // home
+        11: 0x77, // end
+        12: 0x24, // return
+        13: 0x75, // delete
+        14: 0x35, // escape
+        21: 0x7A, 22: 0x78, 23: 0x63, 24: 0x76, 25: 0x60, 26: 0x61, // F1 - F6
+        27: 0x62, 28: 0x64, 29: 0x65, 30: 0x6D, 31: 0x67, 32: 0x6F  // F7 - F12
+    ]
+    
+    /// Time from packet arrival to input injection
+    public let injectionLatency = LatencyHistogram()
+    /// Number of injected batches of key events
+    public private(set) var batchCount: Int = 0
+    /// Number of injected key events
+    public private(set) var eventCount: Int = 0
+    
+    private var pendingEvents: [Device.Id: [KeyEvent]] = [:]
+    private var devices: [Device.Id: Device] = [:]
+    private var isFlushScheduled: Bool = false
+    private let eventSource = CGEventSource(stateID: .hidSystemState)
+    private var keyboardLayoutStrokes: [Character: KeyStroke]? = nil
+    private var keyboardLayoutObserver: NSObjectProtocol? = nil
+    private var isTrustPrompted: Bool = false
+    
+    /// Posts keyboard event to the system. Replaceable (e.g. in tests), so that nothing is injected into the user session.
+    var postEvent: (CGEvent) -> Void = { $0.post(tap: .cghidEventTap) }
+    /// Decides whether events may be posted. Accessibility permission is checked if not set.
+    var isPostingAllowed: (() -> Bool)? = nil
+    
+    
+    // MARK: Init / Deinit
+    
+    public init() {
+        self.keyboardLayoutObserver = DistributedNotificationCenter.default().addObserver(
+            forName: NSNotification.Name(kTISNotifySelectedKeyboardInputSourceChanged as String), object: nil, queue: .main) { [weak self] _ in
+            self?.keyboardLayoutStrokes = nil
+        }
+    }
+    
+    deinit {
+        if let observer = self.keyboardLayoutObserver {
+            DistributedNotificationCenter.default().removeObserver(observer)
+        }
+    }
+    
+    
     // MARK: Service
     
     public static let serviceId: Service.Id = "com.soduto.services.remotekeyboard"
     
-    public let incomingCapabilities = Set<Service.Capability>([ DataPacket.remoteKeyboardRequestPacketType ])
-    public let outgoingCapabilities = Set<Service.Capability>([ DataPacket.remoteKeyboardEchoPacketType ])
+    public static let incomingCapabilities = Set<Service.Capability>([ DataPacket.remoteKeyboardRequestPacketType ])
+    public static let outgoingCapabilities = Set<Service.Capability>([ DataPacket.remoteKeyboardEchoPacketType ])
     
     public func handleDataPacket(_ dataPacket: DataPacket, fromDevice device: Device, onConnection connection: Connection) -> Bool {
     
         guard dataPacket.isRemoteKeyboardRequestPacket else { return false }
         
         do {
-            if !(try dataPacket.getSendAckFlag()) {
-                let body: DataPacket.Body = [
-                    DataPacket.RemoteKeyboardProperty.key: "a" as AnyObject,
-                    DataPacket.RemoteKeyboardProperty.sendAck: true as AnyObject
-                ]
-                let keyPacket = DataPacket(type: DataPacket.remoteKeyboardRequestPacketType, body: body)
-                device.send(keyPacket)
-            }
+            let event = KeyEvent(
+                key: (try? dataPacket.getKey()) ?? "",
+                specialKey: try dataPacket.getSpecialKey(),
+                shift: try dataPacket.getShiftFlag() ?? false,
+                ctrl: try dataPacket.getCtrlFlag() ?? false,
+                alt: try dataPacket.getAltFlag() ?? false,
+                sendAck: try dataPacket.getSendAckFlag(),
+                receivedTime: dataPacket.receivedTime ?? CACurrentMediaTime())
             
-            guard try dataPacket.getSendAckFlag() else { return true }
-            
-            device.send(try DataPacket.remoteKeyboardEchoPacket(for: dataPacket))
+            self.devices[device.id] = device
+            self.enqueue(event, fromDeviceWithId: device.id)
         }
         catch {
             Log.error?.message("Failed handling remote keyboard data packet: \(error).")
@@ -46,7 +153,10 @@ public class RemoteKeyboardService: Service {
     
     public func setup(for device: Device) {}
     
-    public func cleanup(for device: Device) {}
+    public func cleanup(for device: Device) {
+        self.pendingEvents.removeValue(forKey: device.id)
+        self.devices.removeValue(forKey: device.id)
+    }
     
     public func actions(for device: Device) -> [ServiceAction] {
         // No supported actions
@@ -56,6 +166,174 @@ public class RemoteKeyboardService: Service {
     public func performAction(_ id: ServiceAction.Id, forDevice device: Device) {
         // No supported actions
     }
+    
+    
+    // MARK: Private methods
+    
+    /// Queue key event to be injected with the batch it arrives in
+    func enqueue(_ event: KeyEvent, fromDeviceWithId deviceId: Device.Id) {
+        self.pendingEvents[deviceId, default: []].append(event)
+        self.scheduleFlush()
+    }
+    
+    private func scheduleFlush() {
+        guard !self.isFlushScheduled else { return }
+        self.isFlushScheduled = true
+        
+        // Each packet is read only after the previous one is handled - give following packets time to arrive
+        DispatchQueue.main.asyncAfter(deadline: .now() + RemoteKeyboardService.batchWindow) { [weak self] in
+            self?.flush()
+        }
+    }
+    
+    private func flush() {
+        self.isFlushScheduled = false
+        let pendingEvents = self.pendingEvents
+        self.pendingEvents = [:]
+        
+        guard self.isPostingAllowed?() ?? self.isTrustedForAccessibility() else {
+            Log.error?.message("Remote keyboard input dropped: Soduto is not trusted for accessibility")
+            return
+        }
+        
+        for (deviceId, events) in pendingEvents where !events.isEmpty {
+            self.inject(events)
+            
+            let now = CACurrentMediaTime()
+            for event in events {
+                self.injectionLatency.record(now - event.receivedTime)
+            }
+            self.batchCount += 1
+            self.eventCount += events.count
+            
+            let acknowledged = events.filter { $0.sendAck }.map { (key: $0.key, specialKey: $0.specialKey, shift: $0.shift, ctrl: $0.ctrl, alt: $0.alt) }
+            if let device = self.devices[deviceId], let echo = DataPacket.remoteKeyboardEchoPacket(forAcknowledged: acknowledged) {
+                device.send(echo)
+            }
+            
+            if self.batchCount % 100 == 0 {
+                Log.debug?.message("Remote keyboard: \(self.eventCount) events in \(self.batchCount) batches, injection latency \(self.injectionLatency)")
+            }
+        }
+    }
+    
+    private func inject(_ events: [KeyEvent]) {
+        var text = ""
+        for event in events {
+            if event.isPlainText {
+                text += event.key
+            }
+            else {
+                self.postText(text)
+                text = ""
+                self.post(event)
+            }
+        }
+        self.postText(text)
+    }
+    
+    private func postText(_ text: String) {
+        // Each event is posted with the key code of its first character, so a new event starts at every
+        // character whose key differs from the one starting the event
+        var chunk: [UniChar] = []
+        var chunkKeyCode: CGKeyCode = RemoteKeyboardService.unmappedCharacterKeyCode
+        for character in text {
+            let keyCode = self.keyStroke(for: character)?.keyCode ?? RemoteKeyboardService.unmappedCharacterKeyCode
+            let characterUnits = Array(String(character).utf16)
+            if !chunk.isEmpty && (keyCode != chunkKeyCode || chunk.count + characterUnits.count > RemoteKeyboardService.maxEventStringLength) {
+                self.postKey(chunkKeyCode, flags: [], characters: chunk)
+                chunk = []
+            }
+            if chunk.isEmpty {
+                chunkKeyCode = keyCode
+            }
+            chunk += characterUnits
+        }
+        if !chunk.isEmpty {
+            self.postKey(chunkKeyCode, flags: [], characters: chunk)
+        }
+    }
+    
+    private func post(_ keyEvent: KeyEvent) {
+        var flags: CGEventFlags = []
+        if keyEvent.shift { flags.insert(.maskShift) }
+        if keyEvent.ctrl { flags.insert(.maskControl) }
+        if keyEvent.alt { flags.insert(.maskAlternate) }
+        
+        if let specialKey = keyEvent.specialKey {
+            guard let keyCode = RemoteKeyboardService.specialKeyCodes[specialKey] else {
+                Log.debug?.message("Dropping unsupported special key \(specialKey)")
+                return
+            }
+            self.postKey(keyCode, flags: flags, characters: [])
+        }
+        else {
+            guard let character = keyEvent.key.first, let stroke = self.keyStroke(for: character) else {
+                Log.debug?.message("Dropping key '\(keyEvent.key)' not present on current keyboard layout")
+                return
+            }
+            if stroke.shift { flags.insert(.maskShift) }
+            self.postKey(stroke.keyCode, flags: flags, characters: [])
+        }
+    }
+    
+    private func postKey(_ keyCode: CGKeyCode, flags: CGEventFlags, characters: [UniChar]) {
+        for keyDown in [true, false] {
+            guard let event = CGEvent(keyboardEventSource: self.eventSource, virtualKey: keyCode, keyDown: keyDown) else { continue }
+            event.flags = flags
+            if !characters.isEmpty {
+                event.keyboardSetUnicodeString(stringLength: characters.count, unicodeString: characters)
+            }
+            self.postEvent(event)
+        }
+    }
+    
+    /// Accessibility permission is needed to post keyboard events. User is asked for it the first time it is missing.
+    private func isTrustedForAccessibility() -> Bool {
+        guard !AXIsProcessTrusted() else { return true }
+        
+        if !self.isTrustPrompted {
+            self.isTrustPrompted = true
+            let options = [kAXTrustedCheckOptionPrompt.takeUnretainedValue() as String: true] as CFDictionary
+            _ = AXIsProcessTrustedWithOptions(options)
+        }
+        return false
+    }
+    
+    private func keyStroke(for character: Character) -> KeyStroke? {
+        if self.keyboardLayoutStrokes == nil {
+            self.keyboardLayoutStrokes = RemoteKeyboardService.currentKeyboardLayoutStrokes()
+        }
+        return self.keyboardLayoutStrokes?[character]
+    }
+    
+    /// Inverse of the current keyboard layout: characters mapped to keys (with or without shift) producing them
+    private static func currentKeyboardLayoutStrokes() -> [Character: KeyStroke] {
+        guard let inputSource = TISCopyCurrentKeyboardLayoutInputSource()?.takeRetainedValue() else { return [:] }
+        guard let layoutDataPtr = TISGetInputSourceProperty(inputSource, kTISPropertyUnicodeKeyLayoutData) else { return [:] }
+        let layoutData = Unmanaged<CFData>.fromOpaque(layoutDataPtr).takeUnretainedValue() as Data
+        
+        var strokes: [Character: KeyStroke] = [:]
+        layoutData.withUnsafeBytes { (layout: UnsafePointer<UCKeyboardLayout>) in
+            for shift in [false, true] {
+                let modifierKeyState = shift ? UInt32((shiftKey >> 8) & 0xFF) : 0
+                for keyCode in 0 ..< CGKeyCode(128) {
+                    var deadKeyState: UInt32 = 0
+                    var length = 0
+                    var characters = [UniChar](repeating: 0, count: 4)
+                    let status = UCKeyTranslate(layout, keyCode, UInt16(kUCKeyActionDown), modifierKeyState, UInt32(LMGetKbdType()),
+                                                OptionBits(kUCKeyTranslateNoDeadKeysMask), &deadKeyState, characters.count, &length, &characters)
+                    guard status == noErr, length > 0 else { continue }
+                    guard let character = String(utf16CodeUnits: characters, count: length).first else { continue }
+                    // Unshifted strokes are preferred
+                    if strokes[character] == nil {
+                        strokes[character] = KeyStroke(keyCode: keyCode, shift: shift)
+                    }
+                }
+            }
+        }
+        return strokes
+    }
 }
 
 
@@ -99,16 +377,23 @@ fileprivate extension DataPacket {
     
     // MARK: Public static methods
     
-    static func remoteKeyboardEchoPacket(for dataPacket: DataPacket) throws -> DataPacket {
-        assert(dataPacket.isRemoteKeyboardRequestPacket, "Expected packet type \(remoteKeyboardEchoPacketType), but got \(dataPacket.type)")
+    /// Single echo packet acknowledging several key events. Text of the events is concatenated,
+    /// special key and modifiers are taken from the last event. Returns nil if there is nothing to acknowledge.
+    static func remoteKeyboardEchoPacket(forAcknowledged events: [(key: String, specialKey: Int?, shift: Bool, ctrl: Bool, alt: Bool)]) -> DataPacket? {
+        guard let last = events.last else { return nil }
+        let key = events.map { $0.specialKey == nil ? $0.key : "" }.joined()
+        return remoteKeyboardEchoPacket(key: key, specialKey: last.specialKey, shift: last.shift ? true : nil, ctrl: last.ctrl ? true : nil, alt: last.alt ? true : nil)
+    }
+    
+    static func remoteKeyboardEchoPacket(key: String, specialKey: Int?, shift: Bool?, ctrl: Bool?, alt: Bool?) -> DataPacket {
         var body: Body = [
             RemoteKeyboardProperty.isAck: true as AnyObject,
-            RemoteKeyboardProperty.key: try dataPacket.getKey() as AnyObject
+            RemoteKeyboardProperty.key: key as AnyObject
         ]
-        if let specialKey = try dataPacket.getSpecialKey() { body[RemoteKeyboardProperty.specialKey] = specialKey as AnyObject }
-        if let shift = try dataPacket.getShiftFlag() { body[RemoteKeyboardProperty.shift] = shift as AnyObject }
-        if let ctrl = try dataPacket.getCtrlFlag() { body[RemoteKeyboardProperty.ctrl] = ctrl as AnyObject }
-        if let alt = try dataPacket.getAltFlag() { body[RemoteKeyboardProperty.alt] = alt as AnyObject }
+        if let specialKey = specialKey { body[RemoteKeyboardProperty.specialKey] = specialKey as AnyObject }
+        if let shift = shift { body[RemoteKeyboardProperty.shift] = shift as AnyObject }
+        if let ctrl = ctrl { body[RemoteKeyboardProperty.ctrl] = ctrl as AnyObject }
+        if let alt = alt { body[RemoteKeyboardProperty.alt] = alt as AnyObject }
         return DataPacket(type: remoteKeyboardEchoPacketType, body: body)
     }
     
@@ -46,8 +46,8 @@ public class SftpService: NSObject, Service, NSWindowDelegate {
     
     public static let serviceId: Service.Id = "com.soduto.services.sftp"
     
-    public let incomingCapabilities = Set<Service.Capability>([ DataPacket.sftpPacketType ])
-    public let outgoingCapabilities = Set<Service.Capability>([ DataPacket.sftpRequestPacketType ])
+    public static let incomingCapabilities = Set<Service.Capability>([ DataPacket.sftpPacketType ])
+    public static let outgoingCapabilities = Set<Service.Capability>([ DataPacket.sftpRequestPacketType ])
     
     public func handleDataPacket(_ dataPacket: DataPacket, fromDevice device: Device, onConnection connection: Connection) -> Bool {
         
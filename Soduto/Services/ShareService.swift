@@ -50,6 +50,7 @@ public class ShareService: NSObject, Service, DownloadTaskDelegate, UserNotifica
     }
     
     private struct DragDestination {
+        let fileUrls: [URL]
         let dataPackets: [DataPacket]
         let device: Device
     }
@@ -65,12 +66,13 @@ public class ShareService: NSObject, Service, DownloadTaskDelegate, UserNotifica
         NSPasteboard.PasteboardType(rawValue: kUTTypeUTF8PlainText as String),
         NSPasteboard.PasteboardType(rawValue: kUTTypeText as String)]
     
-    public let incomingCapabilities = Set<Service.Capability>([ DataPacket.sharePacketType ])
-    public let outgoingCapabilities = Set<Service.Capability>([ DataPacket.sharePacketType ])
+    public static let incomingCapabilities = Set<Service.Capability>([ DataPacket.sharePacketType ])
+    public static let outgoingCapabilities = Set<Service.Capability>([ DataPacket.sharePacketType ])
     
     private var downloadInfos: [DownloadInfo] = []
     private var devices: [Device.Id:Device] = [:]
     private var validDevices: [Device] { return self.devices.values.filter { $0.isReachable && $0.pairingStatus == .Paired } }
+    private lazy var transferManager: ShareTransferManager = self.createTransferManager()
     
     
     // MARK: Service methods
@@ -113,6 +115,11 @@ public class ShareService: NSObject, Service, DownloadTaskDelegate, UserNotifica
     
     public func cleanup(for device: Device) {
         _ = self.devices.removeValue(forKey: device.id)
+        self.transferManager.deviceDisconnected(device)
+    }
+    
+    public var isIdle: Bool {
+        return self.downloadInfos.isEmpty && self.transferManager.isIdle
     }
     
     public func actions(for device: Device) -> [ServiceAction] {
@@ -136,9 +143,7 @@ public class ShareService: NSObject, Service, DownloadTaskDelegate, UserNotifica
             openPanel.allowsMultipleSelection = true
             openPanel.begin { result in
                 guard result == NSApplication.ModalResponse.OK else { return }
-                for url in openPanel.urls {
-                    self.uploadFile(url: url, to: device)
-                }
+                self.transferManager.enqueue(openPanel.urls, to: device)
             }
             break
         }
@@ -197,7 +202,7 @@ public class ShareService: NSObject, Service, DownloadTaskDelegate, UserNotifica
     public dynamic func performDragOperation(_ sender: NSDraggingInfo) -> Bool {
         guard self.validDevices.count > 0 else { return false }
         
-        var filePackets: [DataPacket] = []
+        var fileUrls: [URL] = []
         var urlPackets: [DataPacket] = []
         var textPackets: [DataPacket] = []
         
@@ -210,8 +215,9 @@ public class ShareService: NSObject, Service, DownloadTaskDelegate, UserNotifica
             case String(kUTTypeFileURL):
                 guard let urlString = item.string(forType: type) else { break }
                 guard let url = URL(string: urlString) else { break }
-                guard let dataPacket = self.dataPacket(forFileUrl: url) else { break }
-                filePackets.append(dataPacket)
+                var isDirectory: ObjCBool = false
+                guard FileManager.default.fileExists(atPath: url.path, isDirectory: &isDirectory), !isDirectory.boolValue else { break }
+                fileUrls.append(url)
                 break
                 
             case String(kUTTypeURL):
@@ -238,9 +244,9 @@ public class ShareService: NSObject, Service, DownloadTaskDelegate, UserNotifica
             }
         }
         
-        guard filePackets.count > 0 || urlPackets.count > 0 || textPackets.count > 0 else { return false }
+        guard fileUrls.count > 0 || urlPackets.count > 0 || textPackets.count > 0 else { return false }
         
-        return self.popUpDragDestinationMenu(forFilePackets: filePackets, urlPackets: urlPackets, textPackets: textPackets, sender: sender)
+        return self.popUpDragDestinationMenu(forFileUrls: fileUrls, urlPackets: urlPackets, textPackets: textPackets, sender: sender)
     }
     
     
@@ -251,6 +257,9 @@ public class ShareService: NSObject, Service, DownloadTaskDelegate, UserNotifica
         
         if let obj = menuItem.representedObject as? DragDestination {
             guard obj.device.isReachable && obj.device.pairingStatus == .Paired else { return }
+            if !obj.fileUrls.isEmpty {
+                self.transferManager.enqueue(obj.fileUrls, to: obj.device)
+            }
             for packet in obj.dataPackets {
                 obj.device.send(packet)
             }
@@ -260,22 +269,49 @@ public class ShareService: NSObject, Service, DownloadTaskDelegate, UserNotifica
     
     // MARK: Private methods
     
-    private func fileSize(path: String) -> Int64? {
-        var fileSize : Int64? = nil
-        
-        do {
-            let attr = try FileManager.default.attributesOfItem(atPath: path)
-            fileSize = attr[FileAttributeKey.size] as? Int64
-        } catch {
-            Log.error?.message("Failed to get file information: \(error)")
+    private func createTransferManager() -> ShareTransferManager {
+        let manager = ShareTransferManager { url, size in
+            guard let stream = InputStream(url: url) else { return nil }
+            return DataPacket.sharePacket(fileStream: stream, fileSize: size, fileName: url.lastPathComponent)
         }
+        manager.progressHandler = { [weak self] device, progress in
+            self?.showUploadProgressNotification(progress, device: device)
+        }
+        return manager
+    }
+    
+    private func showUploadProgressNotification(_ progress: ShareTransferManager.Progress, device: Device) {
+        let notification = NSUserNotification()
+        if progress.isFinished {
+            notification.title = progress.filesFailed == 0 ?
+                NSLocalizedString("Finished uploading files", comment: "Upload notification title") :
+                NSLocalizedString("File upload failed", comment: "Upload notification title")
+            notification.informativeText = progress.filesFailed == 0 ?
+                String(format: NSLocalizedString("%d file(s) sent to device '%@'", comment: "Upload notification text"), progress.filesCompleted, device.name) :
+                String(format: NSLocalizedString("%d of %d file(s) sent to device '%@'", comment: "Upload notification text"), progress.filesCompleted, progress.filesTotal, device.name)
+            notification.soundName = NSUserNotificationDefaultSoundName
+        }
+        else {
+            let percent = Int(progress.fraction * 100.0)
+            notification.title = String(format: NSLocalizedString("Uploading files to '%@'", comment: "Upload progress notification title"), device.name)
+            if let timeLeft = progress.estimatedTimeLeft {
+                notification.informativeText = String(format: NSLocalizedString("%d of %d file(s) sent, %d%%, about %ds left", comment: "Upload progress notification text"),
+                                                      progress.filesCompleted, progress.filesTotal, percent, Int(timeLeft.rounded(.up)))
+            }
+            else {
+                notification.informativeText = String(format: NSLocalizedString("%d of %d file(s) sent, %d%%", comment: "Upload progress notification text"),
+                                                      progress.filesCompleted, progress.filesTotal, percent)
+            }
+        }
+        notification.hasActionButton = false
+        notification.identifier = "\(self.id).upload.\(device.id)"
         
-        return fileSize
-    }
-    
-    private func uploadFile(url: URL, to device: Device) {
-        guard let dataPacket = self.dataPacket(forFileUrl: url) else { return }
-        device.send(dataPacket)
+        // Progress notifications replace each other, only the first and the last are presented
+        var userInfo = notification.userInfo ?? [:]
+        userInfo[UserNotificationManager.Property.dontPresent.rawValue] = NSNumber(value: !progress.isFinished && progress.bytesSent > 0)
+        notification.userInfo = userInfo
+        NSUserNotificationCenter.default.removeDeliveredNotification(notification)
+        NSUserNotificationCenter.default.deliver(notification)
     }
     
     private func downloadFile(_ fileName: String?, usingTask task: DownloadTask, from device: Device) {
@@ -409,15 +445,17 @@ public class ShareService: NSObject, Service, DownloadTaskDelegate, UserNotifica
         }
     }
     
-    private func popUpDragDestinationMenu(forFilePackets filePackets: [DataPacket], urlPackets: [DataPacket], textPackets: [DataPacket], sender: NSDraggingInfo) -> Bool {
+    private func popUpDragDestinationMenu(forFileUrls fileUrls: [URL], urlPackets: [DataPacket], textPackets: [DataPacket], sender: NSDraggingInfo) -> Bool {
         
+        var files: [URL] = []
         let packets: [DataPacket]
         let title: String
-        if filePackets.count > 0 {
-            packets = filePackets
-            title = packets.count == 1 ?
-                String(format: NSLocalizedString("Upload file to:", comment: "Drag destinations menu title"), packets.count) :
-                String(format: NSLocalizedString("Upload %d file(s) to:", comment: "Drag destinations menu title"), packets.count)
+        if fileUrls.count > 0 {
+            files = fileUrls
+            packets = []
+            title = files.count == 1 ?
+                String(format: NSLocalizedString("Upload file to:", comment: "Drag destinations menu title"), files.count) :
+                String(format: NSLocalizedString("Upload %d file(s) to:", comment: "Drag destinations menu title"), files.count)
         }
         else if urlPackets.count > 0 {
             packets = urlPackets
@@ -448,7 +486,7 @@ public class ShareService: NSObject, Service, DownloadTaskDelegate, UserNotifica
             let item = NSMenuItem(title: device.name, action: nil, keyEquivalent: keyEquivalent)
             item.target = self
             item.action = #selector(dragDestinationMenuItemAction(_:))
-            item.representedObject = DragDestination(dataPackets: packets, device: device)
+            item.representedObject = DragDestination(fileUrls: files, dataPackets: packets, device: device)
             menu.addItem(item)
         }
         
@@ -456,24 +494,6 @@ public class ShareService: NSObject, Service, DownloadTaskDelegate, UserNotifica
         return menu.popUp(positioning: nil, at: position, in: nil)
     }
     
-    private func dataPacket(forFileName fileName: String) -> DataPacket? {
-        let url = URL(fileURLWithPath: fileName)
-        let dataPacket = self.dataPacket(forFileUrl: url)
-        return dataPacket
-    }
-    
-    private func dataPacket(forFileUrl url: URL) -> DataPacket? {
-        var isDirectory: ObjCBool = false
-        guard FileManager.default.fileExists(atPath: url.path, isDirectory: &isDirectory) else { return nil }
-        guard !isDirectory.boolValue else { return nil }
-        guard let filename = url.pathComponents.last else { return nil }
-        guard let stream = InputStream(url: url) else { return nil }
-        
-        let fileSize = self.fileSize(path: url.path)
-        let dataPacket = DataPacket.sharePacket(fileStream: stream, fileSize: fileSize, fileName: filename)
-        return dataPacket
-    }
-    
     private func dataPacket(forUrl url: URL) -> DataPacket {
         return DataPacket.sharePacket(url: url)
     }
@@ -537,7 +557,8 @@ fileprivate extension DataPacket {
         let body: Body = [
             ShareProperty.text: text as AnyObject
         ]
-        let packet = DataPacket(type: sharePacketType, body: body)
+        var packet = DataPacket(type: sharePacketType, body: body)
+        packet.offloadableProperty = ShareProperty.text
         return packet
     }
     
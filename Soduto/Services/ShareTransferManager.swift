@@ -0,0 +1,278 @@
+//
+//  ShareTransferManager.swift
+//  Soduto
+//
+//  Created by Giedrius Stanevičius on 2018-03-25.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import QuartzCore
+import CleanroomLogger
+
+/// Queue of file uploads to other devices. Files are sent to each device with limited concurrency,
+/// so that many shared files do not exhaust payload ports, and smallest files go first, so that progress
+/// is visible early. Progress is tracked for the whole batch of queued files per device.
+///
+/// Upload slots are freed not only by sending completion, but also when device disconnects before an upload
+/// starts (its packet may stay unsent indefinitely) and when an upload makes no progress for `stallTimeout`.
+/// Completions arriving after that are ignored.
+///
+/// Not thread safe - expected to be used on the main queue.
+public class ShareTransferManager {
+
+    // MARK: Types
+
+    /// Aggregate progress of files queued for a device
+    public struct Progress {
+        public let filesTotal: Int
+        public let filesCompleted: Int
+        public let filesFailed: Int
+        public let bytesTotal: Int64
+        public let bytesSent: Int64
+        /// Estimated time left, nil if it can not be estimated yet
+        public let estimatedTimeLeft: TimeInterval?
+
+        public var isFinished: Bool { return self.filesCompleted + self.filesFailed >= self.filesTotal }
+        public var fraction: Double { return self.bytesTotal > 0 ? Double(self.bytesSent) / Double(self.bytesTotal) : (self.isFinished ? 1.0 : 0.0) }
+    }
+
+    /// Builds data packet for uploading a file. Returns nil if file can not be read.
+    public typealias PacketFactory = (_ url: URL, _ size: Int64) -> DataPacket?
+
+    private struct Item {
+        let id: Int // the same file may be queued more than once, so items are told apart by id
+        let url: URL
+        let size: Int64
+    }
+
+    private struct ActiveTransfer {
+        let item: Item
+        var bytesSent: Int64 = 0
+        var lastProgressTime: TimeInterval = CACurrentMediaTime()
+
+        init(item: Item) {
+            self.item = item
+        }
+    }
+
+    private class DeviceQueue {
+        let deviceId: Device.Id // kept apart from the weak device, so the queue can be removed after device is gone
+        weak var device: Device?
+        var pending: [Item] = [] // sorted by size, largest last
+        var active: [Int: ActiveTransfer] = [:]
+        var filesTotal: Int = 0
+        var filesCompleted: Int = 0
+        var filesFailed: Int = 0
+        var bytesTotal: Int64 = 0
+        var bytesFinished: Int64 = 0
+        var startTime: TimeInterval = CACurrentMediaTime()
+
+        init(device: Device) {
+            self.deviceId = device.id
+            self.device = device
+        }
+
+        var bytesSent: Int64 {
+            return self.active.values.reduce(self.bytesFinished) { $0 + $1.bytesSent }
+        }
+    }
+
+
+    // MARK: Properties
+
+    public static let defaultConcurrencyLimit = 2
+    /// Shortest interval between progress reports of the same device
+    public static let progressReportInterval: TimeInterval = 1.0
+    /// Time without any progress after which an upload is considered failed. Longer than upload task
+    /// timeouts, so that it catches only uploads whose completion would never be reported.
+    public static let stallTimeout: TimeInterval = 90.0
+    private static let stallCheckInterval: TimeInterval = 10.0
+
+    /// Maximum number of files uploaded to the same device at once
+    public var concurrencyLimit: Int = ShareTransferManager.defaultConcurrencyLimit {
+        didSet { self.queues.values.forEach { self.startTransfers(in: $0) } }
+    }
+    /// Called with aggregate progress while files are being sent, and once more when all of them are finished
+    public var progressHandler: ((_ device: Device, _ progress: Progress) -> Void)? = nil
+
+    private let packetFactory: PacketFactory
+    private var queues: [Device.Id: DeviceQueue] = [:]
+    private var lastReportTimes: [Device.Id: TimeInterval] = [:]
+    private var nextItemId: Int = 0
+    private var stallCheckTimer: Timer? = nil
+
+
+    // MARK: Init / Deinit
+
+    public init(packetFactory: @escaping PacketFactory) {
+        self.packetFactory = packetFactory
+    }
+
+    deinit {
+        self.stallCheckTimer?.invalidate()
+    }
+
+
+    // MARK: Public methods
+
+    /// Queue files for uploading to the device. Directories and unreadable files are skipped.
+    public func enqueue(_ urls: [URL], to device: Device) {
+        let queue = self.queues[device.id] ?? DeviceQueue(device: device)
+        if self.queues[device.id] == nil {
+            self.queues[device.id] = queue
+        }
+
+        for url in urls {
+            guard let size = ShareTransferManager.fileSize(of: url) else { continue }
+            self.nextItemId += 1
+            queue.pending.append(Item(id: self.nextItemId, url: url, size: size))
+            queue.filesTotal += 1
+            queue.bytesTotal += size
+        }
+        queue.pending.sort { $0.size > $1.size }
+
+        self.startTransfers(in: queue)
+        self.reportProgress(of: queue, force: true)
+    }
+
+    /// Device got disconnected: files not yet started are dropped, and so are uploads that have not
+    /// started sending payload - their packets may never be sent. Uploads in progress are left to finish.
+    public func deviceDisconnected(_ device: Device) {
+        guard let queue = self.queues[device.id] else { return }
+
+        queue.filesFailed += queue.pending.count
+        queue.pending = []
+        for transfer in queue.active.values where transfer.bytesSent == 0 {
+            self.transferFinished(transfer.item.id, in: queue, success: false, startingNext: false)
+        }
+        self.finishIfDone(queue)
+    }
+
+    /// Nothing is queued or being uploaded to any device
+    public var isIdle: Bool {
+        return self.queues.isEmpty
+    }
+
+    /// Current aggregate progress of uploads to the device, nil if nothing is queued
+    public func progress(for device: Device) -> Progress? {
+        return self.queues[device.id].map { self.progress(of: $0) }
+    }
+
+
+    // MARK: Private methods
+
+    private func startTransfers(in queue: DeviceQueue) {
+        guard let device = queue.device else {
+            // Nowhere to send pending files anymore
+            queue.filesFailed += queue.pending.count
+            queue.pending = []
+            self.finishIfDone(queue)
+            return
+        }
+
+        while queue.active.count < max(self.concurrencyLimit, 1), let item = queue.pending.popLast() {
+            guard var packet = self.packetFactory(item.url, item.size) else {
+                queue.filesFailed += 1
+                continue
+            }
+
+            queue.active[item.id] = ActiveTransfer(item: item)
+            packet.payloadProgressHandler = { [weak self, weak queue] bytesSent in
+                guard let queue = queue, queue.active[item.id] != nil else { return }
+                queue.active[item.id]?.bytesSent = bytesSent
+                queue.active[item.id]?.lastProgressTime = CACurrentMediaTime()
+                self?.reportProgress(of: queue, force: false)
+            }
+            device.send(packet) { [weak self, weak queue] _, payloadSent in
+                guard let queue = queue else { return }
+                self?.transferFinished(item.id, in: queue, success: payloadSent)
+            }
+        }
+
+        self.updateStallCheckTimer()
+        self.finishIfDone(queue)
+    }
+
+    private func transferFinished(_ itemId: Int, in queue: DeviceQueue, success: Bool, startingNext: Bool = true) {
+        // Transfer could have been given up already (see `deviceDisconnected(_:)` and `checkStalledTransfers()`)
+        guard let transfer = queue.active.removeValue(forKey: itemId) else { return }
+
+        if success {
+            queue.filesCompleted += 1
+            queue.bytesFinished += transfer.item.size
+        }
+        else {
+            queue.filesFailed += 1
+            Log.error?.message("Failed to upload file: \(transfer.item.url)")
+        }
+
+        if startingNext {
+            self.startTransfers(in: queue)
+            self.reportProgress(of: queue, force: false)
+        }
+        self.updateStallCheckTimer()
+    }
+
+    private func checkStalledTransfers() {
+        let now = CACurrentMediaTime()
+        for queue in Array(self.queues.values) {
+            for transfer in queue.active.values where now - transfer.lastProgressTime > ShareTransferManager.stallTimeout {
+                Log.error?.message("Upload of \(transfer.item.url) made no progress for \(ShareTransferManager.stallTimeout)s - giving up")
+                self.transferFinished(transfer.item.id, in: queue, success: false)
+            }
+        }
+    }
+
+    private func updateStallCheckTimer() {
+        let hasActiveTransfers = self.queues.values.contains { !$0.active.isEmpty }
+        if hasActiveTransfers && self.stallCheckTimer == nil {
+            self.stallCheckTimer = Timer.compatScheduledTimer(withTimeInterval: ShareTransferManager.stallCheckInterval, repeats: true) { [weak self] _ in
+                self?.checkStalledTransfers()
+            }
+        }
+        else if !hasActiveTransfers {
+            self.stallCheckTimer?.invalidate()
+            self.stallCheckTimer = nil
+        }
+    }
+
+    private func finishIfDone(_ queue: DeviceQueue) {
+        guard queue.active.isEmpty && queue.pending.isEmpty else { return }
+        guard self.queues[queue.deviceId] === queue else { return }
+
+        self.queues.removeValue(forKey: queue.deviceId)
+        self.lastReportTimes.removeValue(forKey: queue.deviceId)
+        if let device = queue.device {
+            self.progressHandler?(device, self.progress(of: queue))
+        }
+    }
+
+    private func reportProgress(of queue: DeviceQueue, force: Bool) {
+        guard let device = queue.device, self.queues[device.id] === queue else { return }
+
+        let now = CACurrentMediaTime()
+        if !force, let lastReportTime = self.lastReportTimes[device.id], now - lastReportTime < ShareTransferManager.progressReportInterval {
+            return
+        }
+        self.lastReportTimes[device.id] = now
+        self.progressHandler?(device, self.progress(of: queue))
+    }
+
+    private func progress(of queue: DeviceQueue) -> Progress {
+        let bytesSent = queue.bytesSent
+        let elapsed = CACurrentMediaTime() - queue.startTime
+        var estimatedTimeLeft: TimeInterval? = nil
+        if bytesSent > 0 && elapsed > 0.0 {
+            let throughput = Double(bytesSent) / elapsed
+            estimatedTimeLeft = Double(queue.bytesTotal - bytesSent) / throughput
+        }
+        return Progress(filesTotal: queue.filesTotal, filesCompleted: queue.filesCompleted, filesFailed: queue.filesFailed, bytesTotal: queue.bytesTotal, bytesSent: bytesSent, estimatedTimeLeft: estimatedTimeLeft)
+    }
+
+    private static func fileSize(of url: URL) -> Int64? {
+        guard let values = try? url.resourceValues(forKeys: [.isDirectoryKey, .fileSizeKey]) else { return nil }
+        guard values.isDirectory != true else { return nil }
+        return Int64(values.fileSize ?? 0)
+    }
+}
@@ -45,7 +45,7 @@ public class TelephonyService: Service, UserNotificationActionHandler {
     
     // MARK: Private properties
     
-    private var pendingSMSPackets: [NSUserNotification.Id:([DataPacket], Timer)] = [:]
+    private let smsReassembler = PacketReassembler()
     private lazy var sendMessageController = SendMessageWindowController.loadController()
     
     
@@ -53,8 +53,8 @@ public class TelephonyService: Service, UserNotificationActionHandler {
     
     public static let serviceId: Service.Id = "com.soduto.services.telephony"
     
-    public let incomingCapabilities = Set<Service.Capability>([ DataPacket.telephonyPacketType ])
-    public let outgoingCapabilities = Set<Service.Capability>([ DataPacket.telephonyRequestPacketType, DataPacket.smsRequestPacketType ])
+    public static let incomingCapabilities = Set<Service.Capability>([ DataPacket.telephonyPacketType ])
+    public static let outgoingCapabilities = Set<Service.Capability>([ DataPacket.telephonyRequestPacketType, DataPacket.smsRequestPacketType ])
     
     
     // MARK: Service methods
@@ -310,28 +310,17 @@ public class TelephonyService: Service, UserNotificationActionHandler {
         // One SMS might come in chunks - try waiting for all chunks before showing notification.
         // Although showSmsNotification(for:from) also performs concatenation, it is not enough.
         // Packets may come out of order - the case that is not handled by showSmsNotification(for:from)
-        // So we are dealing with the later here
+        // So we are dealing with the later here. Protocol does not tell how many chunks there are,
+        // so reassembler relies on its adaptive timeout.
         
         guard let id = notificationId(for: packet, from: device) else { return }
         
-        var packets: [DataPacket] = []
-        if let (prevPackets, prevTimer) = pendingSMSPackets[id] {
-            prevTimer.invalidate()
-            packets = prevPackets
-        }
-        packets.append(packet)
-        
-        let timer = Timer.compatScheduledTimer(withTimeInterval: 5.0, repeats: false) { _ in
+        self.smsReassembler.add(packet, toGroup: id) { packets in
             do {
-                guard let (prevPackets, _) = self.pendingSMSPackets.removeValue(forKey: id) else { return }
-                
-                let sortedPackets = prevPackets.sorted(by: { (packet1, packet2) -> Bool in
-                    return packet1.id < packet2.id
-                })
-                let messages = try sortedPackets.map { try $0.getMessageBody() ?? "" }
+                let messages = try packets.map { try $0.getMessageBody() ?? "" }
                 let concatenedMessage = messages.joined()
                 
-                guard let lastPacket = sortedPackets.last else { return }
+                guard let lastPacket = packets.last else { return }
                 
                 var packet = lastPacket
                 var body = packet.body
@@ -344,8 +333,6 @@ public class TelephonyService: Service, UserNotificationActionHandler {
                 Log.error?.message("Failed to handle SMS packets: \(error)")
             }
         }
-        
-        pendingSMSPackets[id] = (packets, timer)
     }
 }
 
@@ -383,7 +370,7 @@ fileprivate extension DataPacket {
         case phoneNumber = "phoneNumber"        // (string)
         case contactName = "contactName"        // (string)
         case messageBody = "messageBody"        // (string)
-        case phoneThumbnail = "phoneThumbnail"  // (bytes)
+        case phoneThumbnail = "phoneThumbnail"  // (string): base64 encoded image
         case action = "action"                  // (string): 'mute' for muting the phone
         case sendSms = "sendSms"                // (boolean): true to send sms
         case isCancel = "isCancel"              // (boolean): cancel previous event
@@ -406,11 +393,13 @@ fileprivate extension DataPacket {
     // MARK: Public static methods
     
     static func smsRequestPacket(phoneNumber: String, message: String) -> DataPacket {
-        return DataPacket(type: smsRequestPacketType, body: [
+        var packet = DataPacket(type: smsRequestPacketType, body: [
             TelephonyProperty.sendSms.rawValue: NSNumber(value: true),
             TelephonyProperty.phoneNumber.rawValue: phoneNumber as AnyObject,
             TelephonyProperty.messageBody.rawValue: message as AnyObject
         ])
+        packet.offloadableProperty = TelephonyProperty.messageBody.rawValue
+        return packet
     }
     
     static func mutePhonePacket() -> DataPacket {
@@ -453,9 +442,25 @@ fileprivate extension DataPacket {
     func getPhoneThumbnail() throws -> NSImage? {
         try self.validateTelephonyType()
         guard body.keys.contains(TelephonyProperty.phoneThumbnail.rawValue) else { return nil }
-        guard let data = body[TelephonyProperty.phoneThumbnail.rawValue] as? Data else { throw TelephonyError.invalidEvent }
-        guard let image = NSImage(data: data) else { throw TelephonyError.invalidEvent }
-        return image
+        
+        // Thumbnail comes base64 encoded - cache it by its encoded form, so repeated events
+        // of the same contact do not need to decode anything
+        if let encoded = body[TelephonyProperty.phoneThumbnail.rawValue] as? String {
+            let key = ImageCache.key(for: Data(encoded.utf8))
+            if let image = ImageCache.shared.image(forKey: key) {
+                return image
+            }
+            guard let data = Data(base64Encoded: encoded, options: .ignoreUnknownCharacters) else { throw TelephonyError.invalidPhoneThumbnail }
+            guard let image = ImageCache.shared.store(data, forKey: key) else { throw TelephonyError.invalidPhoneThumbnail }
+            return image
+        }
+        else if let data = body[TelephonyProperty.phoneThumbnail.rawValue] as? Data {
+            guard let image = ImageCache.shared.image(for: data) else { throw TelephonyError.invalidPhoneThumbnail }
+            return image
+        }
+        else {
+            throw TelephonyError.invalidPhoneThumbnail
+        }
     }
     
     func getCancelFlag() throws -> Bool {
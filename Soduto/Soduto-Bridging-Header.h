@@ -5,6 +5,7 @@
 #import "MyAnonymousIdentity.h"
 #import "SimplePing.h"
 #import "IO.h"
+#import "Atomic.h"
 #import "CertificateUtils.h"
 #import <CommonCrypto/CommonCrypto.h>
 
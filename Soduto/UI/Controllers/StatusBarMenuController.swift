@@ -161,7 +161,7 @@ public class StatusBarMenuController: NSObject, NSWindowDelegate, NSMenuDelegate
     private func batteryImage(for device: Device) -> NSImage? {
         assert(self.serviceManager != nil, "serviceManager property is not setup correctly")
         guard let serviceManager = self.serviceManager else { return nil }
-        guard let service = serviceManager.services.first(where: { $0 is BatteryService }) as? BatteryService else { return nil }
+        guard let service = serviceManager.service(ofType: BatteryService.self) else { return nil }
         guard let batteryStatus = service.statuses.first(where: { $0.key == device.id })?.value else { return nil }
 
         var rect = NSRect(x: 0, y: 0, width: 24, height: 13)
@@ -56,23 +56,23 @@ class BrowserWindowController: NSWindowController {
     }
     
     @IBOutlet weak var collectionView: NSCollectionView!
-    @IBOutlet weak var itemArrayController: NSArrayController!
     @IBOutlet weak var iconsSizeSlider: NSSlider!
     @IBOutlet weak var statusLabel: NSTextField!
     @IBOutlet weak var progressIndicator: NSProgressIndicator!
     @IBOutlet weak var pathControl: NSPathControl!
     
-    @objc private var items: [FileItem] = [] {
-        didSet {
+    @objc private var items: [FileItem] {
+        get { return self.itemIndex.items }
+        set {
+            self.itemIndex.setItems(newValue)
             updateBusyItems()
-            self.itemArrayController.content = self.items
         }
     }
-    fileprivate var arrangedItems: [FileItem] {
-        guard let items = self.itemArrayController.arrangedObjects as? [FileItem] else { assertionFailure("arrangedObjects could not be converted into array of FileItem"); return [] }
-        return items
-    }
+    fileprivate var arrangedItems: [FileItem] { return self.itemIndex.arrangedItems }
+    private let itemIndex = FileItemIndex()
     private var freeSpace: Int64?
+    private var loadGeneration: Int = 0 // incremented with each load, to ignore results of superseded loads
+    private var loadTask: Executor.Task? // streaming load in progress, cancelled when superseded
     
     public let fileSystem: FileSystem
     public private(set) var url: URL
@@ -158,19 +158,53 @@ class BrowserWindowController: NSWindowController {
     
     private func loadContents() {
         let url = self.url
+        self.loadGeneration += 1
+        let generation = self.loadGeneration
+        self.loadTask?.cancel()
+        self.loadTask = nil
         self.isLoadingContents = true
         self.items = []
         self.collectionView.reloadData()
         updateProgress()
         updateStatusInfo()
         
+        if let streamingFileSystem = self.fileSystem as? StreamingFileSystem {
+            self.loadTask = streamingFileSystem.load(url, batchHandler: { batch in
+                guard generation == self.loadGeneration else { return }
+                self.appendLoadedItems(batch)
+            }, completionHandler: { freeSpace, error in
+                guard generation == self.loadGeneration else { return }
+                self.loadTask = nil
+                self.isLoadingContents = false
+                self.freeSpace = freeSpace
+                self.updateProgress()
+                if let error = error {
+                    Log.error?.message("Failed to load items from [\(url)] with error: \(error)")
+                }
+                if !self.busyURLs.isEmpty {
+                    self.updateBusyItems()
+                    self.collectionView.reloadData()
+                }
+                self.updateStatusInfo()
+            })
+            return
+        }
+        
+        // Completion handler may be called more than once - with cached contents first and refreshed ones later
         self.fileSystem.load(url) { (items, freeSpace, error) in
+            guard generation == self.loadGeneration else { return }
+            let isFirstResult = self.isLoadingContents
             self.isLoadingContents = false
             self.updateProgress()
             if let items = items {
-                self.items = items
                 self.freeSpace = freeSpace
-                self.collectionView.reloadData()
+                if isFirstResult {
+                    self.items = items
+                    self.collectionView.reloadData()
+                }
+                else {
+                    self.mergeLoadedItems(items)
+                }
                 self.updateStatusInfo()
             }
             else {
@@ -179,6 +213,67 @@ class BrowserWindowController: NSWindowController {
         }
     }
     
+    /// Add a batch of streamed items, inserting only them into collection view
+    private func appendLoadedItems(_ batch: [FileItem]) {
+        let positions = self.itemIndex.append(batch)
+        guard !positions.isEmpty else { return }
+        self.collectionView.insertItems(at: Set(positions.map { IndexPath(indexes: [0, $0]) }))
+        updateStatusInfo()
+    }
+    
+    /// Replace displayed items with refreshed ones, updating only the changed part of collection view
+    private func mergeLoadedItems(_ loadedItems: [FileItem]) {
+        let oldUrls = self.arrangedItems.map { $0.url }
+        var oldItems: [URL: FileItem] = [:]
+        for item in self.items {
+            oldItems[item.url] = item
+        }
+        
+        var changedUrls = Set<URL>()
+        for item in loadedItems {
+            guard let oldItem = oldItems[item.url], oldItem !== item else { continue }
+            item.dynamicFlags = oldItem.dynamicFlags
+            changedUrls.insert(item.url)
+        }
+        
+        self.items = loadedItems
+        
+        let newUrls = self.arrangedItems.map { $0.url }
+        let oldUrlSet = Set(oldUrls)
+        let newUrlSet = Set(newUrls)
+        
+        // Incremental update is possible only if items that stay did not change their relative order
+        guard oldUrls.filter({ newUrlSet.contains($0) }) == newUrls.filter({ oldUrlSet.contains($0) }) else {
+            self.collectionView.reloadData()
+            return
+        }
+        
+        var deletedIndexPaths: Set<IndexPath> = []
+        for (i, url) in oldUrls.enumerated() where !newUrlSet.contains(url) {
+            deletedIndexPaths.insert(IndexPath(indexes: [0, i]))
+        }
+        var insertedIndexPaths: Set<IndexPath> = []
+        var changedIndexPaths: Set<IndexPath> = []
+        for (i, url) in newUrls.enumerated() {
+            if !oldUrlSet.contains(url) {
+                insertedIndexPaths.insert(IndexPath(indexes: [0, i]))
+            }
+            else if changedUrls.contains(url) {
+                changedIndexPaths.insert(IndexPath(indexes: [0, i]))
+            }
+        }
+        
+        if !deletedIndexPaths.isEmpty || !insertedIndexPaths.isEmpty {
+            self.collectionView.performBatchUpdates({
+                self.collectionView.deleteItems(at: deletedIndexPaths)
+                self.collectionView.insertItems(at: insertedIndexPaths)
+            }, completionHandler: nil)
+        }
+        if !changedIndexPaths.isEmpty {
+            self.collectionView.reloadItems(at: changedIndexPaths)
+        }
+    }
+    
     private func updateWindowTitle() {
         if self.fileSystem.isUnderRoot(self.url) {
             self.window?.title = "\(self.fileSystem.name) - \(self.url.lastPathComponent)"
@@ -260,21 +355,15 @@ class BrowserWindowController: NSWindowController {
     }
     
     private func updateFilter() {
-        self.itemArrayController.filterPredicate = NSPredicate(block: { (item, substitutions) -> Bool in
-            guard let fileItem = item as? FileItem else { return false }
-            guard !fileItem.isHidden || self.isHiddenFilesVisible else { return false }
-            return true
-        })
+        self.itemIndex.filter = self.isHiddenFilesVisible ? nil : { !$0.isHidden }
+        self.itemIndex.rearrange()
         self.collectionView.reloadData()
         updateStatusInfo()
     }
     
     private func updateSorting() {
-        var descriptors: [NSSortDescriptor] = []
-        if isFoldersAlwaysFirst {
-            descriptors.append(NSSortDescriptor(key: "isDirectory", ascending: false))
-        }
-        self.itemArrayController.sortDescriptors = descriptors
+        self.itemIndex.rank = isFoldersAlwaysFirst ? { $0.isDirectory ? 0 : 1 } : nil
+        self.itemIndex.rearrange()
         self.collectionView.reloadData()
         updateStatusInfo()
     }
@@ -337,7 +426,7 @@ class BrowserWindowController: NSWindowController {
     
     fileprivate func indexPaths<T: Collection>(for fileItems: T) -> Set<IndexPath> where T.Iterator.Element == FileItem {
         var paths: Set<IndexPath> = []
-        let arrangedItems: [FileItem] = (self.itemArrayController.arrangedObjects as? [FileItem]) ?? []
+        let arrangedItems = self.arrangedItems
         for i in 0 ..< arrangedItems.count {
             let url = arrangedItems[i].url
             guard fileItems.contains(where: { $0.url == url }) else { continue }
@@ -521,7 +610,6 @@ class BrowserWindowController: NSWindowController {
                     self.resetBusyUrl(srcUrl, reload: false)
                     let newFileItem = FileItem(url: destUrl)
                     self.items[index] = newFileItem
-                    self.itemArrayController.content = self.items
                     if let newIndexPath = self.indexPath(for: newFileItem) {
                         self.collectionView.moveItem(at: indexPath, to: newIndexPath)
                         self.collectionView.reloadItems(at: [newIndexPath])
@@ -650,7 +738,6 @@ class BrowserWindowController: NSWindowController {
         else {
             let fileItem = FileItem(url: url)
             self.items.append(fileItem)
-            self.itemArrayController.content = self.items
             if let indexPath = indexPath(for: fileItem) {
                 self.collectionView.insertItems(at: [indexPath])
             }
@@ -673,7 +760,7 @@ class BrowserWindowController: NSWindowController {
     private func removeDeletedItems() {
         // To avoid full reload of collection view, find positions of deleted items and remove only those items
         var viewIndices: Set<IndexPath> = []
-        let arrangedItems: [FileItem] = (self.itemArrayController.arrangedObjects as? [FileItem]) ?? []
+        let arrangedItems = self.arrangedItems
         for i in 0 ..< arrangedItems.count {
             guard arrangedItems[i].flags.contains(.isDeleted) else { continue }
             viewIndices.insert(IndexPath(indexes: [0, i]))
@@ -936,6 +1023,8 @@ class BrowserWindowController: NSWindowController {
 extension BrowserWindowController: NSWindowDelegate {
     
     func windowWillClose(_ notification: Notification) {
+        self.loadTask?.cancel()
+        self.loadTask = nil
         self.delegate?.browserWindowWillClose(self)
     }
     
@@ -1171,8 +1260,12 @@ extension BrowserWindowController: NSCollectionViewDelegate {
     
     /* Sent to notify the delegate that the CollectionView is about to add an NSCollectionViewItem.  The indexPath identifies the object that the item represents.
      */
-//    @available(OSX 10.11, *)
-//    optional public func collectionView(_ collectionView: NSCollectionView, willDisplay item: NSCollectionViewItem, forRepresentedObjectAt indexPath: IndexPath)
+    public func collectionView(_ collectionView: NSCollectionView, willDisplay item: NSCollectionViewItem, forRepresentedObjectAt indexPath: IndexPath) {
+        // Thumbnails are requested only for items being displayed
+        guard let iconItem = item as? IconItem else { return }
+        let scale = self.window?.backingScaleFactor ?? 1.0
+        iconItem.loadThumbnail(maxPixelSize: Int(CGFloat(self.iconsSize) * scale), fileSystem: self.fileSystem)
+    }
     
     
     /* Sent to notify the delegate that the CollectionView is about to add a supplementary view (e.g. a section header or footer view).  Each NSCollectionViewLayout class defines its own possible values and associated meanings for "elementKind".  (For example, NSCollectionViewFlowLayout declares NSCollectionElementKindSectionHeader and NSCollectionElementKindSectionFooter.)
@@ -1183,8 +1276,9 @@ extension BrowserWindowController: NSCollectionViewDelegate {
     
     /* Sent to notify the delegate that the CollectionView is no longer displaying the given NSCollectionViewItem instance.  This happens when the model changes, or when an item is scrolled out of view.  You should perform any actions necessary to help decommission the item (such as releasing expensive resources).  The CollectionView may retain the item instance and later reuse it to represent the same or a different model object.
      */
-//    @available(OSX 10.11, *)
-//    optional public func collectionView(_ collectionView: NSCollectionView, didEndDisplaying item: NSCollectionViewItem, forRepresentedObjectAt indexPath: IndexPath)
+    public func collectionView(_ collectionView: NSCollectionView, didEndDisplaying item: NSCollectionViewItem, forRepresentedObjectAt indexPath: IndexPath) {
+        (item as? IconItem)?.cancelThumbnail()
+    }
     
     
     /* Sent to notify the delegate that the CollectionView is no longer displaying the given supplementary view. This happens when the model changes, or when a supplementary view is scrolled out of view. You should perform any actions necessary to help decommission the view (such as releasing expensive resources). The CollectionView may retain the view and later reuse it. */
@@ -0,0 +1,137 @@
+//
+//  DirectoryListingCache.swift
+//  SodutoBrowser
+//
+//  Created by Giedrius Stanevičius on 2018-03-27.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+
+/// Cache of directory listings, keyed by directory path. Listings keep enough information about their entries
+/// (modification dates and sizes) to tell whether a fresh listing differs, so that unchanged file items can be
+/// reused instead of rebuilt, and whether directory itself changed since it was listed.
+///
+/// Thread safe.
+class DirectoryListingCache {
+
+    // MARK: Types
+
+    /// What is known about a directory entry to tell whether it changed
+    struct Signature: Equatable {
+        let isDirectory: Bool
+        let size: UInt64?
+        let modificationDate: Date?
+
+        static func ==(lhs: Signature, rhs: Signature) -> Bool {
+            return lhs.isDirectory == rhs.isDirectory && lhs.size == rhs.size && lhs.modificationDate == rhs.modificationDate
+        }
+    }
+
+    struct Entry {
+        let item: FileItem
+        let signature: Signature
+    }
+
+    struct Listing {
+        let entries: [Entry]
+        let freeSpace: Int64?
+        /// Modification date of the directory itself at the time of listing
+        let directoryModificationDate: Date?
+        /// When the listing was made
+        let date: Date
+
+        var items: [FileItem] { return self.entries.map { $0.item } }
+
+        /// Whether another listing of the same directory has the same entries
+        func hasSameEntries(as other: Listing) -> Bool {
+            guard self.entries.count == other.entries.count else { return false }
+            for (entry, otherEntry) in zip(self.entries, other.entries) {
+                guard entry.item === otherEntry.item else { return false }
+            }
+            return true
+        }
+    }
+
+
+    // MARK: Properties
+
+    static let defaultCapacity = 64
+    /// Age after which listing is reloaded even if directory modification date did not change
+    static let maxListingAge: TimeInterval = 60.0
+    /// Modification dates have a resolution of one second - listings made within the same second as
+    /// a modification may miss it, so they can not be validated by modification date
+    static let modificationDateResolution: TimeInterval = 1.0
+
+    let capacity: Int
+
+    private let lock = NSLock()
+    private var listings: [String: Listing] = [:]
+    private var accessOrder: [String] = [] // least recently used first
+
+
+    // MARK: Setup / Cleanup
+
+    init(capacity: Int = DirectoryListingCache.defaultCapacity) {
+        self.capacity = capacity
+    }
+
+
+    // MARK: Public methods
+
+    func listing(for path: String) -> Listing? {
+        self.lock.lock()
+        defer { self.lock.unlock() }
+
+        guard let listing = self.listings[path] else { return nil }
+        self.touch(path)
+        return listing
+    }
+
+    func store(_ listing: Listing, for path: String) {
+        self.lock.lock()
+        defer { self.lock.unlock() }
+
+        self.listings[path] = listing
+        self.touch(path)
+        while self.accessOrder.count > self.capacity {
+            let evictedPath = self.accessOrder.removeFirst()
+            self.listings.removeValue(forKey: evictedPath)
+        }
+    }
+
+    func invalidate(_ path: String) {
+        self.lock.lock()
+        defer { self.lock.unlock() }
+
+        self.listings.removeValue(forKey: path)
+        if let index = self.accessOrder.index(of: path) {
+            self.accessOrder.remove(at: index)
+        }
+    }
+
+    func invalidateAll() {
+        self.lock.lock()
+        defer { self.lock.unlock() }
+
+        self.listings = [:]
+        self.accessOrder = []
+    }
+
+    /// Whether cached listing may still be used, given current modification date of the directory
+    func isValid(_ listing: Listing, directoryModificationDate: Date?) -> Bool {
+        guard let modificationDate = directoryModificationDate, modificationDate == listing.directoryModificationDate else { return false }
+        guard listing.date.timeIntervalSince(modificationDate) >= DirectoryListingCache.modificationDateResolution else { return false }
+        return Date().timeIntervalSince(listing.date) < DirectoryListingCache.maxListingAge
+    }
+
+
+    // MARK: Private methods
+
+    private func touch(_ path: String) {
+        if let index = self.accessOrder.index(of: path) {
+            self.accessOrder.remove(at: index)
+        }
+        self.accessOrder.append(path)
+    }
+}
@@ -0,0 +1,231 @@
+//
+//  FileIconProvider.swift
+//  SodutoBrowser
+//
+//  Created by Giedrius Stanevičius on 2018-03-29.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import AppKit
+import ImageIO
+import CleanroomLogger
+
+/// File system able to read beginning of a file, enough for image thumbnail to be decoded from it
+protocol PartialReadingFileSystem: FileSystem {
+
+    /// Synchronously read at most `maxLength` first bytes of a file under rootUrl
+    func readData(at url: URL, maxLength: Int) throws -> Data
+}
+
+
+/// Source of file icons and thumbnails for the browser.
+///
+/// Generic icons are looked up once per file type and shared by all items of that type, so that listing
+/// directories does not ask NSWorkspace for an icon of each file. Thumbnails of images (and specific icons of
+/// local files, e.g. applications or folders with custom icons) are made on background queue when items are
+/// displayed. They are kept in a bounded memory cache and in an on-disk cache, keyed by file URL, size and
+/// modification date, so that changed files get new thumbnails.
+///
+/// Thread safe. Thumbnail completion handlers are called on main queue.
+class FileIconProvider {
+
+    // MARK: Properties
+
+    static let shared = FileIconProvider()
+
+    /// Memory used by cached thumbnails, in bytes
+    static let memoryCacheLimit = 64 * 1024 * 1024
+    /// Disk space used by cached thumbnails, in bytes. Cache is trimmed to this size at startup.
+    static let diskCacheLimit: UInt64 = 128 * 1024 * 1024
+    /// How much of a remote file is read for decoding its thumbnail. Most photos have an embedded thumbnail
+    /// in their metadata at the beginning of the file.
+    static let remotePrefixLength = 256 * 1024
+    /// Largest local image decoded in full if it has no embedded thumbnail
+    static let maxDecodedFileSize = 64 * 1024 * 1024
+
+    private let typeIconsLock = NSLock()
+    private var typeIcons: [String: NSImage] = [:]
+    private let memoryCache = NSCache<NSString, NSImage>()
+    private let diskCacheUrl: URL?
+
+
+    // MARK: Setup / Cleanup
+
+    init() {
+        self.memoryCache.totalCostLimit = FileIconProvider.memoryCacheLimit
+
+        let cachesUrl = try? FileManager.default.url(for: .cachesDirectory, in: .userDomainMask, appropriateFor: nil, create: true)
+        let bundleId = Bundle.main.bundleIdentifier ?? "com.soduto.SodutoBrowser"
+        self.diskCacheUrl = cachesUrl?.appendingPathComponent(bundleId, isDirectory: true).appendingPathComponent("Thumbnails", isDirectory: true)
+        if let diskCacheUrl = self.diskCacheUrl {
+            try? FileManager.default.createDirectory(at: diskCacheUrl, withIntermediateDirectories: true, attributes: nil)
+            Executor.shared.submit(.background) { FileIconProvider.trimDiskCache(at: diskCacheUrl) }
+        }
+    }
+
+
+    // MARK: Public methods
+
+    /// Generic icon of files of given type (file name extension or UTI)
+    func icon(forFileType fileType: String) -> NSImage {
+        self.typeIconsLock.lock()
+        defer { self.typeIconsLock.unlock() }
+
+        if let icon = self.typeIcons[fileType] {
+            return icon
+        }
+        let icon = NSWorkspace.shared.icon(forFileType: fileType)
+        self.typeIcons[fileType] = icon
+        return icon
+    }
+
+    /// Generic icon of the file at URL, based on its type
+    func icon(for url: URL, isDirectory: Bool) -> NSImage {
+        return icon(forFileType: isDirectory ? String(kUTTypeFolder) : url.pathExtension.lowercased())
+    }
+
+    /// Start making thumbnail (or specific icon) of file item. Completion handler is called only if there is
+    /// a better image than the generic icon of the item. Returns task that may be cancelled if the image
+    /// is no longer needed, nil if completion handler was called right away or if there is nothing to do.
+    func thumbnail(for fileItem: FileItem, maxPixelSize: Int, fileSystem: FileSystem, completionHandler: @escaping (NSImage) -> Void) -> Executor.Task? {
+        guard !fileItem.isDeleted else { return nil }
+        let isLocal = fileItem.url.isFileURL
+        let isImage = FileIconProvider.isImage(fileItem.url)
+        let reader = fileSystem as? PartialReadingFileSystem
+        guard isLocal || (isImage && reader != nil && fileSystem.isUnderRoot(fileItem.url)) else { return nil }
+
+        let pixelSize = FileIconProvider.bucketedPixelSize(maxPixelSize)
+        let key = FileIconProvider.cacheKey(for: fileItem, pixelSize: pixelSize)
+        if let image = self.memoryCache.object(forKey: key as NSString) {
+            completionHandler(image)
+            return nil
+        }
+
+        let url = fileItem.url
+        let isDiskCacheable = isImage && fileItem.size != nil && fileItem.modificationDate != nil
+        return Executor.shared.submit(.background) { [weak self] in
+            guard let `self` = self, let currentTask = Executor.currentTask else { return }
+
+            var image: NSImage? = nil
+            if isDiskCacheable {
+                image = self.diskCachedImage(forKey: key)
+            }
+            if image == nil && isImage {
+                let source: CGImageSource?
+                if isLocal {
+                    source = CGImageSourceCreateWithURL(url as CFURL, nil)
+                }
+                else {
+                    let data = try? reader!.readData(at: url, maxLength: FileIconProvider.remotePrefixLength)
+                    source = data.flatMap { CGImageSourceCreateWithData($0 as CFData, nil) }
+                }
+                // Local images are decoded in full if there is no embedded thumbnail, remote ones have only a prefix
+                let canDecodeImage = isLocal && (fileItem.size ?? Int64.max) <= Int64(FileIconProvider.maxDecodedFileSize)
+                if let cgImage = source.flatMap({ FileIconProvider.thumbnail(from: $0, pixelSize: pixelSize, decodingImage: canDecodeImage) }) {
+                    image = NSImage(cgImage: cgImage, size: NSSize(width: cgImage.width, height: cgImage.height))
+                    if isDiskCacheable {
+                        self.storeDiskCachedImage(cgImage, forKey: key)
+                    }
+                }
+            }
+            if image == nil && isLocal {
+                image = NSWorkspace.shared.icon(forFile: url.path)
+            }
+
+            guard let result = image else { return }
+            let cost = Int(result.size.width * result.size.height * 4.0)
+            self.memoryCache.setObject(result, forKey: key as NSString, cost: cost)
+            DispatchQueue.main.async {
+                guard !currentTask.isCancelled else { return }
+                completionHandler(result)
+            }
+        }
+    }
+
+
+    // MARK: Private methods
+
+    private static func isImage(_ url: URL) -> Bool {
+        let pathExtension = url.pathExtension
+        guard !pathExtension.isEmpty else { return false }
+        guard let uti = UTTypeCreatePreferredIdentifierForTag(kUTTagClassFilenameExtension, pathExtension as CFString, nil)?.takeRetainedValue() else { return false }
+        return UTTypeConformsTo(uti, kUTTypeImage)
+    }
+
+    /// Thumbnails are made in a few sizes only, so that resizing icons does not make new thumbnails for each size
+    private static func bucketedPixelSize(_ pixelSize: Int) -> Int {
+        var bucket = 64
+        while bucket < pixelSize && bucket < 1024 {
+            bucket *= 2
+        }
+        return bucket
+    }
+
+    private static func cacheKey(for fileItem: FileItem, pixelSize: Int) -> String {
+        let size = fileItem.size.map { String($0) } ?? "-"
+        let modificationDate = fileItem.modificationDate.map { String($0.timeIntervalSinceReferenceDate) } ?? "-"
+        return "\(fileItem.url.absoluteString)|\(size)|\(modificationDate)|\(pixelSize)"
+    }
+
+    private static func thumbnail(from source: CGImageSource, pixelSize: Int, decodingImage: Bool) -> CGImage? {
+        let options: [CFString: Any] = [
+            kCGImageSourceThumbnailMaxPixelSize: pixelSize,
+            kCGImageSourceCreateThumbnailWithTransform: true,
+            kCGImageSourceCreateThumbnailFromImageIfAbsent: decodingImage
+        ]
+        return CGImageSourceCreateThumbnailAtIndex(source, 0, options as CFDictionary)
+    }
+
+
+    // MARK: Disk cache
+
+    private func diskCacheFileUrl(forKey key: String) -> URL? {
+        // FNV-1a hash of the key is used as file name
+        var hash: UInt64 = 0xcbf29ce484222325
+        for byte in key.utf8 {
+            hash = (hash ^ UInt64(byte)) &* 0x100000001b3
+        }
+        return self.diskCacheUrl?.appendingPathComponent(String(format: "%016llx.png", hash))
+    }
+
+    private func diskCachedImage(forKey key: String) -> NSImage? {
+        guard let fileUrl = diskCacheFileUrl(forKey: key) else { return nil }
+        guard let source = CGImageSourceCreateWithURL(fileUrl as CFURL, nil) else { return nil }
+        guard let cgImage = CGImageSourceCreateImageAtIndex(source, 0, nil) else { return nil }
+        // Modification date tells which thumbnails were used recently when trimming the cache
+        try? FileManager.default.setAttributes([.modificationDate: Date()], ofItemAtPath: fileUrl.path)
+        return NSImage(cgImage: cgImage, size: NSSize(width: cgImage.width, height: cgImage.height))
+    }
+
+    private func storeDiskCachedImage(_ image: CGImage, forKey key: String) {
+        guard let fileUrl = diskCacheFileUrl(forKey: key) else { return }
+        guard let data = NSBitmapImageRep(cgImage: image).representation(using: .png, properties: [:]) else { return }
+        do {
+            try data.write(to: fileUrl, options: .atomic)
+        }
+        catch {
+            Log.error?.message("Failed to write thumbnail to cache at [\(fileUrl)]: \(error)")
+        }
+    }
+
+    /// Remove least recently modified thumbnails until cache fits its size limit
+    private static func trimDiskCache(at url: URL) {
+        let keys: [URLResourceKey] = [.fileSizeKey, .contentModificationDateKey]
+        guard let fileUrls = try? FileManager.default.contentsOfDirectory(at: url, includingPropertiesForKeys: keys, options: [.skipsHiddenFiles]) else { return }
+
+        var files: [(url: URL, size: UInt64, date: Date)] = fileUrls.flatMap { (fileUrl) -> (url: URL, size: UInt64, date: Date)? in
+            guard let values = try? fileUrl.resourceValues(forKeys: Set(keys)) else { return nil }
+            return (url: fileUrl, size: UInt64(values.fileSize ?? 0), date: values.contentModificationDate ?? Date.distantPast)
+        }
+        var totalSize = files.reduce(UInt64(0)) { $0 + $1.size }
+        guard totalSize > FileIconProvider.diskCacheLimit else { return }
+
+        files.sort { $0.date < $1.date }
+        for file in files {
+            guard totalSize > FileIconProvider.diskCacheLimit else { break }
+            try? FileManager.default.removeItem(at: file.url)
+            totalSize -= file.size
+        }
+    }
+}
@@ -31,6 +31,9 @@ public class FileItem: NSObject, NSPasteboardReading, NSPasteboardWriting {
     public let icon: NSImage
     public let staticFlags: Flags
     public var dynamicFlags: Flags = []
+    /// File size in bytes, nil if unknown or item is a directory
+    public let size: Int64?
+    public let modificationDate: Date?
     
     public var flags: Flags { return self.staticFlags.union(self.dynamicFlags) }
     @objc dynamic public var isDirectory: Bool { return self.flags.contains(.isDirectory) }
@@ -42,25 +45,29 @@ public class FileItem: NSObject, NSPasteboardReading, NSPasteboardWriting {
     @objc dynamic public var canRead: Bool { return self.isReadable && !self.isBusy && !self.isDeleted }
     @objc dynamic public var canModify: Bool { return self.isWritable && !self.isBusy && !self.isDeleted }
     
-    public init(url: URL, name: String, icon: NSImage, flags: Flags) {
+    public init(url: URL, name: String, icon: NSImage, flags: Flags, size: Int64? = nil, modificationDate: Date? = nil) {
         self.url = url
         self.name = name
         self.icon = icon
         self.staticFlags = flags
+        self.size = size
+        self.modificationDate = modificationDate
     }
     
     public convenience init(url: URL) {
         if url.isFileURL {
-            let icon = NSWorkspace.shared.icon(forFile: url.path)
+            // Specific icon of the file (if it has one) is loaded later by FileIconProvider, when item is displayed
             do {
-                let resourceValues = try url.resourceValues(forKeys: [URLResourceKey.isHiddenKey, URLResourceKey.localizedNameKey, URLResourceKey.isDirectoryKey])
+                let resourceValues = try url.resourceValues(forKeys: [URLResourceKey.isHiddenKey, URLResourceKey.localizedNameKey, URLResourceKey.isDirectoryKey, URLResourceKey.fileSizeKey, URLResourceKey.contentModificationDateKey])
                 let name = resourceValues.localizedName ?? url.lastPathComponent
                 var flags: Flags = []
                 if resourceValues.isDirectory == true { flags.insert(.isDirectory) }
                 if resourceValues.isHidden == true { flags.insert(.isHidden) }
                 if FileManager.default.isReadableFile(atPath: url.path) { flags.insert(.isReadable) }
                 if FileManager.default.isWritableFile(atPath: url.path) { flags.insert(.isWritable) }
-                self.init(url: url, name: name, icon: icon, flags: flags)
+                let icon = FileIconProvider.shared.icon(for: url, isDirectory: flags.contains(.isDirectory))
+                let size = resourceValues.fileSize.map { Int64($0) }
+                self.init(url: url, name: name, icon: icon, flags: flags, size: size, modificationDate: resourceValues.contentModificationDate)
             }
             catch {
                 Log.error?.message("Failed retrieving file resource information for url [\(url)]: \(error)")
@@ -70,6 +77,7 @@ public class FileItem: NSObject, NSPasteboardReading, NSPasteboardWriting {
                 if url.lastPathComponent.hasPrefix(".") { flags.insert(.isHidden) }
                 if FileManager.default.isReadableFile(atPath: url.path) { flags.insert(.isReadable) }
                 if FileManager.default.isWritableFile(atPath: url.path) { flags.insert(.isWritable) }
+                let icon = FileIconProvider.shared.icon(for: url, isDirectory: flags.contains(.isDirectory))
                 self.init(url: url, name: name, icon: icon, flags: flags)
             }
         }
@@ -78,8 +86,7 @@ public class FileItem: NSObject, NSPasteboardReading, NSPasteboardWriting {
             var flags: Flags = [.isReadable, .isWritable]
             if url.hasDirectoryPath { flags.insert(.isDirectory) }
             if url.lastPathComponent.hasPrefix(".") { flags.insert(.isHidden) }
-            let fileType: String = flags.contains(.isDirectory) ? String(kUTTypeDirectory) : url.pathExtension
-            let icon = NSWorkspace.shared.icon(forFileType: fileType)
+            let icon = FileIconProvider.shared.icon(for: url, isDirectory: flags.contains(.isDirectory))
             self.init(url: url, name: name, icon: icon, flags: flags)
 
         }
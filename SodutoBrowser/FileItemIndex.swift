@@ -0,0 +1,91 @@
+//
+//  FileItemIndex.swift
+//  SodutoBrowser
+//
+//  Created by Giedrius Stanevičius on 2018-03-28.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+
+/// Filtered and sorted view of file items, that can be extended incrementally. Items are arranged by rank
+/// (e.g. folders first) and then by the order they were added in, so that a batch of new items can be merged
+/// into already arranged ones without sorting everything again.
+///
+/// Not thread safe - expected to be used on the main queue.
+class FileItemIndex {
+
+    // MARK: Properties
+
+    /// Tells whether item should be visible. All items are visible if nil.
+    var filter: ((FileItem) -> Bool)? = nil
+    /// Items with lower rank go first. Items are kept in the order they were added if nil.
+    var rank: ((FileItem) -> Int)? = nil
+
+    /// All items in the order they were added
+    private(set) var items: [FileItem] = []
+    /// Visible items in the order they should be shown
+    private(set) var arrangedItems: [FileItem] = []
+
+
+    // MARK: Public methods
+
+    /// Replace all items
+    func setItems(_ items: [FileItem]) {
+        self.items = []
+        self.arrangedItems = []
+        _ = append(items)
+    }
+
+    /// Arrange all items again, e.g. after filter or rank changes
+    func rearrange() {
+        setItems(self.items)
+    }
+
+    /// Add items after existing ones. Returns positions of newly visible items in updated `arrangedItems`.
+    func append(_ newItems: [FileItem]) -> [Int] {
+        var visibleItems: [FileItem] = []
+        for item in newItems {
+            self.items.append(item)
+            if self.filter?(item) ?? true {
+                visibleItems.append(item)
+            }
+        }
+        guard !visibleItems.isEmpty else { return [] }
+
+        // New items go after existing ones of the same rank, so a stable sort by rank arranges them
+        // and a single merge pass puts them in place
+        let keyedItems: [(rank: Int, item: FileItem)]
+        if let rank = self.rank {
+            keyedItems = visibleItems.enumerated()
+                .map { (offset: $0.offset, rank: rank($0.element), item: $0.element) }
+                .sorted { $0.rank != $1.rank ? $0.rank < $1.rank : $0.offset < $1.offset }
+                .map { (rank: $0.rank, item: $0.item) }
+        }
+        else {
+            keyedItems = visibleItems.map { (rank: 0, item: $0) }
+        }
+
+        guard !self.arrangedItems.isEmpty else {
+            self.arrangedItems = keyedItems.map { $0.item }
+            return Array(0 ..< keyedItems.count)
+        }
+
+        var merged: [FileItem] = []
+        merged.reserveCapacity(self.arrangedItems.count + keyedItems.count)
+        var insertedPositions: [Int] = []
+        insertedPositions.reserveCapacity(keyedItems.count)
+        var existingIndex = 0
+        for keyedItem in keyedItems {
+            while existingIndex < self.arrangedItems.count && (self.rank?(self.arrangedItems[existingIndex]) ?? 0) <= keyedItem.rank {
+                merged.append(self.arrangedItems[existingIndex])
+                existingIndex += 1
+            }
+            insertedPositions.append(merged.count)
+            merged.append(keyedItem.item)
+        }
+        merged.append(contentsOf: self.arrangedItems[existingIndex...])
+        self.arrangedItems = merged
+        return insertedPositions
+    }
+}
@@ -84,6 +84,8 @@ protocol FileSystem: class {
     
     /// Read file list for provided URL. URL must reside under rootUrl.
     /// Completion handler is called with retrieved file itemArray, free disk space and error paraneters.
+    /// File systems that cache listings may call completion handler more than once - first with cached contents
+    /// and then with refreshed ones, if they differ.
     func load(_ url: URL, completionHandler: @escaping ([FileItem]?, Int64?, Error?)->Void)
     
     /// Delete file at provided URL. URL must reside under rootUrl
@@ -100,6 +102,17 @@ protocol FileSystem: class {
     func createFolder(_ url: URL) -> FileOperation
 }
 
+/// File system able to deliver directory contents progressively, while they are still being read
+protocol StreamingFileSystem: FileSystem {
+    
+    /// Read file list for provided URL in batches. URL must reside under rootUrl.
+    /// Batch handler is called with consecutive batches of file items as they are read, then completion handler is
+    /// called with free disk space and error parameters. Both handlers are called on main queue.
+    /// Cancelling returned task stops reading - handlers may then not be called at all.
+    @discardableResult
+    func load(_ url: URL, batchHandler: @escaping ([FileItem])->Void, completionHandler: @escaping (Int64?, Error?)->Void) -> Executor.Task
+}
+
 extension FileSystem {
     
     var defaultPlace: Place {
@@ -22,6 +22,9 @@ public class IconItem: NSCollectionViewItem {
     
     public var fileItem: FileItem? {
         didSet {
+            if self.fileItem !== oldValue {
+                cancelThumbnail()
+            }
             guard isViewLoaded else { return }
             if let fileItem = self.fileItem, !fileItem.flags.contains(.isDeleted) {
                 self.imageView?.image = fileItem.icon
@@ -52,6 +55,8 @@ public class IconItem: NSCollectionViewItem {
         }
     }
     
+    private var thumbnailTask: Executor.Task?
+    
     private func updateViewSelection() {
         self.iconView?.isSelected = self.isSelected || self.highlightState == .asDropTarget
     }
@@ -69,6 +74,31 @@ public class IconItem: NSCollectionViewItem {
         (self.view as? IconItemView)?.collectionItem = self
     }
     
+    public override func prepareForReuse() {
+        super.prepareForReuse()
+        cancelThumbnail()
+    }
+    
+    
+    // MARK: Thumbnails
+    
+    /// Replace generic icon with thumbnail or specific icon of the file, once it is available
+    public func loadThumbnail(maxPixelSize: Int, fileSystem: FileSystem) {
+        cancelThumbnail()
+        guard let fileItem = self.fileItem else { return }
+        
+        self.thumbnailTask = FileIconProvider.shared.thumbnail(for: fileItem, maxPixelSize: maxPixelSize, fileSystem: fileSystem) { [weak self] image in
+            guard let `self` = self, self.fileItem === fileItem, !fileItem.isDeleted else { return }
+            self.thumbnailTask = nil
+            self.imageView?.image = image
+        }
+    }
+    
+    public func cancelThumbnail() {
+        self.thumbnailTask?.cancel()
+        self.thumbnailTask = nil
+    }
+    
     
     // MARK: Editing
     
@@ -9,7 +9,14 @@
 import Foundation
 import AppKit
 
-class LocalFileSystem: FileSystem {
+class LocalFileSystem: StreamingFileSystem {
+    
+    /// Number of items in the first batch of streamed directory contents - kept small so that something is shown quickly
+    static let initialBatchSize = 64
+    /// Largest number of items in a batch of streamed directory contents
+    static let maxBatchSize = 1024
+    /// Resource values used by file items, fetched together with directory contents
+    private static let prefetchedResourceKeys: [URLResourceKey] = [.isHiddenKey, .localizedNameKey, .isDirectoryKey, .fileSizeKey, .contentModificationDateKey]
     
     weak var delegate: FileSystemDelegate?
     
@@ -24,10 +31,10 @@ class LocalFileSystem: FileSystem {
     }
     
     func load(_ url: URL, completionHandler: @escaping (([FileItem]?, Int64?, Error?) -> Void)) {
-        DispatchQueue.global(qos: .userInitiated).async { [weak self] in
+        Executor.shared.submit(.interactive) { [weak self] in
             do {
                 var content: [FileItem] = []
-                let fileURLs: [URL] = try FileManager.default.contentsOfDirectory(at: url, includingPropertiesForKeys: nil, options: [])
+                let fileURLs: [URL] = try FileManager.default.contentsOfDirectory(at: url, includingPropertiesForKeys: LocalFileSystem.prefetchedResourceKeys, options: [])
                 for url in fileURLs {
                     let item = FileItem(url: url)
                     content.append(item)
@@ -43,6 +50,50 @@ class LocalFileSystem: FileSystem {
         }
     }
     
+    @discardableResult
+    func load(_ url: URL, batchHandler: @escaping ([FileItem]) -> Void, completionHandler: @escaping (Int64?, Error?) -> Void) -> Executor.Task {
+        return Executor.shared.submit(.interactive) { [weak self] in
+            var enumerationError: Error? = nil
+            let enumerator = FileManager.default.enumerator(at: url, includingPropertiesForKeys: LocalFileSystem.prefetchedResourceKeys, options: [.skipsSubdirectoryDescendants]) { failedUrl, error in
+                // Failure to read the directory itself fails the load, unreadable entries are just skipped
+                if failedUrl.standardizedFileURL == url.standardizedFileURL {
+                    enumerationError = error
+                    return false
+                }
+                return true
+            }
+            guard let contents = enumerator else {
+                DispatchQueue.main.async { completionHandler(nil, FileSystemError.invalidUrl(url: url)) }
+                return
+            }
+            
+            // Batches grow, so that first items are shown quickly, but large directories do not flood main queue
+            var batchSize = LocalFileSystem.initialBatchSize
+            var batch: [FileItem] = []
+            batch.reserveCapacity(batchSize)
+            for case let fileUrl as URL in contents {
+                // Superseded listing is abandoned, so that large directories are not walked in vain
+                guard Executor.currentTask?.isCancelled != true else { return }
+                batch.append(FileItem(url: fileUrl))
+                if batch.count >= batchSize {
+                    let fullBatch = batch
+                    DispatchQueue.main.async { batchHandler(fullBatch) }
+                    batch = []
+                    batchSize = min(batchSize * 2, LocalFileSystem.maxBatchSize)
+                    batch.reserveCapacity(batchSize)
+                }
+            }
+            if !batch.isEmpty {
+                let lastBatch = batch
+                DispatchQueue.main.async { batchHandler(lastBatch) }
+            }
+            
+            let error = enumerationError
+            let space = error == nil ? self?.freeSpace(at: url) : nil
+            DispatchQueue.main.async { completionHandler(space, error) }
+        }
+    }
+    
     func delete(_ url: URL) -> FileOperation {
         _ = canDelete(url, assertOnFailure: true)
         
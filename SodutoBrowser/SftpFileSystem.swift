@@ -10,7 +10,7 @@ import Foundation
 import CleanroomLogger
 import Cocoa
 
-class SftpFileSystem: NSObject, FileSystem, NMSSHSessionDelegate {
+class SftpFileSystem: NSObject, PartialReadingFileSystem, NMSSHSessionDelegate {
     
     // MARK: Types
     
@@ -29,10 +29,11 @@ class SftpFileSystem: NSObject, FileSystem, NMSSHSessionDelegate {
         case creatingDirectoryFailed(at: URL)
         case openInputStreamFailed(at: URL)
         case openOutputStreamFailed(at: URL)
+        case cancelled
     }
     
     typealias DownloadProgress = ((UInt, UInt)->Bool)
-    typealias UploadProgress = ((UInt)->Bool)
+    typealias LoadCompletionHandler = ([FileItem]?, Int64?, Error?) -> Void
     
     
     // MARK: Properties
@@ -44,9 +45,18 @@ class SftpFileSystem: NSObject, FileSystem, NMSSHSessionDelegate {
     let places: [Place] = []
     
     private let browseQueue = OperationQueue()
+    private let prefetchQueue = OperationQueue()
     private let fileOperationsQueue = OperationQueue()
     private let browseSession: NMSSHSession
     private let fileOperationsSession: NMSSHSession
+    private let sessionFactory: () throws -> NMSSHSession
+    private var prefetchSession: NMSSHSession? = nil // made on first prefetch, accessed on prefetch queue only
+    private let transferEngine: SftpTransferEngine
+    private let listingCache = DirectoryListingCache()
+    private var prefetchOperations: [Operation] = [] // accessed on main queue only
+    
+    /// Maximum number of subdirectories prefetched after loading a directory
+    private static let maxPrefetchedSubdirectories = 4
     
     
     // MARK: Setup / Cleanup
@@ -55,8 +65,11 @@ class SftpFileSystem: NSObject, FileSystem, NMSSHSessionDelegate {
         self.name = name
         
         let hostWithPort = port != nil ? "\(host):\(port!)" : host
-        self.browseSession = try type(of: self).initSession(host: hostWithPort, user: user, password: password)
-        self.fileOperationsSession = try type(of: self).initSession(host: hostWithPort, user: user, password: password)
+        let sessionFactory = { try SftpFileSystem.initSession(host: hostWithPort, user: user, password: password) }
+        self.sessionFactory = sessionFactory
+        self.browseSession = try sessionFactory()
+        self.fileOperationsSession = try sessionFactory()
+        self.transferEngine = SftpTransferEngine(sessionFactory: sessionFactory)
         
         let directoryPath = path.hasSuffix("/") ? path : path + "/"
         guard let rootUrl = URL.url(scheme: "sftp", host: host, port: port, user: user, path: directoryPath) else { throw SftpError.rootUrlInitializationFailed }
@@ -64,6 +77,8 @@ class SftpFileSystem: NSObject, FileSystem, NMSSHSessionDelegate {
         
         self.browseQueue.maxConcurrentOperationCount = 1
         self.browseQueue.qualityOfService = .userInteractive
+        self.prefetchQueue.maxConcurrentOperationCount = 1
+        self.prefetchQueue.qualityOfService = .utility
         self.fileOperationsQueue.maxConcurrentOperationCount = 1
         self.fileOperationsQueue.qualityOfService = .userInitiated
     }
@@ -81,27 +96,52 @@ class SftpFileSystem: NSObject, FileSystem, NMSSHSessionDelegate {
         return session
     }
     
+    deinit {
+        // Running prefetches hold a strong reference, so none can be using the session by now
+        self.prefetchQueue.cancelAllOperations()
+        self.prefetchSession?.disconnect()
+    }
+    
     
     // MARK: FileSystem
     
-    func load(_ url: URL, completionHandler: @escaping (([FileItem]?, Int64?, Error?) -> Void)) {
+    /// Cached listing, if there is one, is passed to completion handler right away. Then the listing is revalidated
+    /// and completion handler is called once more if it changed.
+    func load(_ url: URL, completionHandler: @escaping LoadCompletionHandler) {
         assert(isUnderRoot(url) || url == self.rootUrl, "URL (\(url)) is outside root tree (\(self.rootUrl)).")
         
-        browseQueue.addOperation {[weak self] in
+        // Prefetches of previous directory are not needed anymore. They run on their own queue and session,
+        // so those already started do not hold back loading of this directory either
+        self.prefetchOperations.forEach { $0.cancel() }
+        self.prefetchOperations = []
+        
+        let cachedListing = self.listingCache.listing(for: url.path)
+        if let listing = cachedListing {
+            DispatchQueue.main.async { completionHandler(listing.items, listing.freeSpace, nil) }
+        }
+        
+        let operation = BlockOperation { [weak self] in
             guard let `self` = self else { return }
             do {
-                let rawContents = self.browseSession.sftp.contentsOfDirectory(atPath: url.path)
-                guard let contents = rawContents as? [NMSFTPFile] else { throw SftpError.invalidDirectoryContent(at: url) }
-                let fileItems = contents.flatMap { return FileItem(sftpFile: $0, parentUrl: url, user: self.browseSession.username ?? "") }
-                let freeSpace = self.browseSession.channel.freeSpace(at: url.path)
-                DispatchQueue.main.async { completionHandler(fileItems, freeSpace, nil) }
+                let listing = try self.refreshListing(at: url, using: self.browseSession)
+                if cachedListing == nil || !listing.hasSameEntries(as: cachedListing!) {
+                    DispatchQueue.main.async { completionHandler(listing.items, listing.freeSpace, nil) }
+                }
+                DispatchQueue.main.async { self.prefetchNeighbors(of: url, listing: listing) }
             }
             catch {
-                print("\(self.browseSession.lastError)")
-                print("\(self.browseSession.sftp.lastError)")
+                Log.error?.message("Failed to list directory [\(url)]: \(error). Session error: \(String(describing: self.browseSession.lastError)), SFTP error: \(String(describing: self.browseSession.sftp.lastError))")
+                self.listingCache.invalidate(url.path)
                 DispatchQueue.main.async { completionHandler(nil, nil, error) }
             }
         }
+        operation.queuePriority = .high
+        self.browseQueue.addOperation(operation)
+    }
+    
+    func readData(at url: URL, maxLength: Int) throws -> Data {
+        assert(isUnderRoot(url), "URL (\(url)) is outside root tree (\(self.rootUrl)).")
+        return try self.transferEngine.readPrefix(of: url, maxLength: maxLength)
     }
     
     func delete(_ url: URL) -> FileOperation {
@@ -111,6 +151,7 @@ class SftpFileSystem: NSObject, FileSystem, NMSSHSessionDelegate {
         operation.sourceState = .inProgress
         operation.addExecutionBlock { [weak self] in
             guard let `self` = self else { return }
+            defer { self.invalidateListings(containing: [url]) }
             do {
                 try self.deleteRemote(at: url)
                 operation.sourceState = .deleted
@@ -131,6 +172,7 @@ class SftpFileSystem: NSObject, FileSystem, NMSSHSessionDelegate {
         operation.destinationState = .inProgress
         operation.addExecutionBlock { [weak self] in
             guard let `self` = self else { return }
+            defer { self.invalidateListings(containing: [operation.destination]) }
             do {
                 let progress: DownloadProgress = { _, _ in return !operation.isCancelled }
                 
@@ -142,10 +184,10 @@ class SftpFileSystem: NSObject, FileSystem, NMSSHSessionDelegate {
                     guard self.fileOperationsSession.sftp.copyContents(ofPath: srcUrl.path, toFileAtPath: destUrl.path, progress: progress) else { throw SftpError.copyingFileFailed(from: srcUrl, to: destUrl) }
                 }
                 else if self.isUnderRoot(srcUrl) {
-                    try self.download(from: srcUrl, to: destUrl, progress: progress)
+                    try self.transferEngine.download(from: srcUrl, to: destUrl, isCancelled: { operation.isCancelled })
                 }
                 else if self.isUnderRoot(destUrl) {
-                    try self.upload(from: srcUrl, to: destUrl)
+                    try self.transferEngine.upload(from: srcUrl, to: destUrl, isCancelled: { operation.isCancelled })
                 }
                 operation.destinationState = .present
             }
@@ -166,6 +208,7 @@ class SftpFileSystem: NSObject, FileSystem, NMSSHSessionDelegate {
         operation.destinationState = .inProgress
         operation.addExecutionBlock {[weak self] in
             guard let `self` = self else { return }
+            defer { self.invalidateListings(containing: [srcUrl, operation.destination]) }
             do {
                 let destUrl = try self.nonExistingUrl(for: destUrl)
                 operation.destination = destUrl
@@ -191,6 +234,7 @@ class SftpFileSystem: NSObject, FileSystem, NMSSHSessionDelegate {
         let operation = FileOperation(operation: .createFolder, destination: url)
         operation.destinationState = .inProgress
         operation.addExecutionBlock {
+            defer { self.invalidateListings(containing: [operation.destination]) }
             do {
                 let url = try self.nonExistingUrl(for: url)
                 operation.destination = url
@@ -211,117 +255,117 @@ class SftpFileSystem: NSObject, FileSystem, NMSSHSessionDelegate {
     
     // MARK: Private stuff
     
-    /// Return the same given URL or an alternative that does not yet exist
-    private func nonExistingUrl(for url: URL) throws -> URL {
-        var url = url
+    /// Synchronously bring cached listing of directory up to date. Directory is listed again only if
+    /// cached listing is missing or the directory changed. Entries that did not change keep their file items.
+    /// Cancellation is checked between requests and entries, throwing `SftpError.cancelled`.
+    private func refreshListing(at url: URL, using session: NMSSHSession, isCancelled: () -> Bool = { false }) throws -> DirectoryListingCache.Listing {
+        let path = url.path
+        let sftp = session.sftp
+        let cachedListing = self.listingCache.listing(for: path)
+        let directoryModificationDate = sftp.infoForFile(atPath: path)?.modificationDate
+        
+        if let listing = cachedListing, self.listingCache.isValid(listing, directoryModificationDate: directoryModificationDate) {
+            return listing
+        }
         
-        if isUnderRoot(url) {
-            while self.fileOperationsSession.sftp.fileExists(atPath: url.regularFileURL.path) || self.fileOperationsSession.sftp.directoryExists(atPath: url.regularFileURL.path) {
-                url = url.alternativeForDuplicate()
-            }
-            return url
+        guard !isCancelled() else { throw SftpError.cancelled }
+        guard let contents = sftp.contentsOfDirectory(atPath: path) as? [NMSFTPFile] else { throw SftpError.invalidDirectoryContent(at: url) }
+        
+        var cachedEntries: [URL: DirectoryListingCache.Entry] = [:]
+        for entry in cachedListing?.entries ?? [] {
+            cachedEntries[entry.item.url] = entry
         }
-        else if url.isFileURL {
-            while FileManager.default.fileExists(atPath: url.regularFileURL.path) {
-                url = url.alternativeForDuplicate()
+        
+        let user = session.username ?? ""
+        var entries: [DirectoryListingCache.Entry] = []
+        for file in contents {
+            guard !isCancelled() else { throw SftpError.cancelled }
+            guard let itemUrl = FileItem.url(of: file, parentUrl: url) else { continue }
+            let signature = DirectoryListingCache.Signature(isDirectory: file.isDirectory, size: file.fileSize?.uint64Value, modificationDate: file.modificationDate)
+            if let cachedEntry = cachedEntries[itemUrl], cachedEntry.signature == signature {
+                entries.append(cachedEntry)
+                continue
             }
-            return url
-        }
-        else {
-            throw FileSystemError.invalidUrl(url: url)
+            guard let item = FileItem(sftpFile: file, parentUrl: url, user: user) else { continue }
+            entries.append(DirectoryListingCache.Entry(item: item, signature: signature))
         }
+        
+        guard !isCancelled() else { throw SftpError.cancelled }
+        let freeSpace = session.channel.freeSpace(at: path)
+        let listing = DirectoryListingCache.Listing(entries: entries, freeSpace: freeSpace, directoryModificationDate: directoryModificationDate, date: Date())
+        self.listingCache.store(listing, for: path)
+        return listing
     }
     
-    /// Make sure there is required directory on local file system
-    private func ensureLocalDirectory(at url: URL) throws {
-        var url = url
-        var existsDirectory: ObjCBool = false
-        if !FileManager.default.fileExists(atPath: url.path, isDirectory: &existsDirectory) {
-            url = try nonExistingUrl(for: url)
+    /// Load listings of directories likely to be visited next - parent and most recently modified subdirectories -
+    /// so that going there would show contents instantly. Prefetching runs on its own low priority queue and
+    /// session, so that it never delays loading of directories the user actually opens.
+    private func prefetchNeighbors(of url: URL, listing: DirectoryListingCache.Listing) {
+        var urls: [URL] = []
+        if isUnderRoot(url) {
+            urls.append(url.deletingLastPathComponent())
+        }
+        let subdirectories = listing.entries
+            .filter { $0.signature.isDirectory && !$0.item.isHidden }
+            .sorted { ($0.signature.modificationDate ?? Date.distantPast) > ($1.signature.modificationDate ?? Date.distantPast) }
+            .prefix(SftpFileSystem.maxPrefetchedSubdirectories)
+        urls.append(contentsOf: subdirectories.map { $0.item.url })
+        
+        for prefetchUrl in urls where self.listingCache.listing(for: prefetchUrl.path) == nil {
+            let operation = BlockOperation()
+            operation.addExecutionBlock { [weak self, unowned operation] in
+                guard let `self` = self, !operation.isCancelled else { return }
+                guard self.listingCache.listing(for: prefetchUrl.path) == nil else { return }
+                guard let session = self.prefetchSessionOrNil() else { return }
+                _ = try? self.refreshListing(at: prefetchUrl, using: session, isCancelled: { operation.isCancelled })
+            }
+            self.prefetchOperations.append(operation)
+            self.prefetchQueue.addOperation(operation)
         }
-        try FileManager.default.createDirectory(at: url, withIntermediateDirectories: true, attributes: nil)
     }
     
-    /// Synchronously download remote file or directory to local destination.
-    private func download(from srcUrl: URL, to destUrl: URL, progress: DownloadProgress?) throws {
-        assert(isUnderRoot(srcUrl), "Source URL (\(srcUrl)) expected to be under root (\(self.rootUrl)).")
-        assert(destUrl.isFileURL, "Destination URL (\(destUrl)) expected to be local URL.")
-        
-        if srcUrl.hasDirectoryPath {
-            try downloadDirectory(from: srcUrl, to: destUrl, progress: progress)
+    /// Session used for prefetching. Must be called on prefetch queue
+    private func prefetchSessionOrNil() -> NMSSHSession? {
+        if let session = self.prefetchSession, session.isConnected && session.sftp.isConnected {
+            return session
         }
-        else {
-            let destUrl = try nonExistingUrl(for: destUrl)
-            guard let stream = OutputStream(url: destUrl, append: false) else { throw SftpError.openOutputStreamFailed(at: srcUrl) }
-            guard self.fileOperationsSession.sftp.readFile(atPath: srcUrl.path, to: stream, progress: progress) else { throw SftpError.copyingFileFailed(from: srcUrl, to: destUrl) }
+        self.prefetchSession?.disconnect()
+        do {
+            self.prefetchSession = try self.sessionFactory()
         }
-    }
-    
-    /// Synchromously donwload remote directory to local destination.
-    private func downloadDirectory(from srcUrl: URL, to destUrl: URL, progress: DownloadProgress?) throws {
-        assert(isUnderRoot(srcUrl), "Source URL (\(srcUrl)) expected to be under root (\(self.rootUrl)).")
-        assert(srcUrl.hasDirectoryPath, "Source URL (\(srcUrl)) expected to be a directory.")
-        assert(destUrl.isFileURL, "Destination URL (\(destUrl)) expected to be local directory URL.")
-        
-        guard let files = self.fileOperationsSession.sftp.contentsOfDirectory(atPath: srcUrl.path) as? [NMSFTPFile] else { throw SftpError.invalidDirectoryContent(at: srcUrl) }
-        
-        try ensureLocalDirectory(at: destUrl)
-        
-        for file in files {
-            guard let filename = file.filename else { assertionFailure("File name expected to be non-nil."); continue }
-            let fileSrcUrl = srcUrl.appendingPathComponent(filename, isDirectory: file.isDirectory)
-            let fileDestUrl = destUrl.appendingPathComponent(filename, isDirectory: file.isDirectory)
-            try download(from: fileSrcUrl, to: fileDestUrl, progress: progress)
+        catch {
+            Log.error?.message("Failed to open prefetch session: \(error)")
+            self.prefetchSession = nil
         }
+        return self.prefetchSession
     }
     
-    /// Make sure there is required directory on remote file system
-    private func ensureRemoteDirectory(at url: URL) throws {
-        assert(isUnderRoot(url), "URL (\(url)) expected to be under root (\(self.rootUrl)).")
-        
-        var url = url
-        if self.fileOperationsSession.sftp.fileExists(atPath: url.path) {
-            url = try nonExistingUrl(for: url)
+    /// Drop cached listings of directories containing given URLs, as they are being modified
+    private func invalidateListings(containing urls: [URL?]) {
+        for url in urls {
+            guard let url = url, isUnderRoot(url) else { continue }
+            self.listingCache.invalidate(url.deletingLastPathComponent().path)
         }
-        guard !self.fileOperationsSession.sftp.directoryExists(atPath: url.path) else { return }
-        guard self.fileOperationsSession.sftp.createDirectory(atPath: url.path) else { throw SftpError.creatingDirectoryFailed(at: url) }
     }
     
-    /// Synchronously upload local file or directory to remote destination.
-    private func upload(from srcUrl: URL, to destUrl: URL) throws {
-        assert(srcUrl.isFileURL, "Source URL (\(srcUrl)) expected to be local directory URL.")
-        assert(isUnderRoot(destUrl), "Destination URL (\(destUrl)) expected to be under root (\(self.rootUrl)).")
+    /// Return the same given URL or an alternative that does not yet exist
+    private func nonExistingUrl(for url: URL) throws -> URL {
+        var url = url
         
-        if srcUrl.hasDirectoryPath {
-            try uploadDirectory(from: srcUrl, to: destUrl)
+        if isUnderRoot(url) {
+            while self.fileOperationsSession.sftp.fileExists(atPath: url.regularFileURL.path) || self.fileOperationsSession.sftp.directoryExists(atPath: url.regularFileURL.path) {
+                url = url.alternativeForDuplicate()
+            }
+            return url
         }
-        else {
-            let destUrl = try nonExistingUrl(for: destUrl)
-            var started: Bool = false
-            let progress: UploadProgress = { _ in
-                if !started {
-                    started = true
-                }
-                return true
+        else if url.isFileURL {
+            while FileManager.default.fileExists(atPath: url.regularFileURL.path) {
+                url = url.alternativeForDuplicate()
             }
-            guard let stream = InputStream(url: srcUrl) else { throw SftpError.openInputStreamFailed(at: srcUrl) }
-            guard self.fileOperationsSession.sftp.write(stream, toFileAtPath: destUrl.path, progress: progress) else { throw SftpError.copyingFileFailed(from: srcUrl, to: destUrl) }
+            return url
         }
-    }
-    
-    /// Synchromously upload local directory to remote destination.
-    private func uploadDirectory(from srcUrl: URL, to destUrl: URL) throws {
-        assert(srcUrl.isFileURL, "Source URL (\(srcUrl)) expected to be local directory URL.")
-        assert(srcUrl.hasDirectoryPath, "Source URL (\(srcUrl)) expected to be a directory.")
-        assert(isUnderRoot(destUrl), "Destination URL (\(destUrl)) expected to be under root (\(self.rootUrl)).")
-        
-        let files = try FileManager.default.contentsOfDirectory(at: srcUrl, includingPropertiesForKeys: nil, options: [.skipsPackageDescendants, .skipsSubdirectoryDescendants])
-        
-        try ensureRemoteDirectory(at: destUrl)
-        
-        for fileSrcUrl in files {
-            let fileDestUrl = fileSrcUrl.movedTo(destUrl)
-            try upload(from: fileSrcUrl, to: fileDestUrl)
+        else {
+            throw FileSystemError.invalidUrl(url: url)
         }
     }
     
@@ -400,11 +444,15 @@ class SftpFileSystem: NSObject, FileSystem, NMSSHSessionDelegate {
 
 extension FileItem {
     
-    fileprivate convenience init?(sftpFile: NMSFTPFile, parentUrl: URL, user: String) {
+    fileprivate static func url(of sftpFile: NMSFTPFile, parentUrl: URL) -> URL? {
         guard var name = sftpFile.filename else { return nil }
         if name.hasSuffix("/") { name = String(name.dropLast()) }
-        
-        let url = parentUrl.appendingPathComponent(name, isDirectory: sftpFile.isDirectory)
+        return parentUrl.appendingPathComponent(name, isDirectory: sftpFile.isDirectory)
+    }
+    
+    fileprivate convenience init?(sftpFile: NMSFTPFile, parentUrl: URL, user: String) {
+        guard let url = FileItem.url(of: sftpFile, parentUrl: parentUrl) else { return nil }
+        let name = url.lastPathComponent
         
         var flags: Flags = []
         if sftpFile.isWritable(by: user) { flags.insert(.isWritable) }
@@ -412,10 +460,10 @@ extension FileItem {
         if sftpFile.isDirectory { flags.insert(.isDirectory) }
         if name.hasPrefix(".") { flags.insert(.isHidden) }
         
-        let fileType: String = flags.contains(.isDirectory) ? String(kUTTypeDirectory) : url.pathExtension
-        let icon = NSWorkspace.shared.icon(forFileType: fileType)
+        let icon = FileIconProvider.shared.icon(for: url, isDirectory: sftpFile.isDirectory)
+        let size = sftpFile.isDirectory ? nil : sftpFile.fileSize?.int64Value
         
-        self.init(url: url, name: name, icon: icon, flags: flags)
+        self.init(url: url, name: name, icon: icon, flags: flags, size: size, modificationDate: sftpFile.modificationDate)
     }
     
 }
@@ -0,0 +1,389 @@
+//
+//  SftpTransferEngine.swift
+//  SodutoBrowser
+//
+//  Created by Giedrius Stanevičius on 2018-03-28.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+import QuartzCore
+import CleanroomLogger
+
+/// Transfers files and whole directory trees between local and remote file systems over several SFTP sessions
+/// at once. Each worker holds its own session from a pool, so that directory trees are walked and files are
+/// transferred concurrently instead of one request at a time. Pending work is kept as a stack, so that trees
+/// are walked depth first and the amount of pending work stays proportional to the tree depth rather than its size.
+///
+/// Destinations of all items are resolved and reserved (see `TransferDestinations`) before they are handed to workers,
+/// so existing files are never overwritten and items whose names differ only in case do not overwrite each other on
+/// case insensitive volumes. Sessions beyond the first one are closed once no transfer needs them.
+///
+/// Sessions are made by provided factory, so the engine may be pointed at any SFTP server, e.g. a local sshd.
+///
+/// Thread safe. Transfer methods are synchronous and are expected to be called from background queues.
+class SftpTransferEngine {
+
+    // MARK: Types
+
+    enum TransferError: Error {
+        case listingFailed(at: URL)
+        case creatingDirectoryFailed(at: URL)
+        case openInputStreamFailed(at: URL)
+        case openOutputStreamFailed(at: URL)
+        case transferFailed(from: URL, to: URL)
+        case cancelled
+    }
+
+    typealias SessionFactory = () throws -> NMSSHSession
+
+    /// Aggregate statistics of a transfer
+    struct Statistics {
+        var filesTransferred: Int = 0
+        var bytesTransferred: UInt64 = 0
+        var duration: TimeInterval = 0.0
+
+        /// Average throughput in bytes per second
+        var throughput: Double { return self.duration > 0.0 ? Double(self.bytesTransferred) / self.duration : 0.0 }
+    }
+
+    private enum Direction {
+        case download
+        case upload
+    }
+
+    private enum Task {
+        case file(source: URL, destination: URL)
+        case directory(source: URL, destination: URL)
+    }
+
+    /// State of a single call to download or upload, shared by its workers
+    private class Transfer {
+        let direction: Direction
+        let destinations: TransferDestinations
+        let isCancelled: () -> Bool
+        let condition = NSCondition()
+        var pending: [Task] = []
+        var activeCount: Int = 0 // number of workers busy with a task
+        var error: Error? = nil
+        var statistics = Statistics()
+
+        init(direction: Direction, destinations: TransferDestinations, isCancelled: @escaping () -> Bool) {
+            self.direction = direction
+            self.destinations = destinations
+            self.isCancelled = isCancelled
+        }
+    }
+
+
+    // MARK: Properties
+
+    static let defaultSessionCount = 4
+
+    /// Maximum number of sessions, and so concurrent requests, used by a transfer
+    let sessionCount: Int
+
+    private let sessionFactory: SessionFactory
+    private let poolCondition = NSCondition()
+    private var idleSessions: [NMSSHSession] = []
+    private var sessionsMade: Int = 0
+    private var activeTransferCount: Int = 0
+
+
+    // MARK: Setup / Cleanup
+
+    init(sessionCount: Int = SftpTransferEngine.defaultSessionCount, sessionFactory: @escaping SessionFactory) {
+        self.sessionCount = max(sessionCount, 1)
+        self.sessionFactory = sessionFactory
+    }
+
+    deinit {
+        self.idleSessions.forEach { $0.disconnect() }
+    }
+
+
+    // MARK: Public methods
+
+    /// Synchronously download remote file or directory tree to local destination. Destination is expected not to exist,
+    /// items inside directory tree get alternative names if they already exist.
+    @discardableResult
+    func download(from srcUrl: URL, to destUrl: URL, isCancelled: @escaping () -> Bool = { false }) throws -> Statistics {
+        assert(destUrl.isFileURL, "Destination URL (\(destUrl)) expected to be local URL.")
+        return try perform(.download, from: srcUrl, to: destUrl, isCancelled: isCancelled)
+    }
+
+    /// Synchronously upload local file or directory tree to remote destination. Destination is expected not to exist,
+    /// items inside directory tree get alternative names if they already exist.
+    @discardableResult
+    func upload(from srcUrl: URL, to destUrl: URL, isCancelled: @escaping () -> Bool = { false }) throws -> Statistics {
+        assert(srcUrl.isFileURL, "Source URL (\(srcUrl)) expected to be local URL.")
+        return try perform(.upload, from: srcUrl, to: destUrl, isCancelled: isCancelled)
+    }
+
+
+    /// Synchronously read at most `maxLength` first bytes of remote file
+    func readPrefix(of url: URL, maxLength: Int) throws -> Data {
+        let session = try checkOut()
+        defer {
+            checkIn(session)
+            // Concurrent reads (e.g. thumbnails of a folder of images) may have opened more sessions
+            trimIdleSessions()
+        }
+
+        let stream = OutputStream(toMemory: ())
+        stream.open()
+        defer { stream.close() }
+        // Reading is stopped by progress handler once enough is read, so failure is expected for larger files
+        _ = session.sftp.readFile(atPath: url.path, to: stream, progress: { got, _ in return got < UInt(maxLength) })
+        guard let data = stream.property(forKey: .dataWrittenToMemoryStreamKey) as? Data, !data.isEmpty else { throw TransferError.transferFailed(from: url, to: url) }
+        return data.count > maxLength ? data.prefix(maxLength) : data
+    }
+
+
+    // MARK: Private methods
+
+    private func perform(_ direction: Direction, from srcUrl: URL, to destUrl: URL, isCancelled: @escaping () -> Bool) throws -> Statistics {
+        // Remote file systems are assumed to be case sensitive
+        let isCaseSensitive = direction == .upload || SftpTransferEngine.isCaseSensitiveVolume(at: destUrl)
+        let destinations = TransferDestinations(isCaseSensitive: isCaseSensitive)
+        destinations.reserve(destUrl)
+        let transfer = Transfer(direction: direction, destinations: destinations, isCancelled: isCancelled)
+        let task: Task = srcUrl.hasDirectoryPath ? .directory(source: srcUrl, destination: destUrl) : .file(source: srcUrl, destination: destUrl)
+        transfer.pending.append(task)
+
+        let startTime = CACurrentMediaTime()
+        self.poolCondition.lock()
+        self.activeTransferCount += 1
+        self.poolCondition.unlock()
+        defer { self.transferFinished() }
+
+        // Calling thread works too, so that a transfer progresses even if executor is busy with other transfers
+        let workerCount = srcUrl.hasDirectoryPath ? self.sessionCount : 1
+        let helpers = (1 ..< workerCount).map { _ in
+            Executor.shared.submit(.transfer) { [weak self] in
+                self?.work(on: transfer)
+            }
+        }
+        work(on: transfer)
+        // Helpers that have not started yet would find nothing to do
+        helpers.forEach { $0.cancel() }
+
+        transfer.condition.lock()
+        while transfer.activeCount > 0 {
+            transfer.condition.wait()
+        }
+        transfer.statistics.duration = CACurrentMediaTime() - startTime
+        let statistics = transfer.statistics
+        let error = transfer.error
+        transfer.condition.unlock()
+
+        if let error = error {
+            throw error
+        }
+
+        Log.info?.message("Transferred \(statistics.filesTransferred) files (\(statistics.bytesTransferred) bytes) from [\(srcUrl)] in \(String(format: "%.2f", statistics.duration))s: \(String(format: "%.0f", statistics.throughput / 1024.0)) KB/s")
+        return statistics
+    }
+
+    /// Take tasks of the transfer until there are none left and no other worker may add more
+    private func work(on transfer: Transfer) {
+        while let task = nextTask(of: transfer) {
+            do {
+                guard !transfer.isCancelled() else { throw TransferError.cancelled }
+                // Session is held only while performing a task, so that workers waiting for tasks
+                // do not keep sessions from workers of other transfers
+                let session = try checkOut()
+                defer { checkIn(session) }
+                try perform(task, of: transfer, with: session)
+            }
+            catch {
+                transfer.condition.lock()
+                if transfer.error == nil {
+                    transfer.error = error
+                }
+                transfer.pending = []
+                transfer.condition.unlock()
+            }
+
+            transfer.condition.lock()
+            transfer.activeCount -= 1
+            transfer.condition.broadcast()
+            transfer.condition.unlock()
+        }
+    }
+
+    /// Wait for a pending task. Returns nil when there are no pending tasks and no worker is busy with one,
+    /// as then no more tasks may appear.
+    private func nextTask(of transfer: Transfer) -> Task? {
+        transfer.condition.lock()
+        defer { transfer.condition.unlock() }
+
+        while transfer.pending.isEmpty && transfer.activeCount > 0 && transfer.error == nil {
+            transfer.condition.wait()
+        }
+        guard transfer.error == nil, let task = transfer.pending.popLast() else { return nil }
+        transfer.activeCount += 1
+        return task
+    }
+
+    private func perform(_ task: Task, of transfer: Transfer, with session: NMSSHSession) throws {
+        switch (task, transfer.direction) {
+        case (.directory(let srcUrl, let destUrl), .download):
+            guard let files = session.sftp.contentsOfDirectory(atPath: srcUrl.path) as? [NMSFTPFile] else { throw TransferError.listingFailed(at: srcUrl) }
+            try FileManager.default.createDirectory(at: destUrl, withIntermediateDirectories: true, attributes: nil)
+            let tasks: [Task] = files.flatMap { (file) -> Task? in
+                guard var filename = file.filename else { return nil }
+                if filename.hasSuffix("/") { filename = String(filename.dropLast()) }
+                let fileSrcUrl = srcUrl.appendingPathComponent(filename, isDirectory: file.isDirectory)
+                let fileDestUrl = transfer.destinations.resolve(destUrl.appendingPathComponent(filename, isDirectory: file.isDirectory),
+                                                                as: file.isDirectory ? .directory : .file,
+                                                                existingKind: SftpTransferEngine.localItemKind,
+                                                                alternative: { $0.alternativeForDuplicate() })
+                return file.isDirectory ? .directory(source: fileSrcUrl, destination: fileDestUrl) : .file(source: fileSrcUrl, destination: fileDestUrl)
+            }
+            enqueue(tasks, to: transfer)
+
+        case (.directory(let srcUrl, let destUrl), .upload):
+            let urls = try FileManager.default.contentsOfDirectory(at: srcUrl, includingPropertiesForKeys: [.isDirectoryKey], options: [.skipsPackageDescendants, .skipsSubdirectoryDescendants])
+            if !session.sftp.directoryExists(atPath: destUrl.path) {
+                guard session.sftp.createDirectory(atPath: destUrl.path) else { throw TransferError.creatingDirectoryFailed(at: destUrl) }
+            }
+            let tasks: [Task] = urls.map { (url) -> Task in
+                let isDirectory = (try? url.resourceValues(forKeys: [.isDirectoryKey]))?.isDirectory ?? false
+                let fileDestUrl = transfer.destinations.resolve(destUrl.appendingPathComponent(url.lastPathComponent, isDirectory: isDirectory),
+                                                                as: isDirectory ? .directory : .file,
+                                                                existingKind: { SftpTransferEngine.remoteItemKind(at: $0, session: session) },
+                                                                alternative: { $0.alternativeForDuplicate() })
+                return isDirectory ? .directory(source: url, destination: fileDestUrl) : .file(source: url, destination: fileDestUrl)
+            }
+            enqueue(tasks, to: transfer)
+
+        case (.file(let srcUrl, let destUrl), .download):
+            guard let stream = OutputStream(url: destUrl, append: false) else { throw TransferError.openOutputStreamFailed(at: destUrl) }
+            var lastReported: UInt = 0
+            let progress: (UInt, UInt) -> Bool = { got, _ in
+                self.record(bytes: got - min(lastReported, got), of: transfer)
+                lastReported = got
+                return !transfer.isCancelled()
+            }
+            guard session.sftp.readFile(atPath: srcUrl.path, to: stream, progress: progress) else {
+                throw transfer.isCancelled() ? TransferError.cancelled : TransferError.transferFailed(from: srcUrl, to: destUrl)
+            }
+            recordFileTransferred(of: transfer)
+
+        case (.file(let srcUrl, let destUrl), .upload):
+            guard let stream = InputStream(url: srcUrl) else { throw TransferError.openInputStreamFailed(at: srcUrl) }
+            var lastReported: UInt = 0
+            let progress: (UInt) -> Bool = { sent in
+                self.record(bytes: sent - min(lastReported, sent), of: transfer)
+                lastReported = sent
+                return !transfer.isCancelled()
+            }
+            guard session.sftp.write(stream, toFileAtPath: destUrl.path, progress: progress) else {
+                throw transfer.isCancelled() ? TransferError.cancelled : TransferError.transferFailed(from: srcUrl, to: destUrl)
+            }
+            recordFileTransferred(of: transfer)
+        }
+    }
+
+    private func enqueue(_ tasks: [Task], to transfer: Transfer) {
+        guard !tasks.isEmpty else { return }
+
+        transfer.condition.lock()
+        // Reversed, so that tasks are taken in listing order
+        transfer.pending.append(contentsOf: tasks.reversed())
+        transfer.condition.broadcast()
+        transfer.condition.unlock()
+    }
+
+    private func record(bytes: UInt, of transfer: Transfer) {
+        transfer.condition.lock()
+        transfer.statistics.bytesTransferred += UInt64(bytes)
+        transfer.condition.unlock()
+    }
+
+    private func recordFileTransferred(of transfer: Transfer) {
+        transfer.condition.lock()
+        transfer.statistics.filesTransferred += 1
+        transfer.condition.unlock()
+    }
+
+    private static func isCaseSensitiveVolume(at url: URL) -> Bool {
+        let values = try? url.deletingLastPathComponent().resourceValues(forKeys: [.volumeSupportsCaseSensitiveNamesKey])
+        return values?.volumeSupportsCaseSensitiveNames ?? false
+    }
+
+    private static func localItemKind(at url: URL) -> TransferDestinations.ItemKind? {
+        var isDirectory: ObjCBool = false
+        guard FileManager.default.fileExists(atPath: url.path, isDirectory: &isDirectory) else { return nil }
+        return isDirectory.boolValue ? .directory : .file
+    }
+
+    private static func remoteItemKind(at url: URL, session: NMSSHSession) -> TransferDestinations.ItemKind? {
+        if session.sftp.directoryExists(atPath: url.path) { return .directory }
+        if session.sftp.fileExists(atPath: url.path) { return .file }
+        return nil
+    }
+
+    private func transferFinished() {
+        self.poolCondition.lock()
+        self.activeTransferCount -= 1
+        self.poolCondition.unlock()
+
+        trimIdleSessions()
+    }
+
+    /// Close idle sessions while no transfer is running. One is kept for reading file prefixes, which happens often
+    private func trimIdleSessions() {
+        self.poolCondition.lock()
+        var closedSessions: [NMSSHSession] = []
+        while self.activeTransferCount == 0 && self.idleSessions.count > 1, let session = self.idleSessions.popLast() {
+            closedSessions.append(session)
+            self.sessionsMade -= 1
+        }
+        self.poolCondition.unlock()
+
+        closedSessions.forEach { $0.disconnect() }
+    }
+
+    /// Take an idle session from the pool, making a new one if pool is not full yet, or waiting for one otherwise
+    private func checkOut() throws -> NMSSHSession {
+        self.poolCondition.lock()
+        while self.idleSessions.isEmpty && self.sessionsMade >= self.sessionCount {
+            self.poolCondition.wait()
+        }
+        if let session = self.idleSessions.popLast() {
+            self.poolCondition.unlock()
+            if session.isConnected && session.sftp.isConnected {
+                return session
+            }
+            // Dropped session is replaced by a new one
+            session.disconnect()
+            return try makeSession()
+        }
+        self.sessionsMade += 1
+        self.poolCondition.unlock()
+        return try makeSession()
+    }
+
+    private func checkIn(_ session: NMSSHSession) {
+        self.poolCondition.lock()
+        self.idleSessions.append(session)
+        self.poolCondition.signal()
+        self.poolCondition.unlock()
+    }
+
+    private func makeSession() throws -> NMSSHSession {
+        do {
+            return try self.sessionFactory()
+        }
+        catch {
+            // Slot of the session that could not be made is freed for others to try
+            self.poolCondition.lock()
+            self.sessionsMade -= 1
+            self.poolCondition.signal()
+            self.poolCondition.unlock()
+            throw error
+        }
+    }
+}
@@ -3,3 +3,4 @@
 //
 
 #import <NMSSH/NMSSH.h>
+#import "Atomic.h"
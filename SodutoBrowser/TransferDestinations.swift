@@ -0,0 +1,92 @@
+//
+//  TransferDestinations.swift
+//  SodutoBrowser
+//
+//  Created by Giedrius Stanevičius on 2018-03-31.
+//  Copyright © 2018 Soduto. All rights reserved.
+//
+
+import Foundation
+
+/// Destinations reserved by a single transfer of a directory tree. Each transferred item gets a destination
+/// that is neither taken by an existing item nor reserved by another item of the same transfer, so that items
+/// never overwrite existing files or each other. Existing directories are merged into, as the transfer would
+/// only add files to them.
+///
+/// On case insensitive file systems names differing only in case refer to the same item, so they are
+/// reserved as one.
+///
+/// Thread safe.
+class TransferDestinations {
+
+    // MARK: Types
+
+    enum ItemKind {
+        case file
+        case directory
+    }
+
+    typealias ExistingKindProvider = (URL) -> ItemKind?
+    typealias AlternativeProvider = (URL) -> URL
+
+
+    // MARK: Properties
+
+    let isCaseSensitive: Bool
+
+    private let lock = NSLock()
+    private var reserved: Set<String> = []
+
+
+    // MARK: Setup / Cleanup
+
+    init(isCaseSensitive: Bool) {
+        self.isCaseSensitive = isCaseSensitive
+    }
+
+
+    // MARK: Public methods
+
+    /// Reserve destination without checking whether it exists - it must already be known to be free
+    func reserve(_ url: URL) {
+        self.lock.lock()
+        self.reserved.insert(self.key(for: url))
+        self.lock.unlock()
+    }
+
+    /// Find and reserve a destination for an item, starting with the given one and trying its alternatives
+    /// until a free one is found. Existence of items is checked with `existingKind`, which may be slow
+    /// (e.g. a remote request), so it is not called while holding the lock.
+    func resolve(_ url: URL, as kind: ItemKind, existingKind: ExistingKindProvider, alternative: AlternativeProvider) -> URL {
+        var url = url
+        while !self.tryReserving(url, as: kind, existingKind: existingKind) {
+            url = alternative(url)
+        }
+        return url
+    }
+
+
+    // MARK: Private methods
+
+    private func tryReserving(_ url: URL, as kind: ItemKind, existingKind: ExistingKindProvider) -> Bool {
+        let key = self.key(for: url)
+
+        self.lock.lock()
+        let isReserved = self.reserved.contains(key)
+        self.lock.unlock()
+        guard !isReserved else { return false }
+
+        if let existing = existingKind(url), !(kind == .directory && existing == .directory) {
+            return false
+        }
+
+        self.lock.lock()
+        defer { self.lock.unlock() }
+        return self.reserved.insert(key).inserted
+    }
+
+    private func key(for url: URL) -> String {
+        let path = url.standardizedFileURL.path
+        return self.isCaseSensitive ? path : path.folding(options: [.caseInsensitive], locale: nil)
+    }
+}
@@ -0,0 +1,7 @@
+//
+//  Use this file to import your target's public headers that you would like to expose to Swift.
+//
+
+#import "../Soduto/MYUtilities/MYBuffer.h"
+#import "../Soduto/MYUtilities/MYParallelZip.h"
+#import "../Soduto/MYUtilities/MYBuffer+Zip.h"
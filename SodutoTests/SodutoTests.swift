@@ -7,7 +7,9 @@
 //
 
 import XCTest
-import Soduto
+import Cocoa
+import CocoaAsyncSocket
+@testable import Soduto
 
 class SodutoCertificateTests: XCTestCase {
     
@@ -95,6 +97,33 @@ class SodutoCertificateTests: XCTestCase {
         XCTAssert(try! CertificateUtils.findKey(identityName) == nil, "Keys with name '\(identityName)' expected to be deleted")
     }
     
+    func testECIdentityUseWorkflow() {
+        let identity1 = try! CertificateUtils.getOrCreateIdentity(identityName, certCommonName: certCommonName, expirationInterval: self.expirationInterval, keyType: .ec)
+        let identity2 = try! CertificateUtils.getOrCreateIdentity(identityName, certCommonName: certCommonName, expirationInterval: self.expirationInterval, keyType: .ec)
+        XCTAssert(CertificateUtils.compareCertificates(identity1.certificate!, identity2.certificate!), "Identity certificates expected to be equal")
+        
+        let period = CertificateUtils.validityPeriod(of: identity1.certificate!)
+        XCTAssertNotNil(period)
+        XCTAssert(period!.notBefore < Date() && Date() < period!.notAfter, "New certificate expected to be valid")
+        
+        try! CertificateUtils.deleteIdentity(identityName)
+        XCTAssert(CertificateUtils.findIdentity(identityName) == nil, "Identity with preference \(identityName) expected to be deleted")
+    }
+    
+    func testPerformanceOfRSAIdentityCreation() {
+        self.measure {
+            _ = try! CertificateUtils.createIdentity(label: identityName, certCommonName: certCommonName, expirationInterval: self.expirationInterval, keyType: .rsa)
+            try! CertificateUtils.deleteIdentity(identityName)
+        }
+    }
+    
+    func testPerformanceOfECIdentityCreation() {
+        self.measure {
+            _ = try! CertificateUtils.createIdentity(label: identityName, certCommonName: certCommonName, expirationInterval: self.expirationInterval, keyType: .ec)
+            try! CertificateUtils.deleteIdentity(identityName)
+        }
+    }
+    
     
     private func string(forStatus status: OSStatus) -> String {
         var string: CFString? = nil
@@ -102,3 +131,799 @@ class SodutoCertificateTests: XCTestCase {
         return (string as? String) ?? "Unknown status"
     }
 }
+
+
+class SodutoConcurrencyTests: XCTestCase {
+    
+    let threadCount = 8
+    let iterations = 100_000
+    
+    func testAtomicCounterUnderContention() {
+        let counter = AtomicCounter()
+        var seen = [[Int64]](repeating: [], count: self.threadCount)
+        seen.withUnsafeMutableBufferPointer { buffer in
+            DispatchQueue.concurrentPerform(iterations: self.threadCount) { thread in
+                var ids: [Int64] = []
+                ids.reserveCapacity(self.iterations)
+                for _ in 0 ..< self.iterations {
+                    ids.append(counter.increment())
+                }
+                buffer[thread] = ids
+            }
+        }
+        
+        let allIds = seen.flatMap { $0 }
+        XCTAssertEqual(counter.value, Int64(self.threadCount * self.iterations))
+        XCTAssertEqual(Set(allIds).count, allIds.count, "Generated ids expected to be unique")
+    }
+    
+    func testSnapshotReadersSeeConsistentValues() {
+        // Writers keep all elements of the array equal, so readers seeing a mix would catch a torn update
+        let snapshot = Snapshot<[Int]>([Int](repeating: 0, count: 64))
+        let inconsistentReads = AtomicCounter()
+        DispatchQueue.concurrentPerform(iterations: self.threadCount) { thread in
+            for i in 0 ..< self.iterations / 10 {
+                if thread == 0 {
+                    snapshot.update { value in
+                        for index in value.indices {
+                            value[index] = i
+                        }
+                    }
+                }
+                else {
+                    let value = snapshot.value
+                    if value.contains(where: { $0 != value[0] }) {
+                        inconsistentReads.increment()
+                    }
+                }
+            }
+        }
+        XCTAssertEqual(inconsistentReads.value, 0)
+        XCTAssertEqual(snapshot.version, Int64(self.iterations / 10))
+    }
+    
+    func testInstrumentedLockCountsAcquisitions() {
+        let lock = InstrumentedLock(name: "SodutoConcurrencyTests")
+        var total = 0
+        DispatchQueue.concurrentPerform(iterations: self.threadCount) { _ in
+            for _ in 0 ..< self.iterations {
+                lock.withLock { total += 1 }
+            }
+        }
+        let statistics = lock.statistics
+        XCTAssertEqual(total, self.threadCount * self.iterations)
+        XCTAssertEqual(statistics.acquisitions, Int64(self.threadCount * self.iterations))
+        XCTAssert(statistics.contentions <= statistics.acquisitions)
+        XCTAssert(InstrumentedLock.allStatistics().contains { $0.name == "SodutoConcurrencyTests" })
+        // Reading statistics does not take the lock, so it is not counted as an acquisition
+        XCTAssertEqual(lock.statistics.acquisitions, statistics.acquisitions)
+    }
+    
+    func testPerformanceOfLockedCounter() {
+        let lock = NSLock()
+        var counter: Int64 = 0
+        self.measure {
+            DispatchQueue.concurrentPerform(iterations: self.threadCount) { _ in
+                for _ in 0 ..< self.iterations {
+                    lock.lock()
+                    counter += 1
+                    lock.unlock()
+                }
+            }
+        }
+    }
+    
+    func testPerformanceOfAtomicCounter() {
+        let counter = AtomicCounter()
+        self.measure {
+            DispatchQueue.concurrentPerform(iterations: self.threadCount) { _ in
+                for _ in 0 ..< self.iterations {
+                    counter.increment()
+                }
+            }
+        }
+    }
+    
+    func testPerformanceOfSnapshotReads() {
+        let snapshot = Snapshot<[Int: String]>([1: "one", 2: "two"])
+        self.measure {
+            DispatchQueue.concurrentPerform(iterations: self.threadCount) { thread in
+                for i in 0 ..< self.iterations {
+                    if thread == 0 && i % 1000 == 0 {
+                        snapshot.update { $0[i] = "\(i)" }
+                    }
+                    else {
+                        _ = snapshot.value[1]
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+class SodutoExecutorTests: XCTestCase {
+    
+    private var executors: [Executor] = []
+    
+    override func tearDown() {
+        self.executors.forEach { $0.shutdown() }
+        self.executors = []
+        super.tearDown()
+    }
+    
+    private func makeExecutor(workerCount: Int) -> Executor {
+        let executor = Executor(workerCount: workerCount)
+        self.executors.append(executor)
+        return executor
+    }
+    
+    func testAllSubmittedTasksRun() {
+        let executor = self.makeExecutor(workerCount: 4)
+        let counter = AtomicCounter()
+        let group = DispatchGroup()
+        for index in 0 ..< 10_000 {
+            group.enter()
+            executor.submit(Executor.Lane.all[index % Executor.Lane.all.count]) {
+                counter.increment()
+                group.leave()
+            }
+        }
+        XCTAssertEqual(group.wait(timeout: .now() + 10.0), .success)
+        XCTAssertEqual(counter.value, 10_000)
+    }
+    
+    func testNestedTasksAreStolen() {
+        // Tasks submitted from a worker go to its own deque, so other workers may run them only by stealing
+        let executor = self.makeExecutor(workerCount: 4)
+        let threads = Snapshot<Set<String>>([])
+        let group = DispatchGroup()
+        group.enter()
+        executor.submit(.interactive) {
+            for _ in 0 ..< 64 {
+                group.enter()
+                executor.submit(.interactive) {
+                    usleep(2000)
+                    threads.update { _ = $0.insert(Thread.current.name ?? "") }
+                    group.leave()
+                }
+            }
+            group.leave()
+        }
+        XCTAssertEqual(group.wait(timeout: .now() + 10.0), .success)
+        XCTAssert(threads.value.count > 1, "Nested tasks expected to be spread over several workers")
+    }
+    
+    func testCancelledTaskDoesNotRun() {
+        let executor = self.makeExecutor(workerCount: 1)
+        let blocker = DispatchSemaphore(value: 0)
+        let ran = AtomicCounter()
+        executor.submit(.interactive) { blocker.wait() }
+        let task = executor.submit(.interactive) { ran.increment() }
+        task.cancel()
+        blocker.signal()
+        
+        let done = DispatchSemaphore(value: 0)
+        executor.submit(.interactive) { done.signal() }
+        XCTAssertEqual(done.wait(timeout: .now() + 10.0), .success)
+        XCTAssertEqual(ran.value, 0)
+        XCTAssertEqual(executor.statistics(for: .interactive).cancelled, 1)
+    }
+    
+    func testLowPriorityLanesLeaveWorkerForInteractiveWork() {
+        let executor = self.makeExecutor(workerCount: 2)
+        let blocker = DispatchSemaphore(value: 0)
+        for _ in 0 ..< 4 {
+            executor.submit(.transfer) { blocker.wait() }
+        }
+        let done = DispatchSemaphore(value: 0)
+        executor.submit(.interactive) { done.signal() }
+        XCTAssertEqual(done.wait(timeout: .now() + 10.0), .success)
+        for _ in 0 ..< 4 {
+            blocker.signal()
+        }
+    }
+    
+    func testWorkersAreStartedOnDemand() {
+        let executor = self.makeExecutor(workerCount: 4)
+        XCTAssertEqual(executor.startedWorkerCount, 0)
+        
+        // Tasks submitted one at a time are picked up by the idle worker instead of starting new ones
+        for _ in 0 ..< 10 {
+            let done = DispatchSemaphore(value: 0)
+            executor.submit(.background) { done.signal() }
+            XCTAssertEqual(done.wait(timeout: .now() + 10.0), .success)
+            usleep(10_000)
+        }
+        XCTAssert(executor.startedWorkerCount < executor.workerCount)
+    }
+    
+    func testShutDownExecutorDoesNotRunNewWork() {
+        let executor = self.makeExecutor(workerCount: 2)
+        executor.shutdown()
+        let ran = AtomicCounter()
+        let task = executor.submit(.interactive) { ran.increment() }
+        XCTAssertTrue(task.isCancelled)
+        usleep(10_000)
+        XCTAssertEqual(ran.value, 0)
+    }
+}
+
+
+class SodutoClipboardSyncTests: XCTestCase {
+    
+    private class TestClipboardSource: ClipboardSource {
+        var changeCount: Int = 0
+        var text: String? = nil
+        
+        func readText() -> String? {
+            return self.text
+        }
+        
+        func writeText(_ text: String) -> Int {
+            self.copy(text)
+            return self.changeCount
+        }
+        
+        func copy(_ text: String) {
+            self.text = text
+            self.changeCount += 1
+        }
+    }
+    
+    private var source: TestClipboardSource!
+    private var engine: ClipboardSyncEngine!
+    private var sent: [(content: String, peers: Set<Device.Id>)] = []
+    
+    override func setUp() {
+        super.setUp()
+        self.source = TestClipboardSource()
+        self.engine = ClipboardSyncEngine(source: self.source)
+        self.sent = []
+        self.engine.sendContent = { [unowned self] content, peers in
+            self.sent.append((content: content, peers: Set(peers)))
+        }
+        self.engine.addPeer("a")
+        self.engine.addPeer("b")
+    }
+    
+    override func tearDown() {
+        self.engine.removePeer("a")
+        self.engine.removePeer("b")
+        self.engine = nil
+        super.tearDown()
+    }
+    
+    private func waitForDebounce() {
+        RunLoop.current.run(until: Date(timeIntervalSinceNow: ClipboardSyncEngine.debounceInterval * 3.0))
+    }
+    
+    func testReceivedContentIsRelayedButNotEchoed() {
+        self.engine.receive("remote", from: "a")
+        XCTAssertEqual(self.source.text, "remote")
+        XCTAssertEqual(self.sent.count, 1)
+        XCTAssertEqual(self.sent.first?.peers ?? [], ["b"])
+        
+        // Writing received content must not be taken for a local change
+        self.engine.checkForChanges()
+        self.waitForDebounce()
+        XCTAssertEqual(self.sent.count, 1)
+    }
+    
+    func testRapidLocalCopiesAreDebounced() {
+        for text in ["one", "two", "three"] {
+            self.source.copy(text)
+            self.engine.checkForChanges()
+        }
+        self.waitForDebounce()
+        XCTAssertEqual(self.sent.count, 1)
+        XCTAssertEqual(self.sent.first?.content, "three")
+        XCTAssertEqual(self.sent.first?.peers ?? [], ["a", "b"])
+        XCTAssertEqual(self.engine.sentChangesCount, 1)
+    }
+    
+    func testRepeatedContentIsNotResent() {
+        self.source.copy("same")
+        self.engine.checkForChanges()
+        self.waitForDebounce()
+        self.source.copy("same")
+        self.engine.checkForChanges()
+        self.waitForDebounce()
+        XCTAssertEqual(self.sent.count, 1)
+        XCTAssertEqual(self.engine.suppressedCount, 2)
+        
+        // Reconnected peer could have changed its clipboard meanwhile, so it gets the content again
+        self.engine.removePeer("b")
+        self.engine.addPeer("b")
+        self.source.copy("same")
+        self.engine.checkForChanges()
+        self.waitForDebounce()
+        XCTAssertEqual(self.sent.count, 2)
+        XCTAssertEqual(self.sent.last?.peers ?? [], ["b"])
+    }
+}
+
+
+class SodutoImageCacheTests: XCTestCase {
+    
+    private let cacheName = "SodutoTests"
+    
+    override func tearDown() {
+        ImageCache(name: self.cacheName).removeAll()
+        super.tearDown()
+    }
+    
+    private func imageData() -> Data {
+        let image = NSImage(size: NSSize(width: 4, height: 4))
+        image.lockFocus()
+        NSColor.red.setFill()
+        NSRect(x: 0, y: 0, width: 4, height: 4).fill()
+        image.unlockFocus()
+        return image.tiffRepresentation!
+    }
+    
+    func testKeysAreNotUsedAsFilePaths() {
+        let key = "../../escaped-image"
+        let cache = ImageCache(name: self.cacheName)
+        XCTAssertNotNil(cache.store(self.imageData(), forKey: key))
+        
+        // Another instance sees the image only once it is written to disk
+        let deadline = Date(timeIntervalSinceNow: 5.0)
+        while !ImageCache(name: self.cacheName).contains(key) && Date() < deadline {
+            Thread.sleep(forTimeInterval: 0.05)
+        }
+        XCTAssert(ImageCache(name: self.cacheName).contains(key))
+        
+        let cachesUrl = try! FileManager.default.url(for: .cachesDirectory, in: .userDomainMask, appropriateFor: nil, create: false)
+        let bundleId = Bundle.main.bundleIdentifier ?? "com.soduto.Soduto"
+        let escapedUrl = cachesUrl.appendingPathComponent(bundleId).appendingPathComponent(self.cacheName).appendingPathComponent(key).standardizedFileURL
+        XCTAssertFalse(FileManager.default.fileExists(atPath: escapedUrl.path))
+    }
+}
+
+
+class SodutoPacketReassemblerTests: XCTestCase {
+    
+    private func wait(_ interval: TimeInterval) {
+        RunLoop.current.run(until: Date(timeIntervalSinceNow: interval))
+    }
+    
+    func testBurstOfMultipartMessagesIsNotSplit() {
+        let reassembler = PacketReassembler(wheel: TimerWheel())
+        var finished: [String: Int] = [:]
+        func add(part: Int, of message: String) {
+            let packet = DataPacket(type: "kdeconnect.telephony", body: ["messageBody": "\(message).\(part)" as AnyObject])
+            reassembler.add(packet, toGroup: message) { packets in
+                XCTAssertNil(finished[message], "Message \(message) finished more than once")
+                finished[message] = packets.count
+            }
+        }
+        
+        // A burst of messages with parts arriving back to back makes observed gaps tiny
+        for message in 0 ..< 10 {
+            for part in 0 ..< 3 {
+                add(part: part, of: "burst\(message)")
+            }
+        }
+        
+        // A part arriving noticeably later must still join its message
+        add(part: 0, of: "late")
+        self.wait(0.6)
+        add(part: 1, of: "late")
+        self.wait(PacketReassembler.minTimeout * 2.0)
+        
+        XCTAssertEqual(finished.count, 11)
+        XCTAssert(finished.values.filter({ $0 != 3 }).count == 1)
+        XCTAssertEqual(finished["late"], 2)
+        XCTAssertEqual(reassembler.completedByTimeoutCount, 11)
+    }
+}
+
+
+class SodutoConnectionCapacityTests: XCTestCase {
+    
+    /// Identity of the peer the tested connection pretends to be connected to
+    private struct PeerConfiguration: HostConfiguration {
+        let hostDeviceName = "Capacity Test Peer"
+        let hostDeviceType = DeviceType.Desktop
+        let hostDeviceId: Device.Id = "capacity_test_peer"
+        let incomingCapabilities: Set<Service.Capability> = [ "kdeconnect.ping" ]
+        let outgoingCapabilities: Set<Service.Capability> = [ "kdeconnect.ping" ]
+    }
+    
+    /// Accepts loopback connections and keeps them open without reading anything
+    private class Listener: NSObject, GCDAsyncSocketDelegate {
+        let socket = GCDAsyncSocket(delegate: nil, delegateQueue: DispatchQueue.main)
+        var acceptedSocket: GCDAsyncSocket? = nil
+        
+        override init() {
+            super.init()
+            self.socket.delegate = self
+        }
+        
+        func socket(_ sock: GCDAsyncSocket, didAcceptNewSocket newSocket: GCDAsyncSocket) {
+            self.acceptedSocket = newSocket
+        }
+    }
+    
+    private let userDefaultsSuiteName = "com.soduto.SodutoTests.capacity"
+    private var keychain: SecKeychain?
+    private var defaultKeychain: SecKeychain?
+    
+    override func setUp() {
+        super.setUp()
+        
+        // Host identity and paired device certificate go to a temporary keychain
+        let path = "\(NSTemporaryDirectory())/com.soduto.test.capacity".cString(using: .ascii)!
+        let password = "abc".cString(using: .ascii)!
+        SecKeychainOpen(path, &(self.keychain))
+        SecKeychainDelete(self.keychain)
+        SecKeychainCreate(path, UInt32(password.count), password, false, nil, &(self.keychain))
+        SecKeychainUnlock(self.keychain, UInt32(password.count), password, true)
+        SecKeychainCopyDefault(&(self.defaultKeychain))
+        SecKeychainSetDefault(self.keychain)
+        
+        UserDefaults.standard.removePersistentDomain(forName: self.userDefaultsSuiteName)
+    }
+    
+    override func tearDown() {
+        SecKeychainSetDefault(self.defaultKeychain)
+        SecKeychainDelete(self.keychain)
+        UserDefaults.standard.removePersistentDomain(forName: self.userDefaultsSuiteName)
+        super.tearDown()
+    }
+    
+    private func runUntil(timeout: TimeInterval, _ condition: () -> Bool) {
+        let deadline = Date(timeIntervalSinceNow: timeout)
+        while !condition() && Date() < deadline {
+            RunLoop.current.run(until: Date(timeIntervalSinceNow: 0.01))
+        }
+    }
+    
+    func testDeviceKeepsDeclinedPacketsUntilConnectionDrains() {
+        let userDefaults = UserDefaults(suiteName: self.userDefaultsSuiteName)!
+        userDefaults.set(CertificateUtils.KeyType.ec.rawValue, forKey: HostIdentityProvider.keyTypeConfigurationKey)
+        let config = Configuration(userDefaults: userDefaults)
+        let peer = PeerConfiguration()
+        
+        // Any stored certificate makes the peer device count as paired
+        let deviceConfig = config.deviceConfig(for: peer.hostDeviceId)
+        deviceConfig.certificate = config.hostCertificate?.certificate
+        deviceConfig.isPaired = true
+        
+        let listener = Listener()
+        try! listener.socket.accept(onInterface: "localhost", port: 0)
+        let clientSocket = GCDAsyncSocket(delegate: nil, delegateQueue: DispatchQueue.main)
+        try! clientSocket.connect(toHost: "localhost", onPort: listener.socket.localPort)
+        self.runUntil(timeout: 5.0) { listener.acceptedSocket != nil }
+        
+        let connection = Connection(socket: listener.acceptedSocket!, config: config)!
+        try! connection.applyIdentity(packet: DataPacket.identityPacket(config: peer))
+        connection.finishInitialization()
+        connection.highWaterMarkPackets = 2
+        connection.lowWaterMarkPackets = 0
+        let device = try! Device(connection: connection, config: deviceConfig)
+        XCTAssertEqual(device.pairingStatus, .Paired)
+        
+        // Writes complete asynchronously, so the first two packets stay queued and reach the high water mark
+        var sentPacketCount = 0
+        for _ in 0 ..< 3 {
+            device.send(DataPacket(type: "kdeconnect.ping", body: [:])) { packetSent, _ in
+                if packetSent {
+                    sentPacketCount += 1
+                }
+            }
+        }
+        XCTAssertTrue(connection.isAboveHighWaterMark)
+        XCTAssertEqual(device.pendingPacketCount, 1)
+        XCTAssertEqual(connection.queuedPacketCount, 2)
+        
+        // Connection level control packets have no sender to keep them, so they are not declined
+        XCTAssertTrue(connection.send(DataPacket.pairPacket()))
+        
+        self.runUntil(timeout: 5.0) { sentPacketCount == 3 }
+        XCTAssertEqual(sentPacketCount, 3)
+        XCTAssertEqual(device.pendingPacketCount, 0)
+        XCTAssertFalse(connection.isAboveHighWaterMark)
+        
+        connection.close()
+        clientSocket.disconnect()
+        listener.socket.disconnect()
+    }
+}
+
+
+class SodutoRemoteKeyboardTests: XCTestCase {
+    
+    func testKeysArrivingOneByOneAreInjectedInOneBatch() {
+        let service = RemoteKeyboardService()
+        var postedEvents: [CGEvent] = []
+        service.postEvent = { postedEvents.append($0) }
+        service.isPostingAllowed = { true }
+        
+        for key in ["a", "b", "c"] {
+            let event = RemoteKeyboardService.KeyEvent(key: key, specialKey: nil, shift: false, ctrl: false, alt: false, sendAck: false, receivedTime: CACurrentMediaTime())
+            service.enqueue(event, fromDeviceWithId: "device")
+            // Connection reads packets one at a time, so each one is handled on its own main queue turn
+            RunLoop.current.run(until: Date(timeIntervalSinceNow: RemoteKeyboardService.batchWindow / 10.0))
+        }
+        XCTAssertEqual(service.batchCount, 0)
+        
+        RunLoop.current.run(until: Date(timeIntervalSinceNow: RemoteKeyboardService.batchWindow * 5.0))
+        XCTAssertEqual(service.batchCount, 1)
+        XCTAssertEqual(service.eventCount, 3)
+        XCTAssertFalse(postedEvents.isEmpty)
+    }
+}
+
+
+class SodutoTransferDestinationsTests: XCTestCase {
+    
+    private let directoryUrl = URL(fileURLWithPath: "/transfer/", isDirectory: true)
+    
+    private func alternative(_ url: URL) -> URL {
+        return url.deletingLastPathComponent().appendingPathComponent("\(url.lastPathComponent)~", isDirectory: url.hasDirectoryPath)
+    }
+    
+    func testExistingFilesAreNotOverwritten() {
+        let destinations = TransferDestinations(isCaseSensitive: true)
+        let existing: [String: TransferDestinations.ItemKind] = ["/transfer/a.txt": .file, "/transfer/a.txt~": .file, "/transfer/dir": .directory]
+        let existingKind: (URL) -> TransferDestinations.ItemKind? = { existing[$0.path] }
+        
+        let fileUrl = destinations.resolve(self.directoryUrl.appendingPathComponent("a.txt"), as: .file, existingKind: existingKind, alternative: self.alternative)
+        XCTAssertEqual(fileUrl.lastPathComponent, "a.txt~~")
+        
+        // Existing directories are merged into, but existing directory is not replaced by a file
+        let dirUrl = destinations.resolve(self.directoryUrl.appendingPathComponent("dir", isDirectory: true), as: .directory, existingKind: existingKind, alternative: self.alternative)
+        XCTAssertEqual(dirUrl.lastPathComponent, "dir")
+        let otherDestinations = TransferDestinations(isCaseSensitive: true)
+        let fileOverDirUrl = otherDestinations.resolve(self.directoryUrl.appendingPathComponent("dir"), as: .file, existingKind: existingKind, alternative: self.alternative)
+        XCTAssertEqual(fileOverDirUrl.lastPathComponent, "dir~")
+    }
+    
+    func testNamesDifferingInCaseGetDistinctDestinationsOnCaseInsensitiveVolume() {
+        let names = ["Readme.md", "README.md", "readme.md"]
+        
+        let insensitive = TransferDestinations(isCaseSensitive: false)
+        let insensitiveUrls = names.map { insensitive.resolve(self.directoryUrl.appendingPathComponent($0), as: .file, existingKind: { _ in nil }, alternative: self.alternative) }
+        XCTAssertEqual(Set(insensitiveUrls.map { $0.path.lowercased() }).count, names.count)
+        XCTAssertEqual(insensitiveUrls[0].lastPathComponent, "Readme.md")
+        
+        let sensitive = TransferDestinations(isCaseSensitive: true)
+        let sensitiveUrls = names.map { sensitive.resolve(self.directoryUrl.appendingPathComponent($0), as: .file, existingKind: { _ in nil }, alternative: self.alternative) }
+        XCTAssertEqual(sensitiveUrls.map { $0.lastPathComponent }, names)
+    }
+    
+    func testConcurrentResolvingNeverGivesSameDestinationTwice() {
+        let destinations = TransferDestinations(isCaseSensitive: false)
+        let lock = NSLock()
+        var urls: [URL] = []
+        DispatchQueue.concurrentPerform(iterations: 100) { i in
+            let url = destinations.resolve(self.directoryUrl.appendingPathComponent(i % 2 == 0 ? "file" : "FILE"), as: .file, existingKind: { _ in nil }, alternative: self.alternative)
+            lock.lock()
+            urls.append(url)
+            lock.unlock()
+        }
+        XCTAssertEqual(Set(urls.map { $0.path.lowercased() }).count, 100)
+    }
+}
+
+
+class SodutoBufferTests: XCTestCase {
+    
+    private func testData(_ length: Int) -> Data {
+        return Data((0 ..< length).map { UInt8(truncatingIfNeeded: $0 * 7 + $0 / 251) })
+    }
+    
+    private func readAll(_ buffer: MYBuffer) -> Data {
+        var result = Data()
+        var chunk = [UInt8](repeating: 0, count: 1000)
+        while true {
+            let count = buffer.readBytes(&chunk, maxLength: chunk.count)
+            guard count > 0 else { break }
+            result.append(contentsOf: chunk[0 ..< count])
+        }
+        return result
+    }
+    
+    func testReadingDrainedBufferReturnsNothing() {
+        let buffer = MYBuffer()
+        _ = buffer.write("abc".data(using: .utf8)!)
+        XCTAssertEqual(self.readAll(buffer), "abc".data(using: .utf8)!)
+        
+        // The last block is kept for further writes, which must not make reading loop forever
+        var bytes = [UInt8](repeating: 0, count: 10)
+        XCTAssertEqual(buffer.readBytes(&bytes, maxLength: bytes.count), 0)
+        XCTAssertTrue(buffer.atEnd)
+        
+        _ = buffer.write("de".data(using: .utf8)!)
+        XCTAssertEqual(buffer.minLength, 2)
+        XCTAssertEqual(self.readAll(buffer), "de".data(using: .utf8)!)
+    }
+    
+    func testSmallAndLargeWritesAreReadBackInOrder() {
+        let data = self.testData(3 * 4096 + 123)
+        let buffer = MYBuffer()
+        var offset = 0
+        while offset < 4096 + 500 {
+            let count = min(333, 4096 + 500 - offset)
+            _ = buffer.write(data.subdata(in: offset ..< offset + count))
+            offset += count
+        }
+        _ = buffer.write(data.subdata(in: offset ..< data.count))
+        XCTAssertEqual(buffer.minLength, UInt(data.count))
+        XCTAssertEqual(buffer.maxLength, UInt(data.count))
+        
+        XCTAssertEqual(self.readAll(buffer), data)
+        XCTAssertEqual(buffer.minLength, 0)
+        XCTAssertTrue(buffer.atEnd)
+    }
+    
+    func testStreamContentsAreReadOnDemand() {
+        let data = self.testData(10000)
+        let buffer = MYBuffer()
+        _ = buffer.write(data.prefix(100))
+        _ = buffer.writeContents(of: InputStream(data: data))
+        XCTAssertEqual(buffer.minLength, 100)
+        XCTAssertNil(buffer.flattened())
+        
+        XCTAssertEqual(self.readAll(buffer), data.prefix(100) + data)
+        XCTAssertTrue(buffer.atEnd)
+    }
+    
+    func testSliceStopsAtBlockBoundary() {
+        let data = self.testData(4096 + 100)
+        let buffer = MYBuffer()
+        _ = buffer.write(data.prefix(1000))
+        _ = buffer.write(data.subdata(in: 1000 ..< data.count))
+        
+        // First write is copied into a block, the larger one is referenced - a slice covers just one of them
+        let slice = buffer.readSlice(ofMaxLength: data.count)
+        XCTAssertEqual(slice.length, 1000)
+        XCTAssertEqual(Data(bytes: slice.bytes, count: slice.length), data.prefix(1000))
+        XCTAssertEqual(buffer.minLength, UInt(data.count - 1000))
+        XCTAssertEqual(self.readAll(buffer), data.suffix(from: 1000))
+    }
+    
+    func testIOVecsGatherBlocksWithoutConsumingThem() {
+        let data = self.testData(5 * 4096)
+        let buffer = MYBuffer()
+        var offset = 0
+        while offset < data.count {
+            let count = min(1000, data.count - offset)
+            _ = buffer.write(data.subdata(in: offset ..< offset + count))
+            offset += count
+        }
+        
+        var iov = [iovec](repeating: iovec(), count: 8)
+        let count = Int(buffer.getIOVecs(&iov, maxCount: Int32(iov.count), maxLength: 3 * 4096 - 10))
+        XCTAssertEqual(count, 3)
+        var gathered = Data()
+        for vec in iov[0 ..< count] {
+            gathered.append(vec.iov_base.assumingMemoryBound(to: UInt8.self), count: vec.iov_len)
+        }
+        XCTAssertEqual(gathered, data.prefix(3 * 4096 - 10))
+        XCTAssertEqual(buffer.minLength, UInt(data.count))
+        
+        XCTAssertEqual(buffer.skipBytes(gathered.count), gathered.count)
+        XCTAssertEqual(buffer.minLength, UInt(data.count - gathered.count))
+        XCTAssertEqual(self.readAll(buffer), data.suffix(from: gathered.count))
+        XCTAssertTrue(buffer.atEnd)
+    }
+    
+    func testIOVecsStopAtStream() {
+        let data = self.testData(300)
+        let buffer = MYBuffer()
+        _ = buffer.write(data.prefix(100))
+        _ = buffer.writeContents(of: InputStream(data: data))
+        
+        var iov = [iovec](repeating: iovec(), count: 4)
+        XCTAssertEqual(buffer.getIOVecs(&iov, maxCount: Int32(iov.count), maxLength: Int.max), 1)
+        XCTAssertEqual(iov[0].iov_len, 100)
+        XCTAssertEqual(buffer.skipBytes(Int.max), 100)
+        XCTAssertEqual(self.readAll(buffer), data)
+    }
+}
+
+
+class SodutoParallelZipTests: XCTestCase {
+    
+    private func compressibleData(_ length: Int) -> Data {
+        var data = Data(capacity: length + 100)
+        var n = 0
+        while data.count < length {
+            data.append(contentsOf: "line \(n): value=\(n % 977), square=\((n % 977) * (n % 977))\n".utf8)
+            n += 1
+        }
+        return data.prefix(length)
+    }
+    
+    private func unzip(_ data: Data) -> Data? {
+        return MYZip.data(byDecompressing: data)
+    }
+    
+    func testCompressedDataIsOrdinaryGzip() {
+        let data = self.compressibleData(1000000)
+        for threadCount in [1, 2, 4] {
+            let zipped: Data = MYParallelZip.data(byCompressing: data, level: 6, threadCount: threadCount)
+            XCTAssertLessThan(zipped.count, data.count / 2)
+            XCTAssertEqual(self.unzip(zipped), data)
+        }
+        
+        let zipped: Data = MYParallelZip.data(byCompressing: Data(), level: 6, threadCount: 2)
+        XCTAssertEqual(self.unzip(zipped), Data())
+    }
+    
+    func testWriterStreamsCompressedBlocksToBuffer() {
+        let data = self.compressibleData(1000000)
+        let zip = MYParallelZip(level: 1, strategy: MYZipStrategyRLE, threadCount: 3)
+        zip.blockSize = 10000
+        let buffer = MYBuffer()
+        let writer = MYZipWriter(writer: buffer, codec: zip)
+        var offset = 0
+        while offset < data.count {
+            let count = min(7777, data.count - offset)
+            XCTAssertTrue(writer.write(data.subdata(in: offset ..< offset + count)))
+            offset += count
+        }
+        XCTAssertTrue(writer.write(Data()))
+        
+        XCTAssertEqual(self.unzip(buffer.flattened()), data)
+    }
+    
+    func testReaderCompressesWhileReading() {
+        let data = self.compressibleData(300000)
+        let zip = MYParallelZip(level: 6, strategy: MYZipStrategyDefault, threadCount: 2)
+        zip.blockSize = 20000
+        let reader = MYZipReader(reader: MYBuffer(data: data), codec: zip)
+        
+        var zipped = Data()
+        var chunk = [UInt8](repeating: 0, count: 1000)
+        while true {
+            let count = reader.readBytes(&chunk, maxLength: chunk.count)
+            guard count > 0 else { break }
+            zipped.append(contentsOf: chunk[0 ..< count])
+        }
+        XCTAssertTrue(reader.atEnd)
+        XCTAssertEqual(self.unzip(zipped), data)
+    }
+    
+    func testLargeInputKeepsPendingBlocksBounded() {
+        let data = self.compressibleData(1000000)
+        let zip = MYParallelZip(level: 9, strategy: MYZipStrategyDefault, threadCount: 2)
+        zip.blockSize = 10000
+        var maxPendingCount = 0
+        var zipped = Data()
+        let onOutput: (UnsafeRawPointer?, Int) -> Void = { bytes, length in
+            maxPendingCount = max(maxPendingCount, zip.pendingBlockCount)
+            zipped.append(bytes!.assumingMemoryBound(to: UInt8.self), count: length)
+        }
+        
+        // A single call adding 100 blocks delivers output as it goes, instead of keeping the blocks
+        let isAdded = data.withUnsafeBytes { (bytes: UnsafePointer<UInt8>) in
+            return zip.addBytes(bytes, length: data.count, onOutput: onOutput)
+        }
+        XCTAssertTrue(isAdded)
+        XCTAssertGreaterThan(zipped.count, 10)
+        XCTAssertTrue(zip.addBytes(nil, length: 0, onOutput: onOutput))
+        XCTAssertLessThanOrEqual(maxPendingCount, 2 * zip.threadCount)
+        XCTAssertEqual(self.unzip(zipped), data)
+    }
+    
+    
+    // MARK: Benchmarks - compare serial and parallel compression of the same data
+    
+    func testSerialCompressionPerformance() {
+        let data = self.compressibleData(16 * 1024 * 1024)
+        measure {
+            _ = MYZip.data(byCompressing: data)
+        }
+    }
+    
+    func testParallelCompressionPerformance() {
+        let data = self.compressibleData(16 * 1024 * 1024)
+        measure {
+            _ = MYParallelZip.data(byCompressing: data, level: Int32(MYZipDefaultLevel), threadCount: 0)
+        }
+    }
+}